@@ -0,0 +1,448 @@
+/*
+ * baseline.c - libtunepimp driven through tp_c.h directly, as the
+ * native baseline for bench/micro.rb.
+ *
+ * Build (bench/micro.rb does this itself if it has to):
+ *   cc -O2 -o bench/baseline bench/baseline.c -ltunepimp -lpthread -ldl
+ *
+ * Usage:
+ *   bench/baseline [-t SECONDS] [-S HOST:PORT] [-c CASE] DIR
+ *
+ * Adds the files under DIR, waits for analysis and lookups to finish,
+ * then runs each case for SECONDS (default 0.5) and prints one JSON
+ * object per line:
+ *
+ *   {"name":"file_ids","calls":123,"seconds":0.5,"ns_per_call":40.6,
+ *    "mallocs_per_call":0}
+ *
+ * Cases have the same names as the TunePimp methods they correspond to
+ * in bench/micro.rb, and do what a C program would: buffers live on the
+ * stack or are reused, and nothing is converted.  mallocs_per_call is
+ * null unless bench/mcount.so is preloaded.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <tunepimp/tp_c.h>
+
+#define MAX_IDS  65536
+#define MAX_EXTS 64
+#define MAX_TRMS 65536
+
+static tunepimp_t tp, trm_tp;
+static track_t tr;
+static metadata_t *md, *md2;
+static int ids[MAX_IDS], num_ids, file_id;
+static char dir[4096];
+static volatile long sink;
+
+static unsigned long long (*mcount)(void);
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void notify_cb(tunepimp_t t, void *data, TPCallbackEnum type, int id) {
+  (void) t;
+  (void) data;
+  sink += type + id;
+}
+
+/*
+ * cases
+ */
+
+static void c_version(void) {
+  int a, b, c;
+  tp_GetVersion(tp, &a, &b, &c);
+  sink += a + b + c;
+}
+
+static void c_user_info(void) {
+  char u[256], p[256];
+  tp_GetUserInfo(tp, u, sizeof(u), p, sizeof(p));
+  sink += u[0];
+}
+
+static void c_set_user_info(void) {
+  tp_SetUserInfo(tp, "bench", "bench");
+}
+
+static void c_use_utf8(void) { sink += tp_GetUseUTF8(tp); }
+static void c_set_use_utf8(void) { tp_SetUseUTF8(tp, 1); }
+
+static void c_server(void) {
+  char host[256];
+  short port;
+  tp_GetServer(tp, host, sizeof(host), &port);
+  sink += port;
+}
+
+static char server_host[256] = "127.0.0.1";
+static short server_port = 9;
+
+static void c_set_server(void) { tp_SetServer(tp, server_host, server_port); }
+
+static void c_proxy(void) {
+  char host[256];
+  short port;
+  tp_GetProxy(tp, host, sizeof(host), &port);
+  sink += port;
+}
+
+static void c_set_proxy(void) { tp_SetProxy(tp, "", 0); }
+
+static void c_num_supported_extensions(void) {
+  sink += tp_GetNumSupportedExtensions(tp);
+}
+
+static void c_supported_extensions(void) {
+  static char buf[MAX_EXTS][TP_EXTENSION_LEN];
+  char *exts[MAX_EXTS];
+  int i, num = tp_GetNumSupportedExtensions(tp);
+
+  for (i = 0; i < num && i < MAX_EXTS; i++)
+    exts[i] = buf[i];
+  if (num <= MAX_EXTS)
+    tp_GetSupportedExtensions(tp, exts);
+  sink += buf[0][0];
+}
+
+static void c_analyzer_priority(void) { sink += tp_GetAnalyzerPriority(tp); }
+static void c_set_analyzer_priority(void) { tp_SetAnalyzerPriority(tp, eNormal); }
+
+static void c_notification(void) {
+  TPCallbackEnum type;
+  int id;
+  sink += tp_GetNotification(tp, &type, &id);
+}
+
+static void c_status(void) {
+  char buf[1024];
+  sink += tp_GetStatus(tp, buf, sizeof(buf));
+}
+
+static void c_error(void) {
+  char buf[1024];
+  tp_GetError(tp, buf, sizeof(buf));
+  sink += buf[0];
+}
+
+static void c_debug(void) { sink += tp_GetDebug(tp); }
+static void c_set_debug(void) { tp_SetDebug(tp, 0); }
+static void c_num_files(void) { sink += tp_GetNumFiles(tp); }
+static void c_num_unsubmitted(void) { sink += tp_GetNumUnsubmitted(tp); }
+static void c_num_unsaved_items(void) { sink += tp_GetNumUnsavedItems(tp); }
+
+static void c_track_counts(void) {
+  int counts[eLastStatus];
+  sink += tp_GetTrackCounts(tp, counts, eLastStatus) + counts[0];
+}
+
+static void c_num_file_ids(void) { sink += tp_GetNumFileIds(tp); }
+
+static void c_file_ids(void) {
+  int num = tp_GetNumFileIds(tp);
+  if (num > MAX_IDS)
+    num = MAX_IDS;
+  tp_GetFileIds(tp, ids, num);
+  sink += ids[0];
+}
+
+static void c_track(void) {
+  track_t t = tp_GetTrack(tp, file_id);
+  tp_ReleaseTrack(tp, t);
+}
+
+static void c_wake(void) { tp_Wake(tp, tr); }
+
+/*
+ * libtunepimp only empties its TRM list when it's submitted, so this
+ * fills a scratch instance and r_add_trm() replaces it when it's full.
+ */
+static void c_add_trm(void) {
+  tp_AddTRMSubmission(trm_tp, "00000000-0000-0000-0000-000000000000",
+                      "00000000-0000-0000-0000-000000000000");
+}
+
+static void r_add_trm(void) {
+  if (trm_tp && tp_GetNumUnsubmitted(trm_tp) < MAX_TRMS)
+    return;
+  if (trm_tp)
+    tp_Delete(trm_tp);
+  trm_tp = tp_New("tunepimp-bench", "baseline");
+}
+
+static void c_recognized_files(void) {
+  int *list = NULL, num = 0;
+  if (tp_GetRecognizedFileList(tp, 100, &list, &num))
+    tp_DeleteRecognizedFileList(tp, list);
+  sink += num;
+}
+
+#define FLAG(name, fn, val) \
+  static void c_##name(void) { sink += tp_Get##fn(tp); } \
+  static void c_set_##name(void) { tp_Set##fn(tp, val); }
+FLAG(rename_files, RenameFiles, 0)
+FLAG(move_files, MoveFiles, 0)
+FLAG(write_id3v1, WriteID3v1, 0)
+FLAG(clear_tags, ClearTags, 0)
+FLAG(trm_collision_threshold, TRMCollisionThreshold, 80)
+FLAG(min_trm_threshold, MinTRMThreshold, 30)
+FLAG(auto_save_threshold, AutoSaveThreshold, -1)
+FLAG(max_file_name_len, MaxFileNameLen, 255)
+FLAG(auto_remove_saved_files, AutoRemovedSavedFiles, 0)
+
+#define SFLAG(name, fn, val) \
+  static void c_##name(void) { char buf[1024]; tp_Get##fn(tp, buf, sizeof(buf)); sink += buf[0]; } \
+  static void c_set_##name(void) { tp_Set##fn(tp, val); }
+SFLAG(file_mask, FileMask, "%artist/%album/%num %track")
+SFLAG(various_file_mask, VariousFileMask, "Various Artists/%album/%num %artist - %track")
+SFLAG(allowed_file_chars, AllowedFileCharacters, "")
+SFLAG(dest_dir, DestDir, "")
+SFLAG(top_src_dir, TopSrcDir, "")
+
+static void c_track_status(void) { sink += tr_GetStatus(tr); }
+static void c_track_set_status(void) { tr_SetStatus(tr, tr_GetStatus(tr)); }
+
+static void c_track_filename(void) {
+  char buf[4096];
+  tr_GetFileName(tr, buf, sizeof(buf));
+  sink += buf[0];
+}
+
+static void c_track_trm(void) {
+  char buf[64];
+  tr_GetTRM(tr, buf, sizeof(buf));
+  sink += buf[0];
+}
+
+static void c_track_local_metadata(void) { tr_GetLocalMetadata(tr, md); }
+static void c_track_set_local_metadata(void) { tr_SetLocalMetadata(tr, md); }
+static void c_track_server_metadata(void) { tr_GetServerMetadata(tr, md2); }
+static void c_track_set_server_metadata(void) { tr_SetServerMetadata(tr, md2); }
+
+static void c_track_error(void) {
+  char buf[1024];
+  tr_GetError(tr, buf, sizeof(buf));
+  sink += buf[0];
+}
+
+static void c_track_similarity(void) { sink += tr_GetSimilarity(tr); }
+static void c_track_has_changed(void) { sink += tr_HasChanged(tr); }
+static void c_track_num_results(void) { sink += tr_GetNumResults(tr); }
+
+static void c_track_results(void) {
+  result_t res[64];
+  TPResultType type;
+  int num = tr_GetNumResults(tr);
+
+  if (num > 64)
+    num = 64;
+  if (num > 0) {
+    tr_GetResults(tr, &type, res, &num);
+    rs_Delete(type, res, num);
+  }
+  sink += num;
+}
+
+static void c_track_lock(void) {
+  tr_Lock(tr);
+  tr_Unlock(tr);
+}
+
+static void c_metadata_eq(void) { sink += md_Compare(md, md2); }
+
+static void c_add_file(void) {
+  char path[4096];
+  int id;
+
+  tr_GetFileName(tr, path, sizeof(path));
+  id = tp_AddFile(tp, path);
+  tp_Remove(tp, id);
+}
+
+/* reset, if set, runs between batches and isn't counted */
+static struct {
+  const char *name;
+  void (*fn)(void);
+  void (*reset)(void);
+} cases[] = {
+#define C(name) { #name, c_##name, NULL }
+#define S(name) { #name "=", c_set_##name, NULL }
+  C(version), C(user_info), C(set_user_info), C(use_utf8), S(use_utf8),
+  C(server), C(set_server), C(proxy), C(set_proxy),
+  C(num_supported_extensions), C(supported_extensions),
+  C(analyzer_priority), S(analyzer_priority), C(notification), C(status),
+  C(error), C(debug), S(debug), C(num_files), C(num_unsubmitted),
+  C(num_unsaved_items), C(track_counts), C(num_file_ids), C(file_ids),
+  C(track), C(wake), { "add_trm", c_add_trm, r_add_trm },
+  C(recognized_files),
+  C(rename_files), S(rename_files), C(move_files), S(move_files),
+  C(write_id3v1), S(write_id3v1), C(clear_tags), S(clear_tags),
+  C(file_mask), S(file_mask), C(various_file_mask), S(various_file_mask),
+  C(allowed_file_chars), S(allowed_file_chars), C(dest_dir), S(dest_dir),
+  C(top_src_dir), S(top_src_dir),
+  C(trm_collision_threshold), S(trm_collision_threshold),
+  C(min_trm_threshold), S(min_trm_threshold),
+  C(auto_save_threshold), S(auto_save_threshold),
+  C(max_file_name_len), S(max_file_name_len),
+  C(auto_remove_saved_files), S(auto_remove_saved_files),
+  { "Track#status", c_track_status, NULL }, { "Track#status=", c_track_set_status, NULL },
+  { "Track#filename", c_track_filename, NULL }, { "Track#trm", c_track_trm, NULL },
+  { "Track#local_metadata", c_track_local_metadata, NULL },
+  { "Track#local_metadata=", c_track_set_local_metadata, NULL },
+  { "Track#server_metadata", c_track_server_metadata, NULL },
+  { "Track#server_metadata=", c_track_set_server_metadata, NULL },
+  { "Track#error", c_track_error, NULL }, { "Track#similarity", c_track_similarity, NULL },
+  { "Track#has_changed?", c_track_has_changed, NULL },
+  { "Track#num_results", c_track_num_results, NULL },
+  { "Track#results", c_track_results, NULL }, { "Track#lock", c_track_lock, NULL },
+  { "Metadata#==", c_metadata_eq, NULL },
+  /* last, since it gives the analyzer work */
+  C(add_file),
+  { NULL, NULL, NULL }
+#undef C
+#undef S
+};
+
+static void run(const char *name, void (*fn)(void), void (*reset)(void),
+                double secs) {
+  unsigned long long m0 = 0, m1 = 0, rm = 0;
+  double t0, t, batch_t;
+  long i, n = 1, calls = 0;
+
+  if (reset)
+    reset();
+
+  /* find a batch size that takes about a millisecond */
+  for (;;) {
+    t0 = now();
+    for (i = 0; i < n; i++)
+      fn();
+    batch_t = now() - t0;
+    if (batch_t > 0.001 || n > (1L << 24))
+      break;
+    n *= 2;
+    if (reset)
+      reset();
+  }
+  if (reset)
+    reset();
+
+  if (mcount)
+    m0 = mcount();
+  t0 = t = now();
+  while (t - t0 < secs) {
+    for (i = 0; i < n; i++)
+      fn();
+    calls += n;
+    if (reset) {
+      t = now();
+      if (mcount)
+        rm = mcount();
+      reset();
+      if (mcount)
+        m0 += mcount() - rm;
+      t0 += now() - t;
+    }
+    t = now();
+  }
+  if (mcount)
+    m1 = mcount();
+
+  printf("{\"name\":\"%s\",\"calls\":%ld,\"seconds\":%.6f,\"ns_per_call\":%.3f,"
+         "\"mallocs_per_call\":", name, calls, t - t0, (t - t0) * 1e9 / calls);
+  if (mcount)
+    printf("%.3f}\n", (double) (m1 - m0) / calls);
+  else
+    printf("null}\n");
+  fflush(stdout);
+}
+
+static void settle(void) {
+  int counts[eLastStatus];
+  double t0 = now();
+
+  while (now() - t0 < 600) {
+    if (tp_GetTrackCounts(tp, counts, eLastStatus) &&
+        !counts[ePending] && !counts[eTRMLookup] && !counts[eFileLookup])
+      return;
+    usleep(10000);
+  }
+  fprintf(stderr, "baseline: files still busy, going ahead anyway\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *only = NULL;
+  double secs = 0.5;
+  char *p;
+  int i, opt;
+
+  while ((opt = getopt(argc, argv, "t:S:c:")) != -1) {
+    switch (opt) {
+    case 't':
+      secs = atof(optarg);
+      break;
+    case 'S':
+      snprintf(server_host, sizeof(server_host), "%s", optarg);
+      if ((p = strrchr(server_host, ':')) != NULL) {
+        *p = '\0';
+        server_port = atoi(p + 1);
+      }
+      break;
+    case 'c':
+      only = optarg;
+      break;
+    default:
+      fprintf(stderr, "Usage: %s [-t SECONDS] [-S HOST:PORT] [-c CASE] DIR\n", argv[0]);
+      return 1;
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "Usage: %s [-t SECONDS] [-S HOST:PORT] [-c CASE] DIR\n", argv[0]);
+    return 1;
+  }
+  snprintf(dir, sizeof(dir), "%s", argv[optind]);
+  mcount = (unsigned long long (*)(void)) dlsym(RTLD_DEFAULT, "mcount_calls");
+
+  tp = tp_New("tunepimp-bench", "baseline");
+  tp_SetNotifyCallback(tp, notify_cb, NULL);
+  tp_SetServer(tp, server_host, server_port);
+  tp_SetRenameFiles(tp, 0);
+  tp_SetMoveFiles(tp, 0);
+  if (tp_AddDir(tp, dir) < 1) {
+    fprintf(stderr, "baseline: no files in %s\n", dir);
+    return 1;
+  }
+  settle();
+
+  num_ids = tp_GetNumFileIds(tp);
+  tp_GetFileIds(tp, ids, num_ids < MAX_IDS ? num_ids : MAX_IDS);
+  file_id = ids[0];
+  tr = tp_GetTrack(tp, file_id);
+  md = md_New();
+  md2 = md_New();
+  tr_GetLocalMetadata(tr, md);
+  tr_GetServerMetadata(tr, md2);
+
+  for (i = 0; cases[i].name; i++)
+    if (!only || !strcmp(only, cases[i].name))
+      run(cases[i].name, cases[i].fn, cases[i].reset, secs);
+
+  md_Delete(md);
+  md_Delete(md2);
+  tp_ReleaseTrack(tp, tr);
+  if (trm_tp)
+    tp_Delete(trm_tp);
+  tp_Delete(tp);
+
+  return 0;
+}
@@ -0,0 +1,329 @@
+#!/usr/bin/env ruby
+#
+# corpus.rb - generate a reproducible synthetic audio corpus.
+#
+# Usage:
+#   ruby bench/corpus.rb [options] DIR
+#
+# Options:
+#   -n, --files N       number of files (default 2000)
+#   -s, --seed N        random seed (default 1)
+#   -f, --formats LIST  comma separated formats: wav, mp3, ogg
+#                       (default wav,mp3,ogg)
+#   -l, --seconds N     length of each file, in seconds (default 4)
+#
+# The same seed, file count, format list and length always give the
+# same files, names, tags and directory layout, so runs of
+# bench/e2e.rb against different libtunepimp or binding versions can
+# be compared.  The corpus is described in DIR/manifest.json, which
+# bench/mbstub.rb uses as its fixture database.  Each track gets a
+# made-up TRM there ("trms"), which bench/e2e.rb seeds its TRM cache
+# with and the stub maps back to the track.  A corpus generated
+# with other settings is wiped before the new one is written; a DIR
+# that has files in it but no manifest.json is refused rather than
+# wiped.
+#
+# WAV files are written directly.  MP3 files are encoded with lame if
+# it's installed, otherwise they're written as silent MPEG frames with
+# an ID3v2 tag (fine for tag and lookup benchmarks, but every one of
+# them has the same TRM).  Ogg files need oggenc or ffmpeg, and are
+# left out with a warning if neither is installed.
+#
+
+require 'fileutils'
+require 'optparse'
+require 'json'
+require 'digest/md5'
+
+module Corpus
+  # TRM works on 11kHz mono anyway
+  RATE = 11025
+  SINE = (0...4096).map { |i| (Math.sin(2 * Math::PI * i / 4096) * 19000).round }
+  NOISE = (r = Random.new(0); (0...4093).map { r.rand(600) - 300 })
+
+  SYLLABLES = %w{ka ro mi nu ta le so vi da ne po ru shi an el or ith
+                 bel mor dra gon syl var tre os}
+  WORDS = %w{Night Glass River Static Echo Paper Summer Iron Velvet
+             Signal Hollow Northern Quiet Electric Golden Broken Silver
+             Distant Winter Neon Ghost Harbor Machine Garden}
+  ODD = ["Café", "Über", "Señor", "Ærø", "東京", "Ça va", "AC/DC",
+         "Rock & Roll", "\"Quoted\"", "What?", "100%", "Don't Stop"]
+  GENRES = %w{Rock Jazz Electronic Folk Classical Hip-Hop Ambient Pop}
+
+  # directory layouts, weighted by how often we see them in the wild
+  LAYOUTS = [:tree] * 5 + [:flat] * 2 + [:deep] * 2 + [:messy]
+
+  module_function
+
+  def which(cmd)
+    ENV['PATH'].to_s.split(File::PATH_SEPARATOR).any? { |d| File.executable?(File.join(d, cmd)) }
+  end
+
+  def word(rng)
+    (1 + rng.rand(3)).times.map { SYLLABLES[rng.rand(SYLLABLES.size)] }.join.capitalize
+  end
+
+  def title(rng)
+    case rng.rand(10)
+    when 0 then ODD[rng.rand(ODD.size)]
+    when 1 then (1 + rng.rand(8)).times.map { WORDS[rng.rand(WORDS.size)] }.join(' ')
+    when 2, 3 then word(rng)
+    else (1 + rng.rand(3)).times.map { WORDS[rng.rand(WORDS.size)] }.join(' ')
+    end
+  end
+
+  def safe(str)
+    str.gsub(/[\/\\:*?"<>|]/, '_')
+  end
+
+  #
+  # Build the list of tracks: artists with a few albums each, with
+  # a few tracks each, until there are enough files.
+  #
+  def tracks(rng, num, formats, seconds)
+    ret = []
+    artist_num = 0
+
+    while ret.size < num
+      artist = rng.rand(8) == 0 ? ODD[rng.rand(ODD.size)] : "#{word(rng)} #{WORDS[rng.rand(WORDS.size)]}"
+      artist = "#{artist} #{artist_num += 1}"
+      genre = GENRES[rng.rand(GENRES.size)]
+
+      (1 + rng.rand(4)).times do
+        album, year = title(rng), 1960 + rng.rand(60)
+        layout = LAYOUTS[rng.rand(LAYOUTS.size)]
+        discs = rng.rand(10) == 0 ? 2 : 1
+
+        (3 + rng.rand(12)).times do |i|
+          break if ret.size >= num
+          ret << {
+            'artist'  => artist,
+            'album'   => album,
+            'title'   => title(rng),
+            'track'   => i + 1,
+            'disc'    => discs > 1 ? 1 + i % discs : 1,
+            'year'    => year,
+            'genre'   => genre,
+            'format'  => formats[rng.rand(formats.size)],
+            'layout'  => layout.to_s,
+            'seconds' => seconds * (0.5 + rng.rand),
+            # some files come untagged, some with the wrong tags
+            'tagged'  => rng.rand(10) != 0,
+            'mistagged' => rng.rand(20) == 0,
+            'tones'   => (2 + rng.rand(3)).times.map { 110 + rng.rand(1800) },
+          }
+        end
+      end
+    end
+
+    ret.each_with_index do |t, i|
+      t['id'] = i
+      t['path'] = path(t, i)
+      t['trms'] = [trm(i)]
+    end
+  end
+
+  # a TRM for track i, in the usual UUID form
+  def trm(i)
+    Digest::MD5.hexdigest("trm:#{i}").sub(/\A(.{8})(.{4})(.{4})(.{4})(.{12})\z/, '\1-\2-\3-\4-\5')
+  end
+
+  def path(t, i)
+    ext, a, b, n = t['format'], safe(t['artist']), safe(t['album']), t['track']
+    name = format('%02d - %s.%s', n, safe(t['title']), ext)
+
+    case t['layout']
+    when 'tree'
+      File.join(a, b, name)
+    when 'flat'
+      File.join('flat', format('%s - %s - %s', a, safe(t['title']), "#{i}.#{ext}"))
+    when 'deep'
+      File.join(t['genre'], t['year'].to_s, a, b, "CD#{t['disc']}", name)
+    else
+      File.join('incoming', format('batch_%03d', i / 97), format('track%05d.%s', i, ext.upcase))
+    end
+  end
+
+  # the tags a file actually carries (nil for untagged files)
+  def tags(t)
+    return nil unless t['tagged']
+    ret = t.dup
+    ret['title'], ret['artist'] = t['artist'], t['title'] if t['mistagged']
+    ret
+  end
+
+  #
+  # 16-bit mono PCM: a few sine tones that change every half second,
+  # plus a little noise, seeded by the track so every file is
+  # different.
+  #
+  def pcm(t)
+    rng = Random.new(t['id'])
+    n = (t['seconds'] * RATE).to_i
+    step = RATE / 2
+    out = Array.new(n)
+    incs = phases = nil
+    k = rng.rand(NOISE.size)
+
+    n.times do |i|
+      if i % step == 0
+        incs = t['tones'].map { |f| (f * (1 + rng.rand(6) / 12.0) * SINE.size / RATE).round }
+        phases ||= incs.map { 0 }
+      end
+      v = 0
+      incs.each_with_index do |inc, j|
+        v += SINE[phases[j]]
+        phases[j] = (phases[j] + inc) % SINE.size
+      end
+      out[i] = v / incs.size + NOISE[(k + i) % NOISE.size]
+    end
+
+    out.pack('s<*')
+  end
+
+  def riff_chunk(id, data)
+    data += "\0" if data.bytesize.odd?
+    id + [data.bytesize].pack('V') + data
+  end
+
+  def wav(t, data)
+    fmt = [1, 1, RATE, RATE * 2, 2, 16].pack('vvVVvv')
+    info = ''
+    if tg = tags(t)
+      { 'INAM' => 'title', 'IART' => 'artist', 'IPRD' => 'album',
+        'ITRK' => 'track', 'ICRD' => 'year', 'IGNR' => 'genre' }.each do |id, key|
+        info << riff_chunk(id, "#{tg[key]}\0".b)
+      end
+    end
+
+    body = 'WAVE' + riff_chunk('fmt ', fmt)
+    body << riff_chunk('LIST', 'INFO' + info) if info.size > 0
+    body << riff_chunk('data', data)
+    riff_chunk('RIFF', body)
+  end
+
+  def id3_frame(id, str)
+    data = "\1\xff\xfe".b + str.to_s.encode('UTF-16LE').b
+    id + [data.bytesize].pack('N') + "\0\0" + data
+  end
+
+  def id3(t)
+    return '' unless tg = tags(t)
+    frames = id3_frame('TIT2', tg['title']) + id3_frame('TPE1', tg['artist']) +
+             id3_frame('TALB', tg['album']) + id3_frame('TRCK', tg['track']) +
+             id3_frame('TYER', tg['year']) + id3_frame('TCON', tg['genre'])
+    size = frames.bytesize
+    syncsafe = [3, 2, 1, 0].map { |i| (size >> (7 * i)) & 0x7f }.pack('C4')
+    "ID3\3\0\0".b + syncsafe + frames
+  end
+
+  # silent 128kbps mono MPEG-1 layer III frames
+  def mp3_frames(seconds)
+    frame = "\xff\xfb\x90\xc4".b + "\0" * 413
+    frame * (seconds * 44100 / 1152).ceil
+  end
+
+  def encode(t, dst, tmp)
+    tg = tags(t) || {}
+    case t['format']
+    when 'mp3'
+      args = ['--quiet', '-m', 'm']
+      args += ['--tt', tg['title'], '--ta', tg['artist'], '--tl', tg['album'],
+               '--tn', tg['track'].to_s, '--ty', tg['year'].to_s] if tags(t)
+      system('lame', *(args + [tmp, dst]))
+    when 'ogg'
+      if which('oggenc')
+        args = ['-Q']
+        args += ['-t', tg['title'], '-a', tg['artist'], '-l', tg['album'],
+                 '-N', tg['track'].to_s, '-d', tg['year'].to_s] if tags(t)
+        system('oggenc', *(args + ['-o', dst, tmp]))
+      else
+        args = ['-loglevel', 'error', '-y', '-i', tmp]
+        %w{title artist album track date genre}.each do |k|
+          args += ['-metadata', "#{k}=#{tg[k == 'date' ? 'year' : k]}"]
+        end if tags(t)
+        system('ffmpeg', *(args + ['-c:a', 'libvorbis', dst]))
+      end
+    end
+  end
+
+  #
+  # Generate a corpus in +dir+, and return the manifest.  Existing
+  # files are left alone if the manifest says they were generated with
+  # the same settings.
+  #
+  def generate(dir, opts = {})
+    num = opts[:files] || 2000
+    seed = opts[:seed] || 1
+    seconds = opts[:seconds] || 4
+    formats = opts[:formats] || %w{wav mp3 ogg}
+    tools = { 'lame' => which('lame'), 'ogg' => which('oggenc') || which('ffmpeg') }
+
+    skipped = []
+    if formats.include?('ogg') && !tools['ogg']
+      warn 'corpus: no oggenc or ffmpeg, leaving out ogg files'
+      skipped << 'ogg'
+    end
+    formats -= skipped
+    raise ArgumentError, 'no formats to generate' if formats.empty?
+
+    # version goes up when what's in the manifest changes
+    settings = { 'version' => 2, 'files' => num, 'seed' => seed, 'seconds' => seconds,
+                 'formats' => formats, 'lame' => tools['lame'] }
+    mpath = File.join(dir, 'manifest.json')
+    if File.exist?(mpath)
+      old = JSON.parse(File.read(mpath)) rescue {}
+      return old if old['settings'] == settings
+      # don't leave the old corpus's files behind for add_tree to find
+      FileUtils.rm_rf(Dir.glob(File.join(dir, '*'), File::FNM_DOTMATCH).
+                        reject { |f| %w{. ..}.include?(File.basename(f)) })
+    elsif File.directory?(dir) && !(Dir.entries(dir) - %w{. ..}).empty?
+      raise ArgumentError, "#{dir} isn't empty and isn't a corpus"
+    end
+
+    rng = Random.new(seed)
+    list = tracks(rng, num, formats, seconds)
+    tmp = File.join(dir, '.tmp.wav')
+    bytes = 0
+
+    FileUtils.mkdir_p(dir)
+    list.each_with_index do |t, i|
+      dst = File.join(dir, t['path'])
+      FileUtils.mkdir_p(File.dirname(dst))
+
+      if t['format'] == 'wav'
+        File.open(dst, 'wb') { |fh| fh.write(wav(t, pcm(t))) }
+      elsif t['format'] == 'mp3' && !tools['lame']
+        File.open(dst, 'wb') { |fh| fh.write(id3(t) + mp3_frames(t['seconds'])) }
+      else
+        File.open(tmp, 'wb') { |fh| fh.write(wav(t.merge('tagged' => false), pcm(t))) }
+        encode(t, dst, tmp) or raise "couldn't encode #{dst}"
+      end
+
+      bytes += File.size(dst)
+      $stderr.print "\rcorpus: #{i + 1}/#{list.size}" if $stderr.tty?
+    end
+    $stderr.puts if $stderr.tty?
+    FileUtils.rm_f(tmp)
+
+    ret = { 'settings' => settings, 'skipped' => skipped, 'bytes' => bytes,
+            'tracks' => list.map { |t| t.reject { |k, v| k == 'tones' } } }
+    File.open(mpath, 'w') { |fh| fh.write(JSON.generate(ret)) }
+    ret
+  end
+end
+
+if __FILE__ == $0
+  opts = {}
+  OptionParser.new do |o|
+    o.banner = "Usage: #$0 [options] DIR"
+    o.on('-n', '--files N', Integer) { |v| opts[:files] = v }
+    o.on('-s', '--seed N', Integer) { |v| opts[:seed] = v }
+    o.on('-f', '--formats LIST', Array) { |v| opts[:formats] = v }
+    o.on('-l', '--seconds N', Float) { |v| opts[:seconds] = v }
+  end.parse!
+  abort "Usage: #$0 [options] DIR" unless ARGV.size == 1
+
+  m = Corpus.generate(ARGV[0], opts)
+  puts "#{m['tracks'].size} files, #{m['bytes']} bytes in #{ARGV[0]}"
+end
@@ -0,0 +1,290 @@
+#!/usr/bin/env ruby
+#
+# e2e.rb - end-to-end pipeline benchmark.
+#
+# Usage:
+#   ruby bench/e2e.rb [options]
+#
+# Options:
+#   -c, --corpus DIR      corpus to use, generated by bench/corpus.rb if
+#                         it isn't there (default bench/corpus)
+#   -n, --files N         corpus size (default 2000)
+#   -s, --seed N          corpus seed (default 1)
+#   -f, --formats LIST    corpus formats (default wav,mp3,ogg)
+#   -l, --seconds N       corpus file length (default 4)
+#   -S, --server H:P      use this server instead of starting
+#                         bench/mbstub.rb
+#   -x, --stub ARGS       options for bench/mbstub.rb, to inject
+#                         latency, errors and rate limits (e.g.
+#                         "-l lognormal:120ms,0.5 -e 503=0.02 -r 5")
+#   -t, --threads N       add_tree walker threads (default 4)
+#   -g, --generate        generate TRMs rather than seeding the TRM
+#                         cache (needs trm.musicbrainz.org)
+#   -T, --timeout SECS    give up waiting for the pipeline after this
+#                         long (default 600)
+#   -o, --out FILE        append the report to FILE as a JSON line
+#   -L, --label TEXT      label to store with the report
+#
+# Copies the corpus to a scratch directory (tags get written) and runs
+# it through the whole pipeline: TunePimp#add_tree (ingest), TRMs
+# (analysis), lookups against a local bench/mbstub.rb server (lookup;
+# files that need a choice get their first result) and
+# TunePimp#write_tags_async (write).  Prints a JSON report with, for
+# each stage, files, seconds, files/sec, CPU time and memory, plus
+# libtunepimp's and the binding's version, so reports from different
+# versions can be compared.
+#
+# Ingest, analysis and lookup overlap, so their windows all start when
+# ingest does and end when the last file leaves the stage.  CPU time and
+# rss_hwm_delta_kb (how much the RSS high-water mark grew) are counted
+# between one stage ending and the next; rss_hwm_kb is the high-water
+# mark since ingest started (since the process started where
+# /proc/self/clear_refs can't be written).  The stub server runs in a
+# process of its own and isn't counted.
+#
+# The stub only stands in for the server given to set_server.  TRM
+# generation asks the TRM signature server (trm.musicbrainz.org),
+# which libtunepimp doesn't let us redirect and which the stub can't
+# imitate.  So by default a TunePimp::TRMCache is seeded with the TRMs
+# the corpus manifest lists for each file (the ones the stub maps back
+# to their tracks): files go straight from ingest to TRMLookup against
+# the stub, and analysis only measures the cache.  With --generate,
+# TRMs are generated for real; offline, that produces none and the
+# files never get to the lookup stage.  The report says so under
+# "notes" when no lookups ran.  Silent MP3s (corpora made without
+# lame) all share one cache entry, since they have the same audio.
+#
+
+$LOAD_PATH.unshift File.expand_path(File.join(File.dirname(__FILE__), '..'))
+$LOAD_PATH.unshift File.dirname(__FILE__)
+
+require 'tunepimp'
+require 'corpus'
+require 'fileutils'
+require 'optparse'
+require 'tmpdir'
+require 'json'
+require 'time'
+require 'shellwords'
+
+module E2E
+  S = TunePimp::Status
+  LOOKUP = [S::Pending, S::TRMLookup, S::FileLookup]
+  CHOOSE = [S::TRMCollision, S::UserSelection]
+
+  module_function
+
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  # RSS high-water mark in kB, from /proc (nil elsewhere)
+  def rss_hwm
+    File.read('/proc/self/status')[/^VmHWM:\s*(\d+)/, 1].to_i
+  rescue SystemCallError
+    nil
+  end
+
+  # start the high-water mark from here, where the kernel lets us
+  def reset_rss_hwm
+    File.open('/proc/self/clear_refs', 'w') { |fh| fh.write('5') }
+  rescue SystemCallError
+  end
+
+  def cpu
+    t = Process.times
+    [t.utime, t.stime]
+  end
+
+  # approximate quantile from a metrics latency histogram
+  def quantile(h, q)
+    return nil if h[:count] == 0
+    want = q * h[:count]
+    h[:buckets].each { |bound, n| return bound.infinite? ? nil : bound if n >= want }
+    nil
+  end
+
+  def latency(h)
+    return nil unless h && h[:count] > 0
+    { 'count' => h[:count], 'mean' => h[:sum] / h[:count],
+      'p50' => quantile(h, 0.5), 'p95' => quantile(h, 0.95), 'p99' => quantile(h, 0.99) }
+  end
+
+  def start_stub(dir, args)
+    cmd = [RbConfig.ruby, File.join(File.dirname(__FILE__), 'mbstub.rb')] + Shellwords.split(args.to_s)
+    io = IO.popen(cmd + [dir], 'r')
+    line = io.gets or raise 'mbstub.rb failed to start'
+    [io, line[/:(\d+)$/, 1].to_i]
+  end
+
+  def stop_stub(io)
+    Process.kill('INT', io.pid)
+    stats = JSON.parse(io.read.lines.last || '{}') rescue {}
+    io.close
+    stats
+  end
+
+  # give files that stopped for a choice their first result
+  def choose(tp)
+    tp.file_ids.each do |id|
+      tr = tp.track(id)
+      begin
+        tp.select_result(tr, 0) if CHOOSE.include?(tr.status)
+      ensure
+        tp.release_track(tr)
+      end
+    end
+  end
+
+  def run(opts)
+    manifest = Corpus.generate(opts[:corpus], opts)
+    work = Dir.mktmpdir('tunepimp-e2e')
+    FileUtils.cp_r(File.join(opts[:corpus], '.'), work)
+    FileUtils.rm_f(File.join(work, 'manifest.json'))
+
+    if opts[:server]
+      host, port = opts[:server].split(':')
+      port = (port || 80).to_i
+    else
+      stub, port = start_stub(opts[:corpus], opts[:stub])
+      host = '127.0.0.1'
+    end
+
+    tp = TunePimp::TunePimp.new('tunepimp-ruby-bench', TunePimp::VERSION)
+    tp.set_server(host, port)
+    tp.rename_files = false
+    tp.move_files = false
+    tp.metrics_enabled = true
+    unless opts[:generate]
+      cache_dir = Dir.mktmpdir('tunepimp-e2e-trm')
+      cache = TunePimp::TRMCache.new(File.join(cache_dir, 'trm.cache'), :capacity => 65536)
+      manifest['tracks'].each do |t|
+        path = File.join(work, t['path'])
+        cache[path] = t['trms'].first if t['trms'] && File.exist?(path)
+      end
+      tp.trm_cache = cache
+    end
+
+    stages, marks = {}, []
+    t0 = cpu0 = hwm0 = nil
+    mark = lambda do |name, files, since|
+      t, c, hwm = now, cpu, rss_hwm
+      last = marks.last || [t0, cpu0, hwm0]
+      stages[name] = {
+        'files' => files, 'seconds' => t - since,
+        'files_per_sec' => t > since ? files / (t - since) : nil,
+        'cpu_user' => c[0] - last[1][0], 'cpu_system' => c[1] - last[1][1],
+        'rss_hwm_kb' => hwm,
+        'rss_hwm_delta_kb' => hwm && last[2] ? hwm - last[2] : nil,
+      }
+      marks << [t, c, hwm]
+    end
+
+    GC.start
+    reset_rss_hwm
+    t0, cpu0, hwm0 = now, cpu, rss_hwm
+    added = tp.add_tree(work, :threads => opts[:threads])
+    mark.call('ingest', added, t0)
+
+    analyzed = nil
+    deadline = t0 + opts[:timeout]
+    loop do
+      tp.wait_notifications(:timeout => 0.05, :max => 4096)
+      counts = tp.track_counts
+      if !analyzed && counts[S::Pending] == 0
+        mark.call('analysis', added, t0)
+        analyzed = true
+      end
+      choose(tp) if CHOOSE.any? { |s| counts[s] > 0 }
+      break if LOOKUP.all? { |s| counts[s] == 0 } && CHOOSE.all? { |s| counts[s] == 0 }
+      raise "pipeline still busy after #{opts[:timeout]}s: #{counts.inspect}" if now > deadline
+    end
+    mark.call('analysis', added, t0) unless analyzed
+    m = tp.metrics
+    looked_up = m[:completed][:trm_lookup] + m[:completed][:file_lookup]
+    mark.call('lookup', looked_up, t0)
+
+    t = now
+    w = tp.write_tags_async
+    w.wait([deadline - now, 1].max) or raise 'tag writes timed out'
+    mark.call('write', w.results.size, t)
+    stages['write']['errors'] = w.errors.size
+
+    m = tp.metrics
+    { 'analysis' => [:pending], 'lookup' => [:trm_lookup, :file_lookup],
+      'write' => [:recognized] }.each do |name, keys|
+      stages[name]['latency'] = keys.map { |k| [k.to_s, latency(m[:latency][k])] }.
+        reject { |k, v| v.nil? }.inject({}) { |h, (k, v)| h[k] = v; h }
+    end
+    outcome = {}
+    m[:depth].each { |k, n| outcome[k.to_s] = n if n > 0 }
+
+    notes = []
+    if looked_up == 0 && opts[:generate]
+      notes << 'no lookups ran: TRMs come from the TRM signature server, ' \
+               'which the stub does not replace, so offline analysis ' \
+               'produces no TRMs'
+    elsif looked_up == 0
+      notes << 'no lookups ran, although the TRM cache was seeded'
+    end
+    notes << 'analysis used TRMs seeded from the corpus manifest' unless opts[:generate]
+
+    t, c = now, cpu
+    ret = {
+      'benchmark' => 'e2e',
+      'label'     => opts[:label],
+      'time'      => Time.now.utc.iso8601,
+      'versions'  => {
+        'ruby'       => RUBY_VERSION,
+        'binding'    => TunePimp::VERSION,
+        'libtunepimp' => tp.version.join('.'),
+      },
+      'corpus'    => manifest['settings'].merge('bytes' => manifest['bytes'],
+                                                'skipped' => manifest['skipped']),
+      'server'    => stub ? "mbstub #{opts[:stub]}".strip : opts[:server],
+      'trms'      => opts[:generate] ? 'generated' : 'seeded',
+      'stages'    => stages,
+      'total'     => {
+        'files' => added, 'seconds' => t - t0,
+        'cpu_user' => c[0] - cpu0[0], 'cpu_system' => c[1] - cpu0[1],
+        'rss_hwm_kb' => rss_hwm,
+      },
+      'outcome'   => outcome,
+      'notes'     => notes,
+    }
+    ret['server_stats'] = stop_stub(stub) if stub
+    stub = nil
+    ret
+  ensure
+    stop_stub(stub) if stub
+    FileUtils.rm_rf(work) if work
+    FileUtils.rm_rf(cache_dir) if cache_dir
+  end
+end
+
+if __FILE__ == $0
+  opts = {
+    :corpus  => File.join(File.dirname(__FILE__), 'corpus'),
+    :threads => 4,
+    :timeout => 600,
+  }
+  OptionParser.new do |o|
+    o.banner = "Usage: #$0 [options]"
+    o.on('-c', '--corpus DIR') { |v| opts[:corpus] = v }
+    o.on('-n', '--files N', Integer) { |v| opts[:files] = v }
+    o.on('-s', '--seed N', Integer) { |v| opts[:seed] = v }
+    o.on('-f', '--formats LIST', Array) { |v| opts[:formats] = v }
+    o.on('-l', '--seconds N', Float) { |v| opts[:seconds] = v }
+    o.on('-S', '--server HOST:PORT') { |v| opts[:server] = v }
+    o.on('-x', '--stub ARGS') { |v| opts[:stub] = v }
+    o.on('-t', '--threads N', Integer) { |v| opts[:threads] = v }
+    o.on('-g', '--generate') { opts[:generate] = true }
+    o.on('-T', '--timeout SECS', Float) { |v| opts[:timeout] = v }
+    o.on('-o', '--out FILE') { |v| opts[:out] = v }
+    o.on('-L', '--label TEXT') { |v| opts[:label] = v }
+  end.parse!
+
+  report = E2E.run(opts)
+  File.open(opts[:out], 'a') { |fh| fh.puts(JSON.generate(report)) } if opts[:out]
+  puts JSON.pretty_generate(report)
+end
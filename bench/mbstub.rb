@@ -0,0 +1,621 @@
+#!/usr/bin/env ruby
+#
+# mbstub.rb - a local stand-in for the MusicBrainz server.
+#
+# Usage:
+#   ruby bench/mbstub.rb [options] FIXTURES
+#
+# FIXTURES is a bench/corpus.rb corpus directory (its manifest.json is
+# used) or a JSON file of the same shape:
+#
+#   {"tracks": [{"id": 0, "artist": "...", "album": "...",
+#                "title": "...", "track": 1, "seconds": 215.0,
+#                "trms": ["..."]}, ...]}
+#
+# "trms" is optional.  Listed TRMs map to their track; any other TRM
+# maps to a fixture track by hash (we can't know which TRM a file
+# really has), except for the --miss fraction of them, which aren't
+# found.
+#
+# Answers the RDF queries libtunepimp sends to the server given to
+# TunePimp::TunePimp#set_server (POST /cgi-bin/mq_2_1.pl):
+#
+#   TrackInfoFromTRMId  the track the TRM maps to.
+#   FileInfoLookup      tracks matching the artist and track name
+#                       sent, or the TRM's track if there are none,
+#                       plus a few near misses for the --ambiguous
+#                       fraction of lookups.
+#   SubmitTRMList,      accepted and counted.
+#   AuthenticateQuery
+#
+# GET /mm-2.1/{artist,album,track}/ID returns that resource.
+#
+# It doesn't stand in for the TRM signature server TRM generation
+# talks to; set_server doesn't redirect that, so without it files
+# don't get TRMs.  bench/e2e.rb gets around that by seeding a TRM cache
+# with the "trms" in the corpus manifest, so TrackInfoFromTRMId is
+# asked about those.
+#
+# Options:
+#   -p, --port N              port to listen on (default: any free one)
+#   -l, --latency [Q=]DIST    added latency, for every query or for
+#                             query Q (a query name above, or "get");
+#                             may be given more than once.  DIST is:
+#                               fixed:T
+#                               uniform:MIN,MAX
+#                               normal:MEAN,STDDEV
+#                               lognormal:MEDIAN,SIGMA
+#                               exp:MEAN
+#                               pareto:MIN,ALPHA
+#                             with times like 50ms, 0.2s or 300us.
+#   -e, --errors KIND=P,...   fail this fraction of requests: 500,
+#                             503, reset (close the connection with no
+#                             response), hang (say nothing for
+#                             --hang-time, then close) or garbage
+#                             (a truncated response)
+#   -r, --rate N              allow N requests/sec (token bucket)...
+#   -b, --burst N             ...in bursts of up to N (default N)
+#   -m, --rate-mode MODE      reject (503 with Retry-After, the
+#                             default) or delay (queue) requests over
+#                             the rate
+#   -c, --max-conns N         serve at most N requests at once, queueing
+#                             the rest
+#       --miss P              fraction of TRMs that aren't found
+#       --ambiguous P         fraction of lookups with several matches
+#       --hang-time T         how long hung requests hang (default 30s)
+#   -s, --seed N              random seed (default 1)
+#
+# Stats (requests per query, responses per outcome, and time spent
+# delaying and queueing) are printed as a JSON line on exit, and served
+# while running from GET /_stub/stats.  POST /_stub/config with a JSON
+# object of the settings above ({"latency": "lognormal:80ms,0.6",
+# "errors": "503=0.05", "rate": 10}) changes them on the fly, so one
+# run can step through several server behaviours.
+#
+# Example:
+#   ruby bench/mbstub.rb -l lognormal:120ms,0.5 -e 503=0.02,reset=0.005 \
+#                        -r 5 -m delay bench/corpus
+#
+
+require 'socket'
+require 'digest/md5'
+require 'json'
+
+class MBStub
+  MQ_PATH = '/cgi-bin/mq_2_1.pl'
+  MM = 'http://musicbrainz.org/mm-2.1'
+  ERRORS = %w{500 503 reset hang garbage}
+
+  HEADER = <<-EOS
+<?xml version="1.0" encoding="UTF-8"?>
+<rdf:RDF xmlns:rdf="http://www.w3.org/1999/02/22-rdf-syntax-ns#"
+         xmlns:dc="http://purl.org/dc/elements/1.1/"
+         xmlns:mq="http://musicbrainz.org/mm/mq-1.1#"
+         xmlns:mm="http://musicbrainz.org/mm/mm-2.1#">
+  EOS
+
+  #
+  # A latency distribution: parses a spec like "lognormal:80ms,0.5" and
+  # draws samples in seconds.
+  #
+  class Dist
+    KINDS = {
+      'fixed'     => 1, 'uniform' => 2, 'normal' => 2,
+      'lognormal' => 2, 'exp'     => 1, 'pareto' => 2,
+    }
+
+    attr_reader :spec
+
+    def self.time(str)
+      case str.to_s.strip
+      when /\A([\d.]+)us\z/ then $1.to_f / 1e6
+      when /\A([\d.]+)ms\z/ then $1.to_f / 1e3
+      when /\A([\d.]+)s?\z/ then $1.to_f
+      else raise ArgumentError, "bad time: #{str.inspect}"
+      end
+    end
+
+    def initialize(spec)
+      @spec = spec
+      @kind, args = spec.split(':', 2)
+      n = KINDS[@kind] or raise ArgumentError, "unknown distribution: #{@kind.inspect}"
+      args = args.to_s.split(',')
+      raise ArgumentError, "#{@kind} takes #{n} arguments" unless args.size == n
+      # sigma and alpha are plain numbers, everything else is a time
+      @args = args.each_with_index.map do |a, i|
+        i == 1 && %w{lognormal pareto}.include?(@kind) ? a.to_f : Dist.time(a)
+      end
+    end
+
+    def sample(rng)
+      a, b = @args
+      v = case @kind
+          when 'fixed'     then a
+          when 'uniform'   then a + (b - a) * rng.rand
+          when 'normal'    then a + b * gauss(rng)
+          when 'lognormal' then a * Math.exp(b * gauss(rng))
+          when 'exp'       then -a * Math.log(1 - rng.rand)
+          when 'pareto'    then a / (1 - rng.rand) ** (1 / b)
+          end
+      v < 0 ? 0 : v
+    end
+
+    private
+
+    def gauss(rng)
+      Math.sqrt(-2 * Math.log(1 - rng.rand)) * Math.cos(2 * Math::PI * rng.rand)
+    end
+  end
+
+  attr_reader :port
+
+  def self.uuid(str)
+    Digest::MD5.hexdigest(str).sub(/\A(.{8})(.{4})(.{4})(.{4})(.{12})\z/, '\1-\2-\3-\4-\5')
+  end
+
+  def self.esc(str)
+    str.to_s.gsub('&', '&amp;').gsub('<', '&lt;').gsub('>', '&gt;').gsub('"', '&quot;')
+  end
+
+  #
+  # Load fixture tracks from a corpus directory or a fixtures file.
+  #
+  def self.load(path, opts = {})
+    path = File.join(path, 'manifest.json') if File.directory?(path)
+    new(JSON.parse(File.read(path))['tracks'], opts)
+  end
+
+  def initialize(tracks, opts = {})
+    @host = opts[:host] || '127.0.0.1'
+    @port = opts[:port] || 0
+    @lock = Mutex.new
+    @slots = ConditionVariable.new
+    @active = 0
+    @tracks, @albums, @by_name, @by_trm = [], {}, {}, {}
+    @stats = {
+      'requests' => 0, 'queries' => Hash.new(0), 'outcomes' => Hash.new(0),
+      'delay_seconds' => 0.0, 'queued_seconds' => 0.0, 'max_active' => 0,
+    }
+
+    tracks.each do |t|
+      artist_id = MBStub.uuid("artist:#{t['artist']}")
+      album_id = MBStub.uuid("album:#{t['artist']}:#{t['album']}")
+      tr = {
+        'id'        => MBStub.uuid("track:#{t['id']}"),
+        'title'     => t['title'],
+        'artist'    => t['artist'],
+        'artist_id' => artist_id,
+        'album'     => t['album'],
+        'album_id'  => album_id,
+        'num'       => t['track'],
+        'duration'  => (t['seconds'].to_f * 1000).to_i,
+      }
+      @tracks << tr
+      (@albums[album_id] ||= []) << tr
+      (@by_name[key(tr['artist'], tr['title'])] ||= []) << tr
+      (t['trms'] || []).each { |trm| @by_trm[trm] = tr }
+    end
+    raise ArgumentError, 'no fixture tracks' if @tracks.empty?
+
+    configure({ :seed => 1, :rate_mode => 'reject', :hang_time => 30 }.merge(opts))
+  end
+
+  #
+  # Change the injected server behaviour: any of :latency (a Dist spec,
+  # or a hash of query name => spec, with "*" for every query),
+  # :errors (a "KIND=P,..." string or hash), :rate, :burst,
+  # :rate_mode, :max_conns, :miss, :ambiguous, :hang_time and :seed.
+  # Keys may be strings or symbols; settings that aren't given are left
+  # alone.
+  #
+  def configure(opts)
+    opts = opts.inject({}) { |h, (k, v)| h[k.to_s] = v; h }
+    @lock.synchronize do
+      @rng = Random.new(opts['seed'].to_i) if opts.key?('seed')
+
+      if opts.key?('latency')
+        lat = opts['latency']
+        lat = { '*' => lat } unless lat.is_a?(Hash)
+        @latency = {}
+        lat.each { |q, spec| @latency[q.to_s] = Dist.new(spec) if spec }
+      end
+
+      if opts.key?('errors')
+        errs = opts['errors']
+        errs = Hash[errs.to_s.split(',').map { |e| e.split('=', 2) }] unless errs.is_a?(Hash)
+        @errors = []
+        errs.each do |kind, p|
+          raise ArgumentError, "unknown error kind: #{kind.inspect}" unless ERRORS.include?(kind.to_s)
+          @errors << [kind.to_s, p.to_f]
+        end
+        raise ArgumentError, 'error rates add up to more than 1' if @errors.inject(0) { |s, e| s + e[1] } > 1
+      end
+
+      if opts.key?('rate') || opts.key?('burst')
+        @rate = opts['rate'] && opts['rate'].to_f if opts.key?('rate')
+        @burst = (opts['burst'] || @rate || 1).to_f
+        @tokens, @refilled = @burst, now
+      end
+
+      if opts.key?('rate_mode')
+        raise ArgumentError, 'rate_mode is reject or delay' unless %w{reject delay}.include?(opts['rate_mode'].to_s)
+        @rate_mode = opts['rate_mode'].to_s
+      end
+      @max_conns = opts['max_conns'] && opts['max_conns'].to_i if opts.key?('max_conns')
+      @miss = opts['miss'].to_f if opts.key?('miss')
+      @ambiguous = opts['ambiguous'].to_f if opts.key?('ambiguous')
+      @hang_time = Dist.time(opts['hang_time']) if opts.key?('hang_time')
+      @slots.broadcast
+    end
+    self
+  end
+
+  # current settings, in the form configure takes
+  def config
+    @lock.synchronize do
+      {
+        'latency'   => (@latency || {}).inject({}) { |h, (q, d)| h[q] = d.spec; h },
+        'errors'    => (@errors || []).inject({}) { |h, (k, p)| h[k] = p; h },
+        'rate'      => @rate, 'burst' => @burst, 'rate_mode' => @rate_mode,
+        'max_conns' => @max_conns, 'miss' => @miss || 0,
+        'ambiguous' => @ambiguous || 0, 'hang_time' => @hang_time,
+      }
+    end
+  end
+
+  def stats
+    @lock.synchronize { JSON.parse(JSON.generate(@stats)) }.merge('config' => config)
+  end
+
+  def start
+    @server = TCPServer.new(@host, @port)
+    @port = @server.addr[1]
+    @thread = Thread.new do
+      loop do
+        begin
+          sock = @server.accept
+        rescue IOError, Errno::EBADF
+          break
+        end
+        Thread.new(sock) { |s| serve(s) }
+      end
+    end
+    self
+  end
+
+  def stop
+    @server.close if @server && !@server.closed?
+    join
+  end
+
+  def join
+    @thread.join if @thread
+  end
+
+  private
+
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  def count(query, outcome = nil)
+    @lock.synchronize do
+      @stats['queries'][query.to_s] += 1 if query
+      @stats['outcomes'][outcome.to_s] += 1 if outcome
+    end
+  end
+
+  def add_stat(name, secs)
+    @lock.synchronize { @stats[name] += secs }
+  end
+
+  def rand
+    @lock.synchronize { @rng.rand }
+  end
+
+  def key(artist, title)
+    "#{artist.to_s.downcase.strip}\0#{title.to_s.downcase.strip}"
+  end
+
+  # a fraction of things picked by hash rather than at random, so the
+  # same TRMs are missed on every run
+  def picked?(str, frac)
+    frac && frac > 0 && Digest::MD5.hexdigest(str.to_s)[8, 8].to_i(16) < frac * 0xffffffff
+  end
+
+  #
+  # Token bucket.  Returns 0 if the request can go ahead now, or how
+  # long it would have to wait: in delay mode the token is taken
+  # anyway and the caller waits that long; in reject mode nothing is
+  # taken.
+  #
+  def throttle
+    @lock.synchronize do
+      return 0 unless @rate && @rate > 0
+      t = now
+      @tokens = [@tokens + (t - @refilled) * @rate, @burst].min
+      @refilled = t
+
+      if @tokens >= 1
+        @tokens -= 1
+        0
+      elsif @rate_mode == 'delay'
+        @tokens -= 1
+        -@tokens / @rate
+      else
+        (1 - @tokens) / @rate
+      end
+    end
+  end
+
+  def enter
+    t = now
+    @lock.synchronize do
+      @slots.wait(@lock) while @max_conns && @max_conns > 0 && @active >= @max_conns
+      @active += 1
+      @stats['requests'] += 1
+      @stats['max_active'] = @active if @active > @stats['max_active']
+      @stats['queued_seconds'] += now - t
+    end
+  end
+
+  def leave
+    @lock.synchronize do
+      @active -= 1
+      @slots.signal
+    end
+  end
+
+  def error_kind
+    r = rand
+    (@errors || []).each do |kind, p|
+      return kind if r < p
+      r -= p
+    end
+    nil
+  end
+
+  def delay(query)
+    d = @latency && (@latency[query] || @latency['*'])
+    return unless d
+    secs = @lock.synchronize { d.sample(@rng) }
+    add_stat('delay_seconds', secs)
+    sleep secs
+  end
+
+  def respond(sock, code, body, headers = {})
+    head = "HTTP/1.0 #{code}\r\nContent-Type: text/plain\r\n" \
+           "Content-Length: #{body.bytesize}\r\nConnection: close\r\n"
+    headers.each { |k, v| head << "#{k}: #{v}\r\n" }
+    sock.write(head + "\r\n" + body)
+  end
+
+  def serve(sock)
+    line = sock.gets or return
+    meth, path = line.split(' ', 3)
+    len = 0
+    while (l = sock.gets) && l !~ /\A\r?\n\z/
+      len = $1.to_i if l =~ /\AContent-Length:\s*(\d+)/i
+    end
+    body = len > 0 ? sock.read(len).to_s : ''
+    # a request line with no method or path
+    return respond(sock, '400 Bad Request', '') unless path.to_s.start_with?('/')
+
+    # the control endpoints aren't counted or interfered with
+    return control(sock, meth, path, body) if path.start_with?('/_stub/')
+
+    enter
+    begin
+      query = query_name(meth, path, body)
+      count(query)
+
+      if (wait = throttle) > 0
+        if @rate_mode == 'reject'
+          count(nil, 'rate_limited')
+          return respond(sock, '503 Service Unavailable', '', 'Retry-After' => wait.ceil)
+        end
+        add_stat('queued_seconds', wait)
+        sleep wait
+      end
+
+      case kind = error_kind
+      when '500', '503'
+        delay(query)
+        count(nil, kind)
+        return respond(sock, kind == '500' ? '500 Internal Server Error' : '503 Service Unavailable', '')
+      when 'reset'
+        count(nil, kind)
+        sock.setsockopt(Socket::SOL_SOCKET, Socket::SO_LINGER, [1, 0].pack('ii'))
+        return
+      when 'hang'
+        count(nil, kind)
+        sleep @hang_time
+        return
+      end
+
+      delay(query)
+      code, xml = handle(meth, path, body, query)
+      if kind == 'garbage'
+        count(nil, kind)
+        xml = xml[0, xml.size / 2]
+      else
+        count(nil, code[0, 3])
+      end
+      respond(sock, code, xml)
+    ensure
+      leave
+    end
+  rescue SystemCallError, IOError
+    count(nil, 'broken')
+  ensure
+    sock.close rescue nil
+  end
+
+  def control(sock, meth, path, body)
+    case [meth, path]
+    when ['GET', '/_stub/stats']
+      respond(sock, '200 OK', JSON.generate(stats))
+    when ['POST', '/_stub/config']
+      configure(JSON.parse(body))
+      respond(sock, '200 OK', JSON.generate(config))
+    else
+      respond(sock, '404 Not Found', '')
+    end
+  rescue ArgumentError, JSON::ParserError => e
+    respond(sock, '400 Bad Request', e.message)
+  end
+
+  def query_name(meth, path, body)
+    if meth == 'POST' && path.start_with?(MQ_PATH)
+      body =~ /<mq:(\w+)/ ? $1 : 'unknown'
+    elsif meth == 'GET' && path.start_with?('/mm-2.1/')
+      'get'
+    else
+      'unknown'
+    end
+  end
+
+  def handle(meth, path, body, query)
+    if query == 'get' && path =~ %r{\A/mm-2\.1/(artist|album|track)/([-0-9a-f]+)}
+      (r = resource($1, $2)) ? ['200 OK', r] : ['404 Not Found', '']
+    elsif query == 'unknown'
+      ['404 Not Found', '']
+    else
+      mq(query, body)
+    end
+  end
+
+  def arg(body, name)
+    body =~ %r{<mq:#{name}>(.*?)</mq:#{name}>}m ? unesc($1) : nil
+  end
+
+  def unesc(str)
+    str.gsub('&lt;', '<').gsub('&gt;', '>').gsub('&quot;', '"').gsub('&amp;', '&')
+  end
+
+  def mq(name, body)
+    case name
+    when 'TrackInfoFromTRMId'
+      ok(track_list(by_trm(arg(body, 'trmid'))))
+    when 'FileInfoLookup'
+      trm = arg(body, 'trmid').to_s
+      list = @by_name[key(arg(body, 'artistName'), arg(body, 'trackName'))]
+      list ||= trm.size > 0 ? by_trm(trm) : []
+      # near misses: other tracks off the same album, less relevant
+      if list.size > 0 && picked?("ambiguous:#{trm}:#{arg(body, 'trackName')}", @ambiguous)
+        list = list + (@albums[list[0]['album_id']] - list).first(3)
+      end
+      ok(lookup_results(list))
+    when 'SubmitTRMList', 'AuthenticateQuery'
+      session = MBStub.uuid("session:#{rand}")
+      ok("  <mq:sessionKey>#{session}</mq:sessionKey>\n" \
+         "  <mq:challenge>#{session}</mq:challenge>\n")
+    else
+      ['400 Bad Request', HEADER + "<mq:Result><mq:status>Unknown query</mq:status>" \
+                                   "</mq:Result>\n</rdf:RDF>\n"]
+    end
+  end
+
+  def by_trm(trm)
+    return [@by_trm[trm]] if @by_trm[trm]
+    return [] if picked?("miss:#{trm}", @miss)
+    [@tracks[Digest::MD5.hexdigest(trm.to_s)[0, 8].to_i(16) % @tracks.size]]
+  end
+
+  def ok(result)
+    xml = HEADER + "<mq:Result>\n  <mq:status>OK</mq:status>\n#{result}</mq:Result>\n"
+    (Thread.current[:mbstub_refs] || []).uniq.each { |tr| xml << track_rdf(tr) }
+    Thread.current[:mbstub_refs] = nil
+    ['200 OK', xml + "</rdf:RDF>\n"]
+  end
+
+  # remember the tracks a response refers to, so ok can describe them
+  def refer(list)
+    (Thread.current[:mbstub_refs] ||= []).concat(list)
+  end
+
+  def track_list(list)
+    refer(list)
+    "  <mm:trackList>\n    <rdf:Seq>\n" +
+      list.map { |tr| "      <rdf:li rdf:resource=\"#{MM}/track/#{tr['id']}\"/>\n" }.join +
+      "    </rdf:Seq>\n  </mm:trackList>\n"
+  end
+
+  def lookup_results(list)
+    refer(list)
+    "  <mq:lookupResultList>\n    <rdf:Seq>\n" +
+      list.each_with_index.map do |tr, i|
+        "      <rdf:li>\n        <mq:AlbumTrackResult>\n" \
+        "          <mq:relevance>#{100 - 15 * i}</mq:relevance>\n" \
+        "          <mq:album rdf:resource=\"#{MM}/album/#{tr['album_id']}\"/>\n" \
+        "          <mq:track rdf:resource=\"#{MM}/track/#{tr['id']}\"/>\n" \
+        "        </mq:AlbumTrackResult>\n      </rdf:li>\n"
+      end.join +
+      "    </rdf:Seq>\n  </mq:lookupResultList>\n"
+  end
+
+  def track_rdf(tr)
+    e = MBStub.method(:esc)
+    tracks = @albums[tr['album_id']].sort_by { |t| t['num'] }
+    "<mm:Track rdf:about=\"#{MM}/track/#{tr['id']}\">\n" \
+    "  <dc:title>#{e[tr['title']]}</dc:title>\n" \
+    "  <dc:creator rdf:resource=\"#{MM}/artist/#{tr['artist_id']}\"/>\n" \
+    "  <mm:trackNum>#{tr['num']}</mm:trackNum>\n" \
+    "  <mm:duration>#{tr['duration']}</mm:duration>\n" \
+    "</mm:Track>\n" \
+    "<mm:Artist rdf:about=\"#{MM}/artist/#{tr['artist_id']}\">\n" \
+    "  <dc:title>#{e[tr['artist']]}</dc:title>\n" \
+    "  <mm:sortName>#{e[tr['artist']]}</mm:sortName>\n" \
+    "</mm:Artist>\n" \
+    "<mm:Album rdf:about=\"#{MM}/album/#{tr['album_id']}\">\n" \
+    "  <dc:title>#{e[tr['album']]}</dc:title>\n" \
+    "  <dc:creator rdf:resource=\"#{MM}/artist/#{tr['artist_id']}\"/>\n" \
+    "  <mm:releaseType rdf:resource=\"http://musicbrainz.org/mm/mm-2.1#TypeAlbum\"/>\n" \
+    "  <mm:trackList>\n    <rdf:Seq>\n" +
+      tracks.map { |t| "      <rdf:li rdf:resource=\"#{MM}/track/#{t['id']}\"/>\n" }.join +
+    "    </rdf:Seq>\n  </mm:trackList>\n</mm:Album>\n"
+  end
+
+  def resource(kind, id)
+    tr = @tracks.find { |t| t[kind == 'track' ? 'id' : "#{kind}_id"] == id } or return nil
+    refer([tr])
+    ok('')[1]
+  end
+end
+
+if __FILE__ == $0
+  require 'optparse'
+
+  opts, latency = {}, {}
+  usage = "Usage: #$0 [options] FIXTURES"
+  OptionParser.new do |o|
+    o.banner = usage
+    o.on('-p', '--port N', Integer) { |v| opts[:port] = v }
+    o.on('-l', '--latency SPEC') do |v|
+      q, spec = v =~ /\A(\w+)=(.*)\z/ ? [$1, $2] : ['*', v]
+      latency[q] = spec
+    end
+    o.on('-e', '--errors LIST') { |v| opts[:errors] = v }
+    o.on('-r', '--rate N', Float) { |v| opts[:rate] = v }
+    o.on('-b', '--burst N', Float) { |v| opts[:burst] = v }
+    o.on('-m', '--rate-mode MODE') { |v| opts[:rate_mode] = v }
+    o.on('-c', '--max-conns N', Integer) { |v| opts[:max_conns] = v }
+    o.on('--miss P', Float) { |v| opts[:miss] = v }
+    o.on('--ambiguous P', Float) { |v| opts[:ambiguous] = v }
+    o.on('--hang-time T') { |v| opts[:hang_time] = v }
+    o.on('-s', '--seed N', Integer) { |v| opts[:seed] = v }
+  end.parse!
+  abort usage unless ARGV.size == 1
+  opts[:latency] = latency if latency.size > 0
+
+  begin
+    stub = MBStub.load(ARGV[0], opts).start
+  rescue ArgumentError => e
+    abort "#$0: #{e.message}"
+  end
+  $stdout.sync = true
+  puts "listening on 127.0.0.1:#{stub.port}"
+  %w{INT TERM}.each { |sig| trap(sig) { Thread.new { stub.stop } } }
+  stub.join
+  puts JSON.generate(stub.stats)
+end
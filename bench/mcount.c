@@ -0,0 +1,124 @@
+/*
+ * mcount.c - count malloc calls, for bench/micro.rb and bench/baseline.
+ *
+ * Build:
+ *   cc -O2 -shared -fPIC -o bench/mcount.so bench/mcount.c -ldl
+ *
+ * Preload it to count every malloc, calloc, realloc and posix_memalign
+ * in the process
+ * (libtunepimp's, the binding's and Ruby's):
+ *   LD_PRELOAD=bench/mcount.so ruby bench/micro.rb
+ *
+ * The counts are read with mcount_calls() and mcount_bytes().
+ */
+
+#define _GNU_SOURCE
+#include <stddef.h>
+#include <string.h>
+#include <dlfcn.h>
+
+static void *(*real_malloc)(size_t);
+static void *(*real_calloc)(size_t, size_t);
+static void *(*real_realloc)(void *, size_t);
+static int (*real_posix_memalign)(void **, size_t, size_t);
+static void (*real_free)(void *);
+
+static unsigned long long num_calls, num_bytes;
+
+/* dlsym() allocates before we have the real allocators */
+static char boot[4096];
+static size_t boot_used;
+static int booting;
+
+static void mcount_init(void) {
+  booting = 1;
+  real_malloc = dlsym(RTLD_NEXT, "malloc");
+  real_calloc = dlsym(RTLD_NEXT, "calloc");
+  real_realloc = dlsym(RTLD_NEXT, "realloc");
+  real_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+  real_free = dlsym(RTLD_NEXT, "free");
+  booting = 0;
+}
+
+/* called from dlsym() in mcount_init() */
+static void *mcount_boot(size_t size) {
+  void *ret;
+
+  size = (size + 15) & ~15;
+  if (boot_used + size > sizeof(boot))
+    return NULL;
+  ret = boot + boot_used;
+  boot_used += size;
+  memset(ret, 0, size);
+  return ret;
+}
+
+static void mcount_add(size_t size) {
+  __atomic_add_fetch(&num_calls, 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&num_bytes, size, __ATOMIC_RELAXED);
+}
+
+unsigned long long mcount_calls(void) {
+  return __atomic_load_n(&num_calls, __ATOMIC_RELAXED);
+}
+
+unsigned long long mcount_bytes(void) {
+  return __atomic_load_n(&num_bytes, __ATOMIC_RELAXED);
+}
+
+void *malloc(size_t size) {
+  if (!real_malloc && !booting)
+    mcount_init();
+  if (!real_malloc)
+    return mcount_boot(size);
+
+  mcount_add(size);
+  return real_malloc(size);
+}
+
+void *calloc(size_t num, size_t size) {
+  if (!real_calloc && !booting)
+    mcount_init();
+  if (!real_calloc)
+    return mcount_boot(num * size);
+
+  mcount_add(num * size);
+  return real_calloc(num, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  size_t old;
+  void *ret;
+
+  if (!real_realloc && !booting)
+    mcount_init();
+
+  /* glibc can't resize a boot block: copy it out, and leave it (see free) */
+  if ((char*) ptr >= boot && (char*) ptr < boot + sizeof(boot)) {
+    if (real_malloc)
+      mcount_add(size);
+    if ((ret = real_malloc ? real_malloc(size) : mcount_boot(size)) != NULL) {
+      old = boot + boot_used - (char*) ptr;
+      memcpy(ret, ptr, old < size ? old : size);
+    }
+    return ret;
+  }
+
+  mcount_add(size);
+  return real_realloc(ptr, size);
+}
+
+int posix_memalign(void **ptr, size_t align, size_t size) {
+  if (!real_posix_memalign)
+    mcount_init();
+  mcount_add(size);
+  return real_posix_memalign(ptr, align, size);
+}
+
+void free(void *ptr) {
+  if ((char*) ptr >= boot && (char*) ptr < boot + sizeof(boot))
+    return;
+  if (!real_free)
+    mcount_init();
+  real_free(ptr);
+}
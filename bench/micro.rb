@@ -0,0 +1,402 @@
+#!/usr/bin/env ruby
+#
+# micro.rb - binding overhead micro-benchmarks.
+#
+# Usage:
+#   LD_PRELOAD=bench/mcount.so ruby bench/micro.rb [options]
+#
+# Options:
+#   -c, --corpus DIR     corpus to load (default bench/corpus-micro,
+#                        generated by bench/corpus.rb if it isn't there)
+#   -n, --files N        corpus size (default 200)
+#   -t, --time SECS      how long to run each case (default 0.5)
+#   -m, --match REGEX    only run cases whose name matches
+#   -b, --baseline PATH  native baseline (default bench/baseline, built
+#                        from bench/baseline.c if it's missing; CFLAGS
+#                        and LDFLAGS are passed to the compiler)
+#       --no-baseline    don't run the native baseline
+#   -o, --out FILE       append the report to FILE as a JSON line
+#   -L, --label TEXT     label to store with the report
+#
+# Loads the corpus into a TunePimp::TunePimp (looking it up against
+# bench/mbstub.rb, so tracks have results), waits for it to settle,
+# then calls each exported method in a loop for a while and reports
+# calls/sec, Ruby objects allocated per call and, with bench/mcount.so
+# preloaded, mallocs and bytes malloced per call.  The same calls are
+# made straight through tp_c.h by bench/baseline, and each case gets
+# the binding's overhead per call in nanoseconds and as a ratio.
+#
+# Methods that can't be called in a loop (they start threads, write
+# files or go to the network) are listed under "not_measured" with the
+# reason; new methods that have no case yet show up there as
+# "no case", so the list stays complete.
+#
+
+$LOAD_PATH.unshift File.expand_path(File.join(File.dirname(__FILE__), '..'))
+$LOAD_PATH.unshift File.dirname(__FILE__)
+
+require 'tunepimp'
+require 'corpus'
+require 'mbstub'
+require 'rbconfig'
+require 'optparse'
+require 'json'
+require 'time'
+
+module Micro
+  S = TunePimp::Status
+  DIR = File.dirname(__FILE__)
+
+  # methods we deliberately don't loop over, and why
+  SKIP = {
+    'add_dir'            => 'adds a whole tree; see bench/e2e.rb',
+    'add_tree'           => 'starts walker threads; see bench/e2e.rb',
+    'select_result'      => "changes the file's status",
+    'misidentified'      => 'sends the file back for analysis',
+    'identify_again'     => 'sends the file back for analysis',
+    'write_tags'         => 'writes files; see bench/e2e.rb',
+    'write_tags_async'   => 'starts a thread and writes files; see bench/e2e.rb',
+    'submit_trms'        => 'goes to the network',
+    'metrics_enabled='   => 'starts and stops a thread',
+  }
+
+  # most TRMs add_trm's scratch instance holds before it's replaced
+  TRM_LIMIT = 65536
+
+  FLAGS = %w{rename_files move_files write_id3v1 clear_tags file_mask
+             various_file_mask allowed_file_chars dest_dir top_src_dir
+             trm_collision_threshold min_trm_threshold auto_save_threshold
+             max_file_name_len auto_remove_saved_files}
+
+  module_function
+
+  def md_fields
+    TunePimp::Metadata.public_instance_methods(false).map(&:to_s).
+      select { |m| m =~ /\A\w+\z/ && TunePimp::Metadata.method_defined?("#{m}=") }.sort
+  end
+
+  def now
+    Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  end
+
+  # malloc counters from bench/mcount.so, if it's preloaded
+  def mcount
+    return @mcount if defined?(@mcount)
+    @mcount = begin
+      require 'fiddle'
+      h = Fiddle::Handle::DEFAULT
+      [Fiddle::Function.new(h['mcount_calls'], [], Fiddle::TYPE_LONG_LONG),
+       Fiddle::Function.new(h['mcount_bytes'], [], Fiddle::TYPE_LONG_LONG)]
+    rescue LoadError, Fiddle::DLError
+      nil
+    end
+  end
+
+  def mallocs
+    mcount ? mcount.map { |f| f.call } : [0, 0]
+  end
+
+  #
+  # Call blk in batches of about a millisecond for secs seconds.  reset,
+  # if given, is called between batches, and its time, objects and
+  # mallocs aren't counted.
+  #
+  def measure(name, secs, reset = nil, &blk)
+    n = 1
+    loop do
+      t = now
+      n.times(&blk)
+      break if now - t > 0.001 || n > (1 << 24)
+      n *= 2
+      reset.call if reset
+    end
+    reset.call if reset
+
+    GC.start
+    objs = GC.stat(:total_allocated_objects)
+    m = mallocs
+    t0 = t = now
+    calls = 0
+    while t - t0 < secs
+      n.times(&blk)
+      calls += n
+      if reset
+        r, ro, rm = now, GC.stat(:total_allocated_objects), mallocs
+        reset.call
+        t0 += now - r
+        objs += GC.stat(:total_allocated_objects) - ro
+        m2 = mallocs
+        m = [m[0] + m2[0] - rm[0], m[1] + m2[1] - rm[1]]
+      end
+      t = now
+    end
+    m2 = mallocs
+    objs = GC.stat(:total_allocated_objects) - objs
+
+    {
+      'name'              => name,
+      'calls'             => calls,
+      'seconds'           => t - t0,
+      'calls_per_sec'     => calls / (t - t0),
+      'ns_per_call'       => (t - t0) * 1e9 / calls,
+      'objects_per_call'  => objs.to_f / calls,
+      'mallocs_per_call'  => mcount ? (m2[0] - m[0]).to_f / calls : nil,
+      'malloc_bytes_per_call' => mcount ? (m2[1] - m[1]).to_f / calls : nil,
+    }
+  end
+
+  def settle(tp, secs = 600)
+    deadline = now + secs
+    loop do
+      tp.wait_notifications(:timeout => 0.05, :max => 4096)
+      c = tp.track_counts
+      break if c[S::Pending] + c[S::TRMLookup] + c[S::FileLookup] == 0
+      if now > deadline
+        warn 'micro: files still busy, going ahead anyway'
+        break
+      end
+    end
+  end
+
+  def baseline(opts)
+    path = opts[:baseline] || File.join(DIR, 'baseline')
+    unless File.executable?(path)
+      cc = ENV['CC'] || RbConfig::CONFIG['CC']
+      cmd = "#{cc} -O2 #{ENV['CFLAGS']} -o #{path} #{File.join(DIR, 'baseline.c')} " \
+            "#{ENV['LDFLAGS']} -ltunepimp -lpthread -ldl"
+      system(cmd) or (warn "micro: couldn't build the baseline: #{cmd}"; return {})
+    end
+
+    args = [path, '-t', opts[:time].to_s, '-S', opts[:server], opts[:corpus]]
+    ret = {}
+    IO.popen(args, 'r') do |io|
+      io.each_line do |l|
+        r = JSON.parse(l)
+        ret[r['name']] = r
+      end
+    end
+    ret
+  end
+
+  #
+  # The cases: name => block.  Names are method names, with the class
+  # for methods that aren't on TunePimp::TunePimp, and match the ones
+  # in bench/baseline.c where there's a native equivalent.  Cases that
+  # pile up state also get a reset block, in the second hash.
+  #
+  def cases(tp, opts)
+    id = tp.file_ids.first
+    tr = tp.track(id)
+    path = tr.filename
+    md, md2 = tr.local_metadata, tr.server_metadata
+    into = tr.local_metadata
+    rs = tr.results
+    trm = tr.trm
+    null = File.open(File::NULL, 'w')
+    ids = tp.file_ids
+    other = ids.last   # Track objects are shared, so not tr's
+    cache = tp.trm_cache
+    host, port = opts[:server].split(':')
+    port = port.to_i
+    # libtunepimp never empties its TRM list unless it's submitted, so
+    # add_trm fills a scratch instance, replaced when the list gets long
+    subs = TunePimp::TunePimp.new('tunepimp-bench', TunePimp::VERSION)
+
+    c = {
+      'noop'                      => proc { },
+      'version'                   => proc { tp.version },
+      'user_info'                 => proc { tp.user_info },
+      'set_user_info'             => proc { tp.set_user_info('bench', 'bench') },
+      'use_utf8'                  => proc { tp.use_utf8 },
+      'use_utf8='                 => proc { tp.use_utf8 = true },
+      'server'                    => proc { tp.server },
+      'set_server'                => proc { tp.set_server(host, port) },
+      'proxy'                     => proc { tp.proxy },
+      'set_proxy'                 => proc { tp.set_proxy('', 0) },
+      'num_supported_extensions'  => proc { tp.num_supported_extensions },
+      'supported_extensions'      => proc { tp.supported_extensions },
+      'analyzer_priority'         => proc { tp.analyzer_priority },
+      'analyzer_priority='        => proc { tp.analyzer_priority = TunePimp::ThreadPriority::Normal },
+      'notification'              => proc { tp.notification },
+      'status'                    => proc { tp.status },
+      'wait_notifications'        => proc { tp.wait_notifications(:timeout => 0) },
+      'wait_status'               => proc { tp.wait_status(:timeout => 0) },
+      'notification_io'           => proc { tp.notification_io },
+      'error'                     => proc { tp.error },
+      'debug'                     => proc { tp.debug },
+      'debug='                    => proc { tp.debug = false },
+      'trm_cache'                 => proc { tp.trm_cache },
+      'trm_cache='                => proc { tp.trm_cache = cache },
+      'num_files'                 => proc { tp.num_files },
+      'num_unsubmitted'           => proc { tp.num_unsubmitted },
+      'num_unsaved_items'         => proc { tp.num_unsaved_items },
+      'track_counts'              => proc { tp.track_counts },
+      'metrics_enabled'           => proc { tp.metrics_enabled },
+      'metrics'                   => proc { tp.metrics },
+      'metrics_text'              => proc { tp.metrics_text },
+      'transitions'               => proc { tp.transitions(id) },
+      'num_file_ids'              => proc { tp.num_file_ids },
+      'file_ids'                  => proc { tp.file_ids },
+      'track'                     => proc { tp.release_track(tp.track(other)) },
+      'snapshot'                  => proc { tp.snapshot(ids) },
+      'export'                    => proc { tp.export(null) },
+      'wake'                      => proc { tp.wake(tr) },
+      'add_trm'                   => proc { subs.add_trm(trm, trm) },
+      'recognized_files'          => proc { tp.recognized_files(100) },
+      'Track#status'              => proc { tr.status },
+      'Track#status='             => proc { tr.status = tr.status },
+      'Track#filename'            => proc { tr.filename },
+      'Track#trm'                 => proc { tr.trm },
+      'Track#local_metadata'      => proc { tr.local_metadata },
+      'Track#local_metadata(:into)' => proc { tr.local_metadata(:into => into) },
+      'Track#local_metadata='     => proc { tr.local_metadata = md },
+      'Track#server_metadata'     => proc { tr.server_metadata },
+      'Track#server_metadata='    => proc { tr.server_metadata = md2 },
+      'Track#error'               => proc { tr.error },
+      'Track#similarity'          => proc { tr.similarity },
+      'Track#has_changed?'        => proc { tr.has_changed? },
+      'Track#num_results'         => proc { tr.num_results },
+      'Track#results'             => proc { tr.results },
+      'Track#lock'                => proc { tr.lock; tr.unlock },
+      'Metadata#to_h'             => proc { md.to_h },
+      'Metadata#diff'             => proc { md.diff(md2) },
+      'Metadata#=='               => proc { md == md2 },
+      'Results#type'              => proc { rs.type },
+      'Results#size'              => proc { rs.size },
+      'Results#[]'                => proc { rs[0] },
+      'Results#each'              => proc { rs.each { } },
+      'add_file'                  => proc { tp.remove(tp.add_file(path)) },
+      'add_files'                 => proc { tp.add_files([path]).each { |i| tp.remove(i) } },
+    }
+
+    # options and metadata fields: set to what they already are
+    FLAGS.each do |f|
+      get, set = f.to_sym, :"#{f}="
+      v = tp.public_send(get)
+      c[f] = proc { tp.public_send(get) }
+      c["#{f}="] = proc { tp.public_send(set, v) }
+    end
+    md_fields.each do |f|
+      get, set = f.to_sym, :"#{f}="
+      v = md.public_send(get)
+      c["Metadata##{f}"] = proc { md.public_send(get) }
+      c["Metadata##{f}="] = proc { md.public_send(set, v) }
+    end
+
+    # these two add files, so they go last
+    c['add_file'] = c.delete('add_file')
+    c['add_files'] = c.delete('add_files')
+
+    resets = {
+      'add_trm' => proc do
+        if subs.num_unsubmitted >= TRM_LIMIT
+          subs = TunePimp::TunePimp.new('tunepimp-bench', TunePimp::VERSION)
+        end
+      end,
+    }
+
+    [c, resets, proc { tp.release_track(tr); null.close }]
+  end
+
+  # exported methods without a case, and why
+  def not_measured(names)
+    covered = {}
+    names.each do |n|
+      covered[n.sub(/\(.*\)\z/, '')] = true
+    end
+    covered['remove'] = covered['release_track'] = true   # add_file, track
+    covered['Track#unlock'] = true                         # Track#lock
+
+    ret = {}
+    { '' => TunePimp::TunePimp, 'Track#' => TunePimp::Track,
+      'Metadata#' => TunePimp::Metadata, 'Results#' => TunePimp::Results }.each do |pre, klass|
+      klass.public_instance_methods(false).map(&:to_s).sort.each do |m|
+        next if klass.instance_method(m).original_name.to_s != m   # alias
+        name = pre + m
+        next if covered[name]
+        ret[name] = SKIP[name] || 'no case'
+      end
+    end
+    ret
+  end
+
+  def run(opts)
+    manifest = Corpus.generate(opts[:corpus], :files => opts[:files], :formats => %w{wav mp3})
+    stub = MBStub.load(opts[:corpus]).start
+    opts[:server] = "127.0.0.1:#{stub.port}"
+
+    tp = TunePimp::TunePimp.new('tunepimp-bench', TunePimp::VERSION)
+    tp.set_server('127.0.0.1', stub.port)
+    tp.rename_files = false
+    tp.move_files = false
+    tp.add_dir(opts[:corpus])
+    settle(tp)
+
+    cs, resets, done = cases(tp, opts)
+    ret = {}
+    cs.each do |name, blk|
+      next if opts[:match] && name !~ opts[:match]
+      tp.metrics_enabled = true if name =~ /\A(metrics|transitions)/
+      ret[name] = measure(name, opts[:time], resets[name], &blk)
+      tp.metrics_enabled = false
+      tp.wait_notifications(:timeout => 0, :max => 1 << 20)
+      $stderr.print "\rmicro: #{ret.size}/#{cs.size}" if $stderr.tty?
+    end
+    $stderr.puts if $stderr.tty?
+    done.call
+    stub.stop
+
+    # the native side gets its own server, so the two don't share one
+    unless opts[:no_baseline]
+      stub = MBStub.load(opts[:corpus]).start
+      native = baseline(opts.merge(:server => "127.0.0.1:#{stub.port}"))
+      stub.stop
+      noop = ret['noop'] ? ret['noop']['ns_per_call'] : 0
+      ret.each do |name, r|
+        next unless n = native[name]
+        r['native_ns_per_call'] = n['ns_per_call']
+        r['native_mallocs_per_call'] = n['mallocs_per_call']
+        r['overhead_ns_per_call'] = r['ns_per_call'] - noop - n['ns_per_call']
+        r['overhead_ratio'] = n['ns_per_call'] > 0 ? (r['ns_per_call'] - noop) / n['ns_per_call'] : nil
+      end
+    end
+
+    {
+      'benchmark'    => 'micro',
+      'label'        => opts[:label],
+      'time'         => Time.now.utc.iso8601,
+      'versions'     => {
+        'ruby'        => RUBY_VERSION,
+        'binding'     => TunePimp::VERSION,
+        'libtunepimp' => tp.version.join('.'),
+      },
+      'files'        => tp.num_files,
+      'malloc_counts' => !!mcount,
+      'cases'        => ret.values,
+      'not_measured' => not_measured(cs.keys),
+    }
+  end
+end
+
+if __FILE__ == $0
+  opts = {
+    :corpus => File.join(Micro::DIR, 'corpus-micro'),
+    :files  => 200,
+    :time   => 0.5,
+  }
+  OptionParser.new do |o|
+    o.banner = "Usage: #$0 [options]"
+    o.on('-c', '--corpus DIR') { |v| opts[:corpus] = v }
+    o.on('-n', '--files N', Integer) { |v| opts[:files] = v }
+    o.on('-t', '--time SECS', Float) { |v| opts[:time] = v }
+    o.on('-m', '--match REGEX', Regexp) { |v| opts[:match] = v }
+    o.on('-b', '--baseline PATH') { |v| opts[:baseline] = v }
+    o.on('--no-baseline') { opts[:no_baseline] = true }
+    o.on('-o', '--out FILE') { |v| opts[:out] = v }
+    o.on('-L', '--label TEXT') { |v| opts[:label] = v }
+  end.parse!
+
+  report = Micro.run(opts)
+  File.open(opts[:out], 'a') { |fh| fh.puts(JSON.generate(report)) } if opts[:out]
+  puts JSON.pretty_generate(report)
+end
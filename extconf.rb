@@ -2,6 +2,24 @@ require 'mkmf'
 
 $LDFLAGS << ' -lz'
 
+have_header('ruby/st.h')
+have_header('ruby/version.h')
+# GC compaction and native memory accounting (ruby 2.7+ / 2.4+)
+have_func('rb_gc_mark_movable', 'ruby.h')
+have_func('rb_gc_adjust_memory_usage', 'ruby.h')
+
+# release the global VM lock around blocking libtunepimp calls, if this
+# ruby supports it
+if have_header('ruby/thread.h')
+  have_func('rb_thread_call_without_gvl', 'ruby/thread.h')
+end
+
+# CPU pinning for TunePimp::Pool (linux)
+have_func('pthread_setaffinity_np', 'pthread.h')
+
+# physical file order for scheduled tag writes (linux)
+have_header('linux/fiemap.h')
+
 cpp_include 'tunepimp/tp_c.h'
 if have_library('tunepimp', 'tp_New')
   create_makefile('tunepimp')
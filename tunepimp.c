@@ -24,12 +24,86 @@
 /* SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.               */
 /************************************************************************/
 
+/* for pthread_setaffinity_np */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/syscall.h>
+#ifdef HAVE_LINUX_FIEMAP_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <strings.h>
+#include <dirent.h>
 #include <tunepimp/tp_c.h>
 #include <ruby.h>
+#ifdef HAVE_RUBY_ST_H
+#include <ruby/st.h>
+#else
+#include <st.h>
+#endif
+#ifdef HAVE_RUBY_THREAD_H
+#include <ruby/thread.h>
+#endif
+#ifdef HAVE_RUBY_VERSION_H
+#include <ruby/version.h>
+#endif
 
 #define VERSION "0.1.0"
 #define UNUSED(a) ((void) (a))
 
+#ifndef RSTRING_PTR
+#define RSTRING_PTR(s) (RSTRING(s)->ptr)
+#define RSTRING_LEN(s) (RSTRING(s)->len)
+#endif
+/* 
+ * GC compaction support (ruby 2.7+): mark references as movable and
+ * update them in the dcompact callback
+ */
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+#define TP_COMPACT(fn) fn
+#else
+#define rb_gc_mark_movable(v) rb_gc_mark(v)
+#define TP_COMPACT(fn) 0
+#endif
+
+#ifndef HAVE_RB_GC_ADJUST_MEMORY_USAGE
+#define rb_gc_adjust_memory_usage(diff) ((void) (diff))
+#endif
+
+#ifndef RARRAY_PTR
+#define RARRAY_PTR(a) (RARRAY(a)->ptr)
+#define RARRAY_LEN(a) (RARRAY(a)->len)
+#endif
+
+/* BSDs lack MSG_NOSIGNAL; SIGPIPE is blocked in proxy threads anyway */
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 static VALUE mTP,
              cTP,
              cTr,
@@ -39,1841 +113,11884 @@ static VALUE mTP,
              mStat,
              cMD,
              mRT,
+             cArtistResult,
+             cAlbumResult,
+             cTrackResult,
+             cRS,
+             cIdx,
+             cTRMC,
+             cProxy,
+             cPool,
+             cGov,
+             cTagWrite,
+             cJournal,
+             mTracer,
              eException;
 
+/*********************************************************************/
+/* Tracing                                                           */
+/*********************************************************************/
+
+static double tp_now(void) {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/*
+ * Process-wide ring buffer of binding calls, notifications and status
+ * changes, for TunePimp::Tracer.  Every call site tests tp_tracing and
+ * nothing else while tracing is off.  The buffer is kept (not freed)
+ * when tracing stops, so a thread that saw the flag just before it was
+ * cleared can still record safely.  Status changes are recorded as the
+ * status entered; TunePimp::Tracer.dump works out how long each
+ * lasted.
+ */
+enum { TP_TEV_CALL, TP_TEV_NOTE, TP_TEV_STATUS };
+
+typedef struct {
+  double ts, dur;
+  const char *name;
+  int kind, file_id;
+  long arg, tid;
+} tp_tev_t;
+
+static volatile int tp_tracing = 0;
+static struct {
+  pthread_mutex_t lock;
+  tp_tev_t *events;
+  unsigned long cap, total;
+  double epoch;
+} tp_trace = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0, 0 };
+
+static long tp_trace_tid(void) {
+#ifdef SYS_gettid
+  return (long) syscall(SYS_gettid);
+#else
+  return (long) (uintptr_t) pthread_self();
+#endif
+}
+
+static void tp_trace_add(int kind, const char *name, int file_id, long arg, double ts, double dur) {
+  tp_tev_t *ev;
+
+  pthread_mutex_lock(&tp_trace.lock);
+  /* ts is 0 for a call that started before tracing did */
+  if (tp_trace.events && ts > 0) {
+    ev = tp_trace.events + tp_trace.total++ % tp_trace.cap;
+    ev->ts = ts;
+    ev->dur = dur;
+    ev->name = name;
+    ev->kind = kind;
+    ev->file_id = file_id;
+    ev->arg = arg;
+    ev->tid = kind == TP_TEV_STATUS ? file_id : tp_trace_tid();
+  }
+  pthread_mutex_unlock(&tp_trace.lock);
+}
+
+/* 
+ * Time a binding call: TP_TRACE_START notes when it started (if
+ * tracing), and TP_TRACE_CALL records it once it's done.
+ */
+#define TP_TRACE_START(t0) ((t0) = tp_tracing ? tp_now() : 0)
+#define TP_TRACE_CALL(t0, name, file_id, arg) do { \
+  if (tp_tracing) \
+    tp_trace_add(TP_TEV_CALL, (name), (file_id), (arg), (t0), tp_now() - (t0)); \
+} while (0)
+
+/*********************************************************************/
+/* Blocking call wrappers                                            */
+/*********************************************************************/
+
+/*
+ * Arguments and result of a libtunepimp call made without the global
+ * VM lock.  Everything in here is a plain C copy of the Ruby arguments,
+ * so the blocking function never touches a Ruby object.
+ */
+typedef struct tp_call_t tp_call_t;
+typedef struct tp_index_t tp_index_t;
+typedef struct tp_trmc_t tp_trmc_t;
+typedef struct tp_pending_t tp_pending_t;
+typedef struct tp_gov_t tp_gov_t;
+typedef struct tp_wasync_t tp_wasync_t;
+typedef struct tp_jrnl_t tp_jrnl_t;
+typedef struct tp_mx_t tp_mx_t;
+typedef struct tp_pimp_t tp_pimp_t;
+typedef void *(*tp_call_fn)(void *);
+
+static void tp_pimp_ref(tp_pimp_t *);
+static void tp_pimp_unref(tp_pimp_t *);
+
+struct tp_call_t {
+  tunepimp_t tp;
+  track_t tr;
+  char *path;
+  int *ids, num_ids;
+  int file_id, ret;
+  volatile int cancelled;
+
+  /* rescan index and TRM cache consulted when adding files, if any */
+  tp_index_t *index;
+  int restore;
+  tp_trmc_t *trmc;
+  tp_pending_t *pending;
+
+  /* 
+   * if set, called (still without the GVL) when the call was
+   * interrupted, to give back anything it acquired before the
+   * interrupt is raised
+   */
+  tp_call_fn undo;
+};
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+/*
+ * Unblocking function: called by Ruby (from another thread) when the
+ * thread blocked in libtunepimp is interrupted.  libtunepimp calls
+ * can't be aborted midway, so we just flag the call as cancelled;
+ * calls that loop check the flag between iterations, and the pending
+ * interrupt is raised as soon as the call returns.
+ */
+static void tp_call_cancel(void *ptr) {
+  ((tp_call_t*) ptr)->cancelled = 1;
+}
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+/*
+ * Run fn(call) with the global VM lock released (if this Ruby
+ * supports it), then handle any pending interrupts.
+ *
+ * Bulk calls embed a tp_call_t as the first member of their own
+ * argument struct, so fn can cast call back to the enclosing struct.
+ */
+static void tp_call_blocking(tp_call_fn fn, tp_call_t *call) {
+  call->cancelled = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(fn, call, tp_call_cancel, call);
+  if (call->cancelled && call->undo) {
+    /* 
+     * whatever fn acquired has been given back, so the caller can't
+     * carry on even if the interrupt turns out not to raise (a trap
+     * handler that returns, say)
+     */
+    call->undo(call);
+    rb_thread_check_ints();
+    rb_raise(rb_eInterrupt, "Interrupted");
+  }
+  rb_thread_check_ints();
+#else
+  fn(call);
+#endif
+}
+
+/*
+ * Copy a Ruby string into a freshly allocated C string, so it can be
+ * used safely while the GVL is released (another thread may modify or
+ * free the original).  Raises ArgumentError if the string has an
+ * embedded NUL.  Free the result with free().
+ */
+static char *tp_strdup(VALUE str) {
+  char *ret;
+  long len;
+
+  StringValueCStr(str);
+  len = RSTRING_LEN(str);
+  if ((ret = malloc(len + 1)) == NULL)
+    rb_raise(eException, "Couldn't allocate %ld bytes for char*", len + 1);
+  memcpy(ret, RSTRING_PTR(str), len);
+  ret[len] = '\0';
+
+  return ret;
+}
+
+static int tp_add_file(tp_call_t *, const char *);
+
+static void *tp_call_add_file(void *ptr) {
+  tp_call_t *call = ptr;
+  double t0;
+
+  TP_TRACE_START(t0);
+  call->ret = tp_add_file(call, call->path);
+  TP_TRACE_CALL(t0, "add_file", call->ret, 0);
+  return NULL;
+}
+
+static void *tp_call_add_dir(void *ptr) {
+  tp_call_t *call = ptr;
+  double t0;
+
+  TP_TRACE_START(t0);
+  call->ret = tp_AddDir(call->tp, call->path);
+  TP_TRACE_CALL(t0, "add_dir", -1, call->ret);
+  return NULL;
+}
+
+/*
+ * Add num_ids files, whose names are packed back to back (each
+ * NUL-terminated) in path, storing each new file id (or -1 if the
+ * index says to skip it) in ids.  ret is the number processed, which
+ * is short of num_ids if interrupted.
+ */
+static void *tp_call_add_files(void *ptr) {
+  tp_call_t *call = ptr;
+  char *path = call->path;
+  double t0;
+
+  TP_TRACE_START(t0);
+  for (call->ret = 0; call->ret < call->num_ids && !call->cancelled; call->ret++) {
+    call->ids[call->ret] = tp_add_file(call, path);
+    path += strlen(path) + 1;
+  }
+  TP_TRACE_CALL(t0, "add_files", -1, call->ret);
+
+  return NULL;
+}
+
+static void *tp_call_get_track(void *ptr) {
+  tp_call_t *call = ptr;
+  call->tr = tp_GetTrack(call->tp, call->file_id);
+  return NULL;
+}
+
+static void *tp_call_release_track(void *ptr) {
+  tp_call_t *call = ptr;
+  if (call->tr)
+    tp_ReleaseTrack(call->tp, call->tr);
+  return NULL;
+}
+
+/*
+ * Write tags in batches, so an interrupted thread stops queueing
+ * writes at the next batch boundary.
+ */
+#define TP_WRITE_BATCH 256
+static void *tp_call_write_tags(void *ptr) {
+  tp_call_t *call = ptr;
+  double t0;
+  int i, n;
+
+  TP_TRACE_START(t0);
+  if (!call->ids) {
+    call->ret = tp_WriteTags(call->tp, NULL, 0);
+    TP_TRACE_CALL(t0, "write_tags", -1, 0);
+    return NULL;
+  }
+
+  call->ret = 1;
+  for (i = 0; i < call->num_ids && !call->cancelled; i += n) {
+    n = call->num_ids - i;
+    if (n > TP_WRITE_BATCH)
+      n = TP_WRITE_BATCH;
+    if (!tp_WriteTags(call->tp, call->ids + i, n))
+      call->ret = 0;
+  }
+  TP_TRACE_CALL(t0, "write_tags", -1, call->num_ids);
+
+  return NULL;
+}
+
+static void *tp_call_submit_trms(void *ptr) {
+  tp_call_t *call = ptr;
+  double t0;
+
+  TP_TRACE_START(t0);
+  call->ret = tp_SubmitTRMs(call->tp);
+  TP_TRACE_CALL(t0, "submit_trms", -1, call->ret);
+  return NULL;
+}
+
+/* ret says whether the lock is held when the call comes back */
+static void *tp_call_lock(void *ptr) {
+  tr_Lock(((tp_call_t*) ptr)->tr);
+  ((tp_call_t*) ptr)->ret = 1;
+  return NULL;
+}
+
+static void *tp_call_unlock(void *ptr) {
+  tr_Unlock(((tp_call_t*) ptr)->tr);
+  ((tp_call_t*) ptr)->ret = 0;
+  return NULL;
+}
+
+
+/*********************************************************************/
+/* Event queue                                                       */
+/*********************************************************************/
+
+/*
+ * Growable ring buffer of fixed-size elements.  Not locked; the
+ * owning tp_queue_t holds its mutex around every access.
+ */
+typedef struct {
+  char *buf;
+  size_t size, head, len, cap;
+} tp_ring_t;
+
+static void tp_ring_init(tp_ring_t *ring, size_t size) {
+  ring->buf = NULL;
+  ring->size = size;
+  ring->head = ring->len = ring->cap = 0;
+}
+
+static int tp_ring_push(tp_ring_t *ring, const void *elem) {
+  size_t i, cap;
+  char *buf;
+
+  if (ring->len == ring->cap) {
+    cap = ring->cap ? ring->cap * 2 : 64;
+    if ((buf = malloc(cap * ring->size)) == NULL)
+      return 0;
+
+    /* unwrap the old contents to the front of the new buffer */
+    for (i = 0; i < ring->len; i++)
+      memcpy(buf + i * ring->size,
+             ring->buf + ((ring->head + i) % ring->cap) * ring->size,
+             ring->size);
+
+    free(ring->buf);
+    ring->buf = buf;
+    ring->head = 0;
+    ring->cap = cap;
+  }
+
+  memcpy(ring->buf + ((ring->head + ring->len) % ring->cap) * ring->size,
+         elem, ring->size);
+  ring->len++;
+
+  return 1;
+}
+
+static int tp_ring_shift(tp_ring_t *ring, void *elem) {
+  if (!ring->len)
+    return 0;
+
+  memcpy(elem, ring->buf + ring->head * ring->size, ring->size);
+  ring->head = (ring->head + 1) % ring->cap;
+  ring->len--;
+
+  return 1;
+}
+
+/*
+ * A single notification, as passed to the libtunepimp notify callback.
+ */
+typedef struct {
+  int type, file_id;
+} tp_note_t;
+
+/*
+ * Notifications and status messages from one tunepimp_t.
+ *
+ * libtunepimp calls the callbacks below from its own threads; we queue
+ * the events here and wake up anybody waiting on the condition
+ * variable.  The read end of the pipe is readable whenever either queue
+ * is non-empty, so it can be handed to IO.select.
+ */
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  tp_ring_t notes, stats;
+  int fds[2], signalled;
+
+  /* asynchronous tag writes waiting on WriteTagsComplete */
+  tp_wasync_t *writes;
+
+  /* metrics collection, if it's on */
+  tp_mx_t *mx;
+
+  /* files waiting for their TRM to be cached (see tp_pending_notify) */
+  tp_pending_t *pending;
+
+  /* the TunePimp object's state, for tp_tstat_note */
+  tp_pimp_t *pimp;
+} tp_queue_t;
+
+static int tp_queue_init(tp_queue_t *q) {
+  int i;
+
+  if (pipe(q->fds))
+    return 0;
+  for (i = 0; i < 2; i++) {
+    fcntl(q->fds[i], F_SETFL, fcntl(q->fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(q->fds[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  pthread_mutex_init(&q->mutex, NULL);
+  pthread_cond_init(&q->cond, NULL);
+  tp_ring_init(&q->notes, sizeof(tp_note_t));
+  tp_ring_init(&q->stats, sizeof(char*));
+  q->signalled = 0;
+  q->writes = NULL;
+  q->mx = NULL;
+  q->pending = NULL;
+  q->pimp = NULL;
+
+  return 1;
+}
+
+static void tp_queue_free(tp_queue_t *q) {
+  char *stat;
+
+  while (tp_ring_shift(&q->stats, &stat))
+    free(stat);
+  free(q->stats.buf);
+  free(q->notes.buf);
+
+  close(q->fds[0]);
+  close(q->fds[1]);
+  pthread_cond_destroy(&q->cond);
+  pthread_mutex_destroy(&q->mutex);
+}
+
+/* 
+ * Keep the pipe in sync with the queue contents.  Call with the mutex
+ * held.
+ */
+static void tp_queue_sync(tp_queue_t *q) {
+  char c = 0;
+  int pending = q->notes.len || q->stats.len;
+
+  if (pending && !q->signalled) {
+    if (write(q->fds[1], &c, 1) == 1)
+      q->signalled = 1;
+  } else if (!pending && q->signalled) {
+    if (read(q->fds[0], &c, 1) == 1)
+      q->signalled = 0;
+  }
+}
+
+static void tp_wasync_notify(tp_wasync_t *, int);
+static void tp_mx_notify(tp_mx_t *, int, int);
+
+/* notification names, for TunePimp::Tracer */
+static const char *tp_note_names[tpCallbackLast] = {
+  "FileAdded", "FileChanged", "FileRemoved", "WriteTagsComplete"
+};
+
+static void tp_pending_notify(tp_pending_t *, int, int);
+static void tp_tstat_note(tp_pimp_t *, tunepimp_t, int, int);
+
+static void tp_queue_notify_cb(tunepimp_t tp, void *data, TPCallbackEnum type, int file_id) {
+  tp_queue_t *q = data;
+  tp_note_t note;
+
+  if (tp_tracing && type < tpCallbackLast) {
+    tp_trace_add(TP_TEV_NOTE, tp_note_names[type], file_id, type, tp_now(), 0);
+    tp_tstat_note(q->pimp, tp, type, file_id);
+  }
+  note.type = type;
+  note.file_id = file_id;
+
+  pthread_mutex_lock(&q->mutex);
+  if (tp_ring_push(&q->notes, &note)) {
+    tp_queue_sync(q);
+    pthread_cond_broadcast(&q->cond);
+  }
+  if (type == tpWriteTagsComplete && q->writes)
+    tp_wasync_notify(q->writes, file_id);
+  if (q->mx)
+    tp_mx_notify(q->mx, type, file_id);
+  pthread_mutex_unlock(&q->mutex);
+
+  if (q->pending)
+    tp_pending_notify(q->pending, type, file_id);
+}
+
+static void tp_queue_status_cb(tunepimp_t tp, void *data, const char *status) {
+  tp_queue_t *q = data;
+  char *stat;
+
+  UNUSED(tp);
+  if ((stat = strdup(status)) == NULL)
+    return;
+
+  pthread_mutex_lock(&q->mutex);
+  if (tp_ring_push(&q->stats, &stat)) {
+    tp_queue_sync(q);
+    pthread_cond_broadcast(&q->cond);
+  } else {
+    free(stat);
+  }
+  pthread_mutex_unlock(&q->mutex);
+}
+
+/*
+ * Arguments and result of a (possibly blocking) drain of one of the
+ * queues.  ret holds up to max tp_note_t or char* elements; callers
+ * allocate that up front, so max is capped at TP_DRAIN_MAX.
+ */
+#define TP_DRAIN_MAX 65536
+typedef struct {
+  tp_queue_t *q;
+  tp_ring_t *ring;
+  long max, num;
+  double timeout;
+  int collapse;
+  void *ret;
+  volatile int cancelled;
+} tp_drain_t;
+
+/* 
+ * Simple open-addressing set of file ids, used to collapse
+ * FileChanged notifications within a single drain.
+ */
+static int tp_idset_add(int *set, long mask, int id) {
+  long i;
+
+  for (i = (id * 2654435761U) & mask; set[i] != -1; i = (i + 1) & mask)
+    if (set[i] == id)
+      return 0;
+  set[i] = id;
+
+  return 1;
+}
+
+static void *tp_drain(void *ptr) {
+  tp_drain_t *d = ptr;
+  tp_queue_t *q = d->q;
+  tp_note_t note, *notes = d->ret;
+  struct timespec ts;
+  struct timeval tv;
+  int *set = NULL;
+  long mask = 0;
+  double t0;
+
+  TP_TRACE_START(t0);
+  if (d->collapse && d->ring == &q->notes) {
+    for (mask = 1; mask < d->max * 2; mask <<= 1);
+    if ((set = malloc(sizeof(int) * mask)) != NULL)
+      memset(set, 0xff, sizeof(int) * mask);
+    mask--;
+  }
+
+  if (d->timeout > 0) {
+    gettimeofday(&tv, NULL);
+    ts.tv_sec = tv.tv_sec + (time_t) d->timeout;
+    ts.tv_nsec = tv.tv_usec * 1000 + (long) ((d->timeout - (time_t) d->timeout) * 1e9);
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+  }
+
+  pthread_mutex_lock(&q->mutex);
+  while (!d->ring->len && !d->cancelled && d->timeout != 0) {
+    if (d->timeout < 0)
+      pthread_cond_wait(&q->cond, &q->mutex);
+    else if (pthread_cond_timedwait(&q->cond, &q->mutex, &ts) == ETIMEDOUT)
+      break;
+  }
+
+  /* an interrupted wait consumes nothing, so no events are lost */
+  d->num = 0;
+  if (!d->cancelled) {
+    if (d->ring == &q->notes) {
+      while (d->num < d->max && tp_ring_shift(&q->notes, &note))
+        if (!set || note.type != tpFileChanged || tp_idset_add(set, mask, note.file_id))
+          notes[d->num++] = note;
+    } else {
+      while (d->num < d->max && tp_ring_shift(&q->stats, (char**) d->ret + d->num))
+        d->num++;
+    }
+
+    tp_queue_sync(q);
+  }
+  pthread_mutex_unlock(&q->mutex);
+  TP_TRACE_CALL(t0, d->ring == &q->notes ? "wait_notifications" : "wait_status", -1, d->num);
+
+  free(set);
+  return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void tp_drain_cancel(void *ptr) {
+  tp_drain_t *d = ptr;
+
+  pthread_mutex_lock(&d->q->mutex);
+  d->cancelled = 1;
+  pthread_cond_broadcast(&d->q->cond);
+  pthread_mutex_unlock(&d->q->mutex);
+}
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+/*
+ * Drain up to d->max events from d->ring into d->ret, waiting at most
+ * d->timeout seconds (forever if negative) for the first one.
+ */
+static void tp_drain_blocking(tp_drain_t *d) {
+  d->cancelled = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  if (d->timeout != 0) {
+    rb_thread_call_without_gvl(tp_drain, d, tp_drain_cancel, d);
+    rb_thread_check_ints();
+    return;
+  }
+#endif
+  tp_drain(d);
+}
+
+/*********************************************************************/
+/* Rescan index                                                      */
+/*********************************************************************/
+
+/*
+ * On-disk index of files seen by earlier runs, keyed by path and
+ * checked against size, mtime and inode, so unchanged files can be
+ * skipped (or restored) instead of being analyzed again.
+ *
+ * The file is a header, an open-addressing hash table of small
+ * fixed-size slots and an arena the paths are appended to, all mapped
+ * with MAP_SHARED.  Slots are found by a hash of the path and point at
+ * the path's bytes in the arena, which is what's compared.  Each slot
+ * has a checksum that's written last, so a slot torn by a crash fails
+ * the check and reads as missing; the worst case is re-analyzing that
+ * file.  A path written to the arena but not yet to disk just doesn't
+ * match.  The arena grows by extending the file in place; the table is
+ * grown by building a new file (dropping deleted slots and their
+ * paths) and renaming it over the old one.  The header is marked dirty
+ * while the index is open, so the counts and the end of the arena are
+ * rebuilt after a crash.
+ */
+#define TP_IDX_MAGIC "TPINDEX"
+#define TP_IDX_VERSION 3
+#define TP_IDX_MIN_CAP 1024
+#define TP_IDX_MIN_ARENA 65536
+#define TP_IDX_DELETED 0xffffffffU
+
+typedef struct {
+  char magic[8];
+  uint32_t version, slot_size;
+  uint64_t cap, count, deleted;
+  uint64_t arena, arena_cap;   /* arena bytes used, and allocated */
+  uint32_t dirty;
+  char pad[4];
+} tp_idx_hdr_t;
+
+typedef struct {
+  uint64_t key, size, ino;
+  int64_t mtime;
+  uint64_t path_off;
+  uint32_t path_len, status, sum, pad;
+  char trm[40], artist_id[40], album_id[40], track_id[40];
+} tp_idx_slot_t;
+
+struct tp_index_t {
+  int fd;
+  char *path;
+  tp_idx_hdr_t *hdr;
+  tp_idx_slot_t *slots;
+  size_t map_len;
+
+  /* lookups take it shared, everything else exclusive */
+  pthread_rwlock_t lock;
+};
+
+static uint64_t tp_idx_key(const char *path) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (; *path; path++)
+    hash = (hash ^ (unsigned char) *path) * 1099511628211ULL;
+
+  return hash ? hash : 1;
+}
+
+static uint32_t tp_idx_sum(const tp_idx_slot_t *slot) {
+  const unsigned char *p = (const unsigned char*) slot;
+  uint32_t hash = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < sizeof(tp_idx_slot_t); i++)
+    if (i < offsetof(tp_idx_slot_t, sum) || i >= offsetof(tp_idx_slot_t, sum) + sizeof(uint32_t))
+      hash = (hash ^ p[i]) * 16777619U;
+
+  return hash;
+}
+
+static size_t tp_idx_len(uint64_t cap) {
+  return sizeof(tp_idx_hdr_t) + cap * sizeof(tp_idx_slot_t);
+}
+
+/* the arena starts right after the table */
+static char *tp_idx_arena(tp_idx_hdr_t *hdr) {
+  return (char*) hdr + tp_idx_len(hdr->cap);
+}
+
+/* does slot's path lie inside the arena? */
+static int tp_idx_in_arena(const tp_idx_hdr_t *hdr, const tp_idx_slot_t *slot) {
+  return slot->path_off <= hdr->arena &&
+         slot->path_len <= hdr->arena - slot->path_off;
+}
+
+static int tp_idx_valid(const tp_idx_hdr_t *hdr, const tp_idx_slot_t *slot) {
+  return slot->key && slot->status != TP_IDX_DELETED &&
+         slot->sum == tp_idx_sum(slot) && tp_idx_in_arena(hdr, slot);
+}
+
+/* statuses worth remembering between runs */
+static int tp_idx_final(int status) {
+  return status == eRecognized || status == eUnrecognized ||
+         status == eVerified || status == eSaved;
+}
+
+/* write an empty table of cap slots, with arena_cap bytes of arena, to fd */
+static int tp_idx_create(int fd, uint64_t cap, uint64_t arena_cap) {
+  tp_idx_hdr_t hdr;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TP_IDX_MAGIC, sizeof(TP_IDX_MAGIC));
+  hdr.version = TP_IDX_VERSION;
+  hdr.slot_size = sizeof(tp_idx_slot_t);
+  hdr.cap = cap;
+  hdr.arena_cap = arena_cap;
+
+  return ftruncate(fd, tp_idx_len(cap) + arena_cap) == 0 &&
+         pwrite(fd, &hdr, sizeof(hdr), 0) == (ssize_t) sizeof(hdr);
+}
+
+/* 
+ * Find the slot for path (len bytes, whose key is key): either its own
+ * slot, or the empty slot it would go in.  Call with the lock held.
+ */
+static tp_idx_slot_t *tp_idx_find(tp_idx_hdr_t *hdr, uint64_t key,
+                                  const char *path, size_t len) {
+  tp_idx_slot_t *slots = (tp_idx_slot_t*) (hdr + 1), *s;
+  const char *arena = tp_idx_arena(hdr);
+  uint64_t i, mask = hdr->cap - 1;
+
+  for (i = key & mask; (s = slots + i)->key; i = (i + 1) & mask)
+    if (s->key == key && s->path_len == len && tp_idx_in_arena(hdr, s) &&
+        !memcmp(arena + s->path_off, path, len))
+      break;
+
+  return s;
+}
+
+/* map idx->fd, whose table has cap slots and arena arena_cap bytes */
+static int tp_idx_map(tp_index_t *idx, uint64_t cap, uint64_t arena_cap) {
+  size_t len = tp_idx_len(cap) + arena_cap;
+  void *map;
+
+  map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, idx->fd, 0);
+  if (map == MAP_FAILED)
+    return 0;
+  if (idx->hdr)
+    munmap(idx->hdr, idx->map_len);
+  idx->hdr = map;
+  idx->slots = (tp_idx_slot_t*) (idx->hdr + 1);
+  idx->map_len = len;
+
+  return 1;
+}
+
+/* 
+ * Open (or create) the index at path.  Returns NULL, or a message
+ * describing what went wrong.
+ */
+static const char *tp_idx_open(tp_index_t *idx, const char *path) {
+  tp_idx_hdr_t hdr;
+  tp_idx_slot_t *s;
+  struct stat st;
+  uint64_t i;
+
+  idx->fd = -1;
+  if ((idx->path = strdup(path)) == NULL)
+    return "out of memory";
+  if ((idx->fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+    return strerror(errno);
+  fcntl(idx->fd, F_SETFD, FD_CLOEXEC);
+
+  /* one writer at a time, or the dirty flag means nothing */
+  if (flock(idx->fd, LOCK_EX | LOCK_NB) < 0)
+    return errno == EWOULDBLOCK ? "index is in use by another process" : strerror(errno);
+
+  if (fstat(idx->fd, &st) < 0)
+    return strerror(errno);
+  if (!st.st_size) {
+    if (!tp_idx_create(idx->fd, TP_IDX_MIN_CAP, TP_IDX_MIN_ARENA) || fstat(idx->fd, &st) < 0)
+      return strerror(errno);
+  }
+
+  if (pread(idx->fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) ||
+      memcmp(hdr.magic, TP_IDX_MAGIC, sizeof(TP_IDX_MAGIC)) ||
+      hdr.version != TP_IDX_VERSION ||
+      hdr.slot_size != sizeof(tp_idx_slot_t) ||
+      !hdr.cap || (hdr.cap & (hdr.cap - 1)) || !hdr.arena_cap ||
+      hdr.arena > hdr.arena_cap ||
+      (uint64_t) st.st_size < tp_idx_len(hdr.cap) + hdr.arena_cap)
+    return "not a TunePimp index (or from an incompatible version)";
+
+  if (!tp_idx_map(idx, hdr.cap, hdr.arena_cap))
+    return strerror(errno);
+
+  /* 
+   * last run didn't close cleanly; the counts can't be trusted, and
+   * the arena ends after the last path any slot points at
+   */
+  if (idx->hdr->dirty) {
+    idx->hdr->count = idx->hdr->deleted = 0;
+    idx->hdr->arena = 0;
+    for (i = 0; i < idx->hdr->cap; i++) {
+      s = idx->slots + i;
+      if (s->key && s->path_off <= idx->hdr->arena_cap &&
+          s->path_len <= idx->hdr->arena_cap - s->path_off &&
+          s->path_off + s->path_len > idx->hdr->arena)
+        idx->hdr->arena = s->path_off + s->path_len;
+    }
+    for (i = 0; i < idx->hdr->cap; i++) {
+      if (!idx->slots[i].key)
+        continue;
+      idx->hdr->count++;
+      if (!tp_idx_valid(idx->hdr, idx->slots + i))
+        idx->hdr->deleted++;
+    }
+  }
+  idx->hdr->dirty = 1;
+
+  return NULL;
+}
+
+static void tp_idx_close(tp_index_t *idx) {
+  pthread_rwlock_wrlock(&idx->lock);
+  if (idx->hdr) {
+    msync(idx->hdr, idx->map_len, MS_SYNC);
+    idx->hdr->dirty = 0;
+    msync(idx->hdr, sizeof(tp_idx_hdr_t), MS_SYNC);
+    munmap(idx->hdr, idx->map_len);
+    idx->hdr = NULL;
+    idx->slots = NULL;
+  }
+  if (idx->fd >= 0)
+    close(idx->fd);
+  idx->fd = -1;
+  pthread_rwlock_unlock(&idx->lock);
+}
+
+/* 
+ * Double the table: rehash the live slots, and copy their paths, into
+ * a new file and rename it over the old one, so a crash leaves one or
+ * the other intact.  Call with the lock held exclusively.
+ */
+static int tp_idx_grow(tp_index_t *idx) {
+  tp_idx_hdr_t *hdr;
+  tp_idx_slot_t *from, *to;
+  uint64_t i, cap = idx->hdr->cap * 2, arena_cap = idx->hdr->arena_cap;
+  size_t len = tp_idx_len(cap) + arena_cap;
+  char *tmp, *dir;
+  void *map;
+  int fd, dir_fd, err;
+
+  if ((tmp = malloc(strlen(idx->path) + 5)) == NULL)
+    return 0;
+  sprintf(tmp, "%s.tmp", idx->path);
+
+  if ((fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+    free(tmp);
+    return 0;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  map = MAP_FAILED;
+  if (!tp_idx_create(fd, cap, arena_cap) || flock(fd, LOCK_EX | LOCK_NB) < 0 ||
+      (map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    goto fail;
+
+  /* the live paths fit in the old arena, so they fit in one this size */
+  hdr = map;
+  hdr->dirty = 1;
+  for (i = 0; i < idx->hdr->cap; i++) {
+    from = idx->slots + i;
+    if (!tp_idx_valid(idx->hdr, from))
+      continue;
+    to = tp_idx_find(hdr, from->key, tp_idx_arena(idx->hdr) + from->path_off, from->path_len);
+    *to = *from;
+    to->path_off = hdr->arena;
+    memcpy(tp_idx_arena(hdr) + hdr->arena, tp_idx_arena(idx->hdr) + from->path_off, from->path_len);
+    hdr->arena += from->path_len;
+    to->sum = tp_idx_sum(to);
+    hdr->count++;
+  }
+
+  /* the new file has to be on disk before it replaces the old one */
+  if (msync(map, len, MS_SYNC) < 0 || fsync(fd) < 0 || rename(tmp, idx->path) < 0)
+    goto fail;
+
+  /* and so does the rename, before we write to the new file */
+  if ((dir = strrchr(tmp, '/')) != NULL)
+    *(dir == tmp ? dir + 1 : dir) = '\0';
+  if ((dir_fd = open(dir ? tmp : ".", O_RDONLY)) >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+
+  munmap(idx->hdr, idx->map_len);
+  close(idx->fd);
+  idx->fd = fd;
+  idx->hdr = hdr;
+  idx->slots = (tp_idx_slot_t*) (hdr + 1);
+  idx->map_len = len;
+  free(tmp);
+  return 1;
+
+fail:
+  err = errno;
+  if (map != MAP_FAILED)
+    munmap(map, len);
+  close(fd);
+  unlink(tmp);
+  free(tmp);
+  errno = err;
+  return 0;
+}
+
+/* 
+ * Append len bytes of path to the arena, extending the file if it's
+ * full.  Returns the path's offset, or -1 (with errno set).  Call with
+ * the lock held exclusively; idx->hdr and idx->slots may move.
+ */
+static int64_t tp_idx_append(tp_index_t *idx, const char *path, size_t len) {
+  uint64_t off = idx->hdr->arena, cap = idx->hdr->arena_cap;
+
+  if (off + len > cap) {
+    while (off + len > cap)
+      cap *= 2;
+    if (ftruncate(idx->fd, tp_idx_len(idx->hdr->cap) + cap) < 0 ||
+        !tp_idx_map(idx, idx->hdr->cap, cap))
+      return -1;
+    idx->hdr->arena_cap = cap;
+  }
+
+  memcpy(tp_idx_arena(idx->hdr) + off, path, len);
+  idx->hdr->arena = off + len;
+
+  return off;
+}
+
+/* 
+ * Copy the record for path into rec.  Returns 0 if there isn't a
+ * (valid) one.
+ */
+static int tp_idx_get(tp_index_t *idx, const char *path, tp_idx_slot_t *rec) {
+  int ret = 0;
+
+  pthread_rwlock_rdlock(&idx->lock);
+  if (idx->hdr) {
+    *rec = *tp_idx_find(idx->hdr, tp_idx_key(path), path, strlen(path));
+    ret = tp_idx_valid(idx->hdr, rec);
+  }
+  pthread_rwlock_unlock(&idx->lock);
+
+  return ret;
+}
+
+/* 
+ * Store rec as the record for path (rec must be zeroed apart from the
+ * record fields).  Call with the lock held exclusively; returns 0 (with
+ * errno set) if the table or the arena couldn't grow.
+ */
+static int tp_idx_put(tp_index_t *idx, const char *path, tp_idx_slot_t *rec) {
+  tp_idx_slot_t *slot;
+  size_t len = strlen(path);
+  uint64_t i;
+  int64_t off;
+
+  if ((idx->hdr->count + 1) * 10 > idx->hdr->cap * 7 && !tp_idx_grow(idx))
+    return 0;
+
+  rec->key = tp_idx_key(path);
+  rec->path_len = len;
+  slot = tp_idx_find(idx->hdr, rec->key, path, len);
+  if (slot->key) {
+    /* the path's been here before; its copy in the arena will do */
+    rec->path_off = slot->path_off;
+    if (!tp_idx_valid(idx->hdr, slot))
+      idx->hdr->deleted--;
+  } else {
+    i = slot - idx->slots;
+    if ((off = tp_idx_append(idx, path, len)) < 0)
+      return 0;
+    slot = idx->slots + i;
+    rec->path_off = off;
+    idx->hdr->count++;
+  }
+
+  /* invalidate first, so a torn write never looks like a record */
+  slot->sum = ~tp_idx_sum(slot);
+  memcpy(slot, rec, offsetof(tp_idx_slot_t, sum));
+  memcpy(&slot->pad, &rec->pad, sizeof(tp_idx_slot_t) - offsetof(tp_idx_slot_t, pad));
+  slot->sum = tp_idx_sum(slot);
+
+  return 1;
+}
+
+static int tp_idx_delete(tp_index_t *idx, const char *path) {
+  tp_idx_slot_t *slot;
+  int ret = 0;
+
+  pthread_rwlock_wrlock(&idx->lock);
+  if (idx->hdr) {
+    slot = tp_idx_find(idx->hdr, tp_idx_key(path), path, strlen(path));
+    if ((ret = tp_idx_valid(idx->hdr, slot))) {
+      slot->status = TP_IDX_DELETED;
+      slot->sum = tp_idx_sum(slot);
+      idx->hdr->deleted++;
+    }
+  }
+  pthread_rwlock_unlock(&idx->lock);
+
+  return ret;
+}
+
+/*
+ * Put a freshly added track straight into the state recorded for it,
+ * with the recorded TRM and MusicBrainz ids.
+ *
+ * libtunepimp's threads may already have picked the file up, so the
+ * status is checked under the track lock: only a file still Pending
+ * is restored.  One that's got further than that is left to finish
+ * the normal way rather than have its state overwritten halfway
+ * through.
+ */
+static void tp_idx_restore(tunepimp_t tp, int file_id, const tp_idx_slot_t *rec) {
+  metadata_t *md;
+  track_t tr;
+  int status;
+
+  if ((tr = tp_GetTrack(tp, file_id)) == NULL)
+    return;
+  if ((md = md_New()) != NULL) {
+    tr_Lock(tr);
+    status = tr_GetStatus(tr);
+    if (status == ePending) {
+      tr_GetLocalMetadata(tr, md);
+      snprintf(md->artistId, sizeof(md->artistId), "%s", rec->artist_id);
+      snprintf(md->albumId, sizeof(md->albumId), "%s", rec->album_id);
+      snprintf(md->trackId, sizeof(md->trackId), "%s", rec->track_id);
+      snprintf(md->fileTrm, sizeof(md->fileTrm), "%s", rec->trm);
+      tr_SetServerMetadata(tr, md);
+      tr_SetTRM(tr, rec->trm);
+      tr_SetStatus(tr, rec->status == eUnrecognized ? eUnrecognized : eRecognized);
+    }
+    tr_Unlock(tr);
+    tp_Wake(tp, tr);
+    md_Delete(md);
+  }
+  tp_ReleaseTrack(tp, tr);
+}
+
+/*
+ * Does path still match its record in idx (same size, mtime and
+ * inode)?  If so, copies the record into rec.
+ */
+static int tp_idx_unchanged(tp_index_t *idx, const char *path, tp_idx_slot_t *rec) {
+  struct stat st;
+
+  return tp_idx_get(idx, path, rec) && stat(path, &st) == 0 &&
+         rec->size == (uint64_t) st.st_size &&
+         rec->mtime == (int64_t) st.st_mtime &&
+         rec->ino == (uint64_t) st.st_ino;
+}
+
+/*
+ * Record the current state of the tracks in call->ids, for those in a
+ * final state.  call->ret is the number recorded, or -1 if the index
+ * couldn't grow.
+ */
+static void *tp_call_index_record(void *ptr) {
+  tp_call_t *call = ptr;
+  tp_index_t *idx = call->index;
+  tp_idx_slot_t rec;
+  metadata_t *md;
+  struct stat st;
+  char path[4096];
+  track_t tr;
+  int i, ok;
+
+  call->ret = 0;
+  if ((md = md_New()) == NULL) {
+    call->ret = -1;
+    return NULL;
+  }
+
+  for (i = 0; i < call->num_ids && !call->cancelled; i++) {
+    if ((tr = tp_GetTrack(call->tp, call->ids[i])) == NULL)
+      continue;
+
+    memset(&rec, 0, sizeof(rec));
+    tr_Lock(tr);
+    rec.status = tr_GetStatus(tr);
+    tr_GetFileName(tr, path, sizeof(path));
+    tr_GetTRM(tr, rec.trm, sizeof(rec.trm));
+    tr_GetServerMetadata(tr, md);
+    if (!md->trackId[0])
+      tr_GetLocalMetadata(tr, md);
+    tr_Unlock(tr);
+    tp_ReleaseTrack(call->tp, tr);
+
+    /* a path that filled the buffer may have been cut short */
+    if (!tp_idx_final(rec.status) || strlen(path) >= sizeof(path) - 1 ||
+        stat(path, &st) < 0)
+      continue;
+
+    snprintf(rec.artist_id, sizeof(rec.artist_id), "%s", md->artistId);
+    snprintf(rec.album_id, sizeof(rec.album_id), "%s", md->albumId);
+    snprintf(rec.track_id, sizeof(rec.track_id), "%s", md->trackId);
+    rec.size = st.st_size;
+    rec.mtime = st.st_mtime;
+    rec.ino = st.st_ino;
+
+    /* only the table update itself is done with the lock held */
+    pthread_rwlock_wrlock(&idx->lock);
+    ok = idx->hdr ? tp_idx_put(idx, path, &rec) : -1;
+    pthread_rwlock_unlock(&idx->lock);
+    if (ok <= 0) {
+      /* closed from another thread (-1), or couldn't grow (0) */
+      if (!ok)
+        call->ret = -1;
+      break;
+    }
+    call->ret++;
+  }
+
+  md_Delete(md);
+  return NULL;
+}
+
+static void tp_idx_free(void *ptr) {
+  tp_index_t *idx = ptr;
+
+  if (idx) {
+    tp_idx_close(idx);
+    pthread_rwlock_destroy(&idx->lock);
+    free(idx->path);
+    free(idx);
+  }
+}
+
+static size_t tp_idx_memsize(const void *ptr) {
+  const tp_index_t *idx = ptr;
+  return sizeof(tp_index_t) + (idx->path ? strlen(idx->path) + 1 : 0);
+}
+
+static const rb_data_type_t tp_idx_type = {
+  "TunePimp::Index",
+  { 0, tp_idx_free, tp_idx_memsize, TP_COMPACT(0) },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+
+/*********************************************************************/
+/* TRM cache                                                         */
+/*********************************************************************/
+
+/*
+ * Streaming 64-bit hash of a file's audio payload, fed in arbitrary
+ * pieces (Ogg pages arrive one at a time).  Words are mixed with the
+ * xxHash64 round and finished with its avalanche; it only has to be
+ * fast and well distributed, not cryptographic.
+ */
+typedef struct {
+  uint64_t h, len;
+  unsigned char buf[8];
+  int num;
+} tp_phash_t;
+
+#define TP_P1 11400714785074694791ULL
+#define TP_P2 14029467366897019727ULL
+#define TP_P3 1609587929392839161ULL
+
+static uint64_t tp_phash_round(uint64_t h, uint64_t w) {
+  w *= TP_P2;
+  w = (w << 31) | (w >> 33);
+  h ^= w * TP_P1;
+  return ((h << 27) | (h >> 37)) * TP_P1 + TP_P3;
+}
+
+static void tp_phash_update(tp_phash_t *ph, const unsigned char *p, size_t len) {
+  uint64_t w;
+
+  ph->len += len;
+  while (len && ph->num) {
+    ph->buf[ph->num++] = *(p++);
+    len--;
+    if (ph->num == 8) {
+      memcpy(&w, ph->buf, 8);
+      ph->h = tp_phash_round(ph->h, w);
+      ph->num = 0;
+    }
+  }
+  for (; len >= 8; p += 8, len -= 8) {
+    memcpy(&w, p, 8);
+    ph->h = tp_phash_round(ph->h, w);
+  }
+  memcpy(ph->buf, p, len);
+  ph->num = len;
+}
+
+static uint64_t tp_phash_final(tp_phash_t *ph) {
+  uint64_t h = ph->h ^ ph->len;
+  int i;
+
+  for (i = 0; i < ph->num; i++)
+    h = (((h ^ (ph->buf[i] * 2870177450012600261ULL)) << 11) | (h >> 53)) * TP_P1;
+
+  h ^= h >> 33;
+  h *= TP_P2;
+  h ^= h >> 29;
+  h *= TP_P3;
+  h ^= h >> 32;
+
+  return h ? h : 1;
+}
+
+static uint32_t tp_le32(const unsigned char *p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+/*
+ * Hash the audio payload of the file at path, leaving out anything
+ * that changes when only the tags do:
+ *
+ *   MP3 (and others): ID3v2 at the start, ID3v1 and APEv2 at the end
+ *   FLAC: the metadata blocks (Vorbis comments, pictures, padding)
+ *   Ogg: the header pages, plus every page header, since renumbered
+ *        pages change their sequence numbers and CRCs
+ *   WAV: everything but the data chunk
+ *
+ * Returns 0 if the file can't be read or has no payload.
+ */
+static int tp_payload_hash(const char *path, uint64_t *hash, uint64_t *len) {
+  const unsigned char *p, *end;
+  tp_phash_t ph;
+  struct stat st;
+  size_t size, n, i;
+  uint64_t granule;
+  void *map;
+  int fd, audio;
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || !st.st_size) {
+    close(fd);
+    return 0;
+  }
+  size = st.st_size;
+  map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return 0;
+#ifdef MADV_SEQUENTIAL
+  madvise(map, size, MADV_SEQUENTIAL);
+#endif
+
+  memset(&ph, 0, sizeof(ph));
+  ph.h = TP_P3;
+  p = map;
+  end = p + size;
+
+  if (size >= 4 && !memcmp(p, "fLaC", 4)) {
+    /* metadata blocks: 1 bit last flag, 7 bits type, 24 bits length */
+    for (p += 4; end - p >= 4; ) {
+      n = 4 + ((p[1] << 16) | (p[2] << 8) | p[3]);
+      i = p[0] & 0x80;
+      p += n < (size_t) (end - p) ? n : (size_t) (end - p);
+      if (i)
+        break;
+    }
+    tp_phash_update(&ph, p, end - p);
+  } else if (size >= 27 && !memcmp(p, "OggS", 4)) {
+    /* header pages have granule position 0; audio starts after them */
+    for (audio = 0; end - p >= 27 && !memcmp(p, "OggS", 4); p += n) {
+      n = 27 + p[26];
+      if ((size_t) (end - p) < n)
+        break;
+      for (i = 0; i < p[26]; i++)
+        n += p[27 + i];
+      if ((size_t) (end - p) < n)
+        n = end - p;
+      memcpy(&granule, p + 6, 8);
+      if (granule && granule != ~0ULL)
+        audio = 1;
+      if (audio)
+        tp_phash_update(&ph, p + 27 + p[26], n - 27 - p[26]);
+    }
+  } else if (size >= 12 && !memcmp(p, "RIFF", 4) && !memcmp(p + 8, "WAVE", 4)) {
+    for (p += 12; end - p >= 8; p += n) {
+      n = tp_le32(p + 4);
+      if (!memcmp(p, "data", 4)) {
+        p += 8;
+        tp_phash_update(&ph, p, n < (size_t) (end - p) ? n : (size_t) (end - p));
+        break;
+      }
+      n = 8 + n + (n & 1);
+      if (n > (size_t) (end - p))
+        break;
+    }
+  } else {
+    /* ID3v2: 10 byte header, syncsafe size, optional 10 byte footer */
+    if (size >= 10 && !memcmp(p, "ID3", 3)) {
+      n = 10 + ((p[6] & 0x7f) << 21 | (p[7] & 0x7f) << 14 |
+                (p[8] & 0x7f) << 7 | (p[9] & 0x7f));
+      if (p[5] & 0x10)
+        n += 10;
+      p += n < size ? n : size;
+    }
+    if (end - p >= 128 && !memcmp(end - 128, "TAG", 3))
+      end -= 128;
+    /* APEv2 footer: size covers items and footer, plus the header if flagged */
+    if (end - p >= 32 && !memcmp(end - 32, "APETAGEX", 8)) {
+      n = tp_le32(end - 20) + ((end[-9] & 0x80) ? 32 : 0);
+      end -= n < (size_t) (end - p) ? n : (size_t) (end - p);
+    }
+    tp_phash_update(&ph, p, end - p);
+  }
+
+  *len = ph.len;
+  *hash = tp_phash_final(&ph);
+  munmap(map, size);
+
+  return ph.len > 0;
+}
+
+/*
+ * The cache itself: a fixed-size hash table of payload hash => TRM in
+ * a file mapped MAP_SHARED, so every process using it sees the others'
+ * entries right away.  There's no locking at all.  Each slot has a
+ * checksum written last, so a torn or interleaved write reads as a
+ * miss, and a full probe window just evicts; losing an entry only
+ * costs a fingerprint.
+ */
+#define TP_TRMC_MAGIC "TPTRMC"
+#define TP_TRMC_VERSION 1
+#define TP_TRMC_PROBES 8
+
+typedef struct {
+  char magic[8];
+  uint32_t version, slot_size;
+  uint64_t cap;
+  char pad[40];
+} tp_trmc_hdr_t;
+
+typedef struct {
+  uint64_t hash, len;
+  char trm[40];
+  uint32_t sum, pad;
+} tp_trmc_slot_t;
+
+struct tp_trmc_t {
+  char *path;
+  tp_trmc_hdr_t *hdr;
+  tp_trmc_slot_t *slots;
+  size_t map_len;
+
+  /* taken shared to use the mapping, exclusively to unmap it */
+  pthread_rwlock_t lock;
+
+  /* this process's counters */
+  pthread_mutex_t stats_lock;
+  unsigned long hits, misses, stores;
+
+  /* 
+   * the TRMCache object and each TunePimp using the cache (whose
+   * threads may outlive the object); taken under stats_lock
+   */
+  int refs;
+};
+
+static uint32_t tp_trmc_sum(const tp_trmc_slot_t *slot) {
+  const unsigned char *p = (const unsigned char*) slot;
+  uint32_t hash = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < offsetof(tp_trmc_slot_t, sum); i++)
+    hash = (hash ^ p[i]) * 16777619U;
+
+  return hash;
+}
+
+static const char *tp_trmc_open(tp_trmc_t *c, const char *path, uint64_t cap) {
+  tp_trmc_hdr_t hdr;
+  struct stat st;
+  void *map;
+  int fd;
+
+  if ((c->path = strdup(path)) == NULL)
+    return "out of memory";
+  if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+    return strerror(errno);
+
+  /* 
+   * whoever creates the file sizes it; everyone else waits for the
+   * header to show up
+   */
+  flock(fd, LOCK_EX);
+  if (fstat(fd, &st) == 0 && !st.st_size) {
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TP_TRMC_MAGIC, sizeof(TP_TRMC_MAGIC));
+    hdr.version = TP_TRMC_VERSION;
+    hdr.slot_size = sizeof(tp_trmc_slot_t);
+    hdr.cap = cap;
+    if (ftruncate(fd, sizeof(hdr) + cap * sizeof(tp_trmc_slot_t)) < 0 ||
+        pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr)) {
+      close(fd);
+      return strerror(errno);
+    }
+  }
+  flock(fd, LOCK_UN);
+
+  if (fstat(fd, &st) < 0 ||
+      pread(fd, &hdr, sizeof(hdr), 0) != (ssize_t) sizeof(hdr) ||
+      memcmp(hdr.magic, TP_TRMC_MAGIC, sizeof(TP_TRMC_MAGIC)) ||
+      hdr.version != TP_TRMC_VERSION ||
+      hdr.slot_size != sizeof(tp_trmc_slot_t) ||
+      !hdr.cap || (hdr.cap & (hdr.cap - 1)) ||
+      (uint64_t) st.st_size < sizeof(hdr) + hdr.cap * sizeof(tp_trmc_slot_t)) {
+    close(fd);
+    return "not a TunePimp TRM cache (or from an incompatible version)";
+  }
+
+  c->map_len = sizeof(hdr) + hdr.cap * sizeof(tp_trmc_slot_t);
+  map = mmap(NULL, c->map_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return strerror(errno);
+  c->hdr = map;
+  c->slots = (tp_trmc_slot_t*) (c->hdr + 1);
+
+  return NULL;
+}
+
+static void tp_trmc_close(tp_trmc_t *c) {
+  pthread_rwlock_wrlock(&c->lock);
+  if (c->hdr) {
+    msync(c->hdr, c->map_len, MS_ASYNC);
+    munmap(c->hdr, c->map_len);
+    c->hdr = NULL;
+    c->slots = NULL;
+  }
+  pthread_rwlock_unlock(&c->lock);
+}
+
+static void tp_trmc_count(tp_trmc_t *c, unsigned long *counter) {
+  pthread_mutex_lock(&c->stats_lock);
+  (*counter)++;
+  pthread_mutex_unlock(&c->stats_lock);
+}
+
+/* Look up a payload, copying its TRM into trm.  Returns 0 on a miss. */
+static int tp_trmc_get(tp_trmc_t *c, uint64_t hash, uint64_t len, char *trm) {
+  tp_trmc_slot_t slot;
+  uint64_t i, mask;
+  int ret = 0;
+
+  pthread_rwlock_rdlock(&c->lock);
+  if (c->hdr) {
+    mask = c->hdr->cap - 1;
+    for (i = 0; i < TP_TRMC_PROBES && !ret; i++) {
+      slot = c->slots[(hash + i) & mask];
+      if (!slot.hash)
+        break;
+      if (slot.hash == hash && slot.len == len && slot.sum == tp_trmc_sum(&slot)) {
+        slot.trm[sizeof(slot.trm) - 1] = '\0';
+        strcpy(trm, slot.trm);
+        ret = 1;
+      }
+    }
+  }
+  pthread_rwlock_unlock(&c->lock);
+
+  tp_trmc_count(c, ret ? &c->hits : &c->misses);
+  return ret;
+}
+
+static void tp_trmc_put(tp_trmc_t *c, uint64_t hash, uint64_t len, const char *trm) {
+  tp_trmc_slot_t *slot, rec;
+  uint64_t i, mask;
+
+  memset(&rec, 0, sizeof(rec));
+  rec.hash = hash;
+  rec.len = len;
+  snprintf(rec.trm, sizeof(rec.trm), "%s", trm);
+  rec.sum = tp_trmc_sum(&rec);
+
+  pthread_rwlock_rdlock(&c->lock);
+  if (c->hdr) {
+    mask = c->hdr->cap - 1;
+
+    /* same payload, else the first free slot, else evict the first */
+    slot = c->slots + (hash & mask);
+    for (i = 0; i < TP_TRMC_PROBES; i++) {
+      if (c->slots[(hash + i) & mask].hash == hash || !c->slots[(hash + i) & mask].hash) {
+        slot = c->slots + ((hash + i) & mask);
+        break;
+      }
+    }
+
+    slot->sum = ~slot->sum;
+    memcpy(slot, &rec, offsetof(tp_trmc_slot_t, sum));
+    slot->sum = rec.sum;
+  }
+  pthread_rwlock_unlock(&c->lock);
+
+  tp_trmc_count(c, &c->stores);
+}
+
+static void tp_trmc_ref(tp_trmc_t *c) {
+  pthread_mutex_lock(&c->stats_lock);
+  c->refs++;
+  pthread_mutex_unlock(&c->stats_lock);
+}
+
+/* drop a reference, closing and freeing the cache with the last one */
+static void tp_trmc_unref(tp_trmc_t *c) {
+  int last;
+
+  pthread_mutex_lock(&c->stats_lock);
+  last = !--c->refs;
+  pthread_mutex_unlock(&c->stats_lock);
+
+  if (last) {
+    tp_trmc_close(c);
+    pthread_rwlock_destroy(&c->lock);
+    pthread_mutex_destroy(&c->stats_lock);
+    free(c->path);
+    free(c);
+  }
+}
+
+static void tp_trmc_free(void *ptr) {
+  if (ptr)
+    tp_trmc_unref(ptr);
+}
+
+static size_t tp_trmc_memsize(const void *ptr) {
+  const tp_trmc_t *c = ptr;
+  return sizeof(tp_trmc_t) + (c->path ? strlen(c->path) + 1 : 0);
+}
+
+static const rb_data_type_t tp_trmc_type = {
+  "TunePimp::TRMCache",
+  { 0, tp_trmc_free, tp_trmc_memsize, TP_COMPACT(0) },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * Files added while a TRM cache is in use that missed it, by file id,
+ * so their TRM can be stored once the analyzer has worked it out.
+ * Open addressing, with -1 for free slots and -2 for removed ones.
+ *
+ * The notify callback queues FileChanged ids for pending files in
+ * todo, and a native thread (started with the first cache) reads
+ * their TRMs, so nothing depends on Ruby draining notifications and
+ * no track is locked with the GVL held.
+ */
+typedef struct {
+  int file_id;
+  uint64_t hash, len;
+} tp_pending_ent_t;
+
+struct tp_pending_t {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  tp_pending_ent_t *ents;
+  long used, live, mask;
+
+  /* FileChanged ids waiting for the capture thread */
+  int *todo;
+  long todo_len, todo_cap;
+
+  /* cache the TRMs go to; swapped under lock by TunePimp#trm_cache= */
+  tp_trmc_t *trmc;
+
+  /* the thread holds a reference to pimp while it runs */
+  tp_pimp_t *pimp;
+  tunepimp_t tp;
+  pthread_t thread;
+  int running, stop;
+};
+
+static void tp_pending_init(tp_pending_t *p, tp_pimp_t *pimp) {
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  p->ents = NULL;
+  p->used = p->live = p->mask = 0;
+  p->todo = NULL;
+  p->todo_len = p->todo_cap = 0;
+  p->trmc = NULL;
+  p->pimp = pimp;
+  p->tp = NULL;
+  p->running = p->stop = 0;
+}
+
+/*
+ * Tell the capture thread to stop, without waiting for it: it may be
+ * waiting on a track lock, and GC would wait with it.  Its reference
+ * keeps the TunePimp's state around until it's done.
+ */
+static void tp_pending_release(tp_pending_t *p) {
+  if (!p->running)
+    return;
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  p->trmc = NULL;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  pthread_detach(p->thread);
+  p->running = 0;
+}
+
+/* the thread must be gone (see tp_pimp_unref) */
+static void tp_pending_free(tp_pending_t *p) {
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->cond);
+  free(p->ents);
+  free(p->todo);
+}
+
+/* find file_id's slot, or the free slot it would go in; lock held */
+static tp_pending_ent_t *tp_pending_find(tp_pending_t *p, int file_id, int insert) {
+  tp_pending_ent_t *e, *tomb = NULL;
+  long i;
+
+  for (i = (file_id * 2654435761U) & p->mask; (e = p->ents + i)->file_id != -1; i = (i + 1) & p->mask) {
+    if (e->file_id == file_id)
+      return e;
+    if (e->file_id == -2 && !tomb)
+      tomb = e;
+  }
+
+  return insert && tomb ? tomb : e;
+}
+
+static void tp_pending_add(tp_pending_t *p, int file_id, uint64_t hash, uint64_t len) {
+  tp_pending_ent_t *ents, *e;
+  long i, mask;
+
+  pthread_mutex_lock(&p->lock);
+  if ((p->used + 1) * 2 > p->mask) {
+    for (mask = 63; mask < (p->live + 1) * 4; mask = mask * 2 + 1);
+    if ((ents = malloc(sizeof(tp_pending_ent_t) * (mask + 1))) == NULL) {
+      /* just means this file's TRM won't be cached */
+      pthread_mutex_unlock(&p->lock);
+      return;
+    }
+    memset(ents, 0xff, sizeof(tp_pending_ent_t) * (mask + 1));
+
+    e = p->ents;
+    p->ents = ents;
+    for (i = 0; e && i <= p->mask; i++)
+      if (e[i].file_id >= 0)
+        *tp_pending_find(p, e[i].file_id, 1) = e[i];
+    free(e);
+    p->mask = mask;
+    p->used = p->live;
+  }
+
+  e = tp_pending_find(p, file_id, 1);
+  if (e->file_id < 0) {
+    if (e->file_id == -1)
+      p->used++;
+    p->live++;
+  }
+  e->file_id = file_id;
+  e->hash = hash;
+  e->len = len;
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* 
+ * Remove file_id, copying its entry into ent if it was there.
+ * Returns 0 if it wasn't.
+ */
+static int tp_pending_take(tp_pending_t *p, int file_id, tp_pending_ent_t *ent) {
+  tp_pending_ent_t *e;
+  int ret = 0;
+
+  pthread_mutex_lock(&p->lock);
+  if (p->live && (e = tp_pending_find(p, file_id, 0))->file_id == file_id) {
+    if (ent)
+      *ent = *e;
+    e->file_id = -2;
+    p->live--;
+    ret = 1;
+  }
+  pthread_mutex_unlock(&p->lock);
+
+  return ret;
+}
+
+/*
+ * Store the TRM of a pending file if the analyzer is done with it.
+ * Called on the capture thread, without the GVL.
+ */
+static void tp_pending_capture(tp_pending_t *p, int file_id) {
+  tp_pending_ent_t ent;
+  char trm[40];
+  track_t tr;
+  int status;
+
+  if (!tp_pending_take(p, file_id, &ent))
+    return;
+  if ((tr = tp_GetTrack(p->tp, file_id)) == NULL)
+    return;
+
+  tr_Lock(tr);
+  status = tr_GetStatus(tr);
+  tr_GetTRM(tr, trm, sizeof(trm));
+  tr_Unlock(tr);
+  tp_ReleaseTrack(p->tp, tr);
+
+  if (status == ePending) {
+    tp_pending_add(p, file_id, ent.hash, ent.len);
+  } else if (trm[0]) {
+    /* held so the cache can't be swapped out (and freed) meanwhile */
+    pthread_mutex_lock(&p->lock);
+    if (p->trmc)
+      tp_trmc_put(p->trmc, ent.hash, ent.len, trm);
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+static void *tp_pending_main(void *ptr) {
+  tp_pending_t *p = ptr;
+  int *ids;
+  long i, num, cap;
+
+  pthread_mutex_lock(&p->lock);
+  while (!p->stop) {
+    if (!p->todo_len) {
+      pthread_cond_wait(&p->cond, &p->lock);
+      continue;
+    }
+
+    /* take the whole queue, so the callback isn't held up meanwhile */
+    ids = p->todo;
+    num = p->todo_len;
+    cap = p->todo_cap;
+    p->todo = NULL;
+    p->todo_len = p->todo_cap = 0;
+    pthread_mutex_unlock(&p->lock);
+
+    for (i = 0; i < num; i++)
+      tp_pending_capture(p, ids[i]);
+
+    /* and hand the buffer back for reuse, if nothing replaced it */
+    pthread_mutex_lock(&p->lock);
+    if (!p->todo) {
+      p->todo = ids;
+      p->todo_cap = cap;
+    } else {
+      free(ids);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  tp_pimp_unref(p->pimp);
+
+  return NULL;
+}
+
+/*
+ * Point the pending set at cache c (or none), starting the capture
+ * thread the first time there is one.  Returns 0 if the thread
+ * couldn't be started.
+ */
+static int tp_pending_set_cache(tp_pending_t *p, tunepimp_t tp, tp_trmc_t *c) {
+  pthread_mutex_lock(&p->lock);
+  p->trmc = c;
+  p->tp = tp;
+  pthread_mutex_unlock(&p->lock);
+
+  if (c && !p->running) {
+    p->stop = 0;
+    tp_pimp_ref(p->pimp);
+    if (pthread_create(&p->thread, NULL, tp_pending_main, p)) {
+      tp_pimp_unref(p->pimp);
+      return 0;
+    }
+    p->running = 1;
+  }
+
+  return 1;
+}
+
+/*
+ * Notify callback hook: forget removed files, and hand FileChanged
+ * for pending files to the capture thread.
+ */
+static void tp_pending_notify(tp_pending_t *p, int type, int file_id) {
+  int *todo;
+  long cap;
+
+  if (!p->live)
+    return;
+  if (type == tpFileRemoved) {
+    tp_pending_take(p, file_id, NULL);
+    return;
+  }
+  if (type != tpFileChanged)
+    return;
+
+  pthread_mutex_lock(&p->lock);
+  if (p->running && p->trmc && p->live &&
+      tp_pending_find(p, file_id, 0)->file_id == file_id) {
+    if (p->todo_len == p->todo_cap) {
+      cap = p->todo_cap ? p->todo_cap * 2 : 64;
+      if ((todo = realloc(p->todo, sizeof(int) * cap)) != NULL) {
+        p->todo = todo;
+        p->todo_cap = cap;
+      }
+    }
+    /* out of memory just means this TRM isn't cached */
+    if (p->todo_len < p->todo_cap) {
+      p->todo[p->todo_len++] = file_id;
+      pthread_cond_signal(&p->cond);
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * What the rescan index and TRM cache say about a file that's about to
+ * be added.  Working it out only touches the file system and the
+ * index and cache (which have their own locks), so it can be done in
+ * parallel ahead of the tp_AddFile calls.
+ */
+typedef struct {
+  int unchanged, cached;
+  uint64_t hash, len;
+  char trm[40];
+  tp_idx_slot_t rec;
+} tp_add_prep_t;
+
+static void tp_add_prep(tp_call_t *call, const char *path, tp_add_prep_t *a) {
+  a->cached = 0;
+  if ((a->unchanged = call->index && tp_idx_unchanged(call->index, path, &a->rec)))
+    return;
+  if (call->trmc && tp_payload_hash(path, &a->hash, &a->len))
+    a->cached = tp_trmc_get(call->trmc, a->hash, a->len, a->trm) ? 1 : -1;
+}
+
+/*
+ * Add a file that's been through tp_add_prep.  Returns the new file
+ * id, or -1 if the index said to skip the file.
+ */
+static int tp_add_prepped(tp_call_t *call, const char *path, const tp_add_prep_t *a) {
+  track_t tr;
+  int file_id;
+
+  if (a->unchanged) {
+    if (!call->restore)
+      return -1;
+    file_id = tp_AddFile(call->tp, path);
+    tp_idx_restore(call->tp, file_id, &a->rec);
+    return file_id;
+  }
+
+  file_id = tp_AddFile(call->tp, path);
+
+  /* 
+   * hit: hand the track straight to the lookup stage; miss: remember
+   * the payload so the TRM can be stored once it's known
+   */
+  if (a->cached > 0 && (tr = tp_GetTrack(call->tp, file_id)) != NULL) {
+    tr_Lock(tr);
+    if (tr_GetStatus(tr) == ePending) {
+      tr_SetTRM(tr, a->trm);
+      tr_SetStatus(tr, eTRMLookup);
+    }
+    tr_Unlock(tr);
+    tp_Wake(call->tp, tr);
+    tp_ReleaseTrack(call->tp, tr);
+  } else if (a->cached < 0) {
+    tp_pending_add(call->pending, file_id, a->hash, a->len);
+  }
+
+  return file_id;
+}
+
+/*
+ * Add a file for a blocking call, consulting the call's rescan index
+ * and TRM cache (if any).  Returns the new file id, or -1 if the
+ * index said to skip the file.
+ */
+static int tp_add_file(tp_call_t *call, const char *path) {
+  tp_add_prep_t a;
+
+  tp_add_prep(call, path, &a);
+  return tp_add_prepped(call, path, &a);
+}
+
+
+/*********************************************************************/
+/* Directory walker                                                  */
+/*********************************************************************/
+
+/*
+ * Open-addressing set of supported file extensions, lower-cased and
+ * without the leading dot.  Built once per walk so checking a
+ * directory entry is a single hash lookup.
+ */
+typedef struct {
+  char (*slots)[TP_EXTENSION_LEN];
+  unsigned long mask;
+} tp_extset_t;
+
+/* 
+ * Lower-case the extension of name into buf.  Returns the FNV-1a hash
+ * of the extension, or 0 if name has none or it's too long to match.
+ */
+static unsigned long tp_ext_key(const char *name, char *buf) {
+  const char *ext;
+  unsigned long hash = 2166136261UL;
+  int i;
+
+  if ((ext = strrchr(name, '.')) == NULL || !*++ext)
+    return 0;
+  for (i = 0; ext[i]; i++) {
+    if (i == TP_EXTENSION_LEN - 1)
+      return 0;
+    buf[i] = tolower((unsigned char) ext[i]);
+    hash = (hash ^ (unsigned char) buf[i]) * 16777619UL;
+  }
+  buf[i] = '\0';
+
+  return hash ? hash : 1;
+}
+
+static int tp_extset_init(tp_extset_t *set, tunepimp_t tp) {
+  char name[TP_EXTENSION_LEN + 1], key[TP_EXTENSION_LEN], *names, **exts;
+  unsigned long hash, i;
+  int j, num;
+
+  num = tp_GetNumSupportedExtensions(tp);
+  for (set->mask = 16; set->mask < (unsigned long) num * 2; set->mask <<= 1);
+  set->slots = calloc(set->mask--, TP_EXTENSION_LEN);
+  names = malloc(TP_EXTENSION_LEN * (num ? num : 1));
+  exts = malloc(sizeof(char*) * (num ? num : 1));
+  if (!set->slots || !names || !exts) {
+    free(names);
+    free(exts);
+    return 0;
+  }
+
+  for (j = 0; j < num; j++)
+    exts[j] = names + j * TP_EXTENSION_LEN;
+  tp_GetSupportedExtensions(tp, exts);
+
+  /* prefix a dot, since libtunepimp may or may not include one */
+  for (j = 0; j < num; j++) {
+    snprintf(name, sizeof(name), ".%s", exts[j] + (exts[j][0] == '.'));
+    if (!(hash = tp_ext_key(name, key)))
+      continue;
+    for (i = hash & set->mask; set->slots[i][0] && strcmp(set->slots[i], key); i = (i + 1) & set->mask);
+    strcpy(set->slots[i], key);
+  }
+
+  free(names);
+  free(exts);
+  return 1;
+}
+
+static int tp_extset_match(const tp_extset_t *set, const char *name) {
+  char buf[TP_EXTENSION_LEN];
+  unsigned long i, hash;
+
+  if (!(hash = tp_ext_key(name, buf)))
+    return 0;
+  for (i = hash & set->mask; set->slots[i][0]; i = (i + 1) & set->mask)
+    if (!strcmp(set->slots[i], buf))
+      return 1;
+
+  return 0;
+}
+
+/*
+ * Directory walk state, shared by all walker threads.  Directories
+ * still to be scanned sit on a stack; a walk is done when the stack is
+ * empty and no thread is busy scanning (and so possibly pushing more).
+ */
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+} tp_walk_ino_t;
+
+typedef struct {
+  tp_call_t call; /* must be first (see tp_call_blocking) */
+  int threads, follow, nomem, locks;
+  tp_extset_t exts;
+
+  /* protects everything below, and call.cancelled */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  char **dirs;
+  long num_dirs, cap_dirs;
+  int busy;
+
+  /* directories already seen, to break symlink loops (follow only) */
+  tp_walk_ino_t *seen;
+  unsigned long num_seen, mask_seen;
+
+  /* serializes tp_AddFile, so each batch gets consecutive file ids */
+  pthread_mutex_t add_lock;
+
+  /* 
+   * if set (see TunePimp::Pool), each batch is added through the
+   * shard its directory maps to instead of through call
+   */
+  tp_call_t *shards;
+  int num_shards;
+} tp_walk_t;
+
+/* files are handed to libtunepimp this many at a time */
+#define TP_WALK_BATCH 64
+
+/* default number of walker threads */
+#define TP_WALK_THREADS 4
+
+/* push a directory (takes ownership of path); call with w->lock held */
+static void tp_walk_push(tp_walk_t *w, char *path) {
+  char **dirs;
+  long cap;
+
+  if (w->num_dirs == w->cap_dirs) {
+    cap = w->cap_dirs ? w->cap_dirs * 2 : 64;
+    if ((dirs = realloc(w->dirs, sizeof(char*) * cap)) == NULL) {
+      w->nomem = 1;
+      free(path);
+      return;
+    }
+    w->dirs = dirs;
+    w->cap_dirs = cap;
+  }
+
+  w->dirs[w->num_dirs++] = path;
+  pthread_cond_signal(&w->cond);
+}
+
+/* 
+ * Record a directory we're about to descend into, given its stat().
+ * Returns 0 if it's been seen before; call with w->lock held, but
+ * stat() the directory before taking it.
+ */
+static int tp_walk_seen(tp_walk_t *w, const struct stat *st) {
+  tp_walk_ino_t *seen, *e;
+  unsigned long i, j, mask;
+
+  if ((w->num_seen + 1) * 2 > w->mask_seen) {
+    mask = w->mask_seen ? w->mask_seen * 2 + 1 : 255;
+    if ((seen = calloc(mask + 1, sizeof(tp_walk_ino_t))) == NULL) {
+      w->nomem = 1;
+      return 0;
+    }
+    for (i = 0; w->mask_seen && i <= w->mask_seen; i++) {
+      e = w->seen + i;
+      if (!e->ino)
+        continue;
+      for (j = (e->ino * 2654435761U) & mask; seen[j].ino; j = (j + 1) & mask);
+      seen[j] = *e;
+    }
+    free(w->seen);
+    w->seen = seen;
+    w->mask_seen = mask;
+  }
+
+  for (i = (st->st_ino * 2654435761U) & w->mask_seen; (e = w->seen + i)->ino; i = (i + 1) & w->mask_seen)
+    if (e->ino == st->st_ino && e->dev == st->st_dev)
+      return 0;
+  e->dev = st->st_dev;
+  e->ino = st->st_ino ? st->st_ino : 1;
+  w->num_seen++;
+
+  return 1;
+}
+
+/* 
+ * Pick one of num shards for path by hashing its directory, so files
+ * from the same album always end up together.
+ */
+static int tp_shard(const char *path, int num) {
+  const char *end = strrchr(path, '/');
+  uint64_t hash = 14695981039346656037ULL;
+
+  for (end = end ? end : path; path < end; path++)
+    hash = (hash ^ (unsigned char) *path) * 1099511628211ULL;
+
+  return (int) (hash % (uint64_t) num);
+}
+
+/* batches always come from a single directory */
+static void tp_walk_flush(tp_walk_t *w, char **batch, int num) {
+  tp_call_t *call = &w->call;
+  tp_add_prep_t *preps;
+  double t0;
+  int i, id;
+
+  if (num && w->num_shards)
+    call = w->shards + tp_shard(batch[0], w->num_shards);
+
+  TP_TRACE_START(t0);
+
+  /* 
+   * stat and hash outside the lock, so walker threads read files in
+   * parallel; without the memory, fall back to doing it all under it
+   */
+  if ((preps = malloc(sizeof(tp_add_prep_t) * (num ? num : 1))) != NULL)
+    for (i = 0; i < num && !w->call.cancelled; i++)
+      tp_add_prep(call, batch[i], preps + i);
+
+  pthread_mutex_lock(&w->add_lock);
+  for (i = 0; i < num; i++) {
+    if (!w->call.cancelled) {
+      id = preps ? tp_add_prepped(call, batch[i], preps + i) : tp_add_file(call, batch[i]);
+      if (id >= 0)
+        w->call.ret++;
+    }
+    free(batch[i]);
+  }
+  pthread_mutex_unlock(&w->add_lock);
+  free(preps);
+  TP_TRACE_CALL(t0, "add_tree", -1, num);
+}
+
+enum { TP_WALK_SKIP, TP_WALK_DIR, TP_WALK_FILE };
+
+/* 
+ * Scan one directory: subdirectories are pushed for any thread to
+ * pick up, supported files are added as soon as a batch fills up.
+ */
+static void tp_walk_dir(tp_walk_t *w, const char *dir) {
+  char *batch[TP_WALK_BATCH], *path;
+  struct dirent *ent;
+  struct stat st;
+  size_t len = strlen(dir);
+  int type, stated, num = 0;
+  DIR *d;
+
+  if ((d = opendir(dir)) == NULL)
+    return;
+  if (len && dir[len - 1] == '/')
+    len--;
+
+  while (!w->call.cancelled && !w->nomem && (ent = readdir(d)) != NULL) {
+    if (ent->d_name[0] == '.' && (!ent->d_name[1] ||
+        (ent->d_name[1] == '.' && !ent->d_name[2])))
+      continue;
+
+    /* use d_type where we can, so most entries never need a stat */
+    type = -1;
+#ifdef DT_DIR
+    if (ent->d_type == DT_DIR)
+      type = TP_WALK_DIR;
+    else if (ent->d_type == DT_REG)
+      type = TP_WALK_FILE;
+    else if (ent->d_type != DT_UNKNOWN && (ent->d_type != DT_LNK || !w->follow))
+      continue;
+#endif
+    if (type == TP_WALK_FILE && !tp_extset_match(&w->exts, ent->d_name))
+      continue;
+
+    if ((path = malloc(len + strlen(ent->d_name) + 2)) == NULL) {
+      w->nomem = 1;
+      break;
+    }
+    memcpy(path, dir, len);
+    path[len] = '/';
+    strcpy(path + len + 1, ent->d_name);
+
+    stated = 0;
+    if (type == -1) {
+      type = TP_WALK_SKIP;
+      if ((w->follow ? stat(path, &st) : lstat(path, &st)) == 0) {
+        stated = 1;
+        if (S_ISDIR(st.st_mode))
+          type = TP_WALK_DIR;
+        else if (S_ISREG(st.st_mode) && tp_extset_match(&w->exts, ent->d_name))
+          type = TP_WALK_FILE;
+      }
+    }
+
+    if (type == TP_WALK_DIR) {
+      /* stat() before locking, it's slow on network mounts */
+      if (w->follow && !stated && stat(path, &st) < 0) {
+        free(path);
+        continue;
+      }
+      pthread_mutex_lock(&w->lock);
+      if (!w->follow || tp_walk_seen(w, &st))
+        tp_walk_push(w, path);
+      else
+        free(path);
+      pthread_mutex_unlock(&w->lock);
+    } else if (type == TP_WALK_FILE) {
+      batch[num++] = path;
+      if (num == TP_WALK_BATCH) {
+        tp_walk_flush(w, batch, num);
+        num = 0;
+      }
+    } else {
+      free(path);
+    }
+  }
+  closedir(d);
+
+  /* don't sit on a partial batch while scanning the next directory */
+  tp_walk_flush(w, batch, num);
+}
+
+static void *tp_walk_thread(void *ptr) {
+  tp_walk_t *w = ptr;
+  char *dir;
+
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (!w->num_dirs && w->busy && !w->call.cancelled && !w->nomem)
+      pthread_cond_wait(&w->cond, &w->lock);
+    if (!w->num_dirs || w->call.cancelled || w->nomem)
+      break;
+
+    dir = w->dirs[--w->num_dirs];
+    w->busy++;
+    pthread_mutex_unlock(&w->lock);
+
+    tp_walk_dir(w, dir);
+    free(dir);
+
+    pthread_mutex_lock(&w->lock);
+    w->busy--;
+  }
+
+  /* wake everyone else up so they notice we're done */
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+
+  return NULL;
+}
+
+static void *tp_call_walk(void *ptr) {
+  tp_walk_t *w = ptr;
+  pthread_t *tids;
+  int i, num = 0;
+
+  /* the calling thread is a walker too, so this works with no threads */
+  if ((tids = malloc(sizeof(pthread_t) * w->threads)) != NULL)
+    for (num = 0; num < w->threads - 1; num++)
+      if (pthread_create(tids + num, NULL, tp_walk_thread, w))
+        break;
+
+  tp_walk_thread(w);
+  for (i = 0; i < num; i++)
+    pthread_join(tids[i], NULL);
+  free(tids);
+
+  return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void tp_walk_cancel(void *ptr) {
+  tp_walk_t *w = ptr;
+
+  pthread_mutex_lock(&w->lock);
+  w->call.cancelled = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+static VALUE tp_walk_free(VALUE ptr) {
+  tp_walk_t *w = (tp_walk_t*) ptr;
+  long i;
+
+  for (i = 0; i < w->num_dirs; i++)
+    free(w->dirs[i]);
+  free(w->dirs);
+  free(w->seen);
+  free(w->exts.slots);
+  free(w->call.path);
+  if (w->locks) {
+    pthread_mutex_destroy(&w->lock);
+    pthread_mutex_destroy(&w->add_lock);
+    pthread_cond_destroy(&w->cond);
+  }
+
+  return Qnil;
+}
+
+static VALUE tp_walk_run(VALUE ptr) {
+  tp_walk_t *w = (tp_walk_t*) ptr;
+  struct stat st;
+  char *root;
+
+  if (!tp_extset_init(&w->exts, w->call.tp))
+    rb_raise(eException, "Couldn't allocate extension set");
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_mutex_init(&w->add_lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  w->locks = 1;
+
+  if ((root = strdup(w->call.path)) == NULL)
+    rb_raise(eException, "Couldn't allocate directory path");
+  if (!w->follow || (stat(root, &st) == 0 && tp_walk_seen(w, &st)))
+    tp_walk_push(w, root);
+  else
+    free(root);
+
+  w->call.cancelled = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(tp_call_walk, w, tp_walk_cancel, w);
+  rb_thread_check_ints();
+#else
+  tp_call_walk(w);
+#endif
+
+  if (w->nomem)
+    rb_raise(eException, "Couldn't allocate memory for directory walk");
+
+  return INT2FIX(w->call.ret);
+}
+
+/*********************************************************************/
+/* Caching proxy                                                     */
+/*********************************************************************/
+
+/*
+ * A small HTTP/1.0 proxy on 127.0.0.1 for libtunepimp to send its
+ * lookups through (see TunePimp::Proxy).  Responses are cached on disk
+ * for ttl seconds, keyed by method, URL and body (MusicBrainz queries
+ * are POSTs), and a request that's identical to one already on its way
+ * upstream waits for that one's response instead of going out again.
+ *
+ * One thread accepts connections, and each connection gets a detached
+ * thread of its own (at most TP_PROXY_MAX_CONNS at once; past that,
+ * connections wait in the listen queue) that serves a single request
+ * and hangs up.  The accept thread also deletes expired cache files
+ * every TP_PROXY_PRUNE seconds.
+ *
+ * The threads each hold a reference to the proxy, so the dfree
+ * function only has to tell them to stop: the last one out frees it.
+ */
+#define TP_PROXY_MAX_HEAD (64 * 1024)
+#define TP_PROXY_MAX_RESP (16 * 1024 * 1024)
+#define TP_PROXY_TIMEOUT 30
+#define TP_PROXY_MAX_CONNS 64
+#define TP_PROXY_PRUNE (5 * 60)
+
+typedef struct {
+  char *ptr;
+  size_t len, cap;
+} tp_buf_t;
+
+static int tp_buf_add(tp_buf_t *buf, const void *data, size_t len) {
+  char *ptr;
+  size_t cap;
+
+  if (buf->len + len + 1 > buf->cap) {
+    for (cap = buf->cap ? buf->cap : 4096; cap < buf->len + len + 1; cap *= 2);
+    if ((ptr = realloc(buf->ptr, cap)) == NULL)
+      return 0;
+    buf->ptr = ptr;
+    buf->cap = cap;
+  }
+
+  memcpy(buf->ptr + buf->len, data, len);
+  buf->len += len;
+  buf->ptr[buf->len] = '\0';
+
+  return 1;
+}
+
+static int tp_buf_puts(tp_buf_t *buf, const char *str) {
+  return tp_buf_add(buf, str, strlen(str));
+}
+
+/* an upstream request in progress, and whoever's waiting on it */
+typedef struct tp_flight_t tp_flight_t;
+struct tp_flight_t {
+  uint64_t key;
+  const tp_buf_t *id;   /* the owner's, valid while the flight is listed */
+  int done, refs;
+  tp_buf_t resp;
+  tp_flight_t *next;
+};
+
+typedef struct {
+  int fd, wake[2];
+  unsigned short port;
+  char *dir;
+  long ttl;
+  pthread_t thread;
+  int running;
+
+  /* protects everything below */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int refs, conns, stopping;
+  tp_flight_t *flights;
+  unsigned long requests, hits, misses, coalesced, errors, pruned;
+} tp_proxy_t;
+
+typedef struct {
+  tp_proxy_t *proxy;
+  int fd;
+} tp_conn_t;
+
+static void tp_proxy_count(tp_proxy_t *p, unsigned long *counter) {
+  pthread_mutex_lock(&p->lock);
+  (*counter)++;
+  pthread_mutex_unlock(&p->lock);
+}
+
+static int tp_send_all(int fd, const char *data, size_t len) {
+  ssize_t n;
+
+  while (len) {
+    if ((n = send(fd, data, len, MSG_NOSIGNAL)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+    data += n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+static void tp_proxy_error(int fd, const char *status) {
+  char buf[256];
+
+  snprintf(buf, sizeof(buf),
+           "HTTP/1.0 %s\r\nContent-Type: text/plain\r\nContent-Length: %lu\r\n"
+           "Connection: close\r\n\r\n%s\n", status,
+           (unsigned long) strlen(status) + 1, status);
+  tp_send_all(fd, buf, strlen(buf));
+}
+
+static void tp_sock_timeouts(int fd) {
+  struct timeval tv;
+
+  tv.tv_sec = TP_PROXY_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* 
+ * Send a request to host:port and read the whole response (the
+ * request says Connection: close) into resp.
+ */
+static int tp_proxy_fetch(const char *host, const char *port, const tp_buf_t *req, tp_buf_t *resp) {
+  struct addrinfo hints, *res, *ai;
+  char buf[16384];
+  ssize_t n;
+  int fd = -1;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (getaddrinfo(host, port, &hints, &res))
+    return 0;
+  for (ai = res; ai; ai = ai->ai_next) {
+    if ((fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) < 0)
+      continue;
+    tp_sock_timeouts(fd);
+    if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+      break;
+    close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(res);
+  if (fd < 0)
+    return 0;
+
+  if (!tp_send_all(fd, req->ptr, req->len)) {
+    close(fd);
+    return 0;
+  }
+
+  while ((n = recv(fd, buf, sizeof(buf), 0)) != 0) {
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 || resp->len + n > TP_PROXY_MAX_RESP || !tp_buf_add(resp, buf, n)) {
+      close(fd);
+      return 0;
+    }
+  }
+  close(fd);
+
+  return resp->len > 0;
+}
+
+static void tp_proxy_cache_path(tp_proxy_t *p, uint64_t key, char *buf, size_t len) {
+  snprintf(buf, len, "%s/%016llx", p->dir, (unsigned long long) key);
+}
+
+/* 
+ * A cache file is this header, the request it answers (method, URL
+ * and body, as hashed for its name) and the response.  The request is
+ * compared on every read, so two requests whose keys collide just
+ * miss.
+ */
+#define TP_PROXY_MAGIC "TPPROXY1"
+
+typedef struct {
+  char magic[8];
+  uint64_t req_len;
+} tp_proxy_hdr_t;
+
+/* read a cached response to req if there's one younger than the ttl */
+static int tp_proxy_cache_get(tp_proxy_t *p, uint64_t key, const tp_buf_t *req, tp_buf_t *resp) {
+  char path[4096], buf[16384];
+  tp_proxy_hdr_t hdr;
+  struct stat st;
+  size_t off;
+  ssize_t n;
+  int fd, ok = 1;
+
+  tp_proxy_cache_path(p, key, path, sizeof(path));
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return 0;
+  if (fstat(fd, &st) < 0 || st.st_mtime + p->ttl <= time(NULL)) {
+    close(fd);
+    return 0;
+  }
+
+  while (ok && (n = read(fd, buf, sizeof(buf))) != 0) {
+    if (n < 0 && errno == EINTR)
+      continue;
+    ok = n > 0 && tp_buf_add(resp, buf, n);
+  }
+  close(fd);
+
+  /* check it's the response to this request */
+  off = sizeof(hdr) + req->len;
+  if (ok && resp->len > off) {
+    memcpy(&hdr, resp->ptr, sizeof(hdr));
+    ok = !memcmp(hdr.magic, TP_PROXY_MAGIC, sizeof(hdr.magic)) &&
+         hdr.req_len == req->len &&
+         !memcmp(resp->ptr + sizeof(hdr), req->ptr, req->len);
+  } else {
+    ok = 0;
+  }
+
+  if (!ok) {
+    resp->len = 0;
+    return 0;
+  }
+  memmove(resp->ptr, resp->ptr + off, resp->len - off);
+  resp->len -= off;
+  resp->ptr[resp->len] = '\0';
+
+  return 1;
+}
+
+static int tp_write_all(int fd, const void *data, size_t len) {
+  ssize_t n;
+
+  while (len) {
+    if ((n = write(fd, data, len)) < 0) {
+      if (errno == EINTR)
+        continue;
+      return 0;
+    }
+    data = (const char*) data + n;
+    len -= n;
+  }
+
+  return 1;
+}
+
+/* write the response to req to the cache, atomically */
+static void tp_proxy_cache_put(tp_proxy_t *p, uint64_t key, const tp_buf_t *req, const tp_buf_t *resp) {
+  char path[4096], tmp[4200];
+  tp_proxy_hdr_t hdr;
+  int fd, ok;
+
+  tp_proxy_cache_path(p, key, path, sizeof(path));
+  snprintf(tmp, sizeof(tmp), "%s.%ld.%lx", path, (long) getpid(), (unsigned long) pthread_self());
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    return;
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TP_PROXY_MAGIC, sizeof(hdr.magic));
+  hdr.req_len = req->len;
+  ok = tp_write_all(fd, &hdr, sizeof(hdr)) &&
+       tp_write_all(fd, req->ptr, req->len) &&
+       tp_write_all(fd, resp->ptr, resp->len);
+
+  if (close(fd) < 0 || !ok || rename(tmp, path) < 0)
+    unlink(tmp);
+}
+
+/* 
+ * Delete cache files older than the ttl, and temporary files left
+ * behind by writes that never finished.  Only names the cache could
+ * have made are touched.
+ */
+static void tp_proxy_prune(tp_proxy_t *p) {
+  char path[4096];
+  struct dirent *ent;
+  struct stat st;
+  time_t now = time(NULL);
+  unsigned long pruned = 0;
+  long age;
+  size_t i;
+  DIR *d;
+
+  if ((d = opendir(p->dir)) == NULL)
+    return;
+
+  while ((ent = readdir(d)) != NULL) {
+    for (i = 0; i < 16 && isxdigit((unsigned char) ent->d_name[i]); i++);
+    if (i < 16 || (ent->d_name[16] && ent->d_name[16] != '.'))
+      continue;
+
+    /* a write in progress touches its file at least every timeout */
+    age = ent->d_name[16] ? 2 * TP_PROXY_TIMEOUT : p->ttl;
+    snprintf(path, sizeof(path), "%s/%s", p->dir, ent->d_name);
+    if (lstat(path, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_mtime + age <= now && unlink(path) == 0)
+      pruned++;
+  }
+  closedir(d);
+
+  pthread_mutex_lock(&p->lock);
+  p->pruned += pruned;
+  pthread_mutex_unlock(&p->lock);
+}
+
+/* 
+ * Serve one request.  Only absolute http:// URLs are proxied; the
+ * request is forwarded as HTTP/1.0 with Connection: close, so the
+ * response ends when upstream hangs up.
+ */
+static void tp_proxy_serve(tp_proxy_t *p, int fd) {
+  tp_buf_t in, req, id, resp;
+  tp_phash_t ph;
+  tp_flight_t *f, **fp;
+  char *head_end, *line, *next, *method, *url, *host, *path, *port, *colon;
+  char buf[16384], hostbuf[1024];
+  size_t body_len = 0, head_len;
+  ssize_t n;
+  uint64_t key;
+  int wait = 0;
+
+  memset(&in, 0, sizeof(in));
+  memset(&req, 0, sizeof(req));
+  memset(&id, 0, sizeof(id));
+  memset(&resp, 0, sizeof(resp));
+  tp_proxy_count(p, &p->requests);
+
+  /* request line and headers */
+  while (!in.ptr || (head_end = strstr(in.ptr, "\r\n\r\n")) == NULL) {
+    if (in.len > TP_PROXY_MAX_HEAD ||
+        (n = recv(fd, buf, sizeof(buf), 0)) <= 0 || !tp_buf_add(&in, buf, n)) {
+      tp_proxy_error(fd, "400 Bad Request");
+      goto done;
+    }
+  }
+  head_len = head_end + 4 - in.ptr;
+  head_end[2] = '\0';
+
+  method = in.ptr;
+  if ((next = strstr(method, "\r\n")) == NULL || (url = strchr(method, ' ')) == NULL) {
+    tp_proxy_error(fd, "400 Bad Request");
+    goto done;
+  }
+  *next = '\0';
+  *(url++) = '\0';
+  if ((line = strchr(url, ' ')) != NULL)
+    *line = '\0';
+  if (strncmp(url, "http://", 7)) {
+    tp_proxy_error(fd, "501 Not Implemented");
+    goto done;
+  }
+
+  /* split http://host[:port]/path */
+  host = url + 7;
+  path = strchr(host, '/');
+  n = path ? path - host : (ssize_t) strlen(host);
+  if (n <= 0 || n >= (ssize_t) sizeof(hostbuf)) {
+    tp_proxy_error(fd, "400 Bad Request");
+    goto done;
+  }
+  memcpy(hostbuf, host, n);
+  hostbuf[n] = '\0';
+  port = "80";
+  if ((colon = strrchr(hostbuf, ':')) != NULL) {
+    *colon = '\0';
+    port = colon + 1;
+  }
+
+  /* rebuild the request, dropping hop-by-hop and proxy headers */
+  if (!tp_buf_puts(&req, method) || !tp_buf_puts(&req, " ") ||
+      !tp_buf_puts(&req, path ? path : "/") || !tp_buf_puts(&req, " HTTP/1.0\r\nHost: ") ||
+      !tp_buf_add(&req, host, n) || !tp_buf_puts(&req, "\r\n"))
+    goto nomem;
+  for (line = next + 2; *line; line = next + 2) {
+    next = strstr(line, "\r\n");
+    *next = '\0';
+    if (!strncasecmp(line, "Content-Length:", 15))
+      body_len = strtoul(line + 15, NULL, 10);
+    if (!strncasecmp(line, "Proxy-", 6) || !strncasecmp(line, "Connection:", 11) ||
+        !strncasecmp(line, "Keep-Alive:", 11) || !strncasecmp(line, "Host:", 5))
+      continue;
+    if (!tp_buf_puts(&req, line) || !tp_buf_puts(&req, "\r\n"))
+      goto nomem;
+  }
+  if (!tp_buf_puts(&req, "Connection: close\r\n\r\n"))
+    goto nomem;
+
+  /* body */
+  if (body_len > TP_PROXY_MAX_RESP) {
+    tp_proxy_error(fd, "413 Request Entity Too Large");
+    goto done;
+  }
+  while (in.len - head_len < body_len) {
+    if ((n = recv(fd, buf, sizeof(buf), 0)) <= 0 || !tp_buf_add(&in, buf, n)) {
+      tp_proxy_error(fd, "400 Bad Request");
+      goto done;
+    }
+  }
+  if (!tp_buf_add(&req, in.ptr + head_len, body_len))
+    goto nomem;
+
+  /* what the response depends on: method, URL and body */
+  if (!tp_buf_add(&id, method, strlen(method) + 1) ||
+      !tp_buf_add(&id, url, strlen(url) + 1) ||
+      !tp_buf_add(&id, in.ptr + head_len, body_len))
+    goto nomem;
+  memset(&ph, 0, sizeof(ph));
+  ph.h = TP_P3;
+  tp_phash_update(&ph, (unsigned char*) id.ptr, id.len);
+  key = tp_phash_final(&ph);
+
+  if (tp_proxy_cache_get(p, key, &id, &resp)) {
+    tp_proxy_count(p, &p->hits);
+    tp_send_all(fd, resp.ptr, resp.len);
+    goto done;
+  }
+
+  /* join an identical request in flight, or become one */
+  pthread_mutex_lock(&p->lock);
+  for (f = p->flights; f; f = f->next)
+    if (f->key == key && f->id->len == id.len && !memcmp(f->id->ptr, id.ptr, id.len))
+      break;
+  if (f) {
+    p->coalesced++;
+    wait = 1;
+  } else if ((f = malloc(sizeof(tp_flight_t))) != NULL) {
+    memset(f, 0, sizeof(tp_flight_t));
+    f->key = key;
+    f->id = &id;
+    f->next = p->flights;
+    p->flights = f;
+    p->misses++;
+  }
+  if (f)
+    f->refs++;
+  pthread_mutex_unlock(&p->lock);
+  if (!f)
+    goto nomem;
+
+  if (wait) {
+    pthread_mutex_lock(&p->lock);
+    while (!f->done)
+      pthread_cond_wait(&p->cond, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+  } else {
+    if (tp_proxy_fetch(hostbuf, port, &req, &f->resp)) {
+      /* only cache successes */
+      if (f->resp.len > 12 && !strncmp(f->resp.ptr, "HTTP/1.", 7) &&
+          !strncmp(f->resp.ptr + 8, " 200", 4))
+        tp_proxy_cache_put(p, key, &id, &f->resp);
+    } else {
+      f->resp.len = 0;
+      tp_proxy_count(p, &p->errors);
+    }
+
+    pthread_mutex_lock(&p->lock);
+    f->done = 1;
+    for (fp = &p->flights; *fp != f; fp = &(*fp)->next);
+    *fp = f->next;
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+  }
+
+  if (f->resp.len)
+    tp_send_all(fd, f->resp.ptr, f->resp.len);
+  else
+    tp_proxy_error(fd, "502 Bad Gateway");
+
+  pthread_mutex_lock(&p->lock);
+  if (!--f->refs) {
+    free(f->resp.ptr);
+    free(f);
+  }
+  pthread_mutex_unlock(&p->lock);
+  goto done;
+
+nomem:
+  tp_proxy_count(p, &p->errors);
+  tp_proxy_error(fd, "500 Internal Server Error");
+done:
+  free(in.ptr);
+  free(req.ptr);
+  free(id.ptr);
+  free(resp.ptr);
+}
+
+static void tp_proxy_destroy(tp_proxy_t *p) {
+  if (p->fd >= 0)
+    close(p->fd);
+  if (p->wake[0] >= 0) {
+    close(p->wake[0]);
+    close(p->wake[1]);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->cond);
+  free(p->dir);
+  free(p);
+}
+
+/* drop a reference, freeing the proxy with the last one */
+static void tp_proxy_unref(tp_proxy_t *p) {
+  int last;
+
+  pthread_mutex_lock(&p->lock);
+  last = !--p->refs;
+  pthread_mutex_unlock(&p->lock);
+
+  if (last)
+    tp_proxy_destroy(p);
+}
+
+static void *tp_proxy_conn(void *ptr) {
+  tp_conn_t *conn = ptr;
+  tp_proxy_t *p = conn->proxy;
+
+  tp_proxy_serve(p, conn->fd);
+  close(conn->fd);
+  free(conn);
+
+  /* the accept thread may be waiting for a free slot */
+  pthread_mutex_lock(&p->lock);
+  p->conns--;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  tp_proxy_unref(p);
+
+  return NULL;
+}
+
+/* 
+ * Start a thread with all signals blocked, so signals meant for Ruby
+ * are never delivered to it.
+ */
+static int tp_thread_start(pthread_t *tid, int detach, void *(*fn)(void *), void *arg) {
+  pthread_attr_t attr;
+  sigset_t all, old;
+  int ret;
+
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_attr_init(&attr);
+  if (detach)
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  ret = pthread_create(tid, &attr, fn, arg);
+  pthread_attr_destroy(&attr);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+  return ret == 0;
+}
+
+static void *tp_proxy_main(void *ptr) {
+  tp_proxy_t *p = ptr;
+  struct pollfd fds[2];
+  tp_conn_t *conn;
+  pthread_t tid;
+  time_t now, prune = 0;
+  int fd, stop;
+
+  for (;;) {
+    if ((now = time(NULL)) >= prune) {
+      tp_proxy_prune(p);
+      prune = now + TP_PROXY_PRUNE;
+    }
+
+    /* wait for a free connection slot */
+    pthread_mutex_lock(&p->lock);
+    while (p->conns >= TP_PROXY_MAX_CONNS && !p->stopping)
+      pthread_cond_wait(&p->cond, &p->lock);
+    stop = p->stopping;
+    pthread_mutex_unlock(&p->lock);
+    if (stop)
+      break;
+
+    fds[0].fd = p->fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = p->wake[0];
+    fds[1].events = POLLIN;
+    if ((fd = poll(fds, 2, (int) (prune - now) * 1000)) <= 0) {
+      if (fd == 0 || errno == EINTR)
+        continue;
+      break;
+    }
+    if (fds[1].revents)
+      break;
+    if (!(fds[0].revents & POLLIN) || (fd = accept(p->fd, NULL, NULL)) < 0)
+      continue;
+
+    tp_sock_timeouts(fd);
+    if ((conn = malloc(sizeof(tp_conn_t))) == NULL) {
+      close(fd);
+      continue;
+    }
+    conn->proxy = p;
+    conn->fd = fd;
+
+    pthread_mutex_lock(&p->lock);
+    p->conns++;
+    p->refs++;
+    pthread_mutex_unlock(&p->lock);
+    if (!tp_thread_start(&tid, 1, tp_proxy_conn, conn)) {
+      close(fd);
+      free(conn);
+      pthread_mutex_lock(&p->lock);
+      p->conns--;
+      p->refs--;
+      pthread_mutex_unlock(&p->lock);
+    }
+  }
+
+  tp_proxy_unref(p);
+  return NULL;
+}
+
+/* 
+ * Bind to 127.0.0.1:port (any free port if 0) and start serving.
+ * Returns NULL, or a message describing what went wrong.
+ */
+static const char *tp_proxy_start(tp_proxy_t *p, unsigned short port) {
+  struct sockaddr_in addr;
+  socklen_t len = sizeof(addr);
+  int one = 1;
+
+  if (mkdir(p->dir, 0755) < 0 && errno != EEXIST)
+    return strerror(errno);
+  if (pipe(p->wake) < 0)
+    return strerror(errno);
+  fcntl(p->wake[0], F_SETFD, FD_CLOEXEC);
+  fcntl(p->wake[1], F_SETFD, FD_CLOEXEC);
+
+  if ((p->fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    return strerror(errno);
+  fcntl(p->fd, F_SETFD, FD_CLOEXEC);
+  setsockopt(p->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(port);
+  if (bind(p->fd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+      listen(p->fd, 64) < 0 ||
+      getsockname(p->fd, (struct sockaddr*) &addr, &len) < 0)
+    return strerror(errno);
+  p->port = ntohs(addr.sin_port);
+
+  p->refs++;
+  if (!tp_thread_start(&p->thread, 0, tp_proxy_main, p)) {
+    p->refs--;
+    return "couldn't start proxy thread";
+  }
+  p->running = 1;
+
+  return NULL;
+}
+
+/* tell the accept thread to stop */
+static void tp_proxy_signal(tp_proxy_t *p) {
+  pthread_mutex_lock(&p->lock);
+  p->stopping = 1;
+  pthread_cond_broadcast(&p->cond);
+  pthread_mutex_unlock(&p->lock);
+  while (write(p->wake[1], "", 1) < 0 && errno == EINTR);
+}
+
+/* 
+ * Stop accepting, then wait for the connections in progress to
+ * finish (each is bounded by TP_PROXY_TIMEOUT).
+ */
+static void *tp_proxy_stop(void *ptr) {
+  tp_proxy_t *p = ptr;
+
+  if (p->running) {
+    tp_proxy_signal(p);
+    pthread_join(p->thread, NULL);
+    p->running = 0;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  while (p->conns)
+    pthread_cond_wait(&p->cond, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+
+  if (p->fd >= 0)
+    close(p->fd);
+  p->fd = -1;
+
+  return NULL;
+}
+
+/* 
+ * Don't wait for anything here: a connection can take a while to
+ * finish, and GC would wait with it.  The threads free the proxy when
+ * they're done.
+ */
+static void tp_proxy_free(void *ptr) {
+  tp_proxy_t *p = ptr;
+
+  if (p) {
+    if (p->running) {
+      tp_proxy_signal(p);
+      pthread_detach(p->thread);
+    }
+    tp_proxy_unref(p);
+  }
+}
+
+static size_t tp_proxy_memsize(const void *ptr) {
+  const tp_proxy_t *p = ptr;
+  return sizeof(tp_proxy_t) + (p->dir ? strlen(p->dir) + 1 : 0);
+}
+
+static const rb_data_type_t tp_proxy_type = {
+  "TunePimp::Proxy",
+  { 0, tp_proxy_free, tp_proxy_memsize, TP_COMPACT(0) },
+  0, 0, 0
+};
+
+/*********************************************************************/
+/* Tag write scheduler                                               */
+/*********************************************************************/
+
+/*
+ * Puts tag writes in the order their files live on disk: grouped by
+ * device, and by position within each device, so on spinning disks a
+ * batch turns random seeks into a sweep.  libtunepimp writes tags on a
+ * single thread of its own, and tp_WriteTags only queues files for it
+ * in no particular order, so the order only holds if each file is
+ * handed over once the one before it is written (see tp_wasync_main).
+ */
+typedef struct {
+  int id, found;
+  dev_t dev;
+  uint64_t pos;
+} tp_wjob_t;
+
+enum { TP_WORDER_NONE, TP_WORDER_INODE, TP_WORDER_PHYSICAL };
+
+typedef struct {
+  tp_call_t call; /* must be first (see tp_call_blocking) */
+  int order, recognized;
+  tp_wjob_t *jobs;
+  long num_jobs;
+} tp_wsched_t;
+
+/* 
+ * Where a file's data starts on its device: the physical offset of
+ * its first extent where FIEMAP is available, its inode number
+ * (which tends to follow allocation order) otherwise.
+ */
+static uint64_t tp_wsched_pos(const char *path, const struct stat *st, int order) {
+#ifdef HAVE_LINUX_FIEMAP_H
+  struct {
+    struct fiemap map;
+    struct fiemap_extent extent;
+  } fm;
+  int fd;
+
+  if (order == TP_WORDER_PHYSICAL && (fd = open(path, O_RDONLY)) >= 0) {
+    memset(&fm, 0, sizeof(fm));
+    fm.map.fm_length = FIEMAP_MAX_OFFSET;
+    fm.map.fm_extent_count = 1;
+    if (ioctl(fd, FS_IOC_FIEMAP, &fm.map) == 0 && fm.map.fm_mapped_extents == 1) {
+      close(fd);
+      return fm.extent.fe_physical;
+    }
+    close(fd);
+  }
+#else
+  UNUSED(path);
+  UNUSED(order);
+#endif
+
+  return st->st_ino;
+}
+
+static int tp_wjob_cmp(const void *a, const void *b) {
+  const tp_wjob_t *x = a, *y = b;
+
+  if (x->found != y->found)
+    return x->found ? -1 : 1;
+  if ((x->id == -1) != (y->id == -1))
+    return x->id == -1 ? 1 : -1;
+  if (x->dev != y->dev)
+    return x->dev < y->dev ? -1 : 1;
+  if (x->pos != y->pos)
+    return x->pos < y->pos ? -1 : 1;
+  return 0;
+}
+
+/* 
+ * Locate and sort every job.  Jobs whose file can't be found are
+ * sorted to the end (found stays 0); when writing everything, files
+ * that aren't recognized are dropped.
+ */
+static void tp_wsched_sort(tp_wsched_t *s) {
+  tp_wjob_t *job;
+  char path[4096];
+  struct stat st;
+  track_t tr;
+  long i;
+
+  for (i = 0; i < s->num_jobs && !s->call.cancelled; i++) {
+    job = s->jobs + i;
+    job->found = 0;
+    if ((tr = tp_GetTrack(s->call.tp, job->id)) == NULL)
+      continue;
+    tr_GetFileName(tr, path, sizeof(path));
+
+    /* writing everything means everything that's ready to write */
+    if (s->recognized && tr_GetStatus(tr) != eRecognized) {
+      tp_ReleaseTrack(s->call.tp, tr);
+      job->id = -1;
+      continue;
+    }
+    tp_ReleaseTrack(s->call.tp, tr);
+    if (stat(path, &st) < 0)
+      continue;
+
+    job->found = 1;
+    job->dev = st.st_dev;
+    job->pos = s->order == TP_WORDER_NONE ? (uint64_t) i : tp_wsched_pos(path, &st, s->order);
+  }
+  qsort(s->jobs, s->num_jobs, sizeof(tp_wjob_t), tp_wjob_cmp);
+
+  /* drop the files that weren't ready; they sort to the very end */
+  while (s->recognized && s->num_jobs && s->jobs[s->num_jobs - 1].id == -1)
+    s->num_jobs--;
+}
+
+/*********************************************************************/
+/* Asynchronous tag writes                                           */
+/*********************************************************************/
+
+/*
+ * A scheduled write (see tp_wsched_sort) run on a thread of its own,
+ * for TunePimp::TagWrite.  Files are handed to libtunepimp one at a
+ * time, in order, and each is resolved when libtunepimp sends
+ * WriteTagsComplete for it (the notify callback marks it through the
+ * queue's list of writes in progress), or, as a fallback, when polling
+ * shows it has left the Recognized and Verified states.
+ */
+typedef struct {
+  int id, skip, submitted, completed, done, ok;
+  char err[256];
+} tp_wres_t;
+
+struct tp_wasync_t {
+  tp_wsched_t sched;
+  tunepimp_t tp;
+  tp_pimp_t *pimp;   /* referenced by the thread */
+  tp_queue_t *queue; /* NULL once unlinked */
+  tp_wasync_t *next;
+  pthread_t thread;
+  int running;
+
+  /* results, sorted by id; protects everything below */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  tp_wres_t *res;
+  long num_res, num_done;
+  int done, orphaned, exited;
+};
+
+/* how often to check on files that haven't been reported yet, in ms */
+#define TP_WASYNC_POLL 250
+
+static int tp_wres_cmp(const void *a, const void *b) {
+  int x = ((const tp_wres_t*) a)->id, y = ((const tp_wres_t*) b)->id;
+  return x < y ? -1 : x > y;
+}
+
+static tp_wres_t *tp_wasync_find(tp_wasync_t *w, int id) {
+  tp_wres_t key;
+  key.id = id;
+  return bsearch(&key, w->res, w->num_res, sizeof(tp_wres_t), tp_wres_cmp);
+}
+
+/* 
+ * Mark file_id written in every write in the list; called from the
+ * notify callback, with the queue mutex held.
+ */
+static void tp_wasync_notify(tp_wasync_t *w, int file_id) {
+  tp_wres_t *r;
+
+  for (; w; w = w->next) {
+    pthread_mutex_lock(&w->lock);
+    if ((r = tp_wasync_find(w, file_id)) != NULL) {
+      r->completed = 1;
+      pthread_cond_broadcast(&w->cond);
+    }
+    pthread_mutex_unlock(&w->lock);
+  }
+}
+
+/* 
+ * Work out the outcome of a file.  Never called with w->lock held,
+ * since libtunepimp may be holding its own lock while it calls the
+ * notify callback (which takes w->lock).
+ */
+static void tp_wasync_resolve(tp_wasync_t *w, tp_wres_t *r, int submitted, int completed) {
+  char err[sizeof(r->err)];
+  int status, ok = 0;
+  track_t tr;
+
+  err[0] = '\0';
+  if ((tr = tp_GetTrack(w->tp, r->id)) != NULL) {
+    status = tr_GetStatus(tr);
+    if (status == eSaved)
+      ok = 1;
+    else if (status == eError)
+      tr_GetError(tr, err, sizeof(err));
+    else if (!submitted && status != eRecognized)
+      snprintf(err, sizeof(err), "file isn't recognized (status %d)", status);
+    else
+      snprintf(err, sizeof(err), "tags weren't written (status %d)", status);
+    tp_ReleaseTrack(w->tp, tr);
+  } else if (completed) {
+    /* written, then removed (see auto_remove_saved_files) */
+    ok = 1;
+  } else {
+    snprintf(err, sizeof(err), "invalid file id %d", r->id);
+  }
+  if (!ok && !err[0])
+    snprintf(err, sizeof(err), "couldn't write tags");
+
+  pthread_mutex_lock(&w->lock);
+  r->ok = ok;
+  memcpy(r->err, err, sizeof(err));
+  r->done = 1;
+  w->num_done++;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* 
+ * Has an outstanding file visibly finished?  Only for files that
+ * haven't been reported; an unknown file counts as finished.
+ */
+static int tp_wasync_settled(tp_wasync_t *w, int id) {
+  track_t tr;
+  int status;
+
+  if ((tr = tp_GetTrack(w->tp, id)) == NULL)
+    return 1;
+  status = tr_GetStatus(tr);
+  tp_ReleaseTrack(w->tp, tr);
+
+  return status != eRecognized && status != eVerified;
+}
+
+/* 
+ * Wait for a submitted file to be written: until its WriteTagsComplete
+ * comes in, it's visibly finished or the write is cancelled.
+ */
+static void tp_wasync_wait(tp_wasync_t *w, tp_wres_t *r) {
+  struct timespec ts;
+  double next;
+  int completed, cancelled;
+
+  for (;;) {
+    next = tp_now() + TP_WASYNC_POLL / 1000.0;
+    ts.tv_sec = (time_t) next;
+    ts.tv_nsec = (long) ((next - ts.tv_sec) * 1e9);
+    pthread_mutex_lock(&w->lock);
+    while (!r->completed && !w->sched.call.cancelled &&
+           pthread_cond_timedwait(&w->cond, &w->lock, &ts) != ETIMEDOUT);
+    completed = r->completed;
+    cancelled = w->sched.call.cancelled;
+    pthread_mutex_unlock(&w->lock);
+
+    /* nothing reported for a while; look for ourselves */
+    if (completed || cancelled || tp_wasync_settled(w, r->id))
+      return;
+  }
+}
+
+static void tp_wasync_destroy(tp_wasync_t *w) {
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+  free(w->sched.jobs);
+  free(w->res);
+  free(w);
+}
+
+static void *tp_wasync_main(void *ptr) {
+  tp_wasync_t *w = ptr;
+  tp_pimp_t *pimp = w->pimp;
+  tp_wjob_t *job;
+  tp_wres_t *r;
+  double t0;
+  long i;
+  int ok, cancelled, orphaned;
+
+  tp_wsched_sort(&w->sched);
+
+  /* when writing everything, only the recognized files count */
+  pthread_mutex_lock(&w->lock);
+  for (i = 0; w->sched.recognized && i < w->num_res; i++)
+    w->res[i].skip = 1;
+  for (i = 0; i < w->sched.num_jobs; i++)
+    if ((r = tp_wasync_find(w, w->sched.jobs[i].id)) != NULL)
+      r->skip = 0;
+  pthread_mutex_unlock(&w->lock);
+
+  /* 
+   * one file at a time, so libtunepimp's write thread takes them in
+   * our order; only this thread sets done, so it's safe to read here
+   */
+  for (i = 0; i < w->sched.num_jobs; i++) {
+    job = w->sched.jobs + i;
+    if ((r = tp_wasync_find(w, job->id)) == NULL || r->done)
+      continue;
+
+    pthread_mutex_lock(&w->lock);
+    cancelled = w->sched.call.cancelled;
+    pthread_mutex_unlock(&w->lock);
+
+    ok = 0;
+    if (job->found && !cancelled) {
+      TP_TRACE_START(t0);
+      ok = tp_WriteTags(w->tp, &job->id, 1);
+      TP_TRACE_CALL(t0, "write", job->id, ok);
+    }
+
+    pthread_mutex_lock(&w->lock);
+    r->submitted = ok;
+    pthread_mutex_unlock(&w->lock);
+    if (ok)
+      tp_wasync_wait(w, r);
+    tp_wasync_resolve(w, r, ok, ok);
+  }
+
+  pthread_mutex_lock(&w->lock);
+  w->done = w->exited = 1;
+  orphaned = w->orphaned;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+
+  /* nobody's left to free the write (see tp_wasync_free) */
+  if (orphaned)
+    tp_wasync_destroy(w);
+  tp_pimp_unref(pimp);
+
+  return NULL;
+}
+
+/* abandon files not yet started, without waiting for the thread */
+static void tp_wasync_signal(tp_wasync_t *w) {
+  pthread_mutex_lock(&w->lock);
+  w->sched.call.cancelled = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* stop taking WriteTagsComplete from the queue; idempotent */
+static void tp_wasync_unlink(tp_wasync_t *w) {
+  tp_wasync_t **wp;
+
+  if (w->queue) {
+    pthread_mutex_lock(&w->queue->mutex);
+    for (wp = &w->queue->writes; *wp && *wp != w; wp = &(*wp)->next);
+    if (*wp)
+      *wp = w->next;
+    pthread_mutex_unlock(&w->queue->mutex);
+    w->queue = NULL;
+  }
+}
+
+/* 
+ * Stop (abandoning files not yet started), wait for the thread and
+ * unlink from the queue; idempotent.
+ */
+static void *tp_wasync_stop(void *ptr) {
+  tp_wasync_t *w = ptr;
+
+  if (w->running) {
+    tp_wasync_signal(w);
+    pthread_join(w->thread, NULL);
+    w->running = 0;
+  }
+  tp_wasync_unlink(w);
+
+  return NULL;
+}
+
+/* 
+ * Don't wait for the thread here: it may be waiting on a file that
+ * libtunepimp is still writing, and GC would wait with it.  It frees
+ * the write when it's done.
+ */
+static void tp_wasync_free(void *ptr) {
+  tp_wasync_t *w = ptr;
+
+  if (w) {
+    tp_wasync_unlink(w);
+    if (w->running) {
+      pthread_mutex_lock(&w->lock);
+      if (!w->exited) {
+        w->sched.call.cancelled = w->orphaned = 1;
+        pthread_cond_broadcast(&w->cond);
+        pthread_mutex_unlock(&w->lock);
+        pthread_detach(w->thread);
+        return;
+      }
+      pthread_mutex_unlock(&w->lock);
+      pthread_join(w->thread, NULL);
+    }
+    tp_wasync_destroy(w);
+  }
+}
+
+static size_t tp_wasync_memsize(const void *ptr) {
+  const tp_wasync_t *w = ptr;
+  return sizeof(tp_wasync_t) + w->num_res * (sizeof(tp_wres_t) + sizeof(tp_wjob_t));
+}
+
+static const rb_data_type_t tp_wasync_type = {
+  "TunePimp::TagWrite",
+  { 0, tp_wasync_free, tp_wasync_memsize, TP_COMPACT(0) },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*********************************************************************/
+/* Pipeline metrics                                                  */
+/*********************************************************************/
+
+/*
+ * Status transitions per file, and what they add up to: how many files
+ * leave each status (and how fast), and histograms of how long they
+ * spent in it.  The notify callback timestamps each notification and
+ * queues it here; a thread of our own looks up the file's status and
+ * records a transition if it changed.  A file that moves on again
+ * before the thread gets to it has the in-between statuses folded into
+ * one transition, timed from the first notification.
+ */
+#define TP_MX_BUCKETS 16
+#define TP_MX_HISTORY 8
+#define TP_MX_SECONDS 64
+
+/* time spent in a status; the last bucket is +Inf */
+static const double tp_mx_bounds[TP_MX_BUCKETS - 1] = {
+  0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 25, 60, 120, 300, 600
+};
+
+typedef struct {
+  unsigned long count, buckets[TP_MX_BUCKETS];
+  double sum;
+} tp_mx_hist_t;
+
+typedef struct {
+  int type, file_id;
+  double at;
+} tp_mx_event_t;
+
+/* 
+ * A file's last few transitions (n counts them all; the last
+ * TP_MX_HISTORY are kept).  Open addressing, with -1 for free slots
+ * and -2 for removed ones.
+ */
+typedef struct {
+  int file_id, n;
+  unsigned char status[TP_MX_HISTORY];
+  double at[TP_MX_HISTORY], first;
+} tp_mx_file_t;
+
+/* what TunePimp::TunePimp#metrics reports, copied out as a whole */
+typedef struct {
+  /* per status left: totals, per-second counts for rates, and times */
+  unsigned long done[eLastStatus];
+  unsigned long secs[eLastStatus][TP_MX_SECONDS];
+  long stamps[eLastStatus][TP_MX_SECONDS];
+  tp_mx_hist_t stages[eLastStatus];
+
+  /* from first seen to written */
+  tp_mx_hist_t total;
+} tp_mx_stats_t;
+
+struct tp_mx_t {
+  tunepimp_t tp;
+  tp_pimp_t *pimp;  /* referenced by the thread */
+  pthread_t thread;
+  int running;
+  double started;
+
+  /* everything below is protected by lock */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop, orphaned, exited;
+  tp_ring_t events;
+
+  tp_mx_file_t *files;
+  long used, live, mask;
+  tp_mx_stats_t st;
+};
+
+/*
+ * Symbol names for statuses, as used by TunePimp::TunePimp#metrics
+ * and TunePimp::Tracer
+ */
+static const char *tp_status_names[eLastStatus] = {
+  "unrecognized", "recognized", "pending", "trm_lookup", "trm_collision",
+  "file_lookup", "user_selection", "verified", "saved", "deleted", "error"
+};
+
+static void tp_mx_observe(tp_mx_hist_t *h, double secs) {
+  int i;
+
+  if (secs < 0)
+    secs = 0;
+  for (i = 0; i < TP_MX_BUCKETS - 1 && secs > tp_mx_bounds[i]; i++);
+  h->buckets[i]++;
+  h->count++;
+  h->sum += secs;
+}
+
+/* called from the notify callback, with the queue mutex held */
+static void tp_mx_notify(tp_mx_t *mx, int type, int file_id) {
+  tp_mx_event_t ev;
+
+  ev.type = type;
+  ev.file_id = file_id;
+  ev.at = tp_now();
+
+  pthread_mutex_lock(&mx->lock);
+  if (tp_ring_push(&mx->events, &ev))
+    pthread_cond_signal(&mx->cond);
+  pthread_mutex_unlock(&mx->lock);
+}
+
+/* find file_id's slot, or the free slot it would go in; lock held */
+static tp_mx_file_t *tp_mx_find(tp_mx_t *mx, int file_id, int insert) {
+  tp_mx_file_t *f, *tomb = NULL;
+  long i;
+
+  for (i = (file_id * 2654435761U) & mx->mask; (f = mx->files + i)->file_id != -1; i = (i + 1) & mx->mask) {
+    if (f->file_id == file_id)
+      return f;
+    if (f->file_id == -2 && !tomb)
+      tomb = f;
+  }
+
+  return insert && tomb ? tomb : f;
+}
+
+/* get (or add) file_id's entry; lock held.  NULL if out of memory. */
+static tp_mx_file_t *tp_mx_file(tp_mx_t *mx, int file_id) {
+  tp_mx_file_t *files, *f;
+  long i, mask;
+
+  if ((mx->used + 1) * 2 > mx->mask) {
+    for (mask = 63; mask < (mx->live + 1) * 4; mask = mask * 2 + 1);
+    if ((files = malloc(sizeof(tp_mx_file_t) * (mask + 1))) == NULL)
+      return NULL;
+    for (i = 0; i <= mask; i++)
+      files[i].file_id = -1;
+
+    f = mx->files;
+    mx->files = files;
+    for (i = 0; f && i <= mx->mask; i++)
+      if (f[i].file_id >= 0)
+        *tp_mx_find(mx, f[i].file_id, 1) = f[i];
+    free(f);
+    mx->mask = mask;
+    mx->used = mx->live;
+  }
+
+  f = tp_mx_find(mx, file_id, 1);
+  if (f->file_id < 0) {
+    if (f->file_id == -1)
+      mx->used++;
+    mx->live++;
+    f->file_id = file_id;
+    f->n = 0;
+  }
+
+  return f;
+}
+
+/* record file_id entering status at time at; lock held */
+static void tp_mx_transition(tp_mx_t *mx, int file_id, int status, double at) {
+  tp_mx_file_t *f;
+  int last, i;
+  long sec;
+
+  if ((f = tp_mx_file(mx, file_id)) == NULL)
+    return;
+
+  if (f->n) {
+    i = (f->n - 1) % TP_MX_HISTORY;
+    if ((last = f->status[i]) == status)
+      return;
+
+    /* leaving the last status */
+    tp_mx_observe(mx->st.stages + last, at - f->at[i]);
+    mx->st.done[last]++;
+    sec = (long) at;
+    if (mx->st.stamps[last][sec % TP_MX_SECONDS] != sec) {
+      mx->st.stamps[last][sec % TP_MX_SECONDS] = sec;
+      mx->st.secs[last][sec % TP_MX_SECONDS] = 0;
+    }
+    mx->st.secs[last][sec % TP_MX_SECONDS]++;
+  } else {
+    f->first = at;
+  }
+
+  if (status == eSaved)
+    tp_mx_observe(&mx->st.total, at - f->first);
+  f->status[f->n % TP_MX_HISTORY] = status;
+  f->at[f->n++ % TP_MX_HISTORY] = at;
+}
+
+static void tp_mx_forget(tp_mx_t *mx, int file_id) {
+  tp_mx_file_t *f;
+
+  if (mx->live && (f = tp_mx_find(mx, file_id, 0))->file_id == file_id) {
+    f->file_id = -2;
+    mx->live--;
+  }
+}
+
+static void tp_mx_destroy(tp_mx_t *mx) {
+  pthread_mutex_destroy(&mx->lock);
+  pthread_cond_destroy(&mx->cond);
+  free(mx->events.buf);
+  free(mx->files);
+  free(mx);
+}
+
+static void *tp_mx_main(void *ptr) {
+  tp_mx_t *mx = ptr;
+  tp_pimp_t *pimp = mx->pimp;
+  tp_mx_event_t ev;
+  track_t tr;
+  int *ids, i, num, status, orphaned;
+
+  /* start with the files already there */
+  num = tp_GetNumFileIds(mx->tp);
+  if (num > 0 && (ids = malloc(sizeof(int) * num)) != NULL) {
+    memset(ids, 0xff, sizeof(int) * num);
+    tp_GetFileIds(mx->tp, ids, num);
+    for (i = 0; i < num; i++) {
+      if ((tr = tp_GetTrack(mx->tp, ids[i])) == NULL)
+        continue;
+      status = tr_GetStatus(tr);
+      tp_ReleaseTrack(mx->tp, tr);
+      pthread_mutex_lock(&mx->lock);
+      tp_mx_transition(mx, ids[i], status, mx->started);
+      pthread_mutex_unlock(&mx->lock);
+    }
+    free(ids);
+  }
+
+  pthread_mutex_lock(&mx->lock);
+  while (!mx->stop) {
+    if (!tp_ring_shift(&mx->events, &ev)) {
+      pthread_cond_wait(&mx->cond, &mx->lock);
+      continue;
+    }
+    if (ev.type == tpFileRemoved) {
+      tp_mx_forget(mx, ev.file_id);
+      continue;
+    }
+    pthread_mutex_unlock(&mx->lock);
+
+    /* written, then removed (see auto_remove_saved_files) */
+    status = ev.type == tpWriteTagsComplete ? eSaved : -1;
+    if ((tr = tp_GetTrack(mx->tp, ev.file_id)) != NULL) {
+      status = tr_GetStatus(tr);
+      tp_ReleaseTrack(mx->tp, tr);
+    }
+
+    pthread_mutex_lock(&mx->lock);
+    if (status >= 0 && status < eLastStatus)
+      tp_mx_transition(mx, ev.file_id, status, ev.at);
+  }
+  mx->exited = 1;
+  orphaned = mx->orphaned;
+  pthread_mutex_unlock(&mx->lock);
+
+  /* nobody's left to free it (see tp_mx_release) */
+  if (orphaned)
+    tp_mx_destroy(mx);
+  tp_pimp_unref(pimp);
+
+  return NULL;
+}
+
+/* pimp is referenced for the thread; tp is its handle */
+static tp_mx_t *tp_mx_start(tp_pimp_t *pimp, tunepimp_t tp) {
+  tp_mx_t *mx;
+
+  if ((mx = malloc(sizeof(tp_mx_t))) == NULL)
+    return NULL;
+  memset(mx, 0, sizeof(tp_mx_t));
+  mx->tp = tp;
+  mx->pimp = pimp;
+  mx->started = tp_now();
+  pthread_mutex_init(&mx->lock, NULL);
+  pthread_cond_init(&mx->cond, NULL);
+  tp_ring_init(&mx->events, sizeof(tp_mx_event_t));
+
+  tp_pimp_ref(pimp);
+  if (!tp_thread_start(&mx->thread, 0, tp_mx_main, mx)) {
+    tp_pimp_unref(pimp);
+    pthread_mutex_destroy(&mx->lock);
+    pthread_cond_destroy(&mx->cond);
+    free(mx);
+    return NULL;
+  }
+  mx->running = 1;
+
+  return mx;
+}
+
+/* stop the thread and free everything; unhook it from the queue first */
+static void *tp_mx_stop(void *ptr) {
+  tp_mx_t *mx = ptr;
+
+  pthread_mutex_lock(&mx->lock);
+  mx->stop = 1;
+  pthread_cond_signal(&mx->cond);
+  pthread_mutex_unlock(&mx->lock);
+  if (mx->running)
+    pthread_join(mx->thread, NULL);
+  tp_mx_destroy(mx);
+
+  return NULL;
+}
+
+/* 
+ * Like tp_mx_stop, but for GC: rather than wait for the thread (which
+ * may be waiting on a track lock), leave it to free everything.
+ */
+static void tp_mx_release(tp_mx_t *mx) {
+  pthread_mutex_lock(&mx->lock);
+  if (!mx->exited) {
+    mx->stop = mx->orphaned = 1;
+    pthread_cond_signal(&mx->cond);
+    pthread_mutex_unlock(&mx->lock);
+    pthread_detach(mx->thread);
+    return;
+  }
+  pthread_mutex_unlock(&mx->lock);
+  tp_mx_stop(mx);
+}
+
+static void tp_md_free(void *md) {
+  if (md)
+    md_Delete(md);
+}
+
+static size_t tp_md_memsize(const void *md) {
+  UNUSED(md);
+  return sizeof(metadata_t);
+}
+
+static const rb_data_type_t tp_md_type = {
+  "TunePimp::Metadata",
+  { 0, tp_md_free, tp_md_memsize, TP_COMPACT(0) },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*********************************************************************/
+/* TunePimp::TunePimp methods                                        */
+/*********************************************************************/
+
+/*
+ * Native state behind a TunePimp::TunePimp object.  The tunepimp_t
+ * handle must stay the first member: the methods below get at it by
+ * treating the wrapped pointer as a tunepimp_t*.
+ */
+struct tp_pimp_t {
+  tunepimp_t tp;
+  tp_queue_t queue;
+
+  /* what tp was created with (TunePimp::TRMJournal makes its own) */
+  char *app_name, *app_version;
+
+  /* 
+   * file id => TunePimp::Track, weakly held (an ObjectSpace::WeakMap),
+   * or nil if this ruby can't do that
+   */
+  VALUE tracks;
+
+  /* 
+   * references: the TunePimp object, each live Track object (which
+   * needs tp to release its track) and each native thread using tp
+   * (the metrics, capture and governor threads).  tp is deleted and
+   * the struct freed with the last one (see tp_pimp_unref).
+   */
+  pthread_mutex_t ref_lock;
+  long refs;
+
+  /* native memory last reported to the GC (see tp_tp_account) */
+  ssize_t accounted;
+
+  /* TRM cache in use (see TunePimp#trm_cache=), and files that missed it */
+  tp_trmc_t *trmc;
+  tp_pending_t pending;
+
+  /* TunePimp::Governor feeding this object, if any */
+  tp_gov_t *gov;
+
+  /* TunePimp::TRMJournal submitting through this object, if any */
+  tp_jrnl_t *journal;
+};
+
+static void tp_gov_signal(tp_gov_t *);
+static void tp_jrnl_detach(tp_jrnl_t *);
+static void tp_jrnl_settings(tp_jrnl_t *, tunepimp_t);
+
+/*
+ * Native state behind a TunePimp::Track object.  The track_t handle
+ * must stay the first member, as with tp_pimp_t.  tr is NULL once the
+ * track has been released.
+ *
+ * The object is shared through the identity map, so
+ * TunePimp#release_track only sets released: every accessor refuses a
+ * released track, and the handle itself goes back to libtunepimp once
+ * no thread is using it without the GVL (users) and no Track#lock is
+ * outstanding (locks).  All of these are only touched with the GVL
+ * held.
+ */
+typedef struct {
+  track_t tr;
+  tp_pimp_t *pimp;
+  VALUE owner;
+  int file_id;
+  int released, users, locks;
+} tp_track_t;
+
+/*
+ * Get the track_t* of a TunePimp::Track object, raising if the track
+ * has already been released.
+ */
+#define TP_TRACK(obj, tr) do { \
+  (tr) = rb_check_typeddata((obj), &tp_track_type); \
+  if (!*(track_t*) (tr) || ((tp_track_t*) (tr))->released) \
+    rb_raise(eException, "Track has already been released"); \
+} while (0)
+
+static VALUE cWeakMap;
+static ID id_aref, id_aset, id_delete;
+
+/* ObjectSpace::WeakMap#delete only exists from ruby 3.3 */
+static int tp_weakmap_delete;
+
+/*
+ * Rough size of libtunepimp's own state for one file (the track, its
+ * local and server metadata, and lookup results), used to tell the GC
+ * how much native memory a TunePimp object is holding on to.
+ */
+#define TP_FILE_FOOTPRINT 4096
+
+static void tp_tp_mark(void *ptr) {
+  rb_gc_mark_movable(((tp_pimp_t*) ptr)->tracks);
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void tp_tp_compact(void *ptr) {
+  tp_pimp_t *pimp = ptr;
+  pimp->tracks = rb_gc_location(pimp->tracks);
+}
+#endif
+
+static void tp_pimp_ref(tp_pimp_t *pimp) {
+  pthread_mutex_lock(&pimp->ref_lock);
+  pimp->refs++;
+  pthread_mutex_unlock(&pimp->ref_lock);
+}
+
+/* 
+ * Take a reference from a libtunepimp thread, unless tp is already
+ * being deleted.  Returns 0 if it is.
+ */
+static int tp_pimp_tryref(tp_pimp_t *pimp) {
+  int ret;
+
+  pthread_mutex_lock(&pimp->ref_lock);
+  if ((ret = pimp->refs > 0))
+    pimp->refs++;
+  pthread_mutex_unlock(&pimp->ref_lock);
+
+  return ret;
+}
+
+/* 
+ * Drop a reference.  The last one may be dropped on one of our own
+ * threads, so nothing here touches Ruby.
+ */
+static void tp_pimp_unref(tp_pimp_t *pimp) {
+  int last;
+
+  pthread_mutex_lock(&pimp->ref_lock);
+  last = !--pimp->refs;
+  pthread_mutex_unlock(&pimp->ref_lock);
+  if (!last)
+    return;
+
+  /* stops the libtunepimp threads, so no more callbacks after this */
+  if (pimp->tp)
+    tp_Delete(pimp->tp);
+  tp_queue_free(&pimp->queue);
+  tp_pending_free(&pimp->pending);
+  if (pimp->trmc)
+    tp_trmc_unref(pimp->trmc);
+  free(pimp->app_name);
+  free(pimp->app_version);
+  pthread_mutex_destroy(&pimp->ref_lock);
+  free(pimp);
+}
+
+/* 
+ * Don't wait for any of our threads here: the governor may be adding
+ * a file, and the metrics and capture threads waiting on a track lock,
+ * and GC would wait with them.  They're told to stop, and the last
+ * reference out deletes tp.
+ */
+static void tp_tp_free(void *ptr) {
+  tp_pimp_t *pimp = ptr;
+  tp_wasync_t *w;
+  tp_mx_t *mx;
+
+  if (pimp) {
+    if (pimp->gov)
+      tp_gov_signal(pimp->gov);
+
+    /* asynchronous writes are cut short (see tp_tp_write_tags_async) */
+    while ((w = pimp->queue.writes) != NULL) {
+      tp_wasync_signal(w);
+      tp_wasync_unlink(w);
+    }
+    if (pimp->journal)
+      tp_jrnl_detach(pimp->journal);
+
+    pthread_mutex_lock(&pimp->queue.mutex);
+    mx = pimp->queue.mx;
+    pimp->queue.mx = NULL;
+    pthread_mutex_unlock(&pimp->queue.mutex);
+    if (mx)
+      tp_mx_release(mx);
+    tp_pending_release(&pimp->pending);
+
+    if (pimp->accounted)
+      rb_gc_adjust_memory_usage(-pimp->accounted);
+    pimp->accounted = 0;
+    tp_pimp_unref(pimp);
+  }
+}
+
+static size_t tp_tp_memsize(const void *ptr) {
+  const tp_pimp_t *pimp = ptr;
+  size_t ret;
+
+  /* 
+   * runs during GC, so no libtunepimp calls (they take locks); the
+   * footprint last accounted by tp_tp_account will do
+   */
+  ret = sizeof(tp_pimp_t) +
+        pimp->queue.notes.cap * pimp->queue.notes.size +
+        pimp->queue.stats.cap * pimp->queue.stats.size;
+  if (pimp->tp && pimp->accounted > 0)
+    ret += (size_t) pimp->accounted;
+
+  return ret;
+}
+
+static const rb_data_type_t tp_pimp_type = {
+  "TunePimp::TunePimp",
+  { tp_tp_mark, tp_tp_free, tp_tp_memsize, TP_COMPACT(tp_tp_compact) },
+  0, 0, 0
+};
+
+/*
+ * Tell the GC about changes in libtunepimp's footprint since the last
+ * call, so a growing file list counts towards GC pressure.  Call with
+ * the GVL held after anything that adds or removes files.
+ */
+static void tp_tp_account(tp_pimp_t *pimp) {
+  ssize_t size;
+
+  if (!pimp->tp)
+    return;
+
+  size = (ssize_t) tp_GetNumFiles(pimp->tp) * TP_FILE_FOOTPRINT;
+  if (size != pimp->accounted) {
+    rb_gc_adjust_memory_usage(size - pimp->accounted);
+    pimp->accounted = size;
+  }
+}
+
+static void tp_tr_mark(void *ptr) {
+  rb_gc_mark_movable(((tp_track_t*) ptr)->owner);
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void tp_tr_compact(void *ptr) {
+  tp_track_t *track = ptr;
+  track->owner = rb_gc_location(track->owner);
+}
+#endif
+
+static void tp_tr_free(void *ptr) {
+  tp_track_t *track = ptr;
+  tp_pimp_t *pimp;
+
+  if (track) {
+    pimp = track->pimp;
+    if (track->tr && pimp->tp)
+      tp_ReleaseTrack(pimp->tp, track->tr);
+    tp_pimp_unref(pimp);
+    free(track);
+  }
+}
+
+static size_t tp_tr_memsize(const void *ptr) {
+  UNUSED(ptr);
+  return sizeof(tp_track_t);
+}
+
+static const rb_data_type_t tp_track_type = {
+  "TunePimp::Track",
+  { tp_tr_mark, tp_tr_free, tp_tr_memsize, TP_COMPACT(tp_tr_compact) },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * Drop a file id from the Track identity map (the file was removed, or
+ * its track released).
+ */
+static void tp_tracks_evict(tp_pimp_t *pimp, int file_id) {
+  if (NIL_P(pimp->tracks))
+    return;
+  if (tp_weakmap_delete)
+    rb_funcall(pimp->tracks, id_delete, 1, INT2FIX(file_id));
+  else
+    rb_funcall(pimp->tracks, id_aset, 2, INT2FIX(file_id), Qnil);
+}
+
+/*
+ * Give a released track's handle back to libtunepimp, if nothing is
+ * still using it.
+ */
+static void tp_track_settle(tp_track_t *track) {
+  if (track->released && !track->users && !track->locks && track->tr) {
+    if (track->pimp->tp)
+      tp_ReleaseTrack(track->pimp->tp, track->tr);
+    track->tr = NULL;
+  }
+}
+
+/*
+ * Run fn(call) on a track's handle without the GVL, counting the
+ * track as in use meanwhile so TunePimp#release_track can't pull the
+ * handle out from under it.
+ */
+typedef struct {
+  tp_track_t *track;
+  tp_call_fn fn;
+  tp_call_t *call;
+} tp_track_call_t;
+
+static VALUE tp_track_call_run(VALUE ptr) {
+  tp_track_call_t *tc = (tp_track_call_t*) ptr;
+  tp_call_blocking(tc->fn, tc->call);
+  return Qnil;
+}
+
+static VALUE tp_track_call_done(VALUE ptr) {
+  tp_track_call_t *tc = (tp_track_call_t*) ptr;
+
+  tc->track->users--;
+  if (tc->fn == tp_call_lock && tc->call->ret)
+    tc->track->locks++;
+  tp_track_settle(tc->track);
+
+  return Qnil;
+}
+
+static void tp_track_blocking(tp_track_t *track, tp_call_fn fn, tp_call_t *call) {
+  tp_track_call_t tc;
+
+  tc.track = track;
+  tc.fn = fn;
+  tc.call = call;
+  call->tr = track->tr;
+  call->ret = 0;
+  track->users++;
+  rb_ensure(tp_track_call_run, (VALUE) &tc, tp_track_call_done, (VALUE) &tc);
+}
+
+/*
+ * Create a new TunePimp::TunePimp object.
+ *
+ * Examples:
+ *   # create new tunepimp object
+ *   tp = TunePimp::TunePimp.new('PimpApp', 'PimpApp 1.0')
+ *
+ *   # create new tunepimp object, start threads
+ *   tp = TunePimp::TunePimp.new('PimpApp', 'PimpApp 1.0', true)
+ *
+ */
+VALUE tp_tp_new(int argc, VALUE *argv, VALUE klass) {
+  tp_pimp_t *pimp;
+  const char *name, *version;
+  VALUE self;
+
+  if (argc != 2 && argc != 3)
+    rb_raise(rb_eArgError, "invalid argument count (not 2 or 3)");
+  name = StringValueCStr(argv[0]);
+  version = StringValueCStr(argv[1]);
+
+  if ((pimp = malloc(sizeof(tp_pimp_t))) == NULL)
+    rb_raise(eException, "Couldn't allocate memory for tunepimp_t");
+  if (!tp_queue_init(&pimp->queue)) {
+    free(pimp);
+    rb_raise(eException, "Couldn't create notification pipe");
+  }
+  pimp->tp = NULL;
+  pimp->app_name = pimp->app_version = NULL;
+  pimp->tracks = Qnil;
+  pthread_mutex_init(&pimp->ref_lock, NULL);
+  pimp->refs = 1;
+  pimp->accounted = 0;
+  pimp->trmc = NULL;
+  pimp->gov = NULL;
+  pimp->journal = NULL;
+  tp_pending_init(&pimp->pending, pimp);
+  pimp->queue.pending = &pimp->pending;
+  pimp->queue.pimp = pimp;
+  self = TypedData_Wrap_Struct(klass, &tp_pimp_type, pimp);
+  if (cWeakMap)
+    pimp->tracks = rb_class_new_instance(0, NULL, cWeakMap);
+
+  switch (argc) {
+    case 2:
+      pimp->tp = tp_New(name, version);
+      break;
+    case 3:
+      pimp->tp = tp_NewWithArgs(name, version,
+                                !(argv[2] == Qnil || argv[2] == Qfalse));
+      break;
+  }
+  if (!pimp->tp)
+    rb_raise(rb_eNoMemError, "Couldn't create tunepimp_t");
+  pimp->app_name = strdup(name);
+  pimp->app_version = strdup(version);
+  if (!pimp->app_name || !pimp->app_version)
+    rb_raise(rb_eNoMemError, "Couldn't allocate memory for tunepimp_t");
+
+  /* route notifications and status messages into our own queue */
+  tp_SetNotifyCallback(pimp->tp, tp_queue_notify_cb, &pimp->queue);
+  tp_SetStatusCallback(pimp->tp, tp_queue_status_cb, &pimp->queue);
+
+  rb_obj_call_init(self, 0, NULL);
+
+  return self;
+}
+
+/*
+ * Constructor for TunePimp::TunePimp object.
+ *
+ * This method is currently empty.  You should never call this method
+ * directly unless you're instantiating a derived class (ie, you know
+ * what you're doing).
+ *
+ */
+static VALUE tp_tp_init(VALUE self) {
+  return self;
+}
+
+/*
+ * Get the major. minor, and revision version of the TunePimp library.
+ *
+ * Example:
+ *   ary = tp.version
+ *   puts 'TunePimp version: ' << ary.join('.')
+ *
+ */
+static VALUE tp_tp_ver(VALUE self) {
+  tunepimp_t *tp;
+  int i, vals[3];
+  VALUE ret;
+
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  ret = rb_ary_new();
+
+  tp_GetVersion(*tp, &vals[0], &vals[1], &vals[2]);
+  for (i = 0; i < 3; i++)
+    rb_ary_push(ret, INT2FIX(vals[i]));
+  
+  return ret;
+}
+
+/*
+ * Set the username and password for this TunePimp::TunePimp object.
+ *
+ * Example:
+ *   tp.set_user_info('pimpuser', 'p1mpU534')
+ *
+ */
+static VALUE tp_tp_set_user_info(VALUE self, VALUE user, VALUE pass) {
+  tp_pimp_t *pimp;
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  tp_SetUserInfo(pimp->tp, StringValueCStr(user), StringValueCStr(pass));
+  if (pimp->journal)
+    tp_jrnl_settings(pimp->journal, pimp->tp);
+  return Qnil;
+}
+
+/*
+ * Get the username and password for this TunePimp::TunePimp object.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#user_info
+ *   TunePimp::TunePimp#get_user_info
+ *
+ * Example:
+ *   user, pass = tp.user_info
+ *
+ */
+static VALUE tp_tp_get_user_info(VALUE self) {
+  tunepimp_t *tp;
+  char user[1024], pass[1024];
+  VALUE ret;
+
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_GetUserInfo(*tp, user, 1024, pass, 1024);
+
+  ret = rb_ary_new();
+  rb_ary_push(ret, rb_str_new2(user));
+  rb_ary_push(ret, rb_str_new2(pass));
+
+  return ret;
+}
+
+/*
+ * Use the UTF-8 for this TunePimp::TunePimp object?
+ *
+ * Note: Defaults to false, or ISO-8859-1 (latin1).
+ *
+ * Example:
+ *   tp.use_utf8 = true
+ *
+ */
+static VALUE tp_tp_set_use_utf8(VALUE self, VALUE utf8) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetUseUTF8(*tp, !(utf8 == Qfalse || utf8 == Qnil));
+  return Qnil;
+}
+
+/*
+ * Is this TunePimp::TunePimp object using UTF-8?
+ *
+ * Note: False means ISO-8859-1 (latin1).
+ *
+ * Example:
+ *   puts 'Character set: ' << (tp.use_utf8 ? 'UTF-8' : 'ISO-8859-1')
+ *
+ */
+static VALUE tp_tp_get_use_utf8(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return tp_GetUseUTF8(*tp) ? Qtrue : Qfalse;
+}
+
+/*
+ * Set the server and port for this TunePimp::TunePimp object.
+ *
+ * Note: defaults to www.musicbrainz.org, port 80.
+ *
+ * Example:
+ *   tp.set_server('www.musicbrainz.org', 80)
+ *
+ */
+static VALUE tp_tp_set_server(VALUE self, VALUE host, VALUE port) {
+  tp_pimp_t *pimp;
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  tp_SetServer(pimp->tp, StringValueCStr(host), NUM2INT(port));
+  if (pimp->journal)
+    tp_jrnl_settings(pimp->journal, pimp->tp);
+  return Qnil;
+}
+
+/*
+ * Get the server and port for this TunePimp::TunePimp object.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#server
+ *   TunePimp::TunePimp#get_server
+ * 
+ * Example:
+ *   host, port = tp.server
+ *
+ */
+static VALUE tp_tp_get_server(VALUE self) {
+  tunepimp_t *tp;
+  char host[1024];
+  short port;
+  VALUE ret;
+
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_GetServer(*tp, host, 1024, &port);
+
+  ret = rb_ary_new();
+  rb_ary_push(ret, rb_str_new2(host));
+  rb_ary_push(ret, INT2FIX((unsigned short) port));
+  
+  return ret;
+}
+
+/*
+ * Set the proxy host and port for this TunePimp::TunePimp object.
+ *
+ * Note: Defaults to off.  Set to host '' or nil to disable.
+ *
+ * Examples:
+ *   # set the proxy server
+ *   tp.set_proxy('proxy.home.pablotron.org', 8080)
+ *
+ *   # disable the proxy server
+ *   tp.set_proxy(nil)
+ */
+static VALUE tp_tp_set_proxy(int argc, VALUE *argv, VALUE self) {
+  tp_pimp_t *pimp;
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+
+  switch (argc) {
+    case 1:
+      if (argv[0] != Qnil)
+        rb_raise(rb_eArgError, "missing proxy port");
+      else
+        tp_SetProxy(pimp->tp, "", 0);
+      break;
+    case 2:
+      if (argv[0] != Qnil)
+        tp_SetProxy(pimp->tp, StringValueCStr(argv[0]), NUM2INT(argv[1]));
+      else
+        tp_SetProxy(pimp->tp, "", 0);
+
+      break;
+    default:
+      rb_raise(rb_eArgError, "invalid argument count (not 1 or 2)");
+  }
+  if (pimp->journal)
+    tp_jrnl_settings(pimp->journal, pimp->tp);
+
+  return Qnil;
+}
+
+/*
+ * Get the proxy host and port for this TunePimp::TunePimp object.
+ *
+ * Note: Returns nil if there is no proxy set.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#proxy
+ *   TunePimp::TunePimp#get_proxy
+ * 
+ * Example:
+ *   proxy_host, proxy_port = tp.proxy
+ *
+ */
+static VALUE tp_tp_get_proxy(VALUE self) {
+  tunepimp_t *tp;
+  char host[1024];
+  short port;
+  VALUE ret;
+
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_GetProxy(*tp, host, 1024, &port);
+
+  ret = Qnil;
+  if (strlen(host) > 0) {
+    ret = rb_ary_new();
+    rb_ary_push(ret, rb_str_new2(host));
+    rb_ary_push(ret, INT2FIX((unsigned short) port));
+  }
+  
+  return ret;
+}
+
+/*
+ * Number of extensions supported by this TunePimp::TunePimp object.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#num_supported_extensions
+ *   TunePimp::TunePimp#get_num_supported_extensions
+ *
+ * Example:
+ *   puts "Supports #{tp.num_supported_extensions} extensions."
+ *
+ */
+static VALUE tp_tp_num_exts(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return INT2FIX(tp_GetNumSupportedExtensions(*tp));
+}
+
+/*
+ * Get extensions supported by this TunePimp::TunePimp object.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#supported_extensions
+ *   TunePimp::TunePimp#get_supported_extensions
+ *
+ * Example:
+ *   puts "Extensions: \"#{tp.supported_extensions.join('", "')}\"."
+ *
+ */
+static VALUE tp_tp_exts(VALUE self) {
+  tunepimp_t *tp;
+  char **exts;
+  int i, num;
+  VALUE ret;
+  
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+
+  num = tp_GetNumSupportedExtensions(*tp);
+  if ((exts = malloc(sizeof(char*) * num)) == NULL)
+    rb_raise(eException, "Couldn't allocate %d bytes for char**",
+             sizeof(char*) * num);
+  for (i = 0; i < num; i++)
+    if ((exts[i] = malloc(TP_EXTENSION_LEN)) == NULL)
+      rb_raise(eException, "Couldn't allocate %d bytes for char*", TP_EXTENSION_LEN);
+  
+  tp_GetSupportedExtensions(*tp, exts);
+
+  ret = rb_ary_new();
+  for (i = 0; i < num; i++) {
+    rb_ary_push(ret, rb_str_new2(exts[i]));
+    free(exts[i]);
+  }
+  free(exts);
+
+  return ret;
+}
+
+/*
+ * Set the analyzer thread priority for this TunePimp::TunePimp object.
+ *
+ * Valid values are as follows:
+ *   TunePimp::ThreadPriority::Idle
+ *   TunePimp::ThreadPriority::Lowest
+ *   TunePimp::ThreadPriority::Low
+ *   TunePimp::ThreadPriority::Normal
+ *   TunePimp::ThreadPriority::High
+ *   TunePimp::ThreadPriority::Higher
+ *   TunePimp::ThreadPriority::TimeCritical
+ *
+ * Example:
+ *   tp.analyzer_priority = TunePimp::ThreadPriority::High
+ *
+ */
+static VALUE tp_tp_set_analyzer_prio(VALUE self, VALUE prio) {
+  tunepimp_t *tp;
+  int p;
+
+  p = NUM2INT(prio);
+  if (p < eIdle || p > eTimeCritical)
+    rb_raise(eException, "Thread Priority out of range");
+
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetAnalyzerPriority(*tp, p);
+  return prio;
+}
+
+/*
+ * Get the analyzer thread priority for this TunePimp::TunePimp object.
+ *
+ * Example:
+ *   if tp.analyzer_priority == TunePimp::ThreadPriority::Normal
+ *     puts "Analyzer Priority is normal"
+ *   end
+ *
+ */
+static VALUE tp_tp_analyzer_prio(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return INT2FIX(tp_GetAnalyzerPriority(*tp));
+}
+
+/*
+ * Bookkeeping for a notification on its way out to Ruby.
+ */
+static void tp_tp_note(tp_pimp_t *pimp, const tp_note_t *note) {
+  switch (note->type) {
+    case tpFileRemoved:
+      tp_tracks_evict(pimp, note->file_id);
+      break;
+    default:
+      break;
+  }
+}
+
+/*
+ * Get the next notification message from the TunePimp::TunePimp
+ * object's message queue.
+ *
+ * Returns an array with the message type and file id, or nil if there
+ * are no pending messages.  Here's a list of possible values for
+ * message type:
+ *   TunePimp::Callback::FileAdded  
+ *   TunePimp::Callback::FileChanged  
+ *   TunePimp::Callback::FileRemoved  
+ *   TunePimp::Callback::WriteTagsComplete  
+ *   TunePimp::Callback::CallbackLast 
+ *
+ * Note: See TunePimp::TunePimp#wait_notifications for a way to get
+ * many messages at once, and to wait for them without polling.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#notification
+ *   TunePimp::TunePimp#get_notification
+ *
+ * Example:
+ *   msg_type, file_id = tp.notification
+ *
+ */
+static VALUE tp_tp_not(VALUE self) {
+  tp_pimp_t *pimp;
+  tp_note_t note;
+  tp_drain_t d;
+  VALUE ret;
+
+  ret = Qnil;
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+
+  d.q = &pimp->queue;
+  d.ring = &pimp->queue.notes;
+  d.max = 1;
+  d.timeout = 0;
+  d.collapse = 0;
+  d.ret = &note;
+  tp_drain_blocking(&d);
+
+  if (d.num) {
+    tp_tp_note(pimp, &note);
+    if (note.type == tpFileRemoved)
+      tp_tp_account(pimp);
+    ret = rb_ary_new();
+    rb_ary_push(ret, INT2FIX(note.type));
+    rb_ary_push(ret, INT2FIX(note.file_id));
+  }
+
+  return ret;
+}
+
+/*
+ * Get the next status message in the TunePimp::TunePimp status queue.
+ *
+ * Returns nil if there is no pending status message.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#status
+ *   TunePimp::TunePimp#get_status
+ * 
+ * Example:
+ *   puts 'Status: ' << tp.status
+ *
+ */
+static VALUE tp_tp_status(VALUE self) {
+  tp_pimp_t *pimp;
+  tp_drain_t d;
+  char *stat;
+  VALUE ret;
+
+  ret = Qnil;
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+
+  d.q = &pimp->queue;
+  d.ring = &pimp->queue.stats;
+  d.max = 1;
+  d.timeout = 0;
+  d.collapse = 0;
+  d.ret = &stat;
+  tp_drain_blocking(&d);
+
+  if (d.num) {
+    ret = rb_str_new2(stat);
+    free(stat);
+  }
+  
+  return ret;
+}
+
+/*
+ * Look up an option in an (optional) options hash.
+ */
+static VALUE tp_opt(VALUE opts, const char *key) {
+  if (NIL_P(opts))
+    return Qnil;
+  Check_Type(opts, T_HASH);
+  return rb_hash_aref(opts, ID2SYM(rb_intern(key)));
+}
+
+/*
+ * Fill in a tp_drain_t from the options hash passed to
+ * wait_notifications and wait_status.
+ */
+static void tp_drain_opts(tp_drain_t *d, VALUE opts) {
+  VALUE v;
+
+  v = tp_opt(opts, "max");
+  d->max = NIL_P(v) ? 256 : NUM2LONG(v);
+  if (d->max < 1)
+    rb_raise(rb_eArgError, "max must be positive");
+  if (d->max > TP_DRAIN_MAX)
+    d->max = TP_DRAIN_MAX;
+
+  v = tp_opt(opts, "timeout");
+  d->timeout = NIL_P(v) ? -1 : NUM2DBL(v);
+  if (d->timeout < 0)
+    d->timeout = -1;
+
+  v = tp_opt(opts, "collapse");
+  d->collapse = RTEST(v);
+}
+
+/*
+ * Wait for notification messages and return up to max of them at once.
+ *
+ * Other Ruby threads keep running while this method waits.  Returns a
+ * flat array of message type and file id pairs (see
+ * TunePimp::TunePimp#notification for the message types), or an empty
+ * array if the timeout expired first.
+ *
+ * Options:
+ *   :max      - maximum number of messages to return (default: 256,
+ *               at most 65536).
+ *   :timeout  - seconds to wait for the first message.  nil (the
+ *               default) waits forever, 0 never waits.
+ *   :collapse - only return the first TunePimp::Callback::FileChanged
+ *               message for each file id (default: false).
+ *
+ * Example:
+ *   tp.wait_notifications(:max => 100, :timeout => 1.0).each_slice(2) do |type, id|
+ *     puts "#{id} changed" if type == TunePimp::Callback::FileChanged
+ *   end
+ *
+ */
+static VALUE tp_tp_wait_nots(int argc, VALUE *argv, VALUE self) {
+  tp_pimp_t *pimp;
+  tp_note_t *notes;
+  tp_drain_t d;
+  long i;
+  VALUE opts, buf, ret;
+
+  rb_scan_args(argc, argv, "01", &opts);
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+
+  d.q = &pimp->queue;
+  d.ring = &pimp->queue.notes;
+  tp_drain_opts(&d, opts);
+
+  buf = rb_str_buf_new(sizeof(tp_note_t) * d.max);
+  d.ret = notes = (tp_note_t*) RSTRING_PTR(buf);
+  tp_drain_blocking(&d);
+
+  ret = rb_ary_new2(d.num * 2);
+  for (i = 0; i < d.num; i++) {
+    tp_tp_note(pimp, notes + i);
+    rb_ary_push(ret, INT2FIX(notes[i].type));
+    rb_ary_push(ret, INT2FIX(notes[i].file_id));
+  }
+  RB_GC_GUARD(buf);
+  tp_tp_account(pimp);
+
+  return ret;
+}
+
+/*
+ * Wait for status messages and return up to max of them at once.
+ *
+ * Other Ruby threads keep running while this method waits.  Returns an
+ * array of status strings, or an empty array if the timeout expired
+ * first.  Accepts the same :max and :timeout options as
+ * TunePimp::TunePimp#wait_notifications.
+ *
+ * Example:
+ *   tp.wait_status(:timeout => 5).each { |msg| puts 'Status: ' << msg }
+ *
+ */
+static VALUE tp_tp_wait_status(int argc, VALUE *argv, VALUE self) {
+  tp_pimp_t *pimp;
+  tp_drain_t d;
+  char **stats;
+  long i;
+  VALUE opts, buf, ret;
+
+  rb_scan_args(argc, argv, "01", &opts);
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+
+  d.q = &pimp->queue;
+  d.ring = &pimp->queue.stats;
+  tp_drain_opts(&d, opts);
+  d.collapse = 0;
+
+  buf = rb_str_buf_new(sizeof(char*) * d.max);
+  d.ret = stats = (char**) RSTRING_PTR(buf);
+  tp_drain_blocking(&d);
+
+  /* 
+   * turn everything into ruby strings before freeing, so nothing
+   * leaks if we run out of memory halfway through
+   */
+  ret = rb_ary_new2(d.num);
+  for (i = 0; i < d.num; i++)
+    rb_ary_push(ret, rb_str_new2(stats[i]));
+  for (i = 0; i < d.num; i++)
+    free(stats[i]);
+  RB_GC_GUARD(buf);
+
+  return ret;
+}
+
+/*
+ * Get an IO that becomes readable whenever there are pending
+ * notification or status messages, for use with IO.select.  Don't read
+ * from or close it; use TunePimp::TunePimp#wait_notifications and
+ * TunePimp::TunePimp#wait_status to get the messages.
+ *
+ * Example:
+ *   if IO.select([tp.notification_io, sock], nil, nil, 10)
+ *     msgs = tp.wait_notifications(:timeout => 0)
+ *   end
+ *
+ */
+static VALUE tp_tp_not_io(VALUE self) {
+  tp_pimp_t *pimp;
+  VALUE io;
+
+  if (!NIL_P(io = rb_iv_get(self, "@notification_io")))
+    return io;
+
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  io = rb_funcall(rb_cIO, rb_intern("for_fd"), 1, INT2FIX(pimp->queue.fds[0]));
+  if (rb_respond_to(io, rb_intern("autoclose=")))
+    rb_funcall(io, rb_intern("autoclose="), 1, Qfalse);
+  rb_iv_set(self, "@notification_io", io);
+
+  return io;
+}
+
+/*
+ * Get the last error from this TunePimp::TunePimp object.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#error
+ *   TunePimp::TunePimp#get_error
+ * 
+ * Example:
+ *   puts 'Error: ' << tp.error
+ *
+ */
+static VALUE tp_tp_error(VALUE self) {
+  tunepimp_t *tp;
+  char err[1024];
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_GetError(*tp, err, 1024);
+  return rb_str_new2(err);
+}
+
+/*
+ * Send debugging information for this TunePimp::TunePimp object to
+ * stdout?
+ *
+ * Example:
+ *   tp.debug = true # enable debugging
+ *
+ */
+static VALUE tp_tp_set_debug(VALUE self, VALUE debug) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetDebug(*tp, !(debug == Qfalse || debug == Qnil));
+  return debug;
+}
+
+/*
+ * Is debugging enabled for this TunePimp::TunePimp object?
+ *
+ * Example:
+ *   puts 'Debugging is ' << tp.debug ? 'enabled' : 'disabled'
+ *
+ */
+static VALUE tp_tp_debug(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return tp_GetDebug(*tp) ? Qtrue : Qfalse;
+}
+
+/*
+ * Add a file to this TunePimp::TunePimp object's file list.
+ *
+ * Returns the ID of the file added.  Note that this method always
+ * succeeds, even if the file doesn't exist or is inaccessible (although
+ * in those cases, there will be an error in TunePimp::TunePimp#error).
+ *
+ * Example:
+ *   id = tp.add_file('test.mp3')
+ *
+ */
+static VALUE tp_tp_add_file(VALUE self, VALUE path) {
+  tp_pimp_t *pimp;
+  tp_call_t call;
+
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  call.tp = pimp->tp;
+  call.undo = NULL;
+  call.index = NULL;
+  call.trmc = pimp->trmc;
+  call.pending = &pimp->pending;
+  call.path = tp_strdup(path);
+  tp_call_blocking(tp_call_add_file, &call);
+  free(call.path);
+  tp_tp_account(pimp);
+
+  return INT2FIX(call.ret);
+}
+
+/*
+ * Add a directory to this TunePimp::TunePimp object's file list.
+ *
+ * Returns the number of the files added.  If a file already exists in
+ * the list, it is ignored.
+ *
+ * Note: Other Ruby threads keep running while the directory is
+ * scanned.
+ *
+ * Example:
+ *   num = tp.add_dir('My Music')
+ *   puts "Added #{num} files."
+ *
+ */
+static VALUE tp_tp_add_dir(VALUE self, VALUE path) {
+  tp_pimp_t *pimp;
+  tp_call_t call;
+
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  call.tp = pimp->tp;
+  call.undo = NULL;
+  call.path = tp_strdup(path);
+  tp_call_blocking(tp_call_add_dir, &call);
+  free(call.path);
+  tp_tp_account(pimp);
+
+  return INT2FIX(call.ret);
+}
+
+/*
+ * Get the rescan index and mode from the :index and :unchanged
+ * options of add_files and add_tree.
+ */
+static tp_index_t *tp_idx_opts(VALUE opts, int *restore) {
+  tp_index_t *idx;
+  const char *mode;
+  VALUE val;
+
+  *restore = 0;
+  if (NIL_P(val = tp_opt(opts, "index")))
+    return NULL;
+
+  TypedData_Get_Struct(val, tp_index_t, &tp_idx_type, idx);
+  if (!idx->hdr)
+    rb_raise(eException, "Index has been closed");
+
+  if (!NIL_P(val = tp_opt(opts, "unchanged"))) {
+    mode = rb_id2name(rb_to_id(val));
+    if (!strcmp(mode, "restore"))
+      *restore = 1;
+    else if (strcmp(mode, "skip"))
+      rb_raise(rb_eArgError, "unchanged must be :skip or :restore");
+  }
+
+  return idx;
+}
+
+/*
+ * Add a list of files to this TunePimp::TunePimp object's file list.
+ *
+ * Equivalent to calling TunePimp::TunePimp#add_file for each path,
+ * but the paths are copied once and added in a single native call.
+ * Returns an array of the new file ids, in the same order as paths.
+ *
+ * Options:
+ *   :index      a TunePimp::Index to check each file against.
+ *   :unchanged  what to do with files the index says haven't changed:
+ *               :skip (the default) leaves them out, with nil in
+ *               place of their id; :restore adds them and puts them
+ *               straight back into their recorded state.
+ *
+ * Note: Other Ruby threads keep running while the files are added.
+ * If the call is interrupted, files added so far stay in the list.
+ *
+ * Example:
+ *   ids = tp.add_files(changed_paths)
+ *   puts "Added #{ids.size} files."
+ *
+ */
+static VALUE tp_tp_add_files(int argc, VALUE *argv, VALUE self) {
+  tp_pimp_t *pimp;
+  tp_call_t call;
+  long i, len, num;
+  char *arena;
+  VALUE paths, opts, path, strs, names, ids, ret;
+
+  rb_scan_args(argc, argv, "11", &paths, &opts);
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  call.index = tp_idx_opts(opts, &call.restore);
+  paths = rb_Array(paths);
+  if (RARRAY_LEN(paths) > INT_MAX)
+    rb_raise(rb_eArgError, "too many paths (%ld)", RARRAY_LEN(paths));
+
+  /* 
+   * copy everything into buffers owned by the GC, so nothing leaks
+   * if a path turns out not to be a string
+   */
+  strs = rb_ary_new2(RARRAY_LEN(paths));
+  for (i = len = 0; i < RARRAY_LEN(paths); i++) {
+    path = RARRAY_PTR(paths)[i];
+    /* an embedded NUL would throw off the walk through the arena */
+    StringValueCStr(path);
+    rb_ary_push(strs, path);
+    len += RSTRING_LEN(path) + 1;
+  }
+  num = RARRAY_LEN(strs);
+  names = rb_str_buf_new(len ? len : 1);
+  ids = rb_str_buf_new(sizeof(int) * (num ? num : 1));
+
+  arena = RSTRING_PTR(names);
+  for (i = 0; i < num; i++) {
+    path = RARRAY_PTR(strs)[i];
+    memcpy(arena, RSTRING_PTR(path), RSTRING_LEN(path));
+    arena += RSTRING_LEN(path);
+    *(arena++) = '\0';
+  }
+
+  call.tp = pimp->tp;
+  call.undo = NULL;
+  call.trmc = pimp->trmc;
+  call.pending = &pimp->pending;
+  call.path = RSTRING_PTR(names);
+  call.ids = (int*) RSTRING_PTR(ids);
+  call.num_ids = i;
+  tp_call_blocking(tp_call_add_files, &call);
+  tp_tp_account(pimp);
+
+  ret = rb_ary_new2(call.ret);
+  for (i = 0; i < call.ret; i++)
+    rb_ary_push(ret, call.ids[i] < 0 ? Qnil : INT2FIX(call.ids[i]));
+  RB_GC_GUARD(opts);
+  RB_GC_GUARD(strs);
+  RB_GC_GUARD(names);
+  RB_GC_GUARD(ids);
+
+  return ret;
+}
+
+/*
+ * Add every supported file under a directory tree to this
+ * TunePimp::TunePimp object's file list, scanning directories in
+ * parallel.
+ *
+ * Files are filtered by TunePimp::TunePimp#supported_extensions (case
+ * insensitively) and added in small batches as they're found, so
+ * analysis starts right away instead of after the whole tree has been
+ * scanned.  Returns the number of files added.
+ *
+ * Options:
+ *   :threads          number of walker threads (default 4).  More
+ *                     threads help most on network file systems.
+ *   :follow_symlinks  descend into symlinked directories and add
+ *                     symlinked files (default false).  Each directory
+ *                     is only scanned once, so loops are harmless.
+ *   :index            a TunePimp::Index to check each file against.
+ *   :unchanged        :skip (the default) or :restore; see
+ *                     TunePimp::TunePimp#add_files.  Skipped files
+ *                     aren't counted.
+ *
+ * Note: Other Ruby threads keep running while the tree is scanned.
+ * If the call is interrupted, files added so far stay in the list.
+ *
+ * Example:
+ *   num = tp.add_tree('/mnt/music', :threads => 16)
+ *   puts "Added #{num} files."
+ *
+ */
+static VALUE tp_tp_add_tree(int argc, VALUE *argv, VALUE self) {
+  tp_pimp_t *pimp;
+  tp_walk_t walk;
+  VALUE path, opts, threads, ret;
+
+  rb_scan_args(argc, argv, "11", &path, &opts);
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+
+  memset(&walk, 0, sizeof(walk));
+  walk.threads = TP_WALK_THREADS;
+  if (!NIL_P(threads = tp_opt(opts, "threads")))
+    walk.threads = NUM2INT(threads);
+  if (walk.threads < 1 || walk.threads > 256)
+    rb_raise(rb_eArgError, "threads must be between 1 and 256");
+  walk.follow = RTEST(tp_opt(opts, "follow_symlinks"));
+  walk.call.index = tp_idx_opts(opts, &walk.call.restore);
+  walk.call.tp = pimp->tp;
+  walk.call.trmc = pimp->trmc;
+  walk.call.pending = &pimp->pending;
+  walk.call.path = tp_strdup(path);
+
+  ret = rb_ensure(tp_walk_run, (VALUE) &walk, tp_walk_free, (VALUE) &walk);
+  tp_tp_account(pimp);
+  RB_GC_GUARD(opts);
+
+  return ret;
+}
+
+/*
+ * Use a TunePimp::TRMCache when adding files to this
+ * TunePimp::TunePimp object, or stop using one if cache is nil.
+ *
+ * Files added with TunePimp::TunePimp#add_file, #add_files or
+ * #add_tree are looked up by the hash of their audio payload; on a hit
+ * the cached TRM is used and the file goes straight to the TRM lookup
+ * stage without being fingerprinted.  On a miss, the TRM is stored
+ * once the analyzer has worked it out, by a native thread watching
+ * FileChanged notifications as libtunepimp sends them (so it doesn't
+ * matter whether they're read from Ruby).
+ *
+ * Note: files added with TunePimp::TunePimp#add_dir bypass the cache.
+ *
+ * Example:
+ *   tp.trm_cache = TunePimp::TRMCache.new('/var/cache/trm.cache')
+ *
+ */
+static VALUE tp_tp_set_trm_cache(VALUE self, VALUE cache) {
+  tp_pimp_t *pimp;
+  tp_trmc_t *c = NULL;
+
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  if (!NIL_P(cache))
+    TypedData_Get_Struct(cache, tp_trmc_t, &tp_trmc_type, c);
+
+  if (!tp_pending_set_cache(&pimp->pending, pimp->tp, c))
+    rb_raise(eException, "Couldn't start TRM cache thread");
+  rb_iv_set(self, "@trm_cache", cache);
+
+  /* referenced, since our threads may outlive the cache object */
+  if (c)
+    tp_trmc_ref(c);
+  if (pimp->trmc)
+    tp_trmc_unref(pimp->trmc);
+  pimp->trmc = c;
+
+  return cache;
+}
+
+/*
+ * Get the TunePimp::TRMCache used by this TunePimp::TunePimp object,
+ * or nil if there isn't one.
+ *
+ * Example:
+ *   puts "TRM cache hits: #{tp.trm_cache.hits}" if tp.trm_cache
+ *
+ */
+static VALUE tp_tp_trm_cache(VALUE self) {
+  return rb_iv_get(self, "@trm_cache");
+}
+
+/*
+ * Remove a file from this TunePimp::TunePimp object's file list.
+ *
+ * Example:
+ *   id = tp.add_file('test.mp3')
+ *   tp.remove(id)
+ *
+ */
+static VALUE tp_tp_remove(VALUE self, VALUE file_id) {
+  tp_pimp_t *pimp;
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  tp_Remove(pimp->tp, NUM2INT(file_id));
+  tp_tracks_evict(pimp, NUM2INT(file_id));
+  tp_pending_take(&pimp->pending, NUM2INT(file_id), NULL);
+  tp_tp_account(pimp);
+  return Qnil;
+}
+
+/*
+ * Get the number of files in this TunePimp::TunePimp object's file list.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#num_files
+ *   TunePimp::TunePimp#get_num_files
+ *
+ * Example:
+ *   puts "There are #{tp.num_files} files."
+ *
+ */
+static VALUE tp_tp_num_files(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return INT2FIX(tp_GetNumFiles(*tp));
+}
+
+/*
+ * Get the number of TRMs in this TunePimp::TunePimp object's that
+ * haven't been submitted to the server yet.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#num_unsubmitted
+ *   TunePimp::TunePimp#get_num_unsubmitted
+ *
+ * Example:
+ *   puts "There are #{tp.num_unsubmitted} unsubmitted TRMs."
+ *
+ */
+static VALUE tp_tp_num_unsub(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return INT2FIX(tp_GetNumUnsubmitted(*tp));
+}
+
+/*
+ * Get the number of unsaved items in this TunePimp::TunePimp object.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#num_unsaved_items
+ *   TunePimp::TunePimp#get_num_unsaved_items
+ *
+ * Example:
+ *   puts "There are #{tp.num_unsaved_items} unsaved items."
+ *
+ */
+static VALUE tp_tp_num_unsaved_items(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return INT2FIX(tp_GetNumUnsavedItems(*tp));
+}
+
+/*
+ * Get the number of tracks in each status category in this
+ * TunePimp::TunePimp object.
+ *
+ * Returns an array that can be indexed via TunePimp::Status.  Here's a
+ * brief description of each TunePimp::Status type:
+ *
+ *   * TunePimp::Status::Unrecognized: TunePimp was not able to match
+ *     this track.
+ *   * TunePimp::Status::Recognized: Tunepimp recognized this track.
+ *   * TunePimp::Status::Pending: This track is waiting for TunePimp to
+ *     process it.
+ *   * TunePimp::Status::TRMLookup: TunePimp is performing a TRM lookup
+ *     on this track.
+ *   * TunePimp::Status::TRMCollision: TunePimp has detected a TRM
+ *     collision for this track. The user must select which of the
+ *     matching TRMs to use to finish the recognition process.
+ *   * TunePimp::Status::FileLookup: TunePimp is doing a metadata lookup
+ *     on this file.
+ *   * TunePimp::Status::UserSelection: The MB server has returned more
+ *     than one possible match for the track. The user must select a
+ *     match to continue the lookup process.
+ *   * TunePimp::Status::Verified: The user has verified the matched
+ *     track and TunePimp is getting ready to save the changes to disk.
+ *   * TunePimp::Status::Deleted: This track has been deleted from
+ *     TunePimp, but its reference count has not reached zero yet.
+ *   * TunePimp::Status::Error: An error occured during the lookup of
+ *     this track. 
+ *
+ * Example:
+ *   num = tp.track_counts(TunePimp::Status::Recognized)
+ *   puts "There are #{num} recognized tracks."
+ *
+ */
+static VALUE tp_tp_track_counts(VALUE self) {
+  tunepimp_t *tp;
+  int i, counts[eLastStatus];
+  VALUE ret;
+
+  ret = Qnil;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  if (tp_GetTrackCounts(*tp, counts, eLastStatus)) {
+    ret = rb_ary_new();
+    for (i = 0; i < eLastStatus; i++)
+      rb_ary_push(ret, INT2FIX(counts[i]));
+  }
+
+  return ret;
+}
+
+/* files leaving rates are averaged over this many seconds */
+#define TP_MX_RATE_WINDOW 10
+
+/*
+ * Turn metrics collection on or off.  While it's on, every status
+ * change of every file is timestamped (in a thread of its own, so the
+ * cost to libtunepimp is queueing the notification twice), and
+ * TunePimp::TunePimp#metrics and TunePimp::TunePimp#metrics_text
+ * report on them.  Turning it off throws away what was collected.
+ *
+ * Example:
+ *   tp.metrics_enabled = true
+ *
+ */
+static VALUE tp_tp_set_metrics_enabled(VALUE self, VALUE enabled) {
+  tp_pimp_t *pimp;
+  tp_mx_t *mx;
+
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  if (RTEST(enabled) && !pimp->queue.mx) {
+    if ((mx = tp_mx_start(pimp, pimp->tp)) == NULL)
+      rb_raise(eException, "Couldn't start metrics thread");
+    pthread_mutex_lock(&pimp->queue.mutex);
+    pimp->queue.mx = mx;
+    pthread_mutex_unlock(&pimp->queue.mutex);
+  } else if (!RTEST(enabled) && pimp->queue.mx) {
+    pthread_mutex_lock(&pimp->queue.mutex);
+    mx = pimp->queue.mx;
+    pimp->queue.mx = NULL;
+    pthread_mutex_unlock(&pimp->queue.mutex);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(tp_mx_stop, mx, NULL, NULL);
+#else
+    tp_mx_stop(mx);
+#endif
+  }
+
+  return enabled;
+}
+
+/*
+ * Is metrics collection on?
+ *
+ * Example:
+ *   p tp.metrics if tp.metrics_enabled
+ *
+ */
+static VALUE tp_tp_metrics_enabled(VALUE self) {
+  tp_pimp_t *pimp;
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  return pimp->queue.mx ? Qtrue : Qfalse;
+}
+
+/* 
+ * A consistent copy of the metrics (with rates worked out), taken
+ * with the GVL held.  Returns 0 if metrics are off.
+ */
+typedef struct {
+  tp_mx_stats_t st;
+  double uptime, rates[eLastStatus];
+  long files, backlog, events;
+  int depth[eLastStatus], have_depth;
+} tp_mx_snap_t;
+
+static int tp_mx_snapshot(tp_pimp_t *pimp, tp_mx_snap_t *snap) {
+  tp_mx_t *mx = pimp->queue.mx;
+  double now = tp_now();
+  long sec = (long) now;
+  int i, j;
+
+  if (!mx)
+    return 0;
+
+  pthread_mutex_lock(&mx->lock);
+  snap->st = mx->st;
+  snap->files = mx->live;
+  snap->backlog = mx->events.len;
+  pthread_mutex_unlock(&mx->lock);
+
+  pthread_mutex_lock(&pimp->queue.mutex);
+  snap->events = pimp->queue.notes.len;
+  pthread_mutex_unlock(&pimp->queue.mutex);
+
+  snap->uptime = now - mx->started;
+  for (i = 0; i < eLastStatus; i++) {
+    snap->rates[i] = 0;
+    for (j = 0; j < TP_MX_SECONDS; j++)
+      if (snap->st.stamps[i][j] > sec - TP_MX_RATE_WINDOW && snap->st.stamps[i][j] <= sec)
+        snap->rates[i] += snap->st.secs[i][j];
+    snap->rates[i] /= TP_MX_RATE_WINDOW;
+  }
+  snap->have_depth = tp_GetTrackCounts(pimp->tp, snap->depth, eLastStatus);
+
+  return 1;
+}
+
+static VALUE tp_mx_hist_value(const tp_mx_hist_t *h) {
+  VALUE ret = rb_hash_new(), buckets = rb_hash_new();
+  unsigned long sum = 0;
+  int i;
+
+  for (i = 0; i < TP_MX_BUCKETS; i++) {
+    sum += h->buckets[i];
+    rb_hash_aset(buckets, rb_float_new(i < TP_MX_BUCKETS - 1 ? tp_mx_bounds[i] : HUGE_VAL), ULONG2NUM(sum));
+  }
+  rb_hash_aset(ret, ID2SYM(rb_intern("count")), ULONG2NUM(h->count));
+  rb_hash_aset(ret, ID2SYM(rb_intern("sum")), rb_float_new(h->sum));
+  rb_hash_aset(ret, ID2SYM(rb_intern("buckets")), buckets);
+
+  return ret;
+}
+
+/*
+ * Get pipeline metrics, or nil if they're off (see
+ * TunePimp::TunePimp#metrics_enabled=).  Returns a hash with:
+ *
+ *   :uptime     seconds since metrics were turned on.
+ *   :files      files being tracked.
+ *   :depth      files in each status right now.
+ *   :completed  files that have left each status.
+ *   :rate       files leaving each status per second, over the last
+ *               10 seconds.
+ *   :latency    time spent in each status: a hash with :count, :sum
+ *               (in seconds) and :buckets (upper bound => cumulative
+ *               count, ending with Infinity), plus :total, from a file
+ *               being seen to its tags being written.
+ *   :events     notifications waiting to be drained.
+ *   :backlog    notifications the metrics thread hasn't looked at yet.
+ *
+ * Statuses are keyed by symbol: :pending, :trm_lookup, :file_lookup,
+ * :recognized and so on.  So the :rate of :pending is analysis
+ * throughput, and the :latency of :recognized is how long files wait
+ * to be written.
+ *
+ * Example:
+ *   m = tp.metrics
+ *   puts "analyzing #{m[:rate][:pending]} files/s, #{m[:depth][:pending]} waiting"
+ *
+ */
+static VALUE tp_tp_metrics(VALUE self) {
+  tp_pimp_t *pimp;
+  tp_mx_snap_t snap;
+  VALUE ret, depth, done, rate, lat, key;
+  int i;
+
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  if (!tp_mx_snapshot(pimp, &snap))
+    return Qnil;
+
+  depth = rb_hash_new();
+  done = rb_hash_new();
+  rate = rb_hash_new();
+  lat = rb_hash_new();
+  for (i = 0; i < eLastStatus; i++) {
+    key = ID2SYM(rb_intern(tp_status_names[i]));
+    rb_hash_aset(depth, key, snap.have_depth ? INT2FIX(snap.depth[i]) : Qnil);
+    rb_hash_aset(done, key, ULONG2NUM(snap.st.done[i]));
+    rb_hash_aset(rate, key, rb_float_new(snap.rates[i]));
+    rb_hash_aset(lat, key, tp_mx_hist_value(snap.st.stages + i));
+  }
+  rb_hash_aset(lat, ID2SYM(rb_intern("total")), tp_mx_hist_value(&snap.st.total));
+
+  ret = rb_hash_new();
+  rb_hash_aset(ret, ID2SYM(rb_intern("uptime")), rb_float_new(snap.uptime));
+  rb_hash_aset(ret, ID2SYM(rb_intern("files")), LONG2NUM(snap.files));
+  rb_hash_aset(ret, ID2SYM(rb_intern("depth")), depth);
+  rb_hash_aset(ret, ID2SYM(rb_intern("completed")), done);
+  rb_hash_aset(ret, ID2SYM(rb_intern("rate")), rate);
+  rb_hash_aset(ret, ID2SYM(rb_intern("latency")), lat);
+  rb_hash_aset(ret, ID2SYM(rb_intern("events")), LONG2NUM(snap.events));
+  rb_hash_aset(ret, ID2SYM(rb_intern("backlog")), LONG2NUM(snap.backlog));
+
+  return ret;
+}
+
+static void tp_mx_cat(VALUE str, const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  rb_str_vcatf(str, fmt, ap);
+  va_end(ap);
+}
+
+/* 
+ * Is str a valid metric (colons allowed) or label name, as in
+ * [a-zA-Z_:][a-zA-Z0-9_:]*?
+ */
+static int tp_mx_name_ok(const char *str, long len, int colons) {
+  long i;
+
+  if (len < 1)
+    return 0;
+  for (i = 0; i < len; i++)
+    if (!(isalpha((unsigned char) str[i]) || str[i] == '_' || (colons && str[i] == ':') ||
+          (i && isdigit((unsigned char) str[i]))))
+      return 0;
+
+  return 1;
+}
+
+/* HELP and TYPE lines; OpenMetrics names counters without _total */
+static void tp_mx_head(VALUE str, const char *prefix, const char *name, const char *type, const char *help, int om) {
+  size_t len = strlen(name);
+
+  if (om && !strcmp(type, "counter") && len > 6 && !strcmp(name + len - 6, "_total"))
+    len -= 6;
+  tp_mx_cat(str, "# HELP %s_%.*s %s\n# TYPE %s_%.*s %s\n", prefix, (int) len, name, help, prefix, (int) len, name, type);
+}
+
+/* 
+ * labels (each followed by a comma) as a label set, or nothing if
+ * there are none
+ */
+static const char *tp_mx_braces(char *buf, size_t size, const char *labels) {
+  size_t len = strlen(labels);
+
+  if (!len)
+    return "";
+  snprintf(buf, size, "{%.*s}", (int) len - 1, labels);
+  return buf;
+}
+
+static void tp_mx_hist_text(VALUE str, const char *prefix, const char *name, const char *labels, const tp_mx_hist_t *h) {
+  unsigned long sum = 0;
+  char buf[512];
+  int i;
+
+  for (i = 0; i < TP_MX_BUCKETS - 1; i++) {
+    sum += h->buckets[i];
+    tp_mx_cat(str, "%s_%s_bucket{%sle=\"%g\"} %lu\n", prefix, name, labels, tp_mx_bounds[i], sum);
+  }
+  tp_mx_cat(str, "%s_%s_bucket{%sle=\"+Inf\"} %lu\n", prefix, name, labels, h->count);
+  tp_mx_cat(str, "%s_%s_sum%s %.9g\n", prefix, name, tp_mx_braces(buf, sizeof(buf), labels), h->sum);
+  tp_mx_cat(str, "%s_%s_count%s %lu\n", prefix, name, tp_mx_braces(buf, sizeof(buf), labels), h->count);
+}
+
+/* 
+ * Render the extra labels hash as 'k="v",' pairs, escaped as the
+ * exposition format wants.
+ */
+static int tp_mx_label_i(VALUE key, VALUE val, VALUE str) {
+  const char *p;
+  long i, len;
+
+  key = rb_obj_as_string(key);
+  val = rb_obj_as_string(val);
+  if (!tp_mx_name_ok(RSTRING_PTR(key), RSTRING_LEN(key), 0))
+    rb_raise(rb_eArgError, "invalid label name \"%s\"", StringValueCStr(key));
+  rb_str_cat(str, RSTRING_PTR(key), RSTRING_LEN(key));
+  rb_str_cat(str, "=\"", 2);
+  p = RSTRING_PTR(val);
+  len = RSTRING_LEN(val);
+  for (i = 0; i < len; i++) {
+    if (p[i] == '\\' || p[i] == '"')
+      rb_str_cat(str, "\\", 1);
+    if (p[i] == '\n')
+      rb_str_cat(str, "\\n", 2);
+    else
+      rb_str_cat(str, p + i, 1);
+  }
+  rb_str_cat(str, "\",", 2);
+
+  return ST_CONTINUE;
+}
+
+/*
+ * Get pipeline metrics (see TunePimp::TunePimp#metrics) in the
+ * Prometheus text exposition format, ready to serve from a /metrics
+ * endpoint.  Returns nil if metrics are off.
+ *
+ * Options:
+ *   :prefix       metric name prefix (default "tunepimp"); must be
+ *                 a valid metric name.
+ *   :labels       hash of labels added to every sample, to tell
+ *                 instances apart.  Keys must be valid label names
+ *                 ([a-zA-Z_][a-zA-Z0-9_]*).
+ *   :openmetrics  render OpenMetrics text instead (counter names in
+ *                 TYPE lines drop _total, and there's a closing
+ *                 "# EOF").
+ *
+ * Example:
+ *   pool.each_with_index do |tp, i|
+ *     out << tp.metrics_text(:labels => { :instance => i })
+ *   end
+ *
+ */
+static VALUE tp_tp_metrics_text(int argc, VALUE *argv, VALUE self) {
+  tp_pimp_t *pimp;
+  tp_mx_snap_t snap;
+  VALUE opts, val, prefix_str, extra, ret;
+  const char *prefix = "tunepimp", *labels;
+  char lbuf[512];
+  int i, om;
+
+  rb_scan_args(argc, argv, "01", &opts);
+  prefix_str = tp_opt(opts, "prefix");
+  if (!NIL_P(prefix_str)) {
+    prefix = StringValueCStr(prefix_str);
+    if (!tp_mx_name_ok(prefix, RSTRING_LEN(prefix_str), 1))
+      rb_raise(rb_eArgError, "invalid metric name prefix \"%s\"", prefix);
+  }
+  om = RTEST(tp_opt(opts, "openmetrics"));
+  extra = rb_str_new2("");
+  if (!NIL_P(val = tp_opt(opts, "labels"))) {
+    Check_Type(val, T_HASH);
+    rb_hash_foreach(val, tp_mx_label_i, extra);
+  }
+  if (RSTRING_LEN(extra) > 400)
+    rb_raise(rb_eArgError, "labels are too long");
+  labels = StringValueCStr(extra);
+
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  if (!tp_mx_snapshot(pimp, &snap))
+    return Qnil;
+
+  ret = rb_str_new2("");
+  if (snap.have_depth) {
+    tp_mx_head(ret, prefix, "files", "gauge", "Files in each status.", om);
+    for (i = 0; i < eLastStatus; i++)
+      tp_mx_cat(ret, "%s_files{%sstatus=\"%s\"} %d\n", prefix, labels, tp_status_names[i], snap.depth[i]);
+  }
+
+  tp_mx_head(ret, prefix, "stage_completed_total", "counter", "Files that have left each status.", om);
+  for (i = 0; i < eLastStatus; i++)
+    tp_mx_cat(ret, "%s_stage_completed_total{%sstatus=\"%s\"} %lu\n", prefix, labels, tp_status_names[i], snap.st.done[i]);
+
+  tp_mx_head(ret, prefix, "stage_rate", "gauge", "Files leaving each status per second, over the last 10 seconds.", om);
+  for (i = 0; i < eLastStatus; i++)
+    tp_mx_cat(ret, "%s_stage_rate{%sstatus=\"%s\"} %.9g\n", prefix, labels, tp_status_names[i], snap.rates[i]);
+
+  tp_mx_head(ret, prefix, "stage_seconds", "histogram", "Time spent in each status.", om);
+  for (i = 0; i < eLastStatus; i++) {
+    snprintf(lbuf, sizeof(lbuf), "%sstatus=\"%s\",", labels, tp_status_names[i]);
+    tp_mx_hist_text(ret, prefix, "stage_seconds", lbuf, snap.st.stages + i);
+  }
+
+  tp_mx_head(ret, prefix, "file_seconds", "histogram", "Time from a file being seen to its tags being written.", om);
+  tp_mx_hist_text(ret, prefix, "file_seconds", labels, &snap.st.total);
+
+  tp_mx_head(ret, prefix, "notifications", "gauge", "Notifications waiting to be drained.", om);
+  tp_mx_cat(ret, "%s_notifications%s %ld\n", prefix, tp_mx_braces(lbuf, sizeof(lbuf), labels), snap.events);
+  tp_mx_head(ret, prefix, "metrics_backlog", "gauge", "Notifications the metrics thread has yet to look at.", om);
+  tp_mx_cat(ret, "%s_metrics_backlog%s %ld\n", prefix, tp_mx_braces(lbuf, sizeof(lbuf), labels), snap.backlog);
+
+  if (om)
+    rb_str_cat(ret, "# EOF\n", 6);
+  RB_GC_GUARD(extra);
+  RB_GC_GUARD(prefix_str);
+
+  return ret;
+}
+
+/*
+ * Get the status changes recorded for a file (see
+ * TunePimp::TunePimp#metrics_enabled=), oldest first, as an array of
+ * [status, time] pairs; only the last 8 are kept.  Returns nil if
+ * metrics are off or the file isn't known.
+ *
+ * Example:
+ *   tp.transitions(id).each { |st, t| puts "#{Time.at(t)}: #{st}" }
+ *
+ */
+static VALUE tp_tp_transitions(VALUE self, VALUE file_id) {
+  tp_pimp_t *pimp;
+  tp_mx_t *mx;
+  tp_mx_file_t *f, copy;
+  VALUE ret = Qnil;
+  int i, id = NUM2INT(file_id);
+
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  if ((mx = pimp->queue.mx) == NULL || id < 0)
+    return Qnil;
+
+  copy.n = 0;
+  pthread_mutex_lock(&mx->lock);
+  if (mx->live && (f = tp_mx_find(mx, id, 0))->file_id == id)
+    copy = *f;
+  pthread_mutex_unlock(&mx->lock);
+
+  if (copy.n) {
+    ret = rb_ary_new();
+    for (i = copy.n > TP_MX_HISTORY ? copy.n - TP_MX_HISTORY : 0; i < copy.n; i++)
+      rb_ary_push(ret, rb_assoc_new(INT2FIX(copy.status[i % TP_MX_HISTORY]), rb_float_new(copy.at[i % TP_MX_HISTORY])));
+  }
+
+  return ret;
+}
+
+/*
+ * Return the number of files in this TunePimp::TunePimp object's file
+ * list.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#num_file_ids
+ *   TunePimp::TunePimp#get_num_file_ids
+ *
+ * Example:
+ *   puts "There are #{tp.num_file_ids} files in this list."
+ *
+ */
+static VALUE tp_tp_num_file_ids(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return INT2FIX(tp_GetNumFileIds(*tp));
+}
+
+/* 
+ * Get the file ids in this TunePimp::TunePimp object's file list.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#file_ids
+ *   TunePimp::TunePimp#get_file_ids
+ * 
+ * Example:
+ *   puts "File IDs: #{tp.file_ids.join(',')}"
+ *
+ */
+static VALUE tp_tp_file_ids(VALUE self) {
+  tunepimp_t *tp;
+  int i, *ids, num, size;
+  VALUE ret;
+
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  num = tp_GetNumFileIds(*tp);
+  size = sizeof(int) * num;
+  if ((ids = malloc(size)) == NULL)
+    rb_raise(eException, "Couldn't alloc %d bytes for int*", size);
+  tp_GetFileIds(*tp, ids, num);
+
+  ret = rb_ary_new();
+  for (i = 0; i < num; i++)
+    rb_ary_push(ret, INT2FIX(ids[i]));
+  free(ids);
+
+  return ret;
+}
+
+/*
+ * Get the TunePimp::Track associated with a given file ID.
+ *
+ * Returns nil if the given file ID is invalid.  As long as the
+ * TunePimp::Track object is in use, asking for the same file ID again
+ * returns the same object; its track reference is released
+ * automatically when it's garbage collected (or explicitly, with
+ * TunePimp::TunePimp#release_track).
+ *
+ * Example:
+ *   track = tp.get_track(file_id)
+ *
+ */
+static VALUE tp_tp_track(VALUE self, VALUE file_id) {
+  tp_pimp_t *pimp;
+  tp_track_t *tr;
+  tp_call_t call;
+  VALUE track;
+
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  call.file_id = NUM2INT(file_id);
+  if (!NIL_P(pimp->tracks) &&
+      !NIL_P(track = rb_funcall(pimp->tracks, id_aref, 1, INT2FIX(call.file_id))))
+    return track;
+
+  call.tp = pimp->tp;
+  call.undo = tp_call_release_track;
+  tp_call_blocking(tp_call_get_track, &call);
+  if (!call.tr)
+    return Qnil;
+
+  /* another thread may have got there while we didn't hold the GVL */
+  if (!NIL_P(pimp->tracks) &&
+      !NIL_P(track = rb_funcall(pimp->tracks, id_aref, 1, INT2FIX(call.file_id)))) {
+    tp_call_release_track(&call);
+    return track;
+  }
+
+  if ((tr = malloc(sizeof(tp_track_t))) == NULL) {
+    tp_call_release_track(&call);
+    rb_raise(eException, "Couldn't allocate %d bytes for track_t", (int) sizeof(tp_track_t));
+  }
+
+  tr->tr = call.tr;
+  tr->pimp = pimp;
+  tr->owner = self;
+  tr->file_id = call.file_id;
+  tr->released = tr->users = tr->locks = 0;
+  tp_pimp_ref(pimp);
+  track = TypedData_Wrap_Struct(cTr, &tp_track_type, tr);
+
+  if (!NIL_P(pimp->tracks))
+    rb_funcall(pimp->tracks, id_aset, 2, INT2FIX(call.file_id), track);
+  rb_obj_call_init(track, 0, NULL);
+  
+  return track;
+}
+
+/*
+ * Release TunePimp::Track from TunePimp::TunePimp object.
+ *
+ * This happens automatically when the TunePimp::Track is garbage
+ * collected; calling it explicitly just releases the track reference
+ * sooner.  The TunePimp::Track object can't be used afterwards, by
+ * anything holding it (TunePimp::TunePimp#track hands out a fresh
+ * one).  If another thread is waiting in or holding
+ * TunePimp::Track#lock, the reference is released once it unlocks.
+ *
+ * Example:
+ *   tp.release_track(track)
+ *
+ */
+static VALUE tp_tp_release_track(VALUE self, VALUE track) {
+  tp_pimp_t *pimp;
+  tp_track_t *tr;
+
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  TP_TRACK(track, tr);
+  if (tr->pimp != pimp)
+    rb_raise(eException, "Track belongs to a different TunePimp object");
+
+  tp_tracks_evict(pimp, tr->file_id);
+  tr->released = 1;
+  tp_track_settle(tr);
+
+  return Qnil;
+}
+
+/*
+ * Fields that TunePimp::TunePimp#snapshot can read.
+ */
+static const char *tp_snap_field_names[] = {
+  "status", "filename", "trm", "similarity", "error", "changed",
+  "num_results", NULL
+};
+
+enum {
+  TP_SNAP_STATUS,
+  TP_SNAP_FILENAME,
+  TP_SNAP_TRM,
+  TP_SNAP_SIMILARITY,
+  TP_SNAP_ERROR,
+  TP_SNAP_CHANGED,
+  TP_SNAP_NUM_RESULTS,
+  TP_SNAP_LAST
+};
+
+/*
+ * One snapshot entry.  Strings are stored as offsets into the shared
+ * arena, so a big snapshot is a couple of allocations rather than one
+ * per file.
+ */
+typedef struct {
+  int found, status, similarity, changed, num_results;
+  size_t filename, trm, error;
+} tp_snap_row_t;
+
+typedef struct {
+  tp_call_t call; /* must be first (see tp_call_blocking) */
+  int fields;
+  tp_snap_row_t *rows;
+  char *arena;
+  size_t arena_len, arena_cap;
+  int nomem;
+} tp_snap_t;
+
+/*
+ * Append a string to the snapshot arena, returning its offset.
+ */
+static size_t tp_snap_str(tp_snap_t *snap, const char *str) {
+  size_t len = strlen(str) + 1, cap, ret;
+  char *arena;
+
+  if (snap->arena_len + len > snap->arena_cap) {
+    for (cap = snap->arena_cap ? snap->arena_cap : 4096; cap < snap->arena_len + len; cap *= 2);
+    if ((arena = realloc(snap->arena, cap)) == NULL) {
+      snap->nomem = 1;
+      return 0;
+    }
+    snap->arena = arena;
+    snap->arena_cap = cap;
+  }
+
+  ret = snap->arena_len;
+  memcpy(snap->arena + ret, str, len);
+  snap->arena_len += len;
+
+  return ret;
+}
+
+static void *tp_call_snapshot(void *ptr) {
+  tp_snap_t *snap = ptr;
+  tp_snap_row_t *row;
+  track_t tr;
+  char buf[1024];
+  int i, f = snap->fields;
+
+  for (i = 0; i < snap->call.num_ids && !snap->call.cancelled && !snap->nomem; i++) {
+    row = snap->rows + i;
+    if ((tr = tp_GetTrack(snap->call.tp, snap->call.ids[i])) == NULL) {
+      row->found = 0;
+      continue;
+    }
+
+    row->found = 1;
+    tr_Lock(tr);
+    if (f & (1 << TP_SNAP_STATUS))
+      row->status = tr_GetStatus(tr);
+    if (f & (1 << TP_SNAP_FILENAME)) {
+      tr_GetFileName(tr, buf, sizeof(buf));
+      row->filename = tp_snap_str(snap, buf);
+    }
+    if (f & (1 << TP_SNAP_TRM)) {
+      tr_GetTRM(tr, buf, sizeof(buf));
+      row->trm = tp_snap_str(snap, buf);
+    }
+    if (f & (1 << TP_SNAP_SIMILARITY))
+      row->similarity = tr_GetSimilarity(tr);
+    if (f & (1 << TP_SNAP_ERROR)) {
+      tr_GetError(tr, buf, sizeof(buf));
+      row->error = tp_snap_str(snap, buf);
+    }
+    if (f & (1 << TP_SNAP_CHANGED))
+      row->changed = tr_HasChanged(tr);
+    if (f & (1 << TP_SNAP_NUM_RESULTS))
+      row->num_results = tr_GetNumResults(tr);
+    tr_Unlock(tr);
+    tp_ReleaseTrack(snap->call.tp, tr);
+  }
+
+  return NULL;
+}
+
+static VALUE tp_snap_free(VALUE ptr) {
+  tp_snap_t *snap = (tp_snap_t*) ptr;
+  free(snap->rows);
+  free(snap->arena);
+  return Qnil;
+}
+
+static VALUE tp_snap_run(VALUE ptr) {
+  tp_snap_t *snap = (tp_snap_t*) ptr;
+  tp_snap_row_t *row;
+  int i, f, num = snap->call.num_ids;
+  VALUE ret, col;
+
+  /* zeroed, so rows an interrupt kept us from reaching come back as nil */
+  if ((snap->rows = calloc(num ? num : 1, sizeof(tp_snap_row_t))) == NULL)
+    rb_raise(eException, "Couldn't allocate snapshot for %d files", num);
+
+  tp_call_blocking(tp_call_snapshot, &snap->call);
+  if (snap->nomem)
+    rb_raise(eException, "Couldn't allocate snapshot strings");
+
+  ret = rb_hash_new();
+  for (f = 0; f < TP_SNAP_LAST; f++) {
+    if (!(snap->fields & (1 << f)))
+      continue;
+
+    col = rb_ary_new2(num);
+    for (i = 0; i < num; i++) {
+      row = snap->rows + i;
+      if (!row->found) {
+        rb_ary_push(col, Qnil);
+        continue;
+      }
+
+      switch (f) {
+        case TP_SNAP_STATUS:
+          rb_ary_push(col, INT2FIX(row->status));
+          break;
+        case TP_SNAP_FILENAME:
+          rb_ary_push(col, rb_str_new2(snap->arena + row->filename));
+          break;
+        case TP_SNAP_TRM:
+          rb_ary_push(col, rb_str_new2(snap->arena + row->trm));
+          break;
+        case TP_SNAP_SIMILARITY:
+          rb_ary_push(col, INT2FIX(row->similarity));
+          break;
+        case TP_SNAP_ERROR:
+          rb_ary_push(col, rb_str_new2(snap->arena + row->error));
+          break;
+        case TP_SNAP_CHANGED:
+          rb_ary_push(col, row->changed ? Qtrue : Qfalse);
+          break;
+        case TP_SNAP_NUM_RESULTS:
+          rb_ary_push(col, INT2FIX(row->num_results));
+          break;
+      }
+    }
+
+    rb_hash_aset(ret, ID2SYM(rb_intern(tp_snap_field_names[f])), col);
+  }
+
+  return ret;
+}
+
+/*
+ * Read the state of many tracks in a single call.
+ *
+ * Each track is fetched, locked, read, unlocked and released in
+ * native code, with other Ruby threads still running.  Returns a hash
+ * mapping each requested field to an array of values, in the same
+ * order as ids; unknown file ids get nil in every column.
+ *
+ * Valid fields are :status, :filename, :trm, :similarity, :error,
+ * :changed and :num_results.  The default is [:status, :filename,
+ * :trm, :similarity].
+ *
+ * Example:
+ *   snap = tp.snapshot(tp.file_ids, :fields => [:status, :filename])
+ *   snap[:filename].zip(snap[:status]) do |path, status|
+ *     puts path if status == TunePimp::Status::Unrecognized
+ *   end
+ *
+ */
+static VALUE tp_tp_snapshot(int argc, VALUE *argv, VALUE self) {
+  tunepimp_t *tp;
+  tp_snap_t snap;
+  const char *name;
+  long i;
+  int f;
+  VALUE ids, opts, fields, buf, ret;
+
+  rb_scan_args(argc, argv, "11", &ids, &opts);
+  ids = rb_Array(ids);
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+
+  memset(&snap, 0, sizeof(snap));
+  if (NIL_P(fields = tp_opt(opts, "fields"))) {
+    snap.fields = (1 << TP_SNAP_STATUS) | (1 << TP_SNAP_FILENAME) |
+                  (1 << TP_SNAP_TRM) | (1 << TP_SNAP_SIMILARITY);
+  } else {
+    fields = rb_Array(fields);
+    for (i = 0; i < RARRAY_LEN(fields); i++) {
+      name = rb_id2name(rb_to_id(RARRAY_PTR(fields)[i]));
+      for (f = 0; tp_snap_field_names[f] && strcmp(name, tp_snap_field_names[f]); f++);
+      if (!tp_snap_field_names[f])
+        rb_raise(rb_eArgError, "unknown snapshot field: %s", name);
+      snap.fields |= 1 << f;
+    }
+  }
+
+  /* copy the ids while we still hold the GVL */
+  snap.call.tp = *tp;
+  snap.call.num_ids = RARRAY_LEN(ids);
+  buf = rb_str_buf_new(sizeof(int) * (snap.call.num_ids + 1));
+  snap.call.ids = (int*) RSTRING_PTR(buf);
+  for (i = 0; i < snap.call.num_ids; i++)
+    snap.call.ids[i] = NUM2INT(RARRAY_PTR(ids)[i]);
+
+  ret = rb_ensure(tp_snap_run, (VALUE) &snap, tp_snap_free, (VALUE) &snap);
+  RB_GC_GUARD(buf);
+
+  return ret;
+}
+
+/*
+ * Wake up this TunePimp::TunePimp object to look for work to do.
+ *
+ * Note: You have to call this every time you change a TunePimp::Track's
+ * status with TunePimp::Track#set_status, or the changes won't be
+ * saved.
+ *
+ * Example:
+ *   tp.wake(track)
+ *
+ */
+static VALUE tp_tp_wake(VALUE self, VALUE track) {
+  tunepimp_t *tp;
+  track_t *tr;
+
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  TP_TRACK(track, tr);
+  tp_Wake(*tp, *tr);
+
+  return Qnil;
+}
+
+/*
+ * Select a result returned by TunePimp::Track#results.
+ *
+ * Returns TunePimp::Error:InvalidIndex if index is invalid
+ *
+ * Example:
+ *   tp.select_result(track, 5)
+ *
+ */
+static VALUE tp_tp_select_result(VALUE self, VALUE track, VALUE idx) {
+  tunepimp_t *tp;
+  track_t *tr;
+
+  TPError err;
+  double t0;
+
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  TP_TRACK(track, tr);
+  TP_TRACE_START(t0);
+  err = tp_SelectResult(*tp, *tr, NUM2INT(idx));
+  TP_TRACE_CALL(t0, "select_result", ((tp_track_t*) tr)->file_id, err);
+
+  return INT2FIX(err);
+}
+
+/*
+ * Discard all MusicBrainz idenitifiers and identify this file again.
+ * The status is set back to TunePimp::Status::Pending which causes the
+ * whole identification process to start again, including TRM
+ * generation.
+ *
+ * Example:
+ *   tp.misidentified(id)
+ *
+ */
+static VALUE tp_tp_misidentified(VALUE self, VALUE file_id) {
+  tunepimp_t *tp;
+  double t0;
+
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  TP_TRACE_START(t0);
+  tp_Misidentified(*tp, NUM2INT(file_id));
+  TP_TRACE_CALL(t0, "misidentified", NUM2INT(file_id), 0);
+
+  return Qnil;
+}
+
+/*
+ * Mark a file as misidentified. The status is set back to
+ * TunePimp::Status::FileLookup which causes file lookup to be done on
+ * the file. Any MusicBrainz ids that have been downloaded for this file
+ * are ignored and a lookup from the metadata is done in order to find
+ * the right file on the MB server.
+ *
+ * Example:
+ *   tp.identify_again(id)
+ *
+ */
+static VALUE tp_tp_identify_again(VALUE self, VALUE file_id) {
+  tunepimp_t *tp;
+  double t0;
+
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  TP_TRACE_START(t0);
+  tp_IdentifyAgain(*tp, NUM2INT(file_id));
+  TP_TRACE_CALL(t0, "identify_again", NUM2INT(file_id), 0);
+
+  return Qnil;
+}
+
+/*
+ * Set up a scheduled write of ids (every recognized file if there are
+ * none) from the :order option.  Returns the GC-owned buffer holding
+ * the jobs.
+ */
+static VALUE tp_wsched_init(tp_wsched_t *s, tunepimp_t tp, int argc, VALUE *argv, VALUE opts) {
+  VALUE buf, tmp, val;
+  const char *order;
+  long i, num;
+  int *ids;
+
+  memset(s, 0, sizeof(tp_wsched_t));
+  s->order = TP_WORDER_PHYSICAL;
+  if (!NIL_P(val = tp_opt(opts, "order"))) {
+    order = rb_id2name(rb_to_id(val));
+    if (!strcmp(order, "inode"))
+      s->order = TP_WORDER_INODE;
+    else if (!strcmp(order, "none"))
+      s->order = TP_WORDER_NONE;
+    else if (strcmp(order, "physical"))
+      rb_raise(rb_eArgError, "order must be :physical, :inode or :none");
+  }
+
+  s->recognized = !argc;
+  num = argc ? argc : tp_GetNumFileIds(tp);
+  buf = rb_str_buf_new(sizeof(tp_wjob_t) * (num ? num : 1));
+  s->jobs = (tp_wjob_t*) RSTRING_PTR(buf);
+  s->num_jobs = num;
+
+  if (argc) {
+    for (i = 0; i < num; i++)
+      s->jobs[i].id = NUM2INT(argv[i]);
+  } else {
+    tmp = rb_str_buf_new(sizeof(int) * (num ? num : 1));
+    ids = (int*) RSTRING_PTR(tmp);
+    tp_GetFileIds(tp, ids, num);
+    for (i = 0; i < num; i++)
+      s->jobs[i].id = ids[i];
+    RB_GC_GUARD(tmp);
+  }
+
+  s->call.tp = tp;
+  s->call.undo = NULL;
+
+  return buf;
+}
+
+static VALUE tp_tp_write_tags_async(int, VALUE *, VALUE);
+static int tp_wasync_done(tp_wasync_t *);
+static VALUE tp_tagw_wait(int, VALUE *, VALUE);
+static VALUE tp_tagw_success(VALUE);
+static VALUE tp_tagw_cancel(VALUE);
+
+static VALUE tp_tp_wait_tags(VALUE w) {
+  return tp_tagw_wait(0, NULL, w);
+}
+
+/*
+ * Write tags for specified file IDs.  Only files in the state
+ * TunePimp::Status::Recognized will be written.  If
+ * TunePimp::TunePimp::rename_files is enabled, the files are also
+ * renamed.
+ *
+ * Returns false if a file ID was invalid or if not all the files were
+ * in the state TunePimp::Status::Recognized.
+ *
+ * If the last argument is an options hash, the writes are scheduled:
+ * files are grouped by the device they're on and each device's files
+ * are written in on-disk order.  libtunepimp writes tags on a single
+ * thread, so the files are handed to it one at a time, each once the
+ * one before it has been written, and this returns when they all
+ * have been (or failed); it returns false if any failed.
+ * WriteTagsComplete notifications arrive as usual.
+ *
+ * Options:
+ *   :order    :physical (the default) sorts by the first extent's
+ *             physical location where FIEMAP is available, falling
+ *             back to the inode number; :inode always uses the inode
+ *             number; :none keeps the order given.
+ *
+ * Note: libtunepimp writes the tags on a thread of its own; without
+ * options this only hands the files over.
+ *
+ * Examples:
+ *   # write tags for files with the specified file IDs
+ *   tp.write_tags(1, 5 , 5)
+ *
+ *   # write tags for all files in Recognized state
+ *   tp.write_tags
+ *
+ *   # write tags for all recognized files in inode order, and wait
+ *   tp.write_tags(:order => :inode)
+ *
+ */
+static VALUE tp_tp_write_tags(int argc, VALUE *argv, VALUE self) {
+  tunepimp_t *tp;
+  tp_call_t call;
+  int i;
+  VALUE buf, args[2], w;
+
+  if (argc > 0 && TYPE(argv[argc - 1]) == T_HASH) {
+    args[0] = argc > 1 ? rb_ary_new4(argc - 1, argv) : Qnil;
+    args[1] = argv[argc - 1];
+    w = tp_tp_write_tags_async(2, args, self);
+    rb_ensure(tp_tp_wait_tags, w, tp_tagw_cancel, w);
+
+    return tp_tagw_success(w) == Qtrue ? Qtrue : Qfalse;
+  }
+
+  /* 
+   * copy the ids into a GC-managed buffer first, so a bad id raises
+   * without leaking anything
+   */
+  buf = Qnil;
+  call.ids = NULL;
+  call.num_ids = argc;
+  if (argc > 0) {
+    buf = rb_str_buf_new(sizeof(int) * argc);
+    call.ids = (int*) RSTRING_PTR(buf);
+    for (i = 0; i < argc; i++)
+      call.ids[i] = NUM2INT(argv[i]);
+  }
+
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  call.tp = *tp;
+  call.undo = NULL;
+  tp_call_blocking(tp_call_write_tags, &call);
+  RB_GC_GUARD(buf);
+  
+  return call.ret ? Qtrue : Qfalse;
+}
+
+/*
+ * Start writing tags for the files in ids (every recognized file if
+ * ids is nil or omitted) in the background, and return a
+ * TunePimp::TagWrite to follow it with, so you can look up the next
+ * batch while this one is being written.  Each file is resolved as
+ * its WriteTagsComplete notification comes in; the notifications
+ * still reach TunePimp::TunePimp#wait_notifications as well.
+ *
+ * The writes carry on if the TunePimp::TagWrite is dropped: tp keeps
+ * it until they're done.  They're only cut short by
+ * TunePimp::TagWrite#cancel, or by tp itself being garbage collected.
+ *
+ * Takes the same options as TunePimp::TunePimp#write_tags.
+ *
+ * Example:
+ *   w = tp.write_tags_async(batch)
+ *   next_batch.each do |id|
+ *     tr = tp.track(id)
+ *     tp.select_result(tr, 0)
+ *     tp.release_track(tr)
+ *   end
+ *   w.wait
+ *   w.errors.each { |id, err| puts "#{tp.track(id).file_name}: #{err}" }
+ *
+ */
+static VALUE tp_tp_write_tags_async(int argc, VALUE *argv, VALUE self) {
+  tp_pimp_t *pimp;
+  tp_wasync_t *w;
+  tp_wsched_t sched;
+  VALUE ids, opts, buf, ret, writes, keep;
+  size_t size;
+  long i, j;
+
+  rb_scan_args(argc, argv, "02", &ids, &opts);
+  if (NIL_P(opts) && TYPE(ids) == T_HASH) {
+    opts = ids;
+    ids = Qnil;
+  }
+  if (!NIL_P(ids)) {
+    ids = rb_Array(ids);
+    if (RARRAY_LEN(ids) > INT_MAX)
+      rb_raise(rb_eArgError, "too many ids (%ld)", RARRAY_LEN(ids));
+  }
+
+  TypedData_Get_Struct(self, tp_pimp_t, &tp_pimp_type, pimp);
+  buf = tp_wsched_init(&sched, pimp->tp, NIL_P(ids) ? 0 : (int) RARRAY_LEN(ids),
+                       NIL_P(ids) ? NULL : RARRAY_PTR(ids), opts);
+
+  ret = TypedData_Wrap_Struct(cTagWrite, &tp_wasync_type, NULL);
+  if ((w = malloc(sizeof(tp_wasync_t))) == NULL)
+    rb_raise(eException, "Couldn't allocate memory for tag write");
+  memset(w, 0, sizeof(tp_wasync_t));
+  pthread_mutex_init(&w->lock, NULL);
+  pthread_cond_init(&w->cond, NULL);
+  DATA_PTR(ret) = w;
+
+  /* the jobs outlive this call, so they move off the GC heap */
+  w->sched = sched;
+  w->num_res = sched.num_jobs;
+  size = sizeof(tp_wjob_t) * (w->num_res ? w->num_res : 1);
+  w->sched.jobs = malloc(size);
+  w->res = malloc(sizeof(tp_wres_t) * (w->num_res ? w->num_res : 1));
+  if (!w->sched.jobs || !w->res)
+    rb_raise(eException, "Couldn't allocate memory for %ld tag writes", w->num_res);
+  memcpy(w->sched.jobs, RSTRING_PTR(buf), size);
+  RB_GC_GUARD(buf);
+
+  /* one result per distinct id */
+  memset(w->res, 0, sizeof(tp_wres_t) * w->num_res);
+  for (i = 0; i < w->num_res; i++)
+    w->res[i].id = w->sched.jobs[i].id;
+  qsort(w->res, w->num_res, sizeof(tp_wres_t), tp_wres_cmp);
+  for (i = j = 0; i < w->num_res; i++)
+    if (!j || w->res[i].id != w->res[j - 1].id)
+      w->res[j++] = w->res[i];
+  w->num_res = j;
+
+  w->tp = pimp->tp;
+  w->pimp = pimp;
+  w->queue = &pimp->queue;
+  pthread_mutex_lock(&w->queue->mutex);
+  w->next = w->queue->writes;
+  w->queue->writes = w;
+  pthread_mutex_unlock(&w->queue->mutex);
+
+  tp_pimp_ref(pimp);
+  if (!tp_thread_start(&w->thread, 0, tp_wasync_main, w)) {
+    tp_pimp_unref(pimp);
+    tp_wasync_stop(w);
+    rb_raise(eException, "Couldn't start tag write thread");
+  }
+  w->running = 1;
+  rb_iv_set(ret, "@tunepimp", self);
+
+  /* 
+   * hold on to unfinished writes from tp, so dropping the handle
+   * doesn't cancel them
+   */
+  keep = rb_ary_new();
+  writes = rb_iv_get(self, "@writes");
+  for (i = 0; !NIL_P(writes) && i < RARRAY_LEN(writes); i++) {
+    TypedData_Get_Struct(RARRAY_PTR(writes)[i], tp_wasync_t, &tp_wasync_type, w);
+    if (!tp_wasync_done(w))
+      rb_ary_push(keep, RARRAY_PTR(writes)[i]);
+  }
+  rb_ary_push(keep, ret);
+  rb_iv_set(self, "@writes", keep);
+
+  return ret;
+}
+
+/*
+ * Add a track ID, TRM pair to the unsubmitted TRM queue.  You'll have
+ * to call TunePimp::TunePimp#submit_trms to actually submit the queue.
+ *
+ * The queue only lives in memory; TunePimp::TRMJournal keeps one on
+ * disk, and submits and retries it for you.
+ *
+ * Aliases:
+ *   TunePimp::TunePimp#add_trm
+ *   TunePimp::TunePimp#add_trm_submission
+ *
+ * Example:
+ *   tp.add_trm(track, trm)
+ *
+ */
+static VALUE tp_tp_add_trm(VALUE self, VALUE tr_id, VALUE trm_id) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_AddTRMSubmission(*tp, StringValueCStr(tr_id), StringValueCStr(trm_id));
+  return Qnil;
+}
+
+/*
+ * Submit queued TRMs to musicbrainz.
+ *
+ * Returns TunePimp::Error::Ok on success and
+ * TunePimp::Error::SubmitError on error.
+ *
+ * Example:
+ *   tp.submit_trms
+ *
+ */
+static VALUE tp_tp_submit_trms(VALUE self) {
+  tunepimp_t *tp;
+  tp_call_t call;
+
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  call.tp = *tp;
+  call.undo = NULL;
+  tp_call_blocking(tp_call_submit_trms, &call);
+
+  return INT2FIX(call.ret);
+}
+
+/*
+ * Rename files?  If enabled, files are renamed as specified in the
+ * TunePimp::TunePimp#file_mask file mask.
+ *
+ * Enabled by default.
+ *
+ * Example:
+ *   tp.rename_files = true
+ *
+ */
+static VALUE tp_tp_set_rename_files(VALUE self, VALUE rename) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetRenameFiles(*tp, !(rename == Qfalse || rename == Qnil));
+  return Qnil;
+}
+
+/*
+ * Get the TunePimp::TunePimp#rename_files flag.
+ *
+ * Example:
+ *   puts "Renaming is " + (tp.rename_files ? : 'on' : 'off')
+ *
+ */
+static VALUE tp_tp_rename_files(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return tp_GetRenameFiles(*tp) ? Qtrue : Qfalse;
+}
+
+/*
+ * Move files?  If enabled, files are moved as specified in the
+ * TunePimp::TunePimp#file_mask file mask.
+ *
+ * Enabled by default.
+ *
+ * Example:
+ *   tp.move_files = true
+ *
+ */
+static VALUE tp_tp_set_move_files(VALUE self, VALUE move) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetMoveFiles(*tp, !(move == Qfalse || move == Qnil));
+  return Qnil;
+}
+
+/*
+ * Get the TunePimp::TunePimp#move_files flag.
+ *
+ * Example:
+ *   puts "Moving is " + (tp.move_files ? : 'on' : 'off')
+ *
+ */
+static VALUE tp_tp_move_files(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return tp_GetMoveFiles(*tp) ? Qtrue : Qfalse;
+}
+
+/*
+ * Write ID3v1 tags?  
+ *
+ * Enabled by default.
+ *
+ * Example:
+ *   tp.write_id3v1 = true
+ *
+ */
+static VALUE tp_tp_set_write_id3v1(VALUE self, VALUE id3) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetWriteID3v1(*tp, !(id3 == Qfalse || id3 == Qnil));
+  return Qnil;
+}
+
+/*
+ * Get the TunePimp::TunePimp#write_id3v1 flag.
+ *
+ * Example:
+ *   puts "ID3v1 is " + (tp.write_id3v1 ? : 'on' : 'off')
+ *
+ */
+static VALUE tp_tp_write_id3v1(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return tp_GetWriteID3v1(*tp) ? Qtrue : Qfalse;
+}
+
+/*
+ * Clear tags before MusicBrainz writes new ones?
+ *
+ * Disabled by default.
+ *
+ * Example:
+ *   tp.clear_tags = true
+ *
+ */
+static VALUE tp_tp_set_clear_tags(VALUE self, VALUE clear_tags) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetClearTags(*tp, !(clear_tags == Qfalse || clear_tags == Qnil));
+  return Qnil;
+}
+
+/*
+ * Get the TunePimp::TunePimp#clear_tags flag.
+ *
+ * Example:
+ *   puts "Clear Tags is " + (tp.clear_tags ? : 'on' : 'off')
+ *
+ */
+static VALUE tp_tp_clear_tags(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return tp_GetClearTags(*tp) ? Qtrue : Qfalse;
+}
+
+/*
+ * Set the file mask used for renaming files.  
+ *
+ * Valid escape sequences:
+ *   %artist (Name of the artist)
+ *   %abc (The first character of the artist's sortname)
+ *   %abc2 (The first two character of the artist's sortname)
+ *   %abc3 (The first three character of the artist's sortname)
+ *   %sortname (Sortname of the artist)
+ *   %track (Title of the song)
+ *   %album (Title of the album)
+ *   %num (Track number on the album)
+ *   %0num (Track number on the album, zero padded to two places)
+ *   %format (The format of the given file e.g. ogg/mp3/wav/flac/ape)
+ *   %type (The release type: single, album, remix, etc)
+ *   %status (The release status: official, bootleg, promo)
+ *   %year (The first release year)
+ *   %month (The first release month)
+ *   %day (The first release day)
+ *   %country (The first release country)
+ *
+ * The default file mask is "%artist/%album/%artist-%album-%0num-%track".
+ * 
+ * Be careful about using % escape sequences in double-quoted Ruby
+ * strings!
+ *
+ * Note: See the TunePimp::TunePimp#various_file_mask method as well.
+ *
+ * Example:
+ *   # set the file mask (note the single-quoted string)
+ *   tp.file_mask = '%sortname/%album/%0num. %track.%format'
+ *   
+ */
+static VALUE tp_tp_set_file_mask(VALUE self, VALUE file_mask) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetFileMask(*tp, StringValueCStr(file_mask));
+  return Qnil;
+}
+
+/*
+ * Get the TunePimp::TunePimp#file_mask.
+ *
+ * Example:
+ *   puts "Mask: " << tp.file_mask
+ *
+ */
+static VALUE tp_tp_file_mask(VALUE self) {
+  tunepimp_t *tp;
+  char buf[1024];
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_GetFileMask(*tp, buf, 1024);
+  return rb_str_new2(buf);
+}
+
+/*
+ * Set the file mask used for renaming files in multi-artist albums.  
+ *
+ * Valid escape sequences:
+ *   %artist (Name of the artist)
+ *   %abc (The first character of the artist's sortname)
+ *   %abc2 (The first two character of the artist's sortname)
+ *   %abc3 (The first three character of the artist's sortname)
+ *   %sortname (Sortname of the artist)
+ *   %track (Title of the song)
+ *   %album (Title of the album)
+ *   %num (Track number on the album)
+ *   %0num (Track number on the album, zero padded to two places)
+ *   %format (The format of the given file e.g. ogg/mp3/wav/flac/ape)
+ *   %type (The release type: single, album, remix, etc)
+ *   %status (The release status: official, bootleg, promo)
+ *   %year (The first release year)
+ *   %month (The first release month)
+ *   %day (The first release day)
+ *   %country (The first release country)
+ *
+ * The default value for TunePimp::TunePimp#various_file_mask is 
+ * "Various Artists/%album/%album-%0num-%artist-%track".
+ * 
+ * Be careful about using % escape sequences in double-quoted Ruby
+ * strings!
+ *
+ * Note: See the TunePimp::TunePimp::file_mask method as well.
+ *
+ * Example:
+ *   # set the file mask (note the single-quoted string)
+ *   tp.file_mask = '%sortname/%album/%0num. %track.%format'
+ *   
+ */
+static VALUE tp_tp_set_various_file_mask(VALUE self, VALUE various_file_mask) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetVariousFileMask(*tp, StringValueCStr(various_file_mask));
+  return Qnil;
+}
+
+/*
+ * Get the TunePimp::TunePimp::various_file_mask.
+ *
+ * Example:
+ *   puts "Mask: " << tp.various_file_mask
+ *
+ */
+static VALUE tp_tp_various_file_mask(VALUE self) {
+  tunepimp_t *tp;
+  char buf[1024];
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_GetVariousFileMask(*tp, buf, 1024);
+  return rb_str_new2(buf);
+}
+
+/*
+ * Set the characters allowed in file names.
+ *
+ * Note: '/' is always permitted.
+ *
+ * Defaults to "" (all characters allowed).
+ *
+ * Example:
+ *   tp.set_allowed_file_chars 'abcdefghijklmnopqrstuvwxyz0123456789.-_ '
+ *
+ */
+static VALUE tp_tp_set_allowed_file_chars(VALUE self, VALUE allowed_file_chars) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetAllowedFileCharacters(*tp, StringValueCStr(allowed_file_chars));
+  return Qnil;
+}
+
+/*
+ * Get the TunePimp::TunePimp::allowed_file_chars value.
+ * 
+ * Example:
+ *   puts "Allowed Characters: \"" << tp.allowed_file_chars << "\"."
+ *
+ */
+static VALUE tp_tp_allowed_file_chars(VALUE self) {
+  tunepimp_t *tp;
+  char buf[1024];
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_GetAllowedFileCharacters(*tp, buf, 1024);
+  return rb_str_new2(buf);
+}
+
+/*
+ * Set the base directory that is prepended to all file names if the
+ * TunePimp::TunePimp#move_files flag is enabled.
+ *
+ * Defaults to "MyMusic" (in the current working directory).
+ *
+ * Example:
+ *   tp.dest_dir = '/store/mp3'
+ *
+ */
+static VALUE tp_tp_set_dest_dir(VALUE self, VALUE dest_dir) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetDestDir(*tp, StringValueCStr(dest_dir));
+  return Qnil;
+}
+
+/*
+ * Get the value of TunePimp::TunePimp#dest_dir.
+ *
+ * Example:
+ *   puts "Destination: " << tp.dest_dir
+ *
+ */
+static VALUE tp_tp_dest_dir(VALUE self) {
+  tunepimp_t *tp;
+  char buf[1024];
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_GetDestDir(*tp, buf, 1024);
+  return rb_str_new2(buf);
+}
+
+/*
+ * Set the top source directory for TunePimp::TunePimp object.
+ * 
+ * When TunePimp moves a file out of a directory to a new directory, and
+ * the old directory is now empty, the old directory is removed. This
+ * process is repeated for the old directory's parent, until it reaches
+ * the top_src_dir, where it stops removing directories. Set the
+ * top_src_dir to root of the directory tree where TunePimp is writing
+ * ID3 files to.
+ *
+ * For example, if top_src_dir is set to "/mnt/mp3"
+ *
+ *   /mnt/mp3/dirty_mp3s/Beatles/Yesterday.mp3
+ *
+ * The Yesterday song is the only file left in the dirty_mp3s folder.
+ * When tunepimp moves this file to its new, clean location, it will
+ * remove the Beatles directory, then the dirty_mp3s directory, but it
+ * will not remove the "/mnt/mp3" directory, since that is the
+ * top_src_dir.
+ *
+ * Example:
+ *   tp.top_src_dir = '/store/mp3'
+ *
+ */
+static VALUE tp_tp_set_top_src_dir(VALUE self, VALUE top_src_dir) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetTopSrcDir(*tp, StringValueCStr(top_src_dir));
+  return Qnil;
+}
+
+/*
+ * Get the top source directory for a TunePimp::TunePimp object.
+ *
+ * Example:
+ *   puts "Dir: " << tp.top_src_dir
+ *
+ */
+static VALUE tp_tp_top_src_dir(VALUE self) {
+  tunepimp_t *tp;
+  char buf[1024];
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_GetTopSrcDir(*tp, buf, 1024);
+  return rb_str_new2(buf);
+}
+
+/*
+ * Set the TRM collision threshold for a TunePimp::TunePimp object.
+ *
+ * If there is more than one entry matching a TRM in the musicbrainz
+ * database, we have a TRM collision. In this case, a similarity value
+ * is calculated for each returned database entry using the file's meta
+ * data as the reference. The similarity is a percent value describing
+ * how good the match is.
+ *
+ * If the similarity is greater than or equal to the
+ * trm_collision_threshold, then the file is marked as recognized
+ * (TunePimp::Status::Recognized). Otherwise, the track's status is set
+ * to TunePimp::Status::TRMCollision, which requires user invention in 
+ * order to select one of the returned results.
+ *
+ * Valid values for the threshold are between 0 and 100, inclusive.
+ *
+ * Default: 80.
+ *
+ * Example:
+ *   tp.trm_collision_threshold = 95
+ *
+ */
+static VALUE tp_tp_set_trm_collision_threshold(VALUE self, VALUE trm_collision_threshold) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetTRMCollisionThreshold(*tp, NUM2INT(trm_collision_threshold));
+  return Qnil;
+}
+
+/*
+ * Get the TRM collision threshold for a TunePimp::TunePimp object.
+ *
+ * Example:
+ *   puts "Threshold: #{tp.trm_collision_threshold}"
+ *
+ */
+static VALUE tp_tp_trm_collision_threshold(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return INT2FIX(tp_GetTRMCollisionThreshold(*tp));
+}
+
+/*
+ * Set the minimum recognition threshold for TRM lookups with the given
+ * TunePimp::TunePimp object.
+ *
+ * If there is a TRM match for a given track, but the similarity between
+ * the metadata returned is below the minimum recognition threshold,
+ * then the TRM match should not be accepted and the file should be
+ * listed as unrecognized.
+ *
+ * Valid values for the threshold are between 0 and 100, inclusive.
+ *
+ * Default: 50.
+ *
+ * Example:
+ *   tp.min_trm_threshold = 10
+ *
+ */
+static VALUE tp_tp_set_min_trm_threshold(VALUE self, VALUE min_trm_threshold) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetMinTRMThreshold(*tp, NUM2INT(min_trm_threshold));
+  return Qnil;
+}
+
+/*
+ * Get the minimum TRM threshold for a TunePimp::TunePimp object.
+ *
+ * Example:
+ *   puts "min thresh: #{tp.min_trm_threshold}"
+ *
+ */
+static VALUE tp_tp_min_trm_threshold(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return INT2FIX(tp_GetMinTRMThreshold(*tp));
+}
+
+/*
+ * Set the auto-save threshold for a TunePimp::TunePimp object.
+ *
+ * When the similarity value (see TunePimp::TunePimp#trm_collision) is
+ * greater or equal the auto save threshold, a recognized file (in state
+ * TunePimp::Status::Recognized) is marked as verified
+ * (TunePimp::Status::Verified). The effect is the same as calling
+ * TunePimp::TunePimp#write_tags on a recognized file.
+ *
+ * The writing is done immediately, without the possibility of user
+ * intervention.
+ *
+ * Valid values for the threshold are between 0 and 100, inclusive.
+ * Set it to a negative value or nil in order to disable the auto-save
+ * feature.
+ *
+ * Default: 90.
+ *
+ * Example:
+ *   # disable auto-save
+ *   tp.auto_save_threshold = nil
+ *
+ */
+static VALUE tp_tp_set_auto_save_threshold(VALUE self, VALUE auto_save_threshold) {
+  tunepimp_t *tp;
+  int thresh;
+  thresh = (auto_save_threshold == Qnil) ? -1 : NUM2INT(auto_save_threshold);
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetAutoSaveThreshold(*tp, thresh);
+  return Qnil;
+}
+
+/*
+ * Get the auto-save threshold of a TunePimp::TunePimp object.
+ *
+ * Example:
+ *   puts "auto-save threshold: #{tp.auto_save_threshold}"
+ *
+ */
+static VALUE tp_tp_auto_save_threshold(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return INT2FIX(tp_GetAutoSaveThreshold(*tp));
+}
+
+/*
+ * Set the maximum length of a path saved by this TunePimp::TunePimp
+ * object.
+ *
+ * Example:
+ *   tp.max_file_name_len = 128
+ *
+ */
+static VALUE tp_tp_set_max_file_name_len(VALUE self, VALUE max_file_name_len) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetMaxFileNameLen(*tp, NUM2INT(max_file_name_len));
+  return Qnil;
+}
+
+/*
+ * Get the maximum length of a file name saved by this
+ * TunePimp::TunePimp object.
+ *
+ * Example:
+ *   puts "max length: #{tp.max_file_name_len}"
+ *
+ */
+static VALUE tp_tp_max_file_name_len(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return INT2FIX(tp_GetMaxFileNameLen(*tp));
+}
+
+/*
+ * Delete files after they've been saved?
+ *
+ * If false, the status of the track is set to TunePimp::Status::Saved
+ * instead.
+ *
+ * Example:
+ *   # let the user remove stuff
+ *   tp.set_auto_remove_saved_files = false
+ *
+ */
+static VALUE tp_tp_set_auto_remove_saved_files(VALUE self, VALUE auto_remove_saved_files) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  tp_SetAutoRemovedSavedFiles(*tp, !(auto_remove_saved_files == Qfalse || auto_remove_saved_files == Qnil));
+  return Qnil;
+}
+
+/*
+ * Get the value of the TunePimp::TunePimp#auto_remove_saved_files
+ * flag.
+ *
+ * Example:
+ *   puts "Magic delete is " << (tp.auto_remove_saved_files ? 'on' : 'off')
+ *
+ */
+static VALUE tp_tp_auto_remove_saved_files(VALUE self) {
+  tunepimp_t *tp;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  return tp_GetAutoRemovedSavedFiles(*tp) ? Qtrue : Qfalse;
+}
+
+/*
+ * Get a list of files with status TunePimp::Status::Recognized, with a
+ * similarity less than threshold. 
+ *
+ * Example:
+ *   ary = tp.recognized_files(90)
+ *
+ */
+static VALUE tp_tp_recognized_files(VALUE self, VALUE thresh) {
+  tunepimp_t *tp;
+  int i, *ids, num;
+  VALUE ret;
+
+  ret = Qnil;
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+  if (tp_GetRecognizedFileList(*tp, NUM2INT(thresh), &ids, &num)) {
+    ret = rb_ary_new();
+    for (i = 0; i < num; i++)
+      rb_ary_push(ret, INT2FIX(ids[i]));
+    tp_DeleteRecognizedFileList(*tp, ids);
+  }
+
+  return ret;
+}
+
+
+/*********************************************************************/
+/* TunePimp::Track methods                                           */
+/*********************************************************************/
+
+/*
+ * You cannot instantiate this class directly.  Use
+ * TunePimp::TunePimp#get_track instead.
+ *
+ */
+VALUE tp_tr_new(VALUE klass) {
+  rb_raise(eException, "You cannot instantiate this class directly.  Use TunePimp::TunePimp#get_track instead.");
+  return Qnil;
+}
+
+/*
+ * Constructor for TunePimp::Track object.
+ *
+ * This method is currently empty.  You should never call this method
+ * directly unless you're instantiating a derived class (ie, you know
+ * what you're doing).
+ *
+ */
+static VALUE tp_tr_init(VALUE self) {
+  return self;
+}
+
+/*
+ * Get the TunePimp::Status of a TunePimp::Track object.
+ *
+ * Example:
+ *   puts "Recognized" if tr.status == TunePimp::Status::Recognized
+ *
+ */
+static VALUE tp_tr_status(VALUE self) {
+  track_t *tr;
+  TP_TRACK(self, tr);
+  return INT2FIX(tr_GetStatus(*tr));
+}
+
+/*
+ * Set the status of a TunePimp::Track object.
+ *
+ * Example:
+ *   tr.status = TunePimp::Status::Verified
+ *   
+ */
+static VALUE tp_tr_set_status(VALUE self, VALUE status) {
+  track_t *tr;
+  TP_TRACK(self, tr);
+  tr_SetStatus(*tr, NUM2INT(status));
+  return Qnil;
+}
+
+/*
+ * Get the file name of a TunePimp::Track object.
+ *
+ * Example:
+ *   puts "Filename: " << tr.filename
+ *
+ */
+static VALUE tp_tr_filename(VALUE self) {
+  track_t *tr;
+  char buf[1024];
+  TP_TRACK(self, tr);
+  tr_GetFileName(*tr, buf, 1024);
+  return rb_str_new2(buf);
+}
+
+/*
+ * Get the TRM of a TunePimp::Track object.
+ *
+ * Example:
+ *   puts "TRM: " << tr.trm
+ *
+ */
+static VALUE tp_tr_trm(VALUE self) {
+  track_t *tr;
+  char buf[1024];
+  TP_TRACK(self, tr);
+  tr_GetTRM(*tr, buf, 1024);
+  return rb_str_new2(buf);
+}
+
+/*
+ * Wrap a fresh metadata_t in a TunePimp::Metadata object, or unwrap
+ * the :into option, if given.
+ */
+static metadata_t *tp_md_target(VALUE opts, VALUE *md_obj) {
+  metadata_t *md;
+  VALUE into;
+
+  if (!NIL_P(into = tp_opt(opts, "into"))) {
+    TypedData_Get_Struct(into, metadata_t, &tp_md_type, md);
+    *md_obj = into;
+    return md;
+  }
+
+  *md_obj = TypedData_Wrap_Struct(cMD, &tp_md_type, NULL);
+  if ((md = md_New()) == NULL)
+    rb_raise(eException, "Couldn't alloc metadata_t");
+  DATA_PTR(*md_obj) = md;
+
+  return md;
+}
+
+/*
+ * Get the local metadata of a TunePimp::Track object.
+ *
+ * Returns a new TunePimp::Metadata object, or refills the one passed as
+ * the :into option (which allocates nothing).
+ *
+ * Examples:
+ *   md = tr.local_metadata
+ *
+ *   # reuse md for every track
+ *   tr.local_metadata(:into => md)
+ *
+ */
+static VALUE tp_tr_local_metadata(int argc, VALUE *argv, VALUE self) {
+  track_t *tr;
+  VALUE opts, ret;
+  
+  rb_scan_args(argc, argv, "01", &opts);
+  TP_TRACK(self, tr);
+  tr_GetLocalMetadata(*tr, tp_md_target(opts, &ret));
+  
+  return ret;
+}
+
+/*
+ * Set the local metadata of a TunePimp::Track object.
+ *
+ * TODO: better documentation here.
+ *
+ * Example:
+ *   tr.local_metadata = md
+ *
+ */
+static VALUE tp_tr_set_local_metadata(VALUE self, VALUE metadata) {
+  track_t *tr;
+  metadata_t *md;
+  
+  TP_TRACK(self, tr);
+  TypedData_Get_Struct(metadata, metadata_t, &tp_md_type, md);
+  tr_SetLocalMetadata(*tr, md);
+
+  return Qnil;
+}
+
+/*
+ * Get the server metadata of a TunePimp::Track object.
+ *
+ * Returns a new TunePimp::Metadata object, or refills the one passed as
+ * the :into option (which allocates nothing).
+ *
+ * Examples:
+ *   md = tr.server_metadata
+ *
+ *   # reuse md for every track
+ *   tr.server_metadata(:into => md)
+ *
+ */
+static VALUE tp_tr_server_metadata(int argc, VALUE *argv, VALUE self) {
+  track_t *tr;
+  VALUE opts, ret;
+  
+  rb_scan_args(argc, argv, "01", &opts);
+  TP_TRACK(self, tr);
+  tr_GetServerMetadata(*tr, tp_md_target(opts, &ret));
+  
+  return ret;
+}
+
+/*
+ * Set the server metadata of a TunePimp::Track object.
+ *
+ * TODO: better documentation here.
+ *
+ * Example:
+ *   tr.server_metadata = md
+ *
+ */
+static VALUE tp_tr_set_server_metadata(VALUE self, VALUE metadata) {
+  track_t *tr;
+  metadata_t *md;
+  
+  TP_TRACK(self, tr);
+  TypedData_Get_Struct(metadata, metadata_t, &tp_md_type, md);
+  tr_SetServerMetadata(*tr, md);
+
+  return Qnil;
+}
+
+/*
+ * Get the error of a TunePimp::Track object.
+ *
+ * Example:
+ *   puts "Error: " << tr.error
+ *
+ */
+static VALUE tp_tr_error(VALUE self) {
+  track_t *tr;
+  char buf[1024];
+  TP_TRACK(self, tr);
+  tr_GetError(*tr, buf, 1024);
+  return rb_str_new2(buf);
+}
+
+/*
+ * Get the similarity of a TunePimp::Track object.
+ *
+ * Example:
+ *   puts "Similarity: #{tr.similarity}"
+ *
+ */
+static VALUE tp_tr_similarity(VALUE self) {
+  track_t *tr;
+  TP_TRACK(self, tr);
+  return INT2FIX(tr_GetSimilarity(*tr));
+}
+
+/*
+ * Has this TunePimp::Track object changed?
+ *
+ * Example:
+ *   puts 'This track has changed.' if tr.has_changed?
+ *
+ */
+static VALUE tp_tr_has_changed(VALUE self) {
+  track_t *tr;
+  TP_TRACK(self, tr);
+  return tr_HasChanged(*tr) ? Qtrue : Qfalse;
+}
+
+/*
+ * Get the number of results for this track.
+ *
+ * Example:
+ *   puts "Found #{tr.num_results} results."
+ *
+ */
+static VALUE tp_tr_num_results(VALUE self) {
+  track_t *tr;
+  TP_TRACK(self, tr);
+  return INT2FIX(tr_GetNumResults(*tr));
+}
+
+/*
+ * Cache of converted artists and albums for one result list, keyed by
+ * MusicBrainz id, so track results that share an artist or album share
+ * the Ruby object too.  The keys point into the native result list.
+ */
+typedef struct {
+  st_table *artists, *albums;
+} tp_wrap_cache_t;
+
+static VALUE wrap_artist(tp_wrap_cache_t *cache, artistresult_t *a_r) {
+  st_data_t val;
+  VALUE ret;
+
+  if (cache && *a_r->id && st_lookup(cache->artists, (st_data_t) a_r->id, &val))
+    return (VALUE) val;
+
+  ret = rb_struct_new(cArtistResult,
+    INT2FIX(a_r->relevance),
+    rb_str_new2(a_r->id),
+    rb_str_new2(a_r->name),
+    rb_str_new2(a_r->sortName)
+  );
+
+  if (cache && *a_r->id)
+    st_insert(cache->artists, (st_data_t) a_r->id, (st_data_t) ret);
+
+  return ret;
+}
+
+static VALUE wrap_album(tp_wrap_cache_t *cache, albumresult_t *a_r) {
+  st_data_t val;
+  VALUE ret;
+
+  if (cache && *a_r->id && st_lookup(cache->albums, (st_data_t) a_r->id, &val))
+    return (VALUE) val;
+
+  ret = rb_struct_new(cAlbumResult,
+    INT2FIX(a_r->relevance),
+    rb_str_new2(a_r->id),
+    rb_str_new2(a_r->name),
+    INT2FIX(a_r->numTracks),
+    INT2FIX(a_r->numCDIndexIds),
+    a_r->isVA ? Qtrue : Qfalse,
+    INT2FIX(a_r->type),
+    INT2FIX(a_r->releaseYear),
+    INT2FIX(a_r->releaseMonth),
+    INT2FIX(a_r->releaseDay),
+    rb_str_new2(a_r->releaseCountry),
+    a_r->artist ? wrap_artist(cache, a_r->artist) : Qnil
+  );
+
+  if (cache && *a_r->id)
+    st_insert(cache->albums, (st_data_t) a_r->id, (st_data_t) ret);
+
+  return ret;
+}
+
+static VALUE wrap_track(tp_wrap_cache_t *cache, albumtrackresult_t *a_r) {
+  return rb_struct_new(cTrackResult,
+    INT2FIX(a_r->relevance),
+    rb_str_new2(a_r->id),
+    rb_str_new2(a_r->name),
+    INT2FIX(a_r->numTRMIds),
+    INT2FIX(a_r->trackNum),
+    ULONG2NUM(a_r->duration),
+    a_r->artist ? wrap_artist(cache, a_r->artist) : Qnil,
+    a_r->album ? wrap_album(cache, a_r->album) : Qnil
+  );
+}
+
+/*********************************************************************/
+/* TunePimp::Results methods                                         */
+/*********************************************************************/
+
+/*
+ * Native results behind a TunePimp::Results object.  The result_t
+ * array is owned by the object and freed with it; entries are only
+ * converted to Ruby objects when they're asked for, and then kept in
+ * entries.
+ */
+typedef struct {
+  TPResultType type;
+  result_t *results;
+  int num;
+  VALUE entries;
+  tp_wrap_cache_t cache;
+} tp_results_t;
+
+static int tp_results_mark_i(st_data_t key, st_data_t val, st_data_t arg) {
+  UNUSED(key);
+  UNUSED(arg);
+  rb_gc_mark((VALUE) val);
+  return ST_CONTINUE;
+}
+
+static void tp_results_mark(void *ptr) {
+  tp_results_t *rs = ptr;
+
+  /* the cached artists and albums are pinned; they're in entries too */
+  rb_gc_mark_movable(rs->entries);
+  st_foreach(rs->cache.artists, tp_results_mark_i, 0);
+  st_foreach(rs->cache.albums, tp_results_mark_i, 0);
+}
+
+static void tp_results_free(void *ptr) {
+  tp_results_t *rs = ptr;
+
+  if (rs) {
+    st_free_table(rs->cache.artists);
+    st_free_table(rs->cache.albums);
+    if (rs->results) {
+      rs_Delete(rs->type, rs->results, rs->num);
+      free(rs->results);
+    }
+    free(rs);
+  }
+}
+
+#ifdef HAVE_RB_GC_MARK_MOVABLE
+static void tp_results_compact(void *ptr) {
+  tp_results_t *rs = ptr;
+  rs->entries = rb_gc_location(rs->entries);
+}
+#endif
+
+static size_t tp_results_memsize(const void *ptr) {
+  const tp_results_t *rs = ptr;
+  size_t size;
+
+  switch (rs->type) {
+    case eArtistList:
+      size = sizeof(artistresult_t);
+      break;
+    case eAlbumList:
+      size = sizeof(albumresult_t) + sizeof(artistresult_t);
+      break;
+    case eTrackList:
+    case eMatchedTrack:
+      size = sizeof(albumtrackresult_t) + sizeof(albumresult_t) +
+             2 * sizeof(artistresult_t);
+      break;
+    default:
+      size = 0;
+  }
+
+  return sizeof(tp_results_t) + rs->num * (sizeof(result_t) + size);
+}
+
+static const rb_data_type_t tp_results_type = {
+  "TunePimp::Results",
+  { tp_results_mark, tp_results_free, tp_results_memsize, TP_COMPACT(tp_results_compact) },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * Convert result i (assumed to be in range) to a Ruby object.
+ */
+static VALUE tp_results_entry(tp_results_t *rs, int i) {
+  VALUE ret;
+
+  if (!NIL_P(ret = RARRAY_PTR(rs->entries)[i]))
+    return ret;
+
+  switch (rs->type) {
+    case eArtistList:
+      ret = wrap_artist(&rs->cache, (artistresult_t*) rs->results[i]);
+      break;
+    case eAlbumList:
+      ret = wrap_album(&rs->cache, (albumresult_t*) rs->results[i]);
+      break;
+    case eTrackList:
+    case eMatchedTrack:
+      ret = wrap_track(&rs->cache, (albumtrackresult_t*) rs->results[i]);
+      break;
+    default:
+      rb_raise(eException, "Result type %d not implemented", rs->type);
+  }
+  rb_ary_store(rs->entries, i, ret);
+
+  return ret;
+}
+
+/*
+ * You cannot instantiate this class directly.  Use
+ * TunePimp::Track#results instead.
+ *
+ */
+VALUE tp_rs_new(VALUE klass) {
+  rb_raise(eException, "You cannot instantiate this class directly.  Use TunePimp::Track#results instead.");
+  return Qnil;
+}
+
+/*
+ * Get the TunePimp::ResultType of this TunePimp::Results object.
+ *
+ * Example:
+ *   puts 'Artists' if results.type == TunePimp::ResultType::ArtistList
+ *
+ */
+static VALUE tp_rs_type(VALUE self) {
+  tp_results_t *rs;
+  TypedData_Get_Struct(self, tp_results_t, &tp_results_type, rs);
+  return INT2FIX(rs->type);
+}
+
+/*
+ * Get the number of entries in this TunePimp::Results object.
+ *
+ * Aliases:
+ *   TunePimp::Results#size
+ *   TunePimp::Results#length
+ *
+ * Example:
+ *   puts "Found #{results.size} results."
+ *
+ */
+static VALUE tp_rs_size(VALUE self) {
+  tp_results_t *rs;
+  TypedData_Get_Struct(self, tp_results_t, &tp_results_type, rs);
+  return INT2FIX(rs->num);
+}
+
+/*
+ * Get an entry of this TunePimp::Results object.
+ *
+ * Returns a TunePimp::ArtistResult, TunePimp::AlbumResult or
+ * TunePimp::TrackResult, or nil if the index is out of range.  Negative
+ * indices count from the end.  The index can be passed straight to
+ * TunePimp::TunePimp#select_result.
+ *
+ * Example:
+ *   best = results[0]
+ *   tp.select_result(tr, 0) if best && best.relevance > 90
+ *
+ */
+static VALUE tp_rs_aref(VALUE self, VALUE idx) {
+  tp_results_t *rs;
+  int i;
+
+  TypedData_Get_Struct(self, tp_results_t, &tp_results_type, rs);
+  i = NUM2INT(idx);
+  if (i < 0)
+    i += rs->num;
+  if (i < 0 || i >= rs->num)
+    return Qnil;
+
+  return tp_results_entry(rs, i);
+}
+
+static VALUE tp_rs_enum_size(VALUE self, VALUE args, VALUE obj) {
+  UNUSED(args);
+  UNUSED(obj);
+  return tp_rs_size(self);
+}
+
+/*
+ * Iterate over the entries of this TunePimp::Results object.
+ *
+ * Returns an Enumerator if no block is given.
+ *
+ * Example:
+ *   results.each { |r| puts "#{r.relevance}: #{r.name}" }
+ *
+ */
+static VALUE tp_rs_each(VALUE self) {
+  tp_results_t *rs;
+  int i;
+
+  RETURN_SIZED_ENUMERATOR(self, 0, 0, tp_rs_enum_size);
+  TypedData_Get_Struct(self, tp_results_t, &tp_results_type, rs);
+  for (i = 0; i < rs->num; i++)
+    rb_yield(tp_results_entry(rs, i));
+
+  return self;
+}
+
+typedef struct {
+  tp_call_t call; /* must be first (see tp_call_blocking) */
+  tp_results_t *rs;
+} tp_rcall_t;
+
+/*
+ * Read a track's results into rs with the track locked, so the count
+ * and the results come from the same lookup.  Leaves rs->results NULL
+ * if it couldn't be allocated.
+ */
+static void *tp_call_get_results(void *ptr) {
+  tp_rcall_t *rcall = ptr;
+  tp_results_t *rs = rcall->rs;
+
+  tr_Lock(rcall->call.tr);
+  rs->num = tr_GetNumResults(rcall->call.tr);
+  if ((rs->results = malloc(sizeof(result_t) * (rs->num > 0 ? rs->num : 1))) != NULL)
+    tr_GetResults(rcall->call.tr, &rs->type, rs->results, &rs->num);
+  tr_Unlock(rcall->call.tr);
+
+  return NULL;
+}
+
+/*
+ * Get the results for this TunePimp::Track object.
+ *
+ * Returns a TunePimp::Results object.  Entries are converted to
+ * TunePimp::ArtistResult, TunePimp::AlbumResult or
+ * TunePimp::TrackResult objects the first time they're accessed, so
+ * looking at the first few results of a long list is cheap.
+ *
+ * A TunePimp::ResultType::MatchedTrack result holds TunePimp::TrackResult
+ * entries, just like a TunePimp::ResultType::TrackList.  If there are
+ * no results the type is TunePimp::ResultType::None and the object is
+ * empty.
+ *
+ * Example: 
+ *   results = tr.results
+ *   if results.type == TunePimp::ResultType::TrackList
+ *     puts "Best match: #{results[0].name}" if results.size > 0
+ *   end
+ *
+ */
+static VALUE tp_tr_results(VALUE self) {
+  tp_track_t *tr;
+  tp_results_t *rs;
+  tp_rcall_t rcall;
+  VALUE ret;
+  TP_TRACK(self, tr);
+
+  if ((rs = malloc(sizeof(tp_results_t))) == NULL)
+    rb_raise(eException, "Couldn't alloc tp_results_t");
+  rs->results = NULL;
+  rs->type = eNone;
+  rs->num = 0;
+  rs->entries = Qnil;
+  rs->cache.artists = st_init_strtable();
+  rs->cache.albums = st_init_strtable();
+  ret = TypedData_Wrap_Struct(cRS, &tp_results_type, rs);
+
+  rcall.call.undo = NULL;
+  rcall.rs = rs;
+  tp_track_blocking(tr, tp_call_get_results, &rcall.call);
+  if (!rs->results)
+    rb_raise(eException, "Couldn't alloc %d results", rs->num);
+  switch (rs->type) {
+    case eNone:
+      /* nothing to look at, whatever libtunepimp says the count is */
+      rs->num = 0;
+      break;
+    case eArtistList:
+    case eAlbumList:
+    case eTrackList:
+    case eMatchedTrack:
+      break;
+    default:
+      rb_raise(eException, "Result type %d not implemented", rs->type);
+  }
+
+  rs->entries = rb_ary_new2(rs->num);
+  if (rs->num > 0)
+    rb_ary_store(rs->entries, rs->num - 1, Qnil);
+
+  return ret;
+}
+
+/*
+ * Lock this TunePimp::Track object.
+ *
+ * TODO: better documentation
+ *
+ * Note: Other Ruby threads keep running while this thread waits for
+ * the lock.
+ *
+ * Example:
+ *   tr.lock
+ *
+ */
+static VALUE tp_tr_lock(VALUE self) {
+  tp_track_t *tr;
+  tp_call_t call;
+
+  TP_TRACK(self, tr);
+  call.undo = tp_call_unlock;
+  tp_track_blocking(tr, tp_call_lock, &call);
+
+  return Qnil;
+}
+
+/*
+ * Unlock this TunePimp::Track object.
+ *
+ * TODO: better documentation
+ *
+ * Example:
+ *   tr.unlock
+ *
+ */
+static VALUE tp_tr_unlock(VALUE self) {
+  tp_track_t *tr;
+
+  /* a released track that's still locked can (and must) be unlocked */
+  tr = rb_check_typeddata(self, &tp_track_type);
+  if (!tr->tr || (tr->released && !tr->locks))
+    rb_raise(eException, "Track has already been released");
+
+  tr_Unlock(tr->tr);
+  if (tr->locks > 0)
+    tr->locks--;
+  tp_track_settle(tr);
+
+  return Qnil;
+}
+
+
+/*********************************************************************/
+/* TunePimp::Metadata methods                                        */
+/*********************************************************************/
+/*
+ * Create a new TunePimp::Metadata object.
+ *
+ * Example:
+ *   md = TunePimp::Metadata.new
+ *
+ */
+VALUE tp_md_new(VALUE klass) {
+  metadata_t *md;
+  VALUE self;
+
+  self = TypedData_Wrap_Struct(klass, &tp_md_type, NULL);
+  if ((md = md_New()) == NULL)
+    rb_raise(eException, "Couldn't allocate memory for metadata_t");
+  DATA_PTR(self) = md;
 
-static void tp_md_free(void *md) {
-  if (md) {
-    md_Delete(*(metadata_t**) md);
-    free(md);
-  }
-}
+  rb_obj_call_init(self, 0, NULL);
 
-/*********************************************************************/
-/* TunePimp::TunePimp methods                                        */
-/*********************************************************************/
-static void tp_tp_free(void *tp) {
-  if (tp) {
-    tp_Delete(* ((tunepimp_t**) tp));
-    free(tp);
-  }
+  return self;
 }
 
 /*
- * Create a new TunePimp::TunePimp object.
- *
- * Examples:
- *   # create new tunepimp object
- *   tp = TunePimp::TunePimp.new('PimpApp', 'PimpApp 1.0')
+ * Constructor for TunePimp::Metadata object.
  *
- *   # create new tunepimp object, start threads
- *   tp = TunePimp::TunePimp.new('PimpApp', 'PimpApp 1.0', true)
+ * This method is currently empty.  You should never call this method
+ * directly unless you're instantiating a derived class (ie, you know
+ * what you're doing).
  *
  */
-VALUE tp_tp_new(int argc, VALUE *argv, VALUE klass) {
-  tunepimp_t *tp;
-  VALUE self;
+static VALUE tp_md_init(VALUE self) {
+  return self;
+}
 
-  if ((tp = malloc(sizeof(tunepimp_t))) == NULL)
-    rb_raise(eException, "Couldn't allocate memory for tunepimp_t");
+/*
+ * Fields of metadata_t, as exposed by the TunePimp::Metadata accessors.
+ */
+typedef enum {
+  TP_MD_STR,
+  TP_MD_INT,
+  TP_MD_ULONG,
+  TP_MD_BOOL
+} tp_md_type_t;
+
+typedef struct {
+  const char *name;
+  size_t offset, size;
+  tp_md_type_t type;
+} tp_md_field_t;
 
-  switch (argc) {
-    case 2:
-      tp = tp_New(RSTRING(argv[0])->ptr, RSTRING(argv[1])->ptr);
+/*
+ * name, metadata_t member and type of each field.  The table, the
+ * accessors and the order they're defined in all come from this list.
+ */
+#define TP_MD_FIELD_LIST(X) \
+  X(artist, artist, TP_MD_STR) \
+  X(sort_name, sortName, TP_MD_STR) \
+  X(album, album, TP_MD_STR) \
+  X(track, track, TP_MD_STR) \
+  X(track_num, trackNum, TP_MD_INT) \
+  X(various_artist, variousArtist, TP_MD_BOOL) \
+  X(artist_id, artistId, TP_MD_STR) \
+  X(album_id, albumId, TP_MD_STR) \
+  X(track_id, trackId, TP_MD_STR) \
+  X(file_trm, fileTrm, TP_MD_STR) \
+  X(album_artist_id, albumArtistId, TP_MD_STR) \
+  X(duration, duration, TP_MD_ULONG) \
+  X(album_type, albumType, TP_MD_INT) \
+  X(album_status, albumStatus, TP_MD_INT) \
+  X(file_format, fileFormat, TP_MD_STR) \
+  X(release_year, releaseYear, TP_MD_INT) \
+  X(release_month, releaseMonth, TP_MD_INT) \
+  X(release_day, releaseDay, TP_MD_INT) \
+  X(release_country, releaseCountry, TP_MD_STR) \
+  X(num_trm_ids, numTRMIds, TP_MD_INT)
+
+#define TP_MD_FIELD(name, field, type) \
+  { #name, offsetof(metadata_t, field), sizeof(((metadata_t*) 0)->field), type },
+
+static const tp_md_field_t tp_md_fields[] = {
+  TP_MD_FIELD_LIST(TP_MD_FIELD)
+  { NULL, 0, 0, TP_MD_STR }
+};
+
+/* index of each field in tp_md_fields */
+#define TP_MD_INDEX(name, field, type) TP_MD_##name,
+enum { TP_MD_FIELD_LIST(TP_MD_INDEX) TP_MD_NUM_FIELDS };
+
+static VALUE tp_md_field_get(const metadata_t *md, const tp_md_field_t *f) {
+  const char *ptr = (const char*) md + f->offset;
+
+  switch (f->type) {
+    case TP_MD_STR:
+      return rb_str_new2(ptr);
+    case TP_MD_INT:
+      return INT2NUM(*(const int*) ptr);
+    case TP_MD_ULONG:
+      return ULONG2NUM(*(const unsigned long*) ptr);
+    case TP_MD_BOOL:
+      return *(const int*) ptr ? Qtrue : Qfalse;
+  }
+
+  return Qnil;
+}
+
+static void tp_md_field_set(metadata_t *md, const tp_md_field_t *f, VALUE val) {
+  char *ptr = (char*) md + f->offset;
+  long len;
+
+  switch (f->type) {
+    case TP_MD_STR:
+      if (NIL_P(val)) {
+        *ptr = '\0';
+      } else {
+        StringValue(val);
+        len = RSTRING_LEN(val);
+        if (len > (long) f->size - 1)
+          len = f->size - 1;
+        memcpy(ptr, RSTRING_PTR(val), len);
+        ptr[len] = '\0';
+      }
       break;
-    case 3:
-      tp = tp_NewWithArgs(RSTRING(argv[0])->ptr,
-                          RSTRING(argv[1])->ptr, 
-                          !(argv[2] == Qnil || argv[2] == Qfalse));
+    case TP_MD_INT:
+      *(int*) ptr = NIL_P(val) ? 0 : NUM2INT(val);
+      break;
+    case TP_MD_ULONG:
+      *(unsigned long*) ptr = NIL_P(val) ? 0 : NUM2ULONG(val);
+      break;
+    case TP_MD_BOOL:
+      *(int*) ptr = RTEST(val);
       break;
-    default:
-      rb_raise(rb_eArgError, "invalid argument count (not 2 or 3)");
   }
+}
 
-  self = Data_Wrap_Struct(klass, 0, tp_tp_free, tp);
-  rb_obj_call_init(self, 0, NULL);
+static int tp_md_field_eq(const metadata_t *a, const metadata_t *b, const tp_md_field_t *f) {
+  const char *pa = (const char*) a + f->offset,
+             *pb = (const char*) b + f->offset;
 
-  return self;
+  if (f->type == TP_MD_STR)
+    return !strncmp(pa, pb, f->size);
+  if (f->type == TP_MD_BOOL)
+    return !*(const int*) pa == !*(const int*) pb;
+  return !memcmp(pa, pb, f->size);
 }
 
 /*
- * Constructor for TunePimp::TunePimp object.
+ * Generate the reader and writer for a field.
+ */
+#define TP_MD_ACCESSORS(name, field, type) \
+  static VALUE tp_md_get_##name(VALUE self) { \
+    metadata_t *md; \
+    TypedData_Get_Struct(self, metadata_t, &tp_md_type, md); \
+    return tp_md_field_get(md, tp_md_fields + TP_MD_##name); \
+  } \
+  static VALUE tp_md_set_##name(VALUE self, VALUE val) { \
+    metadata_t *md; \
+    TypedData_Get_Struct(self, metadata_t, &tp_md_type, md); \
+    tp_md_field_set(md, tp_md_fields + TP_MD_##name, val); \
+    return val; \
+  }
+
+TP_MD_FIELD_LIST(TP_MD_ACCESSORS)
+
+/*
+ * Readers and writers, in tp_md_fields order.
+ */
+typedef struct {
+  VALUE (*get)(VALUE);
+  VALUE (*set)(VALUE, VALUE);
+} tp_md_accessor_t;
+
+#define TP_MD_ACCESSOR(name, field, type) { tp_md_get_##name, tp_md_set_##name },
+static const tp_md_accessor_t tp_md_accessors[TP_MD_NUM_FIELDS] = {
+  TP_MD_FIELD_LIST(TP_MD_ACCESSOR)
+};
+
+/*
+ * Convert a TunePimp::Metadata object to a hash.
  *
- * This method is currently empty.  You should never call this method
- * directly unless you're instantiating a derived class (ie, you know
- * what you're doing).
+ * Keys are the names of the accessors, as symbols.
+ *
+ * Example:
+ *   puts tr.local_metadata.to_h.inspect
  *
  */
-static VALUE tp_tp_init(VALUE self) {
-  return self;
+static VALUE tp_md_to_h(VALUE self) {
+  metadata_t *md;
+  const tp_md_field_t *f;
+  VALUE ret;
+
+  TypedData_Get_Struct(self, metadata_t, &tp_md_type, md);
+  ret = rb_hash_new();
+  for (f = tp_md_fields; f->name; f++)
+    rb_hash_aset(ret, ID2SYM(rb_intern(f->name)), tp_md_field_get(md, f));
+
+  return ret;
 }
 
 /*
- * Get the major. minor, and revision version of the TunePimp library.
+ * Compare two TunePimp::Metadata objects field by field.
+ *
+ * Returns a hash containing only the fields that differ, mapping each
+ * field name (as a symbol) to a pair of values: this object's first,
+ * then the other object's.  The comparison is done in native code, so
+ * identical metadata costs a single empty hash.
  *
  * Example:
- *   ary = tp.version
- *   puts 'TunePimp version: ' << ary.join('.')
+ *   local, server = tr.local_metadata, tr.server_metadata
+ *   local.diff(server).each do |field, (mine, theirs)|
+ *     puts "#{field}: #{mine.inspect} -> #{theirs.inspect}"
+ *   end
  *
  */
-static VALUE tp_tp_ver(VALUE self) {
-  tunepimp_t *tp;
-  int i, vals[3];
+static VALUE tp_md_diff(VALUE self, VALUE other) {
+  metadata_t *md, *o_md;
+  const tp_md_field_t *f;
   VALUE ret;
 
-  Data_Get_Struct(self, tunepimp_t, tp);
-  ret = rb_ary_new();
+  TypedData_Get_Struct(self, metadata_t, &tp_md_type, md);
+  TypedData_Get_Struct(other, metadata_t, &tp_md_type, o_md);
+
+  ret = rb_hash_new();
+  for (f = tp_md_fields; f->name; f++)
+    if (!tp_md_field_eq(md, o_md, f))
+      rb_hash_aset(ret, ID2SYM(rb_intern(f->name)),
+                   rb_assoc_new(tp_md_field_get(md, f),
+                                tp_md_field_get(o_md, f)));
 
-  tp_GetVersion(*tp, &vals[0], &vals[1], &vals[2]);
-  for (i = 0; i < 3; i++)
-    rb_ary_push(ret, INT2FIX(vals[i]));
-  
   return ret;
 }
 
 /*
- * Set the username and password for this TunePimp::TunePimp object.
+ * Do two TunePimp::Metadata objects have identical fields?
  *
  * Example:
- *   tp.set_user_info('pimpuser', 'p1mpU534')
+ *   puts 'Tags are up to date' if tr.local_metadata == tr.server_metadata
  *
  */
-static VALUE tp_tp_set_user_info(VALUE self, VALUE user, VALUE pass) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetUserInfo(*tp, RSTRING(user)->ptr, RSTRING(pass)->ptr);
-  return Qnil;
+static VALUE tp_md_eq(VALUE self, VALUE other) {
+  metadata_t *md, *o_md;
+  const tp_md_field_t *f;
+
+  if (!rb_typeddata_is_kind_of(other, &tp_md_type))
+    return Qfalse;
+
+  TypedData_Get_Struct(self, metadata_t, &tp_md_type, md);
+  TypedData_Get_Struct(other, metadata_t, &tp_md_type, o_md);
+  for (f = tp_md_fields; f->name; f++)
+    if (!tp_md_field_eq(md, o_md, f))
+      return Qfalse;
+
+  return Qtrue;
 }
 
 /*
- * Get the username and password for this TunePimp::TunePimp object.
+ * Hash code for a TunePimp::Metadata object, consistent with ==, so
+ * metadata with identical fields can be used as the same Hash key.
  *
  * Aliases:
- *   TunePimp::TunePimp#user_info
- *   TunePimp::TunePimp#get_user_info
+ *   TunePimp::Metadata#eql? is the same as TunePimp::Metadata#==
  *
  * Example:
- *   user, pass = tp.user_info
+ *   seen = {}
+ *   tp.file_ids.each { |id| (seen[tp.track(id).local_metadata] ||= []) << id }
  *
  */
-static VALUE tp_tp_get_user_info(VALUE self) {
-  tunepimp_t *tp;
-  char user[1024], pass[1024];
-  VALUE ret;
+static VALUE tp_md_hash(VALUE self) {
+  metadata_t *md;
+  const tp_md_field_t *f;
+  const char *ptr;
+  st_index_t h;
+
+  TypedData_Get_Struct(self, metadata_t, &tp_md_type, md);
+  h = rb_hash_start((st_index_t) &tp_md_type);
+  for (f = tp_md_fields; f->name; f++) {
+    ptr = (const char*) md + f->offset;
+    if (f->type == TP_MD_STR)
+      h = rb_hash_uint(h, rb_memhash(ptr, strnlen(ptr, f->size)));
+    else if (f->type == TP_MD_BOOL)
+      h = rb_hash_uint(h, !!*(const int*) ptr);
+    else
+      h = rb_hash_uint(h, rb_memhash(ptr, f->size));
+  }
 
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_GetUserInfo(*tp, user, 1024, pass, 1024);
+  return ST2FIX(rb_hash_end(h));
+}
 
-  ret = rb_ary_new();
-  rb_ary_push(ret, rb_str_new2(user));
-  rb_ary_push(ret, rb_str_new2(pass));
 
-  return ret;
+/*********************************************************************/
+/* TunePimp::Index methods                                           */
+/*********************************************************************/
+
+static tp_index_t *tp_idx_get_open(VALUE self) {
+  tp_index_t *idx;
+
+  TypedData_Get_Struct(self, tp_index_t, &tp_idx_type, idx);
+  if (!idx->hdr)
+    rb_raise(eException, "Index has been closed");
+
+  return idx;
 }
 
 /*
- * Use the UTF-8 for this TunePimp::TunePimp object?
+ * Open the rescan index at path, creating it if it doesn't exist.
  *
- * Note: Defaults to false, or ISO-8859-1 (latin1).
+ * The index remembers the final status, TRM and MusicBrainz ids of
+ * each file recorded with TunePimp::Index#record, along with its size,
+ * mtime and inode.  Pass it to TunePimp::TunePimp#add_files or
+ * TunePimp::TunePimp#add_tree with the :index option to skip (or
+ * restore) files that haven't changed since they were recorded.
+ *
+ * An index file can only be open once at a time, whether in this
+ * process or another one.
  *
  * Example:
- *   tp.use_utf8 = true
+ *   index = TunePimp::Index.new('library.tpi')
+ *   tp.add_tree('/mnt/music', :index => index, :unchanged => :skip)
  *
  */
-static VALUE tp_tp_set_use_utf8(VALUE self, VALUE utf8) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetUseUTF8(*tp, !(utf8 == Qfalse || utf8 == Qnil));
-  return Qnil;
+VALUE tp_idx_new(VALUE klass, VALUE path) {
+  tp_index_t *idx;
+  const char *err;
+  VALUE self, argv[1];
+
+  self = TypedData_Wrap_Struct(klass, &tp_idx_type, NULL);
+  if ((idx = malloc(sizeof(tp_index_t))) == NULL)
+    rb_raise(eException, "Couldn't allocate memory for tp_index_t");
+  memset(idx, 0, sizeof(tp_index_t));
+  pthread_rwlock_init(&idx->lock, NULL);
+  DATA_PTR(self) = idx;
+
+  if ((err = tp_idx_open(idx, StringValueCStr(path))) != NULL)
+    rb_raise(eException, "Couldn't open index \"%s\": %s", RSTRING_PTR(path), err);
+
+  argv[0] = path;
+  rb_obj_call_init(self, 1, argv);
+
+  return self;
+}
+
+static VALUE tp_idx_init(VALUE self, VALUE path) {
+  UNUSED(path);
+  return self;
 }
 
 /*
- * Is this TunePimp::TunePimp object using UTF-8?
- *
- * Note: False means ISO-8859-1 (latin1).
+ * Get the path of this TunePimp::Index.
  *
  * Example:
- *   puts 'Character set: ' << (tp.use_utf8 ? 'UTF-8' : 'ISO-8859-1')
+ *   puts "Using index #{index.path}"
  *
  */
-static VALUE tp_tp_get_use_utf8(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return tp_GetUseUTF8(*tp) ? Qtrue : Qfalse;
+static VALUE tp_idx_path(VALUE self) {
+  tp_index_t *idx;
+  TypedData_Get_Struct(self, tp_index_t, &tp_idx_type, idx);
+  return rb_str_new2(idx->path);
 }
 
 /*
- * Set the server and port for this TunePimp::TunePimp object.
+ * Get the number of files recorded in this TunePimp::Index.
  *
- * Note: defaults to www.musicbrainz.org, port 80.
+ * Aliases:
+ *   TunePimp::Index#length
  *
  * Example:
- *   tp.set_server('www.musicbrainz.org', 80)
+ *   puts "#{index.size} files indexed."
  *
  */
-static VALUE tp_tp_set_server(VALUE self, VALUE host, VALUE port) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetServer(*tp, RSTRING(host)->ptr, NUM2INT(port));
-  return Qnil;
+static VALUE tp_idx_size(VALUE self) {
+  tp_index_t *idx = tp_idx_get_open(self);
+  return ULL2NUM(idx->hdr->count - idx->hdr->deleted);
 }
 
 /*
- * Get the server and port for this TunePimp::TunePimp object.
+ * Get the record for a path, or nil if there isn't one.
+ *
+ * Returns a hash with the keys :status, :trm, :artist_id, :album_id,
+ * :track_id, :size, :mtime and :inode.  The record may be stale; it's
+ * only used for files whose size, mtime and inode still match.
  *
- * Aliases:
- *   TunePimp::TunePimp#server
- *   TunePimp::TunePimp#get_server
- * 
  * Example:
- *   host, port = tp.server
+ *   rec = index['/mnt/music/song.mp3']
+ *   puts rec[:track_id] if rec
  *
  */
-static VALUE tp_tp_get_server(VALUE self) {
-  tunepimp_t *tp;
-  char host[1024];
-  short port;
+static VALUE tp_idx_aref(VALUE self, VALUE path) {
+  tp_index_t *idx = tp_idx_get_open(self);
+  tp_idx_slot_t rec;
   VALUE ret;
 
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_GetServer(*tp, host, 1024, &port);
+  if (!tp_idx_get(idx, StringValueCStr(path), &rec))
+    return Qnil;
+
+  rec.trm[sizeof(rec.trm) - 1] = '\0';
+  rec.artist_id[sizeof(rec.artist_id) - 1] = '\0';
+  rec.album_id[sizeof(rec.album_id) - 1] = '\0';
+  rec.track_id[sizeof(rec.track_id) - 1] = '\0';
+
+  ret = rb_hash_new();
+  rb_hash_aset(ret, ID2SYM(rb_intern("status")), INT2FIX(rec.status));
+  rb_hash_aset(ret, ID2SYM(rb_intern("trm")), rb_str_new2(rec.trm));
+  rb_hash_aset(ret, ID2SYM(rb_intern("artist_id")), rb_str_new2(rec.artist_id));
+  rb_hash_aset(ret, ID2SYM(rb_intern("album_id")), rb_str_new2(rec.album_id));
+  rb_hash_aset(ret, ID2SYM(rb_intern("track_id")), rb_str_new2(rec.track_id));
+  rb_hash_aset(ret, ID2SYM(rb_intern("size")), ULL2NUM(rec.size));
+  rb_hash_aset(ret, ID2SYM(rb_intern("mtime")), rb_time_new((time_t) rec.mtime, 0));
+  rb_hash_aset(ret, ID2SYM(rb_intern("inode")), ULL2NUM(rec.ino));
 
-  ret = rb_ary_new();
-  rb_ary_push(ret, rb_str_new2(host));
-  rb_ary_push(ret, INT2FIX(port));
-  
   return ret;
 }
 
 /*
- * Set the proxy host and port for this TunePimp::TunePimp object.
+ * Record the current state of tracks in a TunePimp::TunePimp object,
+ * replacing any earlier records for the same paths.
  *
- * Note: Defaults to off.  Set to host '' or nil to disable.
+ * Only tracks in a final state (Recognized, Unrecognized, Verified or
+ * Saved) are recorded.  If ids is omitted, every file is considered.
+ * Returns the number of files recorded.
  *
- * Examples:
- *   # set the proxy server
- *   tp.set_proxy('proxy.home.pablotron.org', 8080)
+ * Note: Other Ruby threads keep running while the index is updated.
+ *
+ * Example:
+ *   # at the end of a run
+ *   index.record(tp)
+ *   index.close
  *
- *   # disable the proxy server
- *   tp.set_proxy(nil)
  */
-static VALUE tp_tp_set_proxy(int argc, VALUE *argv, VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
+static VALUE tp_idx_record(int argc, VALUE *argv, VALUE self) {
+  tp_index_t *idx = tp_idx_get_open(self);
+  tp_pimp_t *pimp;
+  tp_call_t call;
+  long i;
+  VALUE tp, ids, buf;
+
+  rb_scan_args(argc, argv, "11", &tp, &ids);
+  TypedData_Get_Struct(tp, tp_pimp_t, &tp_pimp_type, pimp);
+
+  call.tp = pimp->tp;
+  call.undo = NULL;
+  call.index = idx;
+  if (NIL_P(ids)) {
+    call.num_ids = tp_GetNumFileIds(pimp->tp);
+    buf = rb_str_buf_new(sizeof(int) * (call.num_ids + 1));
+    call.ids = (int*) RSTRING_PTR(buf);
+    tp_GetFileIds(pimp->tp, call.ids, call.num_ids);
+  } else {
+    ids = rb_Array(ids);
+    call.num_ids = RARRAY_LEN(ids);
+    buf = rb_str_buf_new(sizeof(int) * (call.num_ids + 1));
+    call.ids = (int*) RSTRING_PTR(buf);
+    for (i = 0; i < call.num_ids; i++)
+      call.ids[i] = NUM2INT(RARRAY_PTR(ids)[i]);
+  }
 
-  switch (argc) {
-    case 1:
-      if (argv[0] != Qnil)
-        rb_raise(rb_eArgError, "missing proxy port");
-      else
-        tp_SetProxy(*tp, "", 0);
-      break;
-    case 2:
-      if (argv[0] != Qnil)
-        tp_SetProxy(*tp, RSTRING(argv[0])->ptr, NUM2INT(argv[1]));
-      else
-        tp_SetProxy(*tp, "", 0);
+  tp_call_blocking(tp_call_index_record, &call);
+  if (call.ret < 0)
+    rb_raise(eException, "Couldn't update index: %s", strerror(errno));
 
-      break;
-    default:
-      rb_raise(rb_eArgError, "invalid argument count (not 1 or 2)");
-  }
+  RB_GC_GUARD(buf);
+  return INT2FIX(call.ret);
+}
 
-  return Qnil;
+/*
+ * Remove the record for a path.  Returns true if there was one.
+ *
+ * Example:
+ *   index.delete(path) unless File.exist?(path)
+ *
+ */
+static VALUE tp_idx_delete_path(VALUE self, VALUE path) {
+  tp_index_t *idx = tp_idx_get_open(self);
+  return tp_idx_delete(idx, StringValueCStr(path)) ? Qtrue : Qfalse;
 }
 
 /*
- * Get the proxy host and port for this TunePimp::TunePimp object.
+ * Flush this TunePimp::Index to disk.
  *
- * Note: Returns nil if there is no proxy set.
+ * Records are written through a shared mapping, so they survive the
+ * process crashing without this; it's only needed to survive the
+ * machine going down.
  *
- * Aliases:
- *   TunePimp::TunePimp#proxy
- *   TunePimp::TunePimp#get_proxy
- * 
  * Example:
- *   proxy_host, proxy_port = tp.proxy
+ *   index.sync
  *
  */
-static VALUE tp_tp_get_proxy(VALUE self) {
-  tunepimp_t *tp;
-  char host[1024];
-  short port;
-  VALUE ret;
+static VALUE tp_idx_sync(VALUE self) {
+  tp_index_t *idx = tp_idx_get_open(self);
 
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_GetProxy(*tp, host, 1024, &port);
+  pthread_rwlock_rdlock(&idx->lock);
+  if (idx->hdr)
+    msync(idx->hdr, idx->map_len, MS_SYNC);
+  pthread_rwlock_unlock(&idx->lock);
 
-  ret = Qnil;
-  if (strlen(host) > 0) {
-    ret = rb_ary_new();
-    rb_ary_push(ret, rb_str_new2(host));
-    rb_ary_push(ret, INT2FIX(port));
-  }
-  
-  return ret;
+  return self;
 }
 
 /*
- * Number of extensions supported by this TunePimp::TunePimp object.
- *
- * Aliases:
- *   TunePimp::TunePimp#num_supported_extensions
- *   TunePimp::TunePimp#get_num_supported_extensions
+ * Flush and close this TunePimp::Index.  Closing an index that's
+ * already closed does nothing.
  *
  * Example:
- *   puts "Supports #{tp.num_supported_extensions} extensions."
+ *   index.close
  *
  */
-static VALUE tp_tp_num_exts(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_GetNumSupportedExtensions(*tp));
+static VALUE tp_idx_close_index(VALUE self) {
+  tp_index_t *idx;
+  TypedData_Get_Struct(self, tp_index_t, &tp_idx_type, idx);
+  tp_idx_close(idx);
+  return Qnil;
 }
 
 /*
- * Get extensions supported by this TunePimp::TunePimp object.
- *
- * Aliases:
- *   TunePimp::TunePimp#supported_extensions
- *   TunePimp::TunePimp#get_supported_extensions
+ * Has this TunePimp::Index been closed?
  *
  * Example:
- *   puts "Extensions: \"#{tp.supported_extensions.join('", "')}\"."
+ *   index.close unless index.closed?
  *
  */
-static VALUE tp_tp_exts(VALUE self) {
-  tunepimp_t *tp;
-  char **exts;
-  int i, num;
-  VALUE ret;
-  
-  Data_Get_Struct(self, tunepimp_t, tp);
+static VALUE tp_idx_closed(VALUE self) {
+  tp_index_t *idx;
+  TypedData_Get_Struct(self, tp_index_t, &tp_idx_type, idx);
+  return idx->hdr ? Qfalse : Qtrue;
+}
 
-  num = tp_GetNumSupportedExtensions(*tp);
-  if ((exts = malloc(sizeof(char*) * num)) == NULL)
-    rb_raise(eException, "Couldn't allocate %d bytes for char**",
-             sizeof(char*) * num);
-  for (i = 0; i < num; i++)
-    if ((exts[i] = malloc(TP_EXTENSION_LEN)) == NULL)
-      rb_raise(eException, "Couldn't allocate %d bytes for char*", TP_EXTENSION_LEN);
-  
-  tp_GetSupportedExtensions(*tp, exts);
 
-  ret = rb_ary_new();
-  for (i = 0; i < num; i++) {
-    rb_ary_push(ret, rb_str_new2(exts[i]));
-    free(exts[i]);
-  }
-  free(exts);
+/*********************************************************************/
+/* TunePimp::TRMCache methods                                        */
+/*********************************************************************/
 
-  return ret;
-}
+/* default number of slots in a new cache */
+#define TP_TRMC_CAP (1 << 20)
 
 /*
- * Set the analyzer thread priority for this TunePimp::TunePimp object.
+ * Open the TRM cache at path, creating it if it doesn't exist.
+ *
+ * The cache maps a hash of each file's audio payload (with tags left
+ * out) to its TRM, so copies, renames and tag-only edits of a file
+ * never need fingerprinting again.  It's a fixed-size table that can
+ * be shared by any number of processes at once; when it fills up, old
+ * entries are evicted.  Use it with TunePimp::TunePimp#trm_cache=.
  *
- * Valid values are as follows:
- *   TunePimp::ThreadPriority::Idle
- *   TunePimp::ThreadPriority::Lowest
- *   TunePimp::ThreadPriority::Low
- *   TunePimp::ThreadPriority::Normal
- *   TunePimp::ThreadPriority::High
- *   TunePimp::ThreadPriority::Higher
- *   TunePimp::ThreadPriority::TimeCritical
+ * Options:
+ *   :capacity  number of slots (a power of two) if the cache is being
+ *              created; default 1048576, or 64MB of sparse file.
  *
  * Example:
- *   tp.analyzer_priority = TunePimp::ThreadPriority::High
+ *   cache = TunePimp::TRMCache.new('/var/cache/trm.cache')
  *
  */
-static VALUE tp_tp_set_analyzer_prio(VALUE self, VALUE prio) {
-  tunepimp_t *tp;
-  int p;
+VALUE tp_trmc_new(int argc, VALUE *argv, VALUE klass) {
+  tp_trmc_t *c;
+  const char *err;
+  unsigned long cap;
+  VALUE self, path, opts, val;
+
+  rb_scan_args(argc, argv, "11", &path, &opts);
+  cap = TP_TRMC_CAP;
+  if (!NIL_P(val = tp_opt(opts, "capacity")))
+    cap = NUM2ULONG(val);
+  if (cap < TP_TRMC_PROBES || (cap & (cap - 1)))
+    rb_raise(rb_eArgError, "capacity must be a power of two, at least %d", TP_TRMC_PROBES);
+
+  self = TypedData_Wrap_Struct(klass, &tp_trmc_type, NULL);
+  if ((c = malloc(sizeof(tp_trmc_t))) == NULL)
+    rb_raise(eException, "Couldn't allocate memory for tp_trmc_t");
+  memset(c, 0, sizeof(tp_trmc_t));
+  pthread_rwlock_init(&c->lock, NULL);
+  pthread_mutex_init(&c->stats_lock, NULL);
+  c->refs = 1;
+  DATA_PTR(self) = c;
+
+  if ((err = tp_trmc_open(c, StringValueCStr(path), cap)) != NULL)
+    rb_raise(eException, "Couldn't open TRM cache \"%s\": %s", RSTRING_PTR(path), err);
+
+  rb_obj_call_init(self, argc, argv);
 
-  p = NUM2INT(prio);
-  if (p < eIdle || p > eTimeCritical)
-    rb_raise(eException, "Thread Priority out of range");
+  return self;
+}
 
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetAnalyzerPriority(*tp, p);
-  return prio;
+static VALUE tp_trmc_init(int argc, VALUE *argv, VALUE self) {
+  UNUSED(argc);
+  UNUSED(argv);
+  return self;
 }
 
 /*
- * Get the analyzer thread priority for this TunePimp::TunePimp object.
+ * Get the cache key for the file at path: the hash and length of its
+ * audio payload, as a hex string.  Returns nil if the file can't be
+ * read.  Two files with the same key have the same audio.
  *
  * Example:
- *   if tp.analyzer_priority == TunePimp::ThreadPriority::Normal
- *     puts "Analyzer Priority is normal"
- *   end
+ *   puts 'same audio' if TunePimp::TRMCache.key(a) == TunePimp::TRMCache.key(b)
  *
  */
-static VALUE tp_tp_analyzer_prio(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_GetAnalyzerPriority(*tp));
+static VALUE tp_trmc_key(VALUE klass, VALUE path) {
+  uint64_t hash, len;
+  char buf[40];
+
+  UNUSED(klass);
+  if (!tp_payload_hash(StringValueCStr(path), &hash, &len))
+    return Qnil;
+  snprintf(buf, sizeof(buf), "%016llx-%llx", (unsigned long long) hash, (unsigned long long) len);
+
+  return rb_str_new2(buf);
+}
+
+static tp_trmc_t *tp_trmc_get_open(VALUE self) {
+  tp_trmc_t *c;
+
+  TypedData_Get_Struct(self, tp_trmc_t, &tp_trmc_type, c);
+  if (!c->hdr)
+    rb_raise(eException, "TRM cache has been closed");
+
+  return c;
 }
 
 /*
- * Get the next notification message from the TunePimp::TunePimp
- * object's message queue.
- *
- * Returns an array with the message type and file id, or nil if there
- * are no pending messages.  Here's a list of possible values for
- * message type:
- *   TunePimp::Callback::FileAdded  
- *   TunePimp::Callback::FileChanged  
- *   TunePimp::Callback::FileRemoved  
- *   TunePimp::Callback::WriteTagsComplete  
- *   TunePimp::Callback::CallbackLast 
- *
- * Aliases:
- *   TunePimp::TunePimp#notification
- *   TunePimp::TunePimp#get_notification
+ * Get the cached TRM for the audio in the file at path, or nil.
  *
  * Example:
- *   msg_type, file_id = tp.notification
+ *   trm = cache['song.mp3']
  *
  */
-static VALUE tp_tp_not(VALUE self) {
-  tunepimp_t *tp;
-  TPCallbackEnum type;
-  int file_id;
-  VALUE ret;
+static VALUE tp_trmc_aref(VALUE self, VALUE path) {
+  tp_trmc_t *c = tp_trmc_get_open(self);
+  uint64_t hash, len;
+  char trm[40];
 
-  ret = Qnil;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  if (tp_GetNotification(*tp, &type, &file_id)) {
-    ret = rb_ary_new();
-    rb_ary_push(ret, INT2FIX(type));
-    rb_ary_push(ret, INT2FIX(file_id));
-  }
+  if (!tp_payload_hash(StringValueCStr(path), &hash, &len) ||
+      !tp_trmc_get(c, hash, len, trm))
+    return Qnil;
 
-  return ret;
+  return rb_str_new2(trm);
 }
 
 /*
- * Get the next status message in the TunePimp::TunePimp status queue.
- *
- * Returns nil if there is no pending status message.
+ * Store the TRM for the audio in the file at path.
  *
- * Aliases:
- *   TunePimp::TunePimp#status
- *   TunePimp::TunePimp#get_status
- * 
  * Example:
- *   puts 'Status: ' << tp.status
+ *   cache['song.mp3'] = track.trm
  *
  */
-static VALUE tp_tp_status(VALUE self) {
-  tunepimp_t *tp;
-  char status[1024];
-  VALUE ret;
+static VALUE tp_trmc_aset(VALUE self, VALUE path, VALUE trm) {
+  tp_trmc_t *c = tp_trmc_get_open(self);
+  uint64_t hash, len;
 
-  ret = Qnil;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  if (tp_GetStatus(*tp, status, 1024))
-    ret = rb_str_new2(status);
-  
-  return ret;
+  if (!tp_payload_hash(StringValueCStr(path), &hash, &len))
+    rb_raise(eException, "Couldn't read \"%s\"", RSTRING_PTR(path));
+  tp_trmc_put(c, hash, len, StringValueCStr(trm));
+
+  return trm;
 }
 
 /*
- * Get the last error from this TunePimp::TunePimp object.
+ * Get the path of this TunePimp::TRMCache.
  *
- * Aliases:
- *   TunePimp::TunePimp#error
- *   TunePimp::TunePimp#get_error
- * 
  * Example:
- *   puts 'Error: ' << tp.error
+ *   puts "TRM cache: #{cache.path}"
  *
  */
-static VALUE tp_tp_error(VALUE self) {
-  tunepimp_t *tp;
-  char err[1024];
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_GetError(*tp, err, 1024);
-  return rb_str_new2(err);
+static VALUE tp_trmc_path(VALUE self) {
+  tp_trmc_t *c;
+  TypedData_Get_Struct(self, tp_trmc_t, &tp_trmc_type, c);
+  return rb_str_new2(c->path);
 }
 
 /*
- * Send debugging information for this TunePimp::TunePimp object to
- * stdout?
+ * Get the number of slots in this TunePimp::TRMCache.
  *
  * Example:
- *   tp.debug = true # enable debugging
+ *   puts "Room for #{cache.capacity} TRMs."
  *
  */
-static VALUE tp_tp_set_debug(VALUE self, VALUE debug) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetDebug(*tp, !(debug == Qfalse || debug == Qnil));
-  return debug;
+static VALUE tp_trmc_capacity(VALUE self) {
+  return ULL2NUM(tp_trmc_get_open(self)->hdr->cap);
 }
 
 /*
- * Is debugging enabled for this TunePimp::TunePimp object?
+ * Get this process's cache statistics: a hash with :hits, :misses and
+ * :stores.
  *
  * Example:
- *   puts 'Debugging is ' << tp.debug ? 'enabled' : 'disabled'
+ *   s = cache.stats
+ *   puts "Hit rate: #{100.0 * s[:hits] / (s[:hits] + s[:misses])}%"
  *
  */
-static VALUE tp_tp_debug(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return tp_GetDebug(*tp) ? Qtrue : Qfalse;
+static VALUE tp_trmc_stats(VALUE self) {
+  tp_trmc_t *c;
+  unsigned long hits, misses, stores;
+  VALUE ret;
+
+  TypedData_Get_Struct(self, tp_trmc_t, &tp_trmc_type, c);
+  pthread_mutex_lock(&c->stats_lock);
+  hits = c->hits;
+  misses = c->misses;
+  stores = c->stores;
+  pthread_mutex_unlock(&c->stats_lock);
+
+  ret = rb_hash_new();
+  rb_hash_aset(ret, ID2SYM(rb_intern("hits")), ULONG2NUM(hits));
+  rb_hash_aset(ret, ID2SYM(rb_intern("misses")), ULONG2NUM(misses));
+  rb_hash_aset(ret, ID2SYM(rb_intern("stores")), ULONG2NUM(stores));
+
+  return ret;
 }
 
 /*
- * Add a file to this TunePimp::TunePimp object's file list.
- *
- * Returns the ID of the file added.  Note that this method always
- * succeeds, even if the file doesn't exist or is inaccessible (although
- * in those cases, there will be an error in TunePimp::TunePimp#error).
+ * Flush this TunePimp::TRMCache to disk.
  *
  * Example:
- *   id = tp.add_file('test.mp3')
+ *   cache.sync
  *
  */
-static VALUE tp_tp_add_file(VALUE self, VALUE path) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_AddFile(*tp, RSTRING(path)->ptr));
+static VALUE tp_trmc_sync(VALUE self) {
+  tp_trmc_t *c = tp_trmc_get_open(self);
+
+  pthread_rwlock_rdlock(&c->lock);
+  if (c->hdr)
+    msync(c->hdr, c->map_len, MS_SYNC);
+  pthread_rwlock_unlock(&c->lock);
+
+  return self;
 }
 
 /*
- * Add a directory to this TunePimp::TunePimp object's file list.
- *
- * Returns the number of the files added.  If a file already exists in
- * the list, it is ignored.
+ * Close this TunePimp::TRMCache.  TunePimp::TunePimp objects still
+ * using it carry on without it.
  *
  * Example:
- *   num = tp.add_dir('My Music')
- *   puts "Added #{num} files."
+ *   cache.close
  *
  */
-static VALUE tp_tp_add_dir(VALUE self, VALUE path) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_AddDir(*tp, RSTRING(path)->ptr));
+static VALUE tp_trmc_close_cache(VALUE self) {
+  tp_trmc_t *c;
+  TypedData_Get_Struct(self, tp_trmc_t, &tp_trmc_type, c);
+  tp_trmc_close(c);
+  return Qnil;
 }
 
 /*
- * Remove a file from this TunePimp::TunePimp object's file list.
+ * Has this TunePimp::TRMCache been closed?
  *
  * Example:
- *   id = tp.add_file('test.mp3')
- *   tp.remove(id)
+ *   cache.close unless cache.closed?
  *
  */
-static VALUE tp_tp_remove(VALUE self, VALUE file_id) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_Remove(*tp, NUM2INT(file_id));
-  return Qnil;
+static VALUE tp_trmc_closed(VALUE self) {
+  tp_trmc_t *c;
+  TypedData_Get_Struct(self, tp_trmc_t, &tp_trmc_type, c);
+  return c->hdr ? Qfalse : Qtrue;
 }
 
+
+/*********************************************************************/
+/* TunePimp::Proxy methods                                           */
+/*********************************************************************/
+
+/* default lifetime of a cached response, in seconds */
+#define TP_PROXY_TTL (24 * 60 * 60)
+
 /*
- * Get the number of files in this TunePimp::TunePimp object's file list.
+ * Start a caching HTTP proxy on 127.0.0.1, storing responses in the
+ * directory cache_dir (created if it doesn't exist).
  *
- * Aliases:
- *   TunePimp::TunePimp#num_files
- *   TunePimp::TunePimp#get_num_files
+ * Lookups repeat a lot when a library is rescanned, and several
+ * TunePimp::TunePimp objects often look up the same TRM at the same
+ * time; the proxy answers the first from its cache and folds the
+ * second into a single upstream request.  Use it with
+ * TunePimp::Proxy#attach.  Expired responses are deleted from
+ * cache_dir every few minutes.
+ *
+ * Options:
+ *   :ttl   seconds a cached response stays fresh; default 86400.
+ *   :port  port to listen on; default 0, meaning any free port.
  *
  * Example:
- *   puts "There are #{tp.num_files} files."
+ *   proxy = TunePimp::Proxy.new('/var/cache/tunepimp', :ttl => 3600)
+ *   proxy.attach(tp)
  *
  */
-static VALUE tp_tp_num_files(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_GetNumFiles(*tp));
+VALUE tp_proxy_new(int argc, VALUE *argv, VALUE klass) {
+  tp_proxy_t *p;
+  const char *err;
+  long ttl;
+  int port;
+  VALUE self, dir, opts, val;
+
+  rb_scan_args(argc, argv, "11", &dir, &opts);
+  ttl = TP_PROXY_TTL;
+  if (!NIL_P(val = tp_opt(opts, "ttl")))
+    ttl = NUM2LONG(val);
+  port = 0;
+  if (!NIL_P(val = tp_opt(opts, "port")))
+    port = NUM2INT(val);
+  if (ttl < 0)
+    rb_raise(rb_eArgError, "ttl can't be negative");
+  if (port < 0 || port > 65535)
+    rb_raise(rb_eArgError, "invalid port %d", port);
+
+  self = TypedData_Wrap_Struct(klass, &tp_proxy_type, NULL);
+  if ((p = malloc(sizeof(tp_proxy_t))) == NULL)
+    rb_raise(eException, "Couldn't allocate memory for tp_proxy_t");
+  memset(p, 0, sizeof(tp_proxy_t));
+  p->fd = p->wake[0] = p->wake[1] = -1;
+  p->refs = 1;
+  p->ttl = ttl;
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->cond, NULL);
+  DATA_PTR(self) = p;
+
+  if ((p->dir = strdup(StringValueCStr(dir))) == NULL)
+    rb_raise(eException, "Couldn't allocate memory for proxy cache path");
+  if ((err = tp_proxy_start(p, port)) != NULL)
+    rb_raise(eException, "Couldn't start proxy in \"%s\": %s", p->dir, err);
+
+  rb_obj_call_init(self, argc, argv);
+
+  return self;
+}
+
+static VALUE tp_proxy_init(int argc, VALUE *argv, VALUE self) {
+  UNUSED(argc);
+  UNUSED(argv);
+  return self;
+}
+
+static tp_proxy_t *tp_proxy_get_open(VALUE self) {
+  tp_proxy_t *p;
+
+  TypedData_Get_Struct(self, tp_proxy_t, &tp_proxy_type, p);
+  if (!p->running)
+    rb_raise(eException, "Proxy has been closed");
+
+  return p;
 }
 
 /*
- * Get the number of TRMs in this TunePimp::TunePimp object's that
- * haven't been submitted to the server yet.
- *
- * Aliases:
- *   TunePimp::TunePimp#num_unsubmitted
- *   TunePimp::TunePimp#get_num_unsubmitted
+ * Point a TunePimp::TunePimp object at this proxy.  The proxy is kept
+ * alive for as long as tp is.
  *
  * Example:
- *   puts "There are #{tp.num_unsubmitted} unsubmitted TRMs."
+ *   proxy.attach(tp)
  *
  */
-static VALUE tp_tp_num_unsub(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_GetNumUnsubmitted(*tp));
+static VALUE tp_proxy_attach(VALUE self, VALUE tp_obj) {
+  tp_proxy_t *p = tp_proxy_get_open(self);
+  tp_pimp_t *pimp;
+
+  TypedData_Get_Struct(tp_obj, tp_pimp_t, &tp_pimp_type, pimp);
+  tp_SetProxy(pimp->tp, "127.0.0.1", p->port);
+  if (pimp->journal)
+    tp_jrnl_settings(pimp->journal, pimp->tp);
+  rb_iv_set(tp_obj, "@proxy", self);
+
+  return self;
 }
 
 /*
- * Get the number of unsaved items in this TunePimp::TunePimp object.
+ * Get the port this TunePimp::Proxy is listening on.
  *
- * Aliases:
- *   TunePimp::TunePimp#num_unsaved_items
- *   TunePimp::TunePimp#get_num_unsaved_items
+ * Example:
+ *   tp.set_proxy('127.0.0.1', proxy.port)
+ *
+ */
+static VALUE tp_proxy_port(VALUE self) {
+  tp_proxy_t *p;
+  TypedData_Get_Struct(self, tp_proxy_t, &tp_proxy_type, p);
+  return INT2FIX(p->port);
+}
+
+/*
+ * Get the cache directory of this TunePimp::Proxy.
  *
  * Example:
- *   puts "There are #{tp.num_unsaved_items} unsaved items."
+ *   puts "Caching lookups in #{proxy.cache_dir}"
  *
  */
-static VALUE tp_tp_num_unsaved_items(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_GetNumUnsavedItems(*tp));
+static VALUE tp_proxy_cache_dir(VALUE self) {
+  tp_proxy_t *p;
+  TypedData_Get_Struct(self, tp_proxy_t, &tp_proxy_type, p);
+  return rb_str_new2(p->dir);
 }
 
 /*
- * Get the number of tracks in each status category in this
- * TunePimp::TunePimp object.
+ * Get the number of seconds a cached response stays fresh.
  *
- * Returns an array that can be indexed via TunePimp::Status.  Here's a
- * brief description of each TunePimp::Status type:
+ * Example:
+ *   puts "Responses are cached for #{proxy.ttl}s."
  *
- *   * TunePimp::Status::Unrecognized: TunePimp was not able to match
- *     this track.
- *   * TunePimp::Status::Recognized: Tunepimp recognized this track.
- *   * TunePimp::Status::Pending: This track is waiting for TunePimp to
- *     process it.
- *   * TunePimp::Status::TRMLookup: TunePimp is performing a TRM lookup
- *     on this track.
- *   * TunePimp::Status::TRMCollision: TunePimp has detected a TRM
- *     collision for this track. The user must select which of the
- *     matching TRMs to use to finish the recognition process.
- *   * TunePimp::Status::FileLookup: TunePimp is doing a metadata lookup
- *     on this file.
- *   * TunePimp::Status::UserSelection: The MB server has returned more
- *     than one possible match for the track. The user must select a
- *     match to continue the lookup process.
- *   * TunePimp::Status::Verified: The user has verified the matched
- *     track and TunePimp is getting ready to save the changes to disk.
- *   * TunePimp::Status::Deleted: This track has been deleted from
- *     TunePimp, but its reference count has not reached zero yet.
- *   * TunePimp::Status::Error: An error occured during the lookup of
- *     this track. 
+ */
+static VALUE tp_proxy_ttl(VALUE self) {
+  tp_proxy_t *p;
+  TypedData_Get_Struct(self, tp_proxy_t, &tp_proxy_type, p);
+  return LONG2NUM(p->ttl);
+}
+
+/*
+ * Get this proxy's statistics: a hash with :requests, :hits (served
+ * from the cache), :misses (sent upstream), :coalesced (answered by
+ * an identical request already in flight), :errors and :pruned
+ * (expired cache files deleted).
  *
  * Example:
- *   num = tp.track_counts(TunePimp::Status::Recognized)
- *   puts "There are #{num} recognized tracks."
+ *   s = proxy.stats
+ *   puts "#{s[:hits] + s[:coalesced]} of #{s[:requests]} lookups saved"
  *
  */
-static VALUE tp_tp_track_counts(VALUE self) {
-  tunepimp_t *tp;
-  int i, counts[eLastStatus];
+static VALUE tp_proxy_stats(VALUE self) {
+  tp_proxy_t *p;
+  unsigned long requests, hits, misses, coalesced, errors, pruned;
   VALUE ret;
 
-  ret = Qnil;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  if (tp_GetTrackCounts(*tp, counts, eLastStatus)) {
-    ret = rb_ary_new();
-    for (i = 0; i < eLastStatus; i++)
-      rb_ary_push(ret, INT2FIX(counts[i]));
-  }
+  TypedData_Get_Struct(self, tp_proxy_t, &tp_proxy_type, p);
+  pthread_mutex_lock(&p->lock);
+  requests = p->requests;
+  hits = p->hits;
+  misses = p->misses;
+  coalesced = p->coalesced;
+  errors = p->errors;
+  pruned = p->pruned;
+  pthread_mutex_unlock(&p->lock);
+
+  ret = rb_hash_new();
+  rb_hash_aset(ret, ID2SYM(rb_intern("requests")), ULONG2NUM(requests));
+  rb_hash_aset(ret, ID2SYM(rb_intern("hits")), ULONG2NUM(hits));
+  rb_hash_aset(ret, ID2SYM(rb_intern("misses")), ULONG2NUM(misses));
+  rb_hash_aset(ret, ID2SYM(rb_intern("coalesced")), ULONG2NUM(coalesced));
+  rb_hash_aset(ret, ID2SYM(rb_intern("errors")), ULONG2NUM(errors));
+  rb_hash_aset(ret, ID2SYM(rb_intern("pruned")), ULONG2NUM(pruned));
 
   return ret;
 }
 
 /*
- * Return the number of files in this TunePimp::TunePimp object's file
- * list.
- *
- * Aliases:
- *   TunePimp::TunePimp#num_file_ids
- *   TunePimp::TunePimp#get_num_file_ids
+ * Stop this TunePimp::Proxy, after letting requests in progress
+ * finish.  Attached TunePimp::TunePimp objects will fail their lookups
+ * until they're given another proxy (or set_proxy(nil)).  A proxy
+ * that's garbage collected without being closed stops accepting
+ * straight away, but finishes its requests in the background.
  *
  * Example:
- *   puts "There are #{tp.num_file_ids} files in this list."
+ *   proxy.close
  *
  */
-static VALUE tp_tp_num_file_ids(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_GetNumFileIds(*tp));
+static VALUE tp_proxy_close(VALUE self) {
+  tp_proxy_t *p;
+
+  TypedData_Get_Struct(self, tp_proxy_t, &tp_proxy_type, p);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(tp_proxy_stop, p, NULL, NULL);
+#else
+  tp_proxy_stop(p);
+#endif
+
+  return Qnil;
 }
 
-/* 
- * Get the file ids in this TunePimp::TunePimp object's file list.
+/*
+ * Has this TunePimp::Proxy been closed?
  *
- * Aliases:
- *   TunePimp::TunePimp#file_ids
- *   TunePimp::TunePimp#get_file_ids
- * 
  * Example:
- *   puts "File IDs: #{tp.file_ids.join(',')}"
+ *   proxy.close unless proxy.closed?
  *
  */
-static VALUE tp_tp_file_ids(VALUE self) {
-  tunepimp_t *tp;
-  int i, *ids, num, size;
-  VALUE ret;
+static VALUE tp_proxy_closed(VALUE self) {
+  tp_proxy_t *p;
+  TypedData_Get_Struct(self, tp_proxy_t, &tp_proxy_type, p);
+  return p->running ? Qfalse : Qtrue;
+}
+
+
+/*********************************************************************/
+/* TunePimp::Pool methods                                            */
+/*********************************************************************/
+
+/*
+ * A set of TunePimp::TunePimp objects used as one.  File ids handed
+ * out by the pool are local_id * num + shard, so they're unique across
+ * the pool and map back to their instance without a lookup table.
+ * The instances themselves live in @instances.
+ */
+typedef struct {
+  int num, next;
+  tp_pimp_t **pimps;
+  int wake[2];
+} tp_pool_t;
+
+static void tp_pool_free(void *ptr) {
+  tp_pool_t *pool = ptr;
+
+  if (pool) {
+    if (pool->wake[0] >= 0) {
+      close(pool->wake[0]);
+      close(pool->wake[1]);
+    }
+    free(pool->pimps);
+    free(pool);
+  }
+}
 
-  Data_Get_Struct(self, tunepimp_t, tp);
-  num = tp_GetNumFileIds(*tp);
-  size = sizeof(int) * num;
-  if ((ids = malloc(size)) == NULL)
-    rb_raise(eException, "Couldn't alloc %d bytes for int*", size);
-  tp_GetFileIds(*tp, ids, num);
+static size_t tp_pool_memsize(const void *ptr) {
+  const tp_pool_t *pool = ptr;
+  return sizeof(tp_pool_t) + sizeof(tp_pimp_t*) * pool->num;
+}
 
-  ret = rb_ary_new();
-  for (i = 0; i < num; i++)
-    rb_ary_push(ret, INT2FIX(ids[i]));
-  free(ids);
+static const rb_data_type_t tp_pool_type = {
+  "TunePimp::Pool",
+  { 0, tp_pool_free, tp_pool_memsize, TP_COMPACT(0) },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
 
-  return ret;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+/*
+ * Pin the calling thread to the CPUs in cpus (an Integer or an Array
+ * of them), saving its old mask in old.
+ */
+static void tp_pool_pin(VALUE cpus, cpu_set_t *old) {
+  cpu_set_t set;
+  long i;
+  int cpu;
+
+  cpus = rb_Array(cpus);
+  CPU_ZERO(&set);
+  for (i = 0; i < RARRAY_LEN(cpus); i++) {
+    cpu = NUM2INT(RARRAY_PTR(cpus)[i]);
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+      rb_raise(rb_eArgError, "invalid CPU %d", cpu);
+    CPU_SET(cpu, &set);
+  }
+
+  pthread_getaffinity_np(pthread_self(), sizeof(cpu_set_t), old);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set))
+    rb_raise(eException, "Couldn't pin to CPUs %s: %s",
+             RSTRING_PTR(rb_inspect(cpus)), strerror(errno));
+}
+#endif /* HAVE_PTHREAD_SETAFFINITY_NP */
+
+/* create one instance; args holds client, version and start_threads */
+static VALUE tp_pool_create(VALUE ptr) {
+  VALUE *args = (VALUE*) ptr;
+  return rb_funcall2(cTP, rb_intern("new"), args[2] == Qundef ? 2 : 3, args);
 }
 
 /*
- * Get the TunePimp::Track associated with a given file ID.
+ * Create a TunePimp::Pool of num TunePimp::TunePimp objects, each
+ * created with TunePimp::TunePimp.new(client, version[, start_threads]).
  *
- * Returns nil if the given file ID is invalid.
+ * A TunePimp::TunePimp has a single analyzer thread, so it keeps
+ * roughly one core busy.  A pool spreads files over several of them:
+ * files are assigned by directory, so an album stays together on one
+ * instance, and the pool's file ids, notifications and counts cover all
+ * of them.  Instances are yielded to the block (if given) as they're
+ * created, so they can all be set up the same way.
+ *
+ * Options:
+ *   :cpus  pin instance i's threads to cpus[i % cpus.size], either a
+ *          CPU number or an array of them (linux only).
  *
  * Example:
- *   track = tp.get_track(file_id)
+ *   pool = TunePimp::Pool.new(16, 'PimpApp', 'PimpApp 1.0', :cpus => (0...16).to_a) do |tp|
+ *     tp.set_server('musicbrainz.org', 80)
+ *     tp.rename_files = false
+ *   end
  *
  */
-static VALUE tp_tp_track(VALUE self, VALUE file_id) {
-  tunepimp_t *tp;
-  track_t *tr;
-  VALUE track;
+VALUE tp_pool_new(int argc, VALUE *argv, VALUE klass) {
+  tp_pool_t *pool;
+  VALUE self, num, client, version, start, opts, cpus, insts, inst, args[3];
+  long i;
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+  cpu_set_t old;
+  int state;
+#endif
+
+  rb_scan_args(argc, argv, "32", &num, &client, &version, &start, &opts);
+  if (TYPE(start) == T_HASH && NIL_P(opts)) {
+    opts = start;
+    start = Qundef;
+  } else if (argc < 4) {
+    start = Qundef;
+  }
+  if (NUM2INT(num) < 1 || NUM2INT(num) > 4096)
+    rb_raise(rb_eArgError, "pool size must be between 1 and 4096");
+  if (!NIL_P(cpus = tp_opt(opts, "cpus"))) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    cpus = rb_Array(cpus);
+    if (!RARRAY_LEN(cpus))
+      rb_raise(rb_eArgError, "cpus can't be empty");
+#else
+    rb_notimplement();
+#endif
+  }
 
-  if ((tr = malloc(sizeof(track_t))) == NULL)
-    rb_raise(eException, "Couldn't allocate %d bytes for track_t", sizeof(track_t));
+  self = TypedData_Wrap_Struct(klass, &tp_pool_type, NULL);
+  if ((pool = malloc(sizeof(tp_pool_t))) == NULL)
+    rb_raise(eException, "Couldn't allocate memory for tp_pool_t");
+  memset(pool, 0, sizeof(tp_pool_t));
+  pool->wake[0] = pool->wake[1] = -1;
+  DATA_PTR(self) = pool;
+
+  if ((pool->pimps = malloc(sizeof(tp_pimp_t*) * NUM2INT(num))) == NULL)
+    rb_raise(eException, "Couldn't allocate memory for pool");
+  if (pipe(pool->wake))
+    rb_raise(eException, "Couldn't create wake pipe: %s", strerror(errno));
+  for (i = 0; i < 2; i++) {
+    fcntl(pool->wake[i], F_SETFL, fcntl(pool->wake[i], F_GETFL) | O_NONBLOCK);
+    fcntl(pool->wake[i], F_SETFD, FD_CLOEXEC);
+  }
 
-  Data_Get_Struct(self, tunepimp_t, tp);
-  if ((*tr = tp_GetTrack(*tp, NUM2INT(file_id))) != NULL) {
-    track = Data_Wrap_Struct(cTr, 0, tp_tp_free, tr);
-    rb_obj_call_init(track, 0, NULL);
-  } else {
-    free(tr);
-    track = Qnil;
+  insts = rb_ary_new2(NUM2INT(num));
+  rb_iv_set(self, "@instances", insts);
+  args[0] = client;
+  args[1] = version;
+  args[2] = start;
+  for (i = 0; i < NUM2INT(num); i++) {
+    /* libtunepimp's threads inherit the mask of the thread creating them */
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+    if (!NIL_P(cpus))
+      tp_pool_pin(RARRAY_PTR(cpus)[i % RARRAY_LEN(cpus)], &old);
+    inst = rb_protect(tp_pool_create, (VALUE) args, &state);
+    if (!NIL_P(cpus))
+      pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &old);
+    if (state)
+      rb_jump_tag(state);
+#else
+    inst = tp_pool_create((VALUE) args);
+#endif
+
+    TypedData_Get_Struct(inst, tp_pimp_t, &tp_pimp_type, pool->pimps[i]);
+    rb_ary_push(insts, inst);
+    pool->num++;
+    if (rb_block_given_p())
+      rb_yield(inst);
   }
-  
-  return track;
+  rb_obj_freeze(insts);
+
+  rb_obj_call_init(self, argc, argv);
+
+  return self;
+}
+
+static VALUE tp_pool_init(int argc, VALUE *argv, VALUE self) {
+  UNUSED(argc);
+  UNUSED(argv);
+  return self;
 }
 
 /*
- * Release TunePimp::Track from TunePimp::TunePimp object.
+ * Get the TunePimp::TunePimp objects in this pool, as a frozen array.
  *
  * Example:
- *   tp.release_track(track)
+ *   pool.instances.each { |tp| tp.analyzer_priority = TunePimp::Priority::Low }
  *
  */
-static VALUE tp_tp_release_track(VALUE self, VALUE track) {
-  tunepimp_t *tp;
-  track_t *tr;
-
-  Data_Get_Struct(self, tunepimp_t, tp);
-  Data_Get_Struct(track, track_t, tr);
-  tp_ReleaseTrack(*tp, *tr);
-
-  return Qnil;
+static VALUE tp_pool_instances(VALUE self) {
+  return rb_iv_get(self, "@instances");
 }
 
 /*
- * Wake up this TunePimp::TunePimp object to look for work to do.
+ * Get the number of TunePimp::TunePimp objects in this pool.
  *
- * Note: You have to call this every time you change a TunePimp::Track's
- * status with TunePimp::Track#set_status, or the changes won't be
- * saved.
+ * Aliases:
+ *   TunePimp::Pool#size
+ *   TunePimp::Pool#length
  *
  * Example:
- *   tp.wake(track)
+ *   puts "Using #{pool.size} analyzers."
  *
  */
-static VALUE tp_tp_wake(VALUE self, VALUE track) {
-  tunepimp_t *tp;
-  track_t *tr;
-
-  Data_Get_Struct(self, tunepimp_t, tp);
-  Data_Get_Struct(track, track_t, tr);
-  tp_Wake(*tp, *tr);
-
-  return Qnil;
+static VALUE tp_pool_size(VALUE self) {
+  tp_pool_t *pool;
+  TypedData_Get_Struct(self, tp_pool_t, &tp_pool_type, pool);
+  return INT2FIX(pool->num);
 }
 
 /*
- * Select a result returned by TunePimp::Track#results.
- *
- * Returns TunePimp::Error:InvalidIndex if index is invalid
+ * Call the block with each TunePimp::TunePimp object in this pool.
  *
  * Example:
- *   tp.select_result(track, 5)
+ *   pool.each { |tp| tp.set_user_info(user, pass) }
  *
  */
-static VALUE tp_tp_select_result(VALUE self, VALUE track, VALUE idx) {
-  tunepimp_t *tp;
-  track_t *tr;
+static VALUE tp_pool_each(VALUE self) {
+  VALUE insts = rb_iv_get(self, "@instances");
+  long i;
+
+  for (i = 0; i < RARRAY_LEN(insts); i++)
+    rb_yield(RARRAY_PTR(insts)[i]);
+
+  return self;
+}
+
+/* pool-wide file id for a local one (nil stays nil) */
+static VALUE tp_pool_gid(tp_pool_t *pool, int shard, VALUE id) {
+  if (NIL_P(id))
+    return Qnil;
+  return INT2NUM((long) FIX2INT(id) * pool->num + shard);
+}
+
+/* 
+ * Split a pool-wide file id into its instance and local id.  Returns
+ * the instance.
+ */
+static VALUE tp_pool_split(VALUE self, VALUE id, VALUE *local) {
+  tp_pool_t *pool;
+  long gid = NUM2LONG(id);
 
-  Data_Get_Struct(self, tunepimp_t, tp);
-  Data_Get_Struct(track, track_t, tr);
-  return INT2FIX(tp_SelectResult(*tp, *tr, NUM2INT(idx)));
+  TypedData_Get_Struct(self, tp_pool_t, &tp_pool_type, pool);
+  if (gid < 0)
+    rb_raise(rb_eArgError, "invalid file id %ld", gid);
+  *local = INT2FIX(gid / pool->num);
+
+  return RARRAY_PTR(rb_iv_get(self, "@instances"))[gid % pool->num];
 }
 
 /*
- * Discard all MusicBrainz idenitifiers and identify this file again.
- * The status is set back to TunePimp::Status::Pending which causes the
- * whole identification process to start again, including TRM
- * generation.
+ * Get the TunePimp::TunePimp object a path would be added to, and its
+ * index in TunePimp::Pool#instances.
  *
  * Example:
- *   tp.misidentified(id)
+ *   tp, i = pool.shard('/mnt/music/Artist/Album/01.mp3')
  *
  */
-static VALUE tp_tp_misidentified(VALUE self, VALUE file_id) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_Misidentified(*tp, NUM2INT(file_id));
-  return Qnil;
+static VALUE tp_pool_shard(VALUE self, VALUE path) {
+  tp_pool_t *pool;
+  int i;
+
+  TypedData_Get_Struct(self, tp_pool_t, &tp_pool_type, pool);
+  i = tp_shard(StringValueCStr(path), pool->num);
+
+  return rb_ary_new3(2, RARRAY_PTR(rb_iv_get(self, "@instances"))[i], INT2FIX(i));
 }
 
 /*
- * Mark a file as misidentified. The status is set back to
- * TunePimp::Status::FileLookup which causes file lookup to be done on
- * the file. Any MusicBrainz ids that have been downloaded for this file
- * are ignored and a lookup from the metadata is done in order to find
- * the right file on the MB server.
+ * Get the TunePimp::TunePimp object a pool file id belongs to, and the
+ * file's id within that object.
  *
  * Example:
- *   tp.identify_again(id)
+ *   tp, local_id = pool.locate(id)
+ *   tp.misidentified(local_id)
  *
  */
-static VALUE tp_tp_identify_again(VALUE self, VALUE file_id) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_IdentifyAgain(*tp, NUM2INT(file_id));
-  return Qnil;
+static VALUE tp_pool_locate(VALUE self, VALUE id) {
+  VALUE local, inst = tp_pool_split(self, id, &local);
+  return rb_ary_new3(2, inst, local);
 }
 
 /*
- * Write tags for specified file IDs.  Only files in the state
- * TunePimp::Status::Recognized will be written.  If
- * TunePimp::TunePimp::rename_files is enabled, the files are also
- * renamed.
- *
- * Returns false if a file ID was invalid or if not all the files were
- * in the state TunePimp::Status::Recognized.
- *
- * Examples:
- *   # write tags for files with the specified file IDs
- *   tp.write_tags(1, 5 , 5)
+ * Add a file to the pool, on the instance its directory maps to.
+ * Returns the file's pool id.
  *
- *   # write tags for all files in Recognized state
- *   tp.write_tags
+ * Example:
+ *   id = pool.add_file('test.mp3')
  *
  */
-static VALUE tp_tp_write_tags(int argc, VALUE *argv, VALUE self) {
-  tunepimp_t *tp;
-  int i, *ids, size, r;
+static VALUE tp_pool_add_file(VALUE self, VALUE path) {
+  tp_pool_t *pool;
+  VALUE inst;
+  int i;
 
-  ids = NULL;
-  if (argc > 0) {
-    size = sizeof(int) * argc;
-    if ((ids = malloc(size)) == NULL)
-      rb_raise(eException, "Couldn't alloc %d bytes for int*", size);
-    for (i = 0; i < argc; i++)
-      ids[i] = NUM2INT(argv[i]);
-  }
+  TypedData_Get_Struct(self, tp_pool_t, &tp_pool_type, pool);
+  i = tp_shard(StringValueCStr(path), pool->num);
+  inst = RARRAY_PTR(rb_iv_get(self, "@instances"))[i];
 
-  Data_Get_Struct(self, tunepimp_t, tp);
-  r = INT2FIX(tp_WriteTags(*tp, ids, argc)) ? Qtrue : Qfalse;
-  if (ids)
-    free(ids);
-  
-  return r ? Qtrue : Qfalse;
+  return tp_pool_gid(pool, i, rb_funcall(inst, rb_intern("add_file"), 1, path));
 }
 
 /*
- * Add a track ID, TRM pair to the unsubmitted TRM queue.  You'll have
- * to call TunePimp::TunePimp#submit_trms to actually submit the queue.
- *
- * Aliases:
- *   TunePimp::TunePimp#add_trm
- *   TunePimp::TunePimp#add_trm_submission
+ * Add a list of files to the pool; see TunePimp::TunePimp#add_files
+ * for the options.  Returns an array of pool ids, in the same order as
+ * paths.
  *
  * Example:
- *   tp.add_trm(track, trm)
+ *   ids = pool.add_files(paths, :index => index)
  *
  */
-static VALUE tp_tp_add_trm(VALUE self, VALUE tr_id, VALUE trm_id) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_AddTRMSubmission(*tp, RSTRING(tr_id)->ptr, RSTRING(trm_id)->ptr);
-  return Qnil;
+static VALUE tp_pool_add_files(int argc, VALUE *argv, VALUE self) {
+  tp_pool_t *pool;
+  VALUE paths, opts, path, insts, groups, where, ids, ret, *args;
+  long i, j;
+  int shard;
+
+  rb_scan_args(argc, argv, "11", &paths, &opts);
+  TypedData_Get_Struct(self, tp_pool_t, &tp_pool_type, pool);
+  insts = rb_iv_get(self, "@instances");
+  paths = rb_Array(paths);
+
+  /* group the paths by instance, remembering where each came from */
+  groups = rb_ary_new2(pool->num);
+  where = rb_ary_new2(pool->num);
+  for (i = 0; i < pool->num; i++) {
+    rb_ary_push(groups, rb_ary_new());
+    rb_ary_push(where, rb_ary_new());
+  }
+  for (i = 0; i < RARRAY_LEN(paths); i++) {
+    path = RARRAY_PTR(paths)[i];
+    shard = tp_shard(StringValueCStr(path), pool->num);
+    rb_ary_push(RARRAY_PTR(groups)[shard], path);
+    rb_ary_push(RARRAY_PTR(where)[shard], LONG2NUM(i));
+  }
+
+  ret = rb_ary_new2(RARRAY_LEN(paths));
+  for (i = 0; i < pool->num; i++) {
+    if (!RARRAY_LEN(RARRAY_PTR(groups)[i]))
+      continue;
+    args = RARRAY_PTR(groups) + i;
+    ids = NIL_P(opts) ?
+      rb_funcall(RARRAY_PTR(insts)[i], rb_intern("add_files"), 1, *args) :
+      rb_funcall(RARRAY_PTR(insts)[i], rb_intern("add_files"), 2, *args, opts);
+    for (j = 0; j < RARRAY_LEN(ids); j++)
+      rb_ary_store(ret, NUM2LONG(RARRAY_PTR(RARRAY_PTR(where)[i])[j]),
+                   tp_pool_gid(pool, i, RARRAY_PTR(ids)[j]));
+  }
+
+  return ret;
 }
 
 /*
- * Submit queued TRMs to musicbrainz.
- *
- * Returns TunePimp::Error::Ok on success and
- * TunePimp::Error::SubmitError on error.
+ * Add every supported file under a directory tree to the pool; see
+ * TunePimp::TunePimp#add_tree for the options.  Each directory's files
+ * go to the instance it maps to.  Returns the number of files added.
  *
  * Example:
- *   tp.submit_trms
+ *   num = pool.add_tree('/mnt/music', :threads => 16)
  *
  */
-static VALUE tp_tp_submit_trms(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_SubmitTRMs(*tp));
+static VALUE tp_pool_add_tree(int argc, VALUE *argv, VALUE self) {
+  tp_pool_t *pool;
+  tp_walk_t walk;
+  tp_call_t *call;
+  VALUE path, opts, threads, buf, ret;
+  int i;
+
+  rb_scan_args(argc, argv, "11", &path, &opts);
+  TypedData_Get_Struct(self, tp_pool_t, &tp_pool_type, pool);
+
+  memset(&walk, 0, sizeof(walk));
+  walk.threads = TP_WALK_THREADS;
+  if (!NIL_P(threads = tp_opt(opts, "threads")))
+    walk.threads = NUM2INT(threads);
+  if (walk.threads < 1 || walk.threads > 256)
+    rb_raise(rb_eArgError, "threads must be between 1 and 256");
+  walk.follow = RTEST(tp_opt(opts, "follow_symlinks"));
+  walk.call.index = tp_idx_opts(opts, &walk.call.restore);
+  walk.call.tp = pool->pimps[0]->tp;
+
+  buf = rb_str_buf_new(sizeof(tp_call_t) * pool->num);
+  walk.shards = (tp_call_t*) RSTRING_PTR(buf);
+  walk.num_shards = pool->num;
+  memset(walk.shards, 0, sizeof(tp_call_t) * pool->num);
+  for (i = 0; i < pool->num; i++) {
+    call = walk.shards + i;
+    call->tp = pool->pimps[i]->tp;
+    call->trmc = pool->pimps[i]->trmc;
+    call->pending = &pool->pimps[i]->pending;
+    call->index = walk.call.index;
+    call->restore = walk.call.restore;
+  }
+  walk.call.path = tp_strdup(path);
+
+  ret = rb_ensure(tp_walk_run, (VALUE) &walk, tp_walk_free, (VALUE) &walk);
+  for (i = 0; i < pool->num; i++)
+    tp_tp_account(pool->pimps[i]);
+  RB_GC_GUARD(opts);
+  RB_GC_GUARD(buf);
+
+  return ret;
 }
 
 /*
- * Rename files?  If enabled, files are renamed as specified in the
- * TunePimp::TunePimp#file_mask file mask.
- *
- * Enabled by default.
+ * Remove a file from the pool.
  *
  * Example:
- *   tp.rename_files = true
+ *   pool.remove(id)
  *
  */
-static VALUE tp_tp_set_rename_files(VALUE self, VALUE rename) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetRenameFiles(*tp, !(rename == Qfalse || rename == Qnil));
-  return Qnil;
+static VALUE tp_pool_remove(VALUE self, VALUE id) {
+  VALUE local, inst = tp_pool_split(self, id, &local);
+  return rb_funcall(inst, rb_intern("remove"), 1, local);
 }
 
 /*
- * Get the TunePimp::TunePimp#rename_files flag.
+ * Get the TunePimp::Track for a pool file id, or nil.  The track
+ * belongs to (and reports file ids local to) the instance holding the
+ * file; see TunePimp::Pool#locate.
  *
  * Example:
- *   puts "Renaming is " + (tp.rename_files ? : 'on' : 'off')
+ *   track = pool.track(id)
  *
  */
-static VALUE tp_tp_rename_files(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return tp_GetRenameFiles(*tp) ? Qtrue : Qfalse;
+static VALUE tp_pool_track(VALUE self, VALUE id) {
+  VALUE local, inst = tp_pool_split(self, id, &local);
+  return rb_funcall(inst, rb_intern("track"), 1, local);
 }
 
 /*
- * Move files?  If enabled, files are moved as specified in the
- * TunePimp::TunePimp#file_mask file mask.
- *
- * Enabled by default.
+ * Write tags for the given pool file ids, or for every recognized file
+ * in the pool if there are none.  Returns false if any instance did.
  *
  * Example:
- *   tp.move_files = true
+ *   pool.write_tags(*ids)
  *
  */
-static VALUE tp_tp_set_move_files(VALUE self, VALUE move) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetMoveFiles(*tp, !(move == Qfalse || move == Qnil));
-  return Qnil;
+static VALUE tp_pool_write_tags(int argc, VALUE *argv, VALUE self) {
+  tp_pool_t *pool;
+  VALUE insts, groups, local, ret;
+  long i;
+
+  TypedData_Get_Struct(self, tp_pool_t, &tp_pool_type, pool);
+  insts = rb_iv_get(self, "@instances");
+  groups = rb_ary_new2(pool->num);
+  for (i = 0; i < pool->num; i++)
+    rb_ary_push(groups, rb_ary_new());
+  for (i = 0; i < argc; i++) {
+    tp_pool_split(self, argv[i], &local);
+    rb_ary_push(RARRAY_PTR(groups)[NUM2LONG(argv[i]) % pool->num], local);
+  }
+
+  ret = Qtrue;
+  for (i = 0; i < pool->num; i++) {
+    if (argc && !RARRAY_LEN(RARRAY_PTR(groups)[i]))
+      continue;
+    if (!RTEST(rb_funcall2(RARRAY_PTR(insts)[i], rb_intern("write_tags"),
+                           RARRAY_LEN(RARRAY_PTR(groups)[i]),
+                           RARRAY_PTR(RARRAY_PTR(groups)[i]))))
+      ret = Qfalse;
+  }
+
+  return ret;
 }
 
 /*
- * Get the TunePimp::TunePimp#move_files flag.
+ * Submit queued TRMs from every instance.  Returns
+ * TunePimp::Error::Ok, or the first error.
  *
  * Example:
- *   puts "Moving is " + (tp.move_files ? : 'on' : 'off')
+ *   pool.submit_trms
  *
  */
-static VALUE tp_tp_move_files(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return tp_GetMoveFiles(*tp) ? Qtrue : Qfalse;
+static VALUE tp_pool_submit_trms(VALUE self) {
+  VALUE insts = rb_iv_get(self, "@instances"), err, ret = INT2FIX(tpOk);
+  long i;
+
+  for (i = 0; i < RARRAY_LEN(insts); i++)
+    if ((err = rb_funcall(RARRAY_PTR(insts)[i], rb_intern("submit_trms"), 0)) != INT2FIX(tpOk) &&
+        ret == INT2FIX(tpOk))
+      ret = err;
+
+  return ret;
 }
 
 /*
- * Write ID3v1 tags?  
- *
- * Enabled by default.
+ * Get the pool ids of every file in the pool.
  *
  * Example:
- *   tp.write_id3v1 = true
+ *   puts "File IDs: #{pool.file_ids.join(',')}"
  *
  */
-static VALUE tp_tp_set_write_id3v1(VALUE self, VALUE id3) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetWriteID3v1(*tp, !(id3 == Qfalse || id3 == Qnil));
-  return Qnil;
+static VALUE tp_pool_file_ids(VALUE self) {
+  tp_pool_t *pool;
+  VALUE insts, ids, ret;
+  long i, j;
+
+  TypedData_Get_Struct(self, tp_pool_t, &tp_pool_type, pool);
+  insts = rb_iv_get(self, "@instances");
+  ret = rb_ary_new();
+  for (i = 0; i < pool->num; i++) {
+    ids = rb_funcall(RARRAY_PTR(insts)[i], rb_intern("file_ids"), 0);
+    for (j = 0; j < RARRAY_LEN(ids); j++)
+      rb_ary_push(ret, tp_pool_gid(pool, i, RARRAY_PTR(ids)[j]));
+  }
+
+  return ret;
 }
 
 /*
- * Get the TunePimp::TunePimp#write_id3v1 flag.
+ * Get the number of files in the pool.
  *
  * Example:
- *   puts "ID3v1 is " + (tp.write_id3v1 ? : 'on' : 'off')
+ *   puts "There are #{pool.num_files} files."
  *
  */
-static VALUE tp_tp_write_id3v1(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return tp_GetWriteID3v1(*tp) ? Qtrue : Qfalse;
+static VALUE tp_pool_num_files(VALUE self) {
+  tp_pool_t *pool;
+  long i, num = 0;
+
+  TypedData_Get_Struct(self, tp_pool_t, &tp_pool_type, pool);
+  for (i = 0; i < pool->num; i++)
+    num += tp_GetNumFiles(pool->pimps[i]->tp);
+
+  return LONG2NUM(num);
 }
 
 /*
- * Clear tags before MusicBrainz writes new ones?
- *
- * Disabled by default.
+ * Get the number of tracks in each state, summed over the pool; see
+ * TunePimp::TunePimp#track_counts.
  *
  * Example:
- *   tp.clear_tags = true
+ *   num = pool.track_counts[TunePimp::Status::Recognized]
  *
  */
-static VALUE tp_tp_set_clear_tags(VALUE self, VALUE clear_tags) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetClearTags(*tp, !(clear_tags == Qfalse || clear_tags == Qnil));
-  return Qnil;
+static VALUE tp_pool_track_counts(VALUE self) {
+  tp_pool_t *pool;
+  int i, j, counts[eLastStatus];
+  long sums[eLastStatus];
+  VALUE ret;
+
+  TypedData_Get_Struct(self, tp_pool_t, &tp_pool_type, pool);
+  memset(sums, 0, sizeof(sums));
+  for (i = 0; i < pool->num; i++) {
+    if (!tp_GetTrackCounts(pool->pimps[i]->tp, counts, eLastStatus))
+      return Qnil;
+    for (j = 0; j < eLastStatus; j++)
+      sums[j] += counts[j];
+  }
+
+  ret = rb_ary_new2(eLastStatus);
+  for (j = 0; j < eLastStatus; j++)
+    rb_ary_push(ret, LONG2NUM(sums[j]));
+
+  return ret;
 }
 
 /*
- * Get the TunePimp::TunePimp#clear_tags flag.
- *
- * Example:
- *   puts "Clear Tags is " + (tp.clear_tags ? : 'on' : 'off')
- *
+ * Arguments of a wait for any instance's queue to become non-empty
+ * (their pipes become readable) or for the pool's wake pipe.
  */
-static VALUE tp_tp_clear_tags(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return tp_GetClearTags(*tp) ? Qtrue : Qfalse;
+typedef struct {
+  struct pollfd *fds;
+  int num, timeout, wake;   /* wake is the pipe's write end */
+} tp_pool_poll_t;
+
+static void *tp_pool_poll(void *ptr) {
+  tp_pool_poll_t *p = ptr;
+  poll(p->fds, p->num, p->timeout);
+  return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void tp_pool_poll_cancel(void *ptr) {
+  tp_pool_poll_t *p = ptr;
+  char c = 0;
+
+  if (write(p->wake, &c, 1) < 0)
+    return;
 }
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
 
 /*
- * Set the file mask used for renaming files.  
- *
- * Valid escape sequences:
- *   %artist (Name of the artist)
- *   %abc (The first character of the artist's sortname)
- *   %abc2 (The first two character of the artist's sortname)
- *   %abc3 (The first three character of the artist's sortname)
- *   %sortname (Sortname of the artist)
- *   %track (Title of the song)
- *   %album (Title of the album)
- *   %num (Track number on the album)
- *   %0num (Track number on the album, zero padded to two places)
- *   %format (The format of the given file e.g. ogg/mp3/wav/flac/ape)
- *   %type (The release type: single, album, remix, etc)
- *   %status (The release status: official, bootleg, promo)
- *   %year (The first release year)
- *   %month (The first release month)
- *   %day (The first release day)
- *   %country (The first release country)
- *
- * The default file mask is "%artist/%album/%artist-%album-%0num-%track".
- * 
- * Be careful about using % escape sequences in double-quoted Ruby
- * strings!
- *
- * Note: See the TunePimp::TunePimp#various_file_mask method as well.
- *
- * Example:
- *   # set the file mask (note the single-quoted string)
- *   tp.file_mask = '%sortname/%album/%0num. %track.%format'
- *   
+ * Drain notifications (or status messages) from every instance, with
+ * the same options as TunePimp::TunePimp#wait_notifications, waiting
+ * on all of them at once if there are none.  Instances are visited
+ * starting from a different one each call, so none is starved.
  */
-static VALUE tp_tp_set_file_mask(VALUE self, VALUE file_mask) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetFileMask(*tp, RSTRING(file_mask)->ptr);
-  return Qnil;
+static VALUE tp_pool_drain(VALUE self, VALUE opts, int notes) {
+  tp_pool_t *pool;
+  tp_pool_poll_t p;
+  tp_drain_t d;
+  struct timeval tv;
+  double now, deadline = 0;
+  long i, j, left;
+  char c;
+  VALUE insts, hash, msgs, buf, ret;
+  ID mid = rb_intern(notes ? "wait_notifications" : "wait_status");
+
+  TypedData_Get_Struct(self, tp_pool_t, &tp_pool_type, pool);
+  insts = rb_iv_get(self, "@instances");
+  tp_drain_opts(&d, opts);
+  if (d.timeout > 0) {
+    gettimeofday(&tv, NULL);
+    deadline = tv.tv_sec + tv.tv_usec / 1e6 + d.timeout;
+  }
+
+  buf = rb_str_buf_new(sizeof(struct pollfd) * (pool->num + 1));
+  p.fds = (struct pollfd*) RSTRING_PTR(buf);
+  p.num = pool->num + 1;
+  for (i = 0; i < pool->num; i++) {
+    p.fds[i].fd = pool->pimps[i]->queue.fds[0];
+    p.fds[i].events = POLLIN;
+  }
+  p.fds[i].fd = pool->wake[0];
+  p.fds[i].events = POLLIN;
+  p.wake = pool->wake[1];
+
+  ret = rb_ary_new();
+  for (;;) {
+    for (i = 0; i < pool->num; i++) {
+      j = (pool->next + i) % pool->num;
+      if ((left = d.max - RARRAY_LEN(ret) / (notes ? 2 : 1)) <= 0)
+        break;
+
+      hash = rb_hash_new();
+      rb_hash_aset(hash, ID2SYM(rb_intern("max")), LONG2NUM(left));
+      rb_hash_aset(hash, ID2SYM(rb_intern("timeout")), INT2FIX(0));
+      rb_hash_aset(hash, ID2SYM(rb_intern("collapse")), d.collapse ? Qtrue : Qfalse);
+      msgs = rb_funcall(RARRAY_PTR(insts)[j], mid, 1, hash);
+
+      if (!notes) {
+        rb_ary_concat(ret, msgs);
+        continue;
+      }
+      for (left = 0; left + 1 < RARRAY_LEN(msgs); left += 2) {
+        rb_ary_push(ret, RARRAY_PTR(msgs)[left]);
+        rb_ary_push(ret, tp_pool_gid(pool, j, RARRAY_PTR(msgs)[left + 1]));
+      }
+    }
+    pool->next = (pool->next + 1) % pool->num;
+
+    if (RARRAY_LEN(ret) || d.timeout == 0)
+      break;
+
+    p.timeout = -1;
+    if (d.timeout > 0) {
+      gettimeofday(&tv, NULL);
+      now = tv.tv_sec + tv.tv_usec / 1e6;
+      if (now >= deadline)
+        break;
+      p.timeout = (int) ((deadline - now) * 1000) + 1;
+    }
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(tp_pool_poll, &p, tp_pool_poll_cancel, &p);
+    while (read(pool->wake[0], &c, 1) == 1);
+    rb_thread_check_ints();
+#else
+    tp_pool_poll(&p);
+    UNUSED(c);
+#endif
+  }
+  RB_GC_GUARD(buf);
+
+  return ret;
 }
 
 /*
- * Get the TunePimp::TunePimp#file_mask.
+ * Wait for notification messages from any instance in the pool, and
+ * return up to max of them at once, with pool file ids.  Takes the
+ * same options as TunePimp::TunePimp#wait_notifications.
  *
  * Example:
- *   puts "Mask: " << tp.file_mask
+ *   pool.wait_notifications(:timeout => 1.0).each_slice(2) do |type, id|
+ *     puts "#{id} changed" if type == TunePimp::Callback::FileChanged
+ *   end
  *
  */
-static VALUE tp_tp_file_mask(VALUE self) {
-  tunepimp_t *tp;
-  char buf[1024];
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_GetFileMask(*tp, buf, 1024);
-  return rb_str_new2(buf);
+static VALUE tp_pool_wait_nots(int argc, VALUE *argv, VALUE self) {
+  VALUE opts;
+  rb_scan_args(argc, argv, "01", &opts);
+  return tp_pool_drain(self, opts, 1);
 }
 
 /*
- * Set the file mask used for renaming files in multi-artist albums.  
- *
- * Valid escape sequences:
- *   %artist (Name of the artist)
- *   %abc (The first character of the artist's sortname)
- *   %abc2 (The first two character of the artist's sortname)
- *   %abc3 (The first three character of the artist's sortname)
- *   %sortname (Sortname of the artist)
- *   %track (Title of the song)
- *   %album (Title of the album)
- *   %num (Track number on the album)
- *   %0num (Track number on the album, zero padded to two places)
- *   %format (The format of the given file e.g. ogg/mp3/wav/flac/ape)
- *   %type (The release type: single, album, remix, etc)
- *   %status (The release status: official, bootleg, promo)
- *   %year (The first release year)
- *   %month (The first release month)
- *   %day (The first release day)
- *   %country (The first release country)
- *
- * The default value for TunePimp::TunePimp#various_file_mask is 
- * "Various Artists/%album/%album-%0num-%artist-%track".
- * 
- * Be careful about using % escape sequences in double-quoted Ruby
- * strings!
- *
- * Note: See the TunePimp::TunePimp::file_mask method as well.
+ * Wait for status messages from any instance in the pool, and return
+ * up to max of them at once.  Takes the same :max and :timeout options
+ * as TunePimp::TunePimp#wait_status.
  *
  * Example:
- *   # set the file mask (note the single-quoted string)
- *   tp.file_mask = '%sortname/%album/%0num. %track.%format'
- *   
+ *   pool.wait_status(:timeout => 5).each { |msg| puts 'Status: ' << msg }
+ *
  */
-static VALUE tp_tp_set_various_file_mask(VALUE self, VALUE various_file_mask) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetVariousFileMask(*tp, RSTRING(various_file_mask)->ptr);
-  return Qnil;
+static VALUE tp_pool_wait_status(int argc, VALUE *argv, VALUE self) {
+  VALUE opts;
+  rb_scan_args(argc, argv, "01", &opts);
+  return tp_pool_drain(self, opts, 0);
 }
 
+/*********************************************************************/
+/* TunePimp::Governor methods                                        */
+/*********************************************************************/
+
 /*
- * Get the TunePimp::TunePimp::various_file_mask.
+ * Adaptive throttle for the TunePimp::TunePimp objects behind a
+ * TunePimp::Governor.  A native thread samples system pressure every
+ * interval and moves a level between 0 (back off) and 1 (full speed):
+ * it halves the level as soon as any signal is over its target and
+ * creeps back up by a tenth while everything is comfortably under.
+ * The level sets each instance's analyzer priority and how many files
+ * it may have waiting for analysis; queued paths are fed in as that
+ * window allows.
+ */
+struct tp_gov_t {
+  int num;
+  tp_pimp_t **pimps;
+  tp_ring_t *queues;
+  pthread_t thread;
+  int running, attached;
+
+  /* whether pimps are referenced (the thread may outlive the instances) */
+  int held;
+
+  /* targets; a signal at its target counts as fully loaded */
+  double interval, load_target, psi_target, latency_target;
+  int min_window, max_window, max_prio;
+
+  /* protects everything below, and the queues */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop, wake, orphaned, exited;
+  double level, load, cpu_psi, io_psi, latency, latency_at;
+  int window, prio;
+  unsigned long fed, backoffs;
+
+  /* last PSI totals (microseconds stalled) and when they were read */
+  unsigned long long cpu_total, io_total;
+  double psi_at;
+};
+
+/* latency samples older than this many seconds are ignored */
+#define TP_GOV_LATENCY_TTL 2.0
+
+/* 
+ * Read the "some" stall total from a /proc/pressure file.  Returns 0
+ * if there isn't one (no PSI on this kernel).
+ */
+static int tp_gov_psi(const char *path, unsigned long long *total) {
+  char buf[256], *p;
+  FILE *fh;
+  int ret = 0;
+
+  if ((fh = fopen(path, "r")) == NULL)
+    return 0;
+  while (!ret && fgets(buf, sizeof(buf), fh))
+    if (!strncmp(buf, "some ", 5) && (p = strstr(buf, "total=")) != NULL)
+      ret = sscanf(p + 6, "%llu", total) == 1;
+  fclose(fh);
+
+  return ret;
+}
+
+/* 
+ * Take a sample and update the level, priority and window.  Call with
+ * the lock held.  PSI is measured from the change in stall totals
+ * since the last sample, since the kernel's own averages take ten
+ * seconds to react.
+ */
+static void tp_gov_sample(tp_gov_t *g) {
+  unsigned long long cpu, io;
+  double la[1], now = tp_now(), dt, score = 0;
+  long ncpu;
+
+  if (getloadavg(la, 1) == 1 && (ncpu = sysconf(_SC_NPROCESSORS_ONLN)) > 0) {
+    g->load = la[0] / ncpu;
+    if (g->load_target > 0 && g->load / g->load_target > score)
+      score = g->load / g->load_target;
+  }
+
+  dt = now - g->psi_at;
+  g->cpu_psi = g->io_psi = -1;
+  if (tp_gov_psi("/proc/pressure/cpu", &cpu)) {
+    if (g->psi_at > 0 && dt > 0)
+      g->cpu_psi = (cpu - g->cpu_total) / (dt * 1e6);
+    g->cpu_total = cpu;
+  }
+  if (tp_gov_psi("/proc/pressure/io", &io)) {
+    if (g->psi_at > 0 && dt > 0)
+      g->io_psi = (io - g->io_total) / (dt * 1e6);
+    g->io_total = io;
+  }
+  g->psi_at = now;
+  if (g->psi_target > 0) {
+    if (g->cpu_psi / g->psi_target > score)
+      score = g->cpu_psi / g->psi_target;
+    if (g->io_psi / g->psi_target > score)
+      score = g->io_psi / g->psi_target;
+  }
+
+  if (g->latency_at > 0 && now - g->latency_at < TP_GOV_LATENCY_TTL &&
+      g->latency_target > 0 && g->latency / g->latency_target > score)
+    score = g->latency / g->latency_target;
+
+  if (score > 1) {
+    g->level /= 2;
+    if (g->level < 0.01)
+      g->level = 0;
+    g->backoffs++;
+  } else if (score < 0.75) {
+    g->level += 0.1;
+    if (g->level > 1)
+      g->level = 1;
+  }
+
+  g->prio = eIdle + (int) (g->level * (g->max_prio - eIdle) + 0.5);
+  g->window = g->min_window + (int) (g->level * (g->max_window - g->min_window) + 0.5);
+}
+
+static void tp_gov_destroy(tp_gov_t *g) {
+  char *path;
+  int i;
+
+  for (i = 0; g->queues && i < g->num; i++) {
+    while (tp_ring_shift(g->queues + i, &path))
+      free(path);
+    free(g->queues[i].buf);
+  }
+  for (i = 0; g->held && i < g->num; i++)
+    tp_pimp_unref(g->pimps[i]);
+  pthread_mutex_destroy(&g->lock);
+  pthread_cond_destroy(&g->cond);
+  free(g->queues);
+  free(g->pimps);
+  free(g);
+}
+
+static void *tp_gov_main(void *ptr) {
+  tp_gov_t *g = ptr;
+  tp_call_t call;
+  struct timespec ts;
+  double next;
+  int i, n, counts[eLastStatus], prio = -1, orphaned;
+  char *path;
+
+  pthread_mutex_lock(&g->lock);
+  while (!g->stop) {
+    tp_gov_sample(g);
+    if (g->prio != prio)
+      for (i = 0, prio = g->prio; i < g->num; i++)
+        tp_SetAnalyzerPriority(g->pimps[i]->tp, prio);
+
+    /* top up each instance's analyzer queue to the window */
+    for (i = 0; i < g->num && !g->stop; i++) {
+      if (!g->queues[i].len || !tp_GetTrackCounts(g->pimps[i]->tp, counts, eLastStatus))
+        continue;
+      for (n = counts[ePending]; n < g->window && tp_ring_shift(g->queues + i, &path); n++) {
+        memset(&call, 0, sizeof(call));
+        call.tp = g->pimps[i]->tp;
+        call.trmc = g->pimps[i]->trmc;
+        call.pending = &g->pimps[i]->pending;
+        pthread_mutex_unlock(&g->lock);
+        tp_add_file(&call, path);
+        free(path);
+        pthread_mutex_lock(&g->lock);
+        g->fed++;
+      }
+    }
+
+    /* sleep until the next sample, or until woken by a new signal */
+    next = tp_now() + g->interval;
+    ts.tv_sec = (time_t) next;
+    ts.tv_nsec = (long) ((next - ts.tv_sec) * 1e9);
+    while (!g->stop && !g->wake)
+      if (pthread_cond_timedwait(&g->cond, &g->lock, &ts) == ETIMEDOUT)
+        break;
+    g->wake = 0;
+  }
+  g->exited = 1;
+  orphaned = g->orphaned;
+  pthread_mutex_unlock(&g->lock);
+
+  /* nobody's left to free the governor (see tp_gov_free) */
+  if (orphaned)
+    tp_gov_destroy(g);
+
+  return NULL;
+}
+
+/* tell the thread to stop, without waiting for it */
+static void tp_gov_signal(tp_gov_t *g) {
+  pthread_mutex_lock(&g->lock);
+  g->stop = 1;
+  pthread_cond_broadcast(&g->cond);
+  pthread_mutex_unlock(&g->lock);
+}
+
+/* stop the thread; idempotent */
+static void *tp_gov_stop(void *ptr) {
+  tp_gov_t *g = ptr;
+
+  if (g->running) {
+    tp_gov_signal(g);
+    pthread_join(g->thread, NULL);
+    g->running = 0;
+  }
+
+  return NULL;
+}
+
+/* 
+ * Detach from the instances, dropping files still queued once the
+ * thread is gone; call with the GVL held
+ */
+static void tp_gov_detach(tp_gov_t *g) {
+  char *path;
+  int i;
+
+  if (g->attached) {
+    for (i = 0; i < g->num; i++) {
+      g->pimps[i]->gov = NULL;
+      while (!g->running && tp_ring_shift(g->queues + i, &path))
+        free(path);
+    }
+    g->attached = 0;
+  }
+}
+
+/* 
+ * Don't wait for the thread here: it may be in the middle of adding a
+ * file, and GC would wait with it.  It frees the governor when it's
+ * done.
+ */
+static void tp_gov_free(void *ptr) {
+  tp_gov_t *g = ptr;
+
+  if (g) {
+    tp_gov_detach(g);
+    if (g->running) {
+      pthread_mutex_lock(&g->lock);
+      if (!g->exited) {
+        g->stop = g->orphaned = 1;
+        pthread_cond_broadcast(&g->cond);
+        pthread_mutex_unlock(&g->lock);
+        pthread_detach(g->thread);
+        return;
+      }
+      pthread_mutex_unlock(&g->lock);
+      pthread_join(g->thread, NULL);
+    }
+    tp_gov_destroy(g);
+  }
+}
+
+static size_t tp_gov_memsize(const void *ptr) {
+  const tp_gov_t *g = ptr;
+  size_t ret = sizeof(tp_gov_t);
+  int i;
+
+  for (i = 0; g->queues && i < g->num; i++)
+    ret += sizeof(tp_pimp_t*) + sizeof(tp_ring_t) + g->queues[i].cap * g->queues[i].size;
+
+  return ret;
+}
+
+static const rb_data_type_t tp_gov_type = {
+  "TunePimp::Governor",
+  { 0, tp_gov_free, tp_gov_memsize, TP_COMPACT(0) },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * Throttle a TunePimp::TunePimp (or every instance of a
+ * TunePimp::Pool) to what the machine can spare.
+ *
+ * The governor watches the load average, CPU and I/O pressure stall
+ * information (/proc/pressure, on linux) and the latency reported with
+ * TunePimp::Governor#latency=, and adjusts the analyzer priority and
+ * the number of files each instance has waiting for analysis.  Files
+ * queued with TunePimp::Governor#feed are added as room frees up, so
+ * tagging soaks up idle capacity but backs off within one interval of
+ * a signal going over its target.  Only one governor can be attached
+ * to an instance at a time.
+ *
+ * Options:
+ *   :interval      seconds between samples (default 0.25).
+ *   :load          target 1-minute load average per CPU (default 0.8).
+ *   :psi           target fraction of time stalled on CPU or I/O
+ *                  (default 0.1).
+ *   :latency       target for TunePimp::Governor#latency=, in seconds
+ *                  (default none).
+ *   :min_window    files each instance may have waiting when backed
+ *                  off completely (default 1).
+ *   :max_window    ... and at full speed (default 32).
+ *   :max_priority  analyzer priority at full speed (default
+ *                  TunePimp::ThreadPriority::Normal); backed off, it's
+ *                  TunePimp::ThreadPriority::Idle.
+ *
+ * Any target can be disabled with nil or 0.
  *
  * Example:
- *   puts "Mask: " << tp.various_file_mask
+ *   gov = TunePimp::Governor.new(tp, :latency => 0.05)
+ *   gov.feed(File.readlines('new_files.txt').map { |l| l.chomp })
+ *   loop { gov.latency = frontend.p99 ; sleep 0.1 }
  *
  */
-static VALUE tp_tp_various_file_mask(VALUE self) {
-  tunepimp_t *tp;
-  char buf[1024];
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_GetVariousFileMask(*tp, buf, 1024);
-  return rb_str_new2(buf);
+VALUE tp_gov_new(int argc, VALUE *argv, VALUE klass) {
+  tp_gov_t *g;
+  tp_pool_t *pool;
+  tp_pimp_t *pimp = NULL;
+  VALUE self, target, opts, val;
+  int i;
+
+  rb_scan_args(argc, argv, "11", &target, &opts);
+
+  self = TypedData_Wrap_Struct(klass, &tp_gov_type, NULL);
+  if ((g = malloc(sizeof(tp_gov_t))) == NULL)
+    rb_raise(eException, "Couldn't allocate memory for tp_gov_t");
+  memset(g, 0, sizeof(tp_gov_t));
+  pthread_mutex_init(&g->lock, NULL);
+  pthread_cond_init(&g->cond, NULL);
+  DATA_PTR(self) = g;
+
+  g->interval = 0.25;
+  g->load_target = 0.8;
+  g->psi_target = 0.1;
+  g->min_window = 1;
+  g->max_window = 32;
+  g->max_prio = eNormal;
+  if (!NIL_P(opts)) {
+    Check_Type(opts, T_HASH);
+    if (RTEST(rb_funcall(opts, rb_intern("has_key?"), 1, ID2SYM(rb_intern("load")))))
+      g->load_target = NIL_P(val = tp_opt(opts, "load")) ? 0 : NUM2DBL(val);
+    if (RTEST(rb_funcall(opts, rb_intern("has_key?"), 1, ID2SYM(rb_intern("psi")))))
+      g->psi_target = NIL_P(val = tp_opt(opts, "psi")) ? 0 : NUM2DBL(val);
+  }
+  if (!NIL_P(val = tp_opt(opts, "interval")))
+    g->interval = NUM2DBL(val);
+  if (!NIL_P(val = tp_opt(opts, "latency")))
+    g->latency_target = NUM2DBL(val);
+  if (!NIL_P(val = tp_opt(opts, "min_window")))
+    g->min_window = NUM2INT(val);
+  if (!NIL_P(val = tp_opt(opts, "max_window")))
+    g->max_window = NUM2INT(val);
+  if (!NIL_P(val = tp_opt(opts, "max_priority")))
+    g->max_prio = NUM2INT(val);
+  if (g->interval < 0.01 || g->interval > 60)
+    rb_raise(rb_eArgError, "interval must be between 0.01 and 60 seconds");
+  if (g->min_window < 0 || g->max_window < g->min_window)
+    rb_raise(rb_eArgError, "need 0 <= min_window <= max_window");
+  if (g->max_prio < eIdle || g->max_prio > eTimeCritical)
+    rb_raise(eException, "Thread Priority out of range");
+
+  /* a TunePimp::Pool or a single TunePimp::TunePimp */
+  if (rb_obj_is_kind_of(target, cPool)) {
+    TypedData_Get_Struct(target, tp_pool_t, &tp_pool_type, pool);
+    g->num = pool->num;
+  } else {
+    TypedData_Get_Struct(target, tp_pimp_t, &tp_pimp_type, pimp);
+    pool = NULL;
+    g->num = 1;
+  }
+  g->pimps = malloc(sizeof(tp_pimp_t*) * g->num);
+  g->queues = malloc(sizeof(tp_ring_t) * g->num);
+  if (!g->pimps || !g->queues)
+    rb_raise(eException, "Couldn't allocate memory for governor");
+  for (i = 0; i < g->num; i++) {
+    g->pimps[i] = pool ? pool->pimps[i] : pimp;
+    tp_ring_init(g->queues + i, sizeof(char*));
+    if (g->pimps[i]->gov)
+      rb_raise(eException, "TunePimp object already has a governor");
+  }
+
+  /* 
+   * the ivar keeps the instances alive for as long as we use them,
+   * and the references their native state for as long as the thread
+   */
+  rb_iv_set(self, "@target", target);
+  for (i = 0; i < g->num; i++) {
+    g->pimps[i]->gov = g;
+    tp_pimp_ref(g->pimps[i]);
+  }
+  g->attached = g->held = 1;
+  g->level = 0.5;
+  if (!tp_thread_start(&g->thread, 0, tp_gov_main, g))
+    rb_raise(eException, "Couldn't start governor thread");
+  g->running = 1;
+
+  rb_obj_call_init(self, argc, argv);
+
+  return self;
+}
+
+static VALUE tp_gov_init(int argc, VALUE *argv, VALUE self) {
+  UNUSED(argc);
+  UNUSED(argv);
+  return self;
+}
+
+static tp_gov_t *tp_gov_get_open(VALUE self) {
+  tp_gov_t *g;
+
+  TypedData_Get_Struct(self, tp_gov_t, &tp_gov_type, g);
+  if (!g->running)
+    rb_raise(eException, "Governor has been stopped");
+
+  return g;
 }
 
 /*
- * Set the characters allowed in file names.
- *
- * Note: '/' is always permitted.
- *
- * Defaults to "" (all characters allowed).
+ * Queue files to be added as the governor allows.  With a pool, each
+ * file is queued for the instance its directory maps to (see
+ * TunePimp::Pool#shard).  Files are reported through the usual
+ * FileAdded notifications as they're added.  Returns the number of
+ * files queued.
  *
  * Example:
- *   tp.set_allowed_file_chars 'abcdefghijklmnopqrstuvwxyz0123456789.-_ '
+ *   gov.feed(paths)
  *
  */
-static VALUE tp_tp_set_allowed_file_chars(VALUE self, VALUE allowed_file_chars) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetAllowedFileCharacters(*tp, RSTRING(allowed_file_chars)->ptr);
-  return Qnil;
+static VALUE tp_gov_feed(VALUE self, VALUE paths) {
+  tp_gov_t *g = tp_gov_get_open(self);
+  char *path;
+  long i;
+  int ok;
+
+  paths = rb_Array(paths);
+  for (i = 0; i < RARRAY_LEN(paths); i++) {
+    path = tp_strdup(RARRAY_PTR(paths)[i]);
+    pthread_mutex_lock(&g->lock);
+    ok = tp_ring_push(g->queues + (g->num > 1 ? tp_shard(path, g->num) : 0), &path);
+    pthread_mutex_unlock(&g->lock);
+    if (!ok) {
+      free(path);
+      rb_raise(eException, "Couldn't allocate memory for feed queue");
+    }
+  }
+
+  pthread_mutex_lock(&g->lock);
+  g->wake = 1;
+  pthread_cond_signal(&g->cond);
+  pthread_mutex_unlock(&g->lock);
+
+  return LONG2NUM(i);
 }
 
 /*
- * Get the TunePimp::TunePimp::allowed_file_chars value.
- * 
+ * Report the current foreground latency, in seconds (the :latency
+ * option is the target).  A sample counts for two seconds; a sample
+ * over the target takes effect immediately rather than at the next
+ * interval.
+ *
  * Example:
- *   puts "Allowed Characters: \"" << tp.allowed_file_chars << "\"."
+ *   gov.latency = request_time
  *
  */
-static VALUE tp_tp_allowed_file_chars(VALUE self) {
-  tunepimp_t *tp;
-  char buf[1024];
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_GetAllowedFileCharacters(*tp, buf, 1024);
-  return rb_str_new2(buf);
+static VALUE tp_gov_set_latency(VALUE self, VALUE latency) {
+  tp_gov_t *g = tp_gov_get_open(self);
+  double val = NUM2DBL(latency);   /* may raise, so not under the lock */
+
+  pthread_mutex_lock(&g->lock);
+  g->latency = val;
+  g->latency_at = tp_now();
+  if (g->latency_target > 0 && g->latency > g->latency_target) {
+    g->wake = 1;
+    pthread_cond_signal(&g->cond);
+  }
+  pthread_mutex_unlock(&g->lock);
+
+  return latency;
 }
 
 /*
- * Set the base directory that is prepended to all file names if the
- * TunePimp::TunePimp#move_files flag is enabled.
- *
- * Defaults to "MyMusic" (in the current working directory).
+ * Get the number of files queued with TunePimp::Governor#feed that
+ * haven't been added yet.
  *
  * Example:
- *   tp.dest_dir = '/store/mp3'
+ *   sleep 1 while gov.queued > 0
  *
  */
-static VALUE tp_tp_set_dest_dir(VALUE self, VALUE dest_dir) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetDestDir(*tp, RSTRING(dest_dir)->ptr);
-  return Qnil;
+static VALUE tp_gov_queued(VALUE self) {
+  tp_gov_t *g;
+  long num = 0;
+  int i;
+
+  TypedData_Get_Struct(self, tp_gov_t, &tp_gov_type, g);
+  pthread_mutex_lock(&g->lock);
+  for (i = 0; g->attached && i < g->num; i++)
+    num += g->queues[i].len;
+  pthread_mutex_unlock(&g->lock);
+
+  return LONG2NUM(num);
 }
 
 /*
- * Get the value of TunePimp::TunePimp#dest_dir.
+ * Get the governor's current state: a hash with :level (0 is backed
+ * off completely, 1 is full speed), :priority, :window, the latest
+ * :load (per CPU), :cpu_pressure and :io_pressure (fractions of time
+ * stalled, or nil without PSI) and :latency, and the number of files
+ * :fed and :queued and of :backoffs so far.
  *
  * Example:
- *   puts "Destination: " << tp.dest_dir
+ *   s = gov.stats
+ *   puts "running at #{(s[:level] * 100).round}%"
  *
  */
-static VALUE tp_tp_dest_dir(VALUE self) {
-  tunepimp_t *tp;
-  char buf[1024];
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_GetDestDir(*tp, buf, 1024);
-  return rb_str_new2(buf);
+static VALUE tp_gov_stats(VALUE self) {
+  tp_gov_t *g;
+  double level, load, cpu_psi, io_psi, latency;
+  unsigned long fed, backoffs;
+  long queued = 0;
+  int i, prio, window, fresh;
+  VALUE ret;
+
+  TypedData_Get_Struct(self, tp_gov_t, &tp_gov_type, g);
+  pthread_mutex_lock(&g->lock);
+  level = g->level;
+  load = g->load;
+  cpu_psi = g->cpu_psi;
+  io_psi = g->io_psi;
+  latency = g->latency;
+  fresh = g->latency_at > 0 && tp_now() - g->latency_at < TP_GOV_LATENCY_TTL;
+  prio = g->prio;
+  window = g->window;
+  fed = g->fed;
+  backoffs = g->backoffs;
+  for (i = 0; g->attached && i < g->num; i++)
+    queued += g->queues[i].len;
+  pthread_mutex_unlock(&g->lock);
+
+  ret = rb_hash_new();
+  rb_hash_aset(ret, ID2SYM(rb_intern("level")), rb_float_new(level));
+  rb_hash_aset(ret, ID2SYM(rb_intern("priority")), INT2FIX(prio));
+  rb_hash_aset(ret, ID2SYM(rb_intern("window")), INT2FIX(window));
+  rb_hash_aset(ret, ID2SYM(rb_intern("load")), rb_float_new(load));
+  rb_hash_aset(ret, ID2SYM(rb_intern("cpu_pressure")), cpu_psi < 0 ? Qnil : rb_float_new(cpu_psi));
+  rb_hash_aset(ret, ID2SYM(rb_intern("io_pressure")), io_psi < 0 ? Qnil : rb_float_new(io_psi));
+  rb_hash_aset(ret, ID2SYM(rb_intern("latency")), fresh ? rb_float_new(latency) : Qnil);
+  rb_hash_aset(ret, ID2SYM(rb_intern("fed")), ULONG2NUM(fed));
+  rb_hash_aset(ret, ID2SYM(rb_intern("queued")), LONG2NUM(queued));
+  rb_hash_aset(ret, ID2SYM(rb_intern("backoffs")), ULONG2NUM(backoffs));
+
+  return ret;
 }
 
 /*
- * Set the top source directory for TunePimp::TunePimp object.
- * 
- * When TunePimp moves a file out of a directory to a new directory, and
- * the old directory is now empty, the old directory is removed. This
- * process is repeated for the old directory's parent, until it reaches
- * the top_src_dir, where it stops removing directories. Set the
- * top_src_dir to root of the directory tree where TunePimp is writing
- * ID3 files to.
- *
- * For example, if top_src_dir is set to "/mnt/mp3"
- *
- *   /mnt/mp3/dirty_mp3s/Beatles/Yesterday.mp3
- *
- * The Yesterday song is the only file left in the dirty_mp3s folder.
- * When tunepimp moves this file to its new, clean location, it will
- * remove the Beatles directory, then the dirty_mp3s directory, but it
- * will not remove the "/mnt/mp3" directory, since that is the
- * top_src_dir.
+ * Get the level the governor is running at, from 0 (backed off
+ * completely) to 1 (full speed).
  *
  * Example:
- *   tp.top_src_dir = '/store/mp3'
+ *   puts 'backing off' if gov.level < 0.5
  *
  */
-static VALUE tp_tp_set_top_src_dir(VALUE self, VALUE top_src_dir) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetTopSrcDir(*tp, RSTRING(top_src_dir)->ptr);
-  return Qnil;
+static VALUE tp_gov_level(VALUE self) {
+  tp_gov_t *g;
+  double level;
+
+  TypedData_Get_Struct(self, tp_gov_t, &tp_gov_type, g);
+  pthread_mutex_lock(&g->lock);
+  level = g->level;
+  pthread_mutex_unlock(&g->lock);
+
+  return rb_float_new(level);
 }
 
 /*
- * Get the top source directory for a TunePimp::TunePimp object.
+ * Get the TunePimp::TunePimp or TunePimp::Pool being governed.
  *
  * Example:
- *   puts "Dir: " << tp.top_src_dir
+ *   gov.target.wait_notifications(:timeout => 1)
  *
  */
-static VALUE tp_tp_top_src_dir(VALUE self) {
-  tunepimp_t *tp;
-  char buf[1024];
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_GetTopSrcDir(*tp, buf, 1024);
-  return rb_str_new2(buf);
+static VALUE tp_gov_target(VALUE self) {
+  return rb_iv_get(self, "@target");
 }
 
 /*
- * Set the TRM collision threshold for a TunePimp::TunePimp object.
- *
- * If there is more than one entry matching a TRM in the musicbrainz
- * database, we have a TRM collision. In this case, a similarity value
- * is calculated for each returned database entry using the file's meta
- * data as the reference. The similarity is a percent value describing
- * how good the match is.
- *
- * If the similarity is greater than or equal to the
- * trm_collision_threshold, then the file is marked as recognized
- * (TunePimp::Status::Recognized). Otherwise, the track's status is set
- * to TunePimp::Status::TRMCollision, which requires user invention in 
- * order to select one of the returned results.
- *
- * Valid values for the threshold are between 0 and 100, inclusive.
- *
- * Default: 80.
+ * Stop governing.  Files still queued are dropped, and the instances
+ * are left at their current analyzer priority.
  *
  * Example:
- *   tp.trm_collision_threshold = 95
+ *   gov.stop
  *
  */
-static VALUE tp_tp_set_trm_collision_threshold(VALUE self, VALUE trm_collision_threshold) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetTRMCollisionThreshold(*tp, NUM2INT(trm_collision_threshold));
+static VALUE tp_gov_stop_governing(VALUE self) {
+  tp_gov_t *g;
+
+  TypedData_Get_Struct(self, tp_gov_t, &tp_gov_type, g);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(tp_gov_stop, g, NULL, NULL);
+#else
+  tp_gov_stop(g);
+#endif
+  tp_gov_detach(g);
+
   return Qnil;
 }
 
 /*
- * Get the TRM collision threshold for a TunePimp::TunePimp object.
+ * Has this TunePimp::Governor been stopped?
  *
  * Example:
- *   puts "Threshold: #{tp.trm_collision_threshold}"
+ *   gov.stop unless gov.stopped?
  *
  */
-static VALUE tp_tp_trm_collision_threshold(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_GetTRMCollisionThreshold(*tp));
+static VALUE tp_gov_stopped(VALUE self) {
+  tp_gov_t *g;
+  TypedData_Get_Struct(self, tp_gov_t, &tp_gov_type, g);
+  return g->running ? Qfalse : Qtrue;
+}
+
+/*********************************************************************/
+/* TunePimp::TagWrite methods                                        */
+/*********************************************************************/
+
+/* 
+ * Arguments of a wait for a tag write; timeout is in seconds, negative
+ * to wait forever.
+ */
+typedef struct {
+  tp_wasync_t *w;
+  double timeout;
+  volatile int cancelled;
+} tp_wwait_t;
+
+static void *tp_wwait(void *ptr) {
+  tp_wwait_t *ww = ptr;
+  tp_wasync_t *w = ww->w;
+  struct timespec ts;
+  double end = tp_now() + ww->timeout;
+
+  ts.tv_sec = (time_t) end;
+  ts.tv_nsec = (long) ((end - ts.tv_sec) * 1e9);
+
+  pthread_mutex_lock(&w->lock);
+  while (!w->done && !ww->cancelled && ww->timeout != 0) {
+    if (ww->timeout < 0)
+      pthread_cond_wait(&w->cond, &w->lock);
+    else if (pthread_cond_timedwait(&w->cond, &w->lock, &ts) == ETIMEDOUT)
+      break;
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void tp_wwait_cancel(void *ptr) {
+  tp_wwait_t *ww = ptr;
+
+  pthread_mutex_lock(&ww->w->lock);
+  ww->cancelled = 1;
+  pthread_cond_broadcast(&ww->w->cond);
+  pthread_mutex_unlock(&ww->w->lock);
+}
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+static int tp_wasync_done(tp_wasync_t *w) {
+  int done;
+
+  pthread_mutex_lock(&w->lock);
+  done = w->done;
+  pthread_mutex_unlock(&w->lock);
+
+  return done;
 }
 
 /*
- * Set the minimum recognition threshold for TRM lookups with the given
- * TunePimp::TunePimp object.
- *
- * If there is a TRM match for a given track, but the similarity between
- * the metadata returned is below the minimum recognition threshold,
- * then the TRM match should not be accepted and the file should be
- * listed as unrecognized.
- *
- * Valid values for the threshold are between 0 and 100, inclusive.
- *
- * Default: 50.
+ * Wait for every file to be written, for at most timeout seconds
+ * (forever if timeout is nil).  Returns true if they all were, false
+ * if the timeout expired first.  Other Ruby threads keep running
+ * while this waits.
  *
  * Example:
- *   tp.min_trm_threshold = 10
+ *   puts 'still writing' unless w.wait(5)
  *
  */
-static VALUE tp_tp_set_min_trm_threshold(VALUE self, VALUE min_trm_threshold) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetMinTRMThreshold(*tp, NUM2INT(min_trm_threshold));
-  return Qnil;
+static VALUE tp_tagw_wait(int argc, VALUE *argv, VALUE self) {
+  tp_wwait_t ww;
+  VALUE timeout;
+
+  rb_scan_args(argc, argv, "01", &timeout);
+  TypedData_Get_Struct(self, tp_wasync_t, &tp_wasync_type, ww.w);
+  ww.timeout = NIL_P(timeout) ? -1 : NUM2DBL(timeout);
+  if (ww.timeout < 0 && !NIL_P(timeout))
+    rb_raise(rb_eArgError, "timeout must not be negative");
+
+  /* an interrupted wait (Thread#raise, say) raises; others resume */
+  do {
+    ww.cancelled = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(tp_wwait, &ww, tp_wwait_cancel, &ww);
+    rb_thread_check_ints();
+#else
+    tp_wwait(&ww);
+#endif
+  } while (ww.cancelled && !tp_wasync_done(ww.w));
+
+  return tp_wasync_done(ww.w) ? Qtrue : Qfalse;
 }
 
 /*
- * Get the minimum TRM threshold for a TunePimp::TunePimp object.
+ * Has every file been written (or failed)?
  *
  * Example:
- *   puts "min thresh: #{tp.min_trm_threshold}"
+ *   sleep 0.1 until w.done?
  *
  */
-static VALUE tp_tp_min_trm_threshold(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_GetMinTRMThreshold(*tp));
+static VALUE tp_tagw_done(VALUE self) {
+  tp_wasync_t *w;
+  TypedData_Get_Struct(self, tp_wasync_t, &tp_wasync_type, w);
+  return tp_wasync_done(w) ? Qtrue : Qfalse;
 }
 
 /*
- * Set the auto-save threshold for a TunePimp::TunePimp object.
- *
- * When the similarity value (see TunePimp::TunePimp#trm_collision) is
- * greater or equal the auto save threshold, a recognized file (in state
- * TunePimp::Status::Recognized) is marked as verified
- * (TunePimp::Status::Verified). The effect is the same as calling
- * TunePimp::TunePimp#write_tags on a recognized file.
- *
- * The writing is done immediately, without the possibility of user
- * intervention.
- *
- * Valid values for the threshold are between 0 and 100, inclusive.
- * Set it to a negative value or nil in order to disable the auto-save
- * feature.
- *
- * Default: 90.
+ * Get the files resolved so far, as a hash of file id => true if its
+ * tags were written or false if not.  When writing every recognized
+ * file, files that weren't recognized are left out.
  *
  * Example:
- *   # disable auto-save
- *   tp.auto_save_threshold = nil
+ *   w.wait
+ *   saved = w.results.select { |id, ok| ok }.map { |id, ok| id }
  *
  */
-static VALUE tp_tp_set_auto_save_threshold(VALUE self, VALUE auto_save_threshold) {
-  tunepimp_t *tp;
-  int thresh;
-  thresh = (auto_save_threshold == Qnil) ? -1 : NUM2INT(auto_save_threshold);
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetAutoSaveThreshold(*tp, thresh);
-  return Qnil;
+static VALUE tp_tagw_results(VALUE self) {
+  tp_wasync_t *w;
+  VALUE ret = rb_hash_new();
+  long i;
+
+  TypedData_Get_Struct(self, tp_wasync_t, &tp_wasync_type, w);
+  pthread_mutex_lock(&w->lock);
+  for (i = 0; i < w->num_res; i++)
+    if (w->res[i].done && !w->res[i].skip)
+      rb_hash_aset(ret, INT2FIX(w->res[i].id), w->res[i].ok ? Qtrue : Qfalse);
+  pthread_mutex_unlock(&w->lock);
+
+  return ret;
 }
 
 /*
- * Get the auto-save threshold of a TunePimp::TunePimp object.
+ * Get the files that failed so far, as a hash of file id => error
+ * message (libtunepimp's, where it gave one).
  *
  * Example:
- *   puts "auto-save threshold: #{tp.auto_save_threshold}"
+ *   w.errors.each { |id, err| $stderr.puts "#{id}: #{err}" }
  *
  */
-static VALUE tp_tp_auto_save_threshold(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_GetAutoSaveThreshold(*tp));
+static VALUE tp_tagw_errors(VALUE self) {
+  tp_wasync_t *w;
+  VALUE ret = rb_hash_new();
+  long i;
+
+  TypedData_Get_Struct(self, tp_wasync_t, &tp_wasync_type, w);
+  pthread_mutex_lock(&w->lock);
+  for (i = 0; i < w->num_res; i++)
+    if (w->res[i].done && !w->res[i].skip && !w->res[i].ok)
+      rb_hash_aset(ret, INT2FIX(w->res[i].id), rb_str_new2(w->res[i].err));
+  pthread_mutex_unlock(&w->lock);
+
+  return ret;
 }
 
 /*
- * Set the maximum length of a path saved by this TunePimp::TunePimp
- * object.
+ * Get the ids of the files being written.  When writing every
+ * recognized file, this is empty until they've been picked out.
  *
  * Example:
- *   tp.max_file_name_len = 128
+ *   puts "writing #{w.ids.size} files"
  *
  */
-static VALUE tp_tp_set_max_file_name_len(VALUE self, VALUE max_file_name_len) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetMaxFileNameLen(*tp, NUM2INT(max_file_name_len));
-  return Qnil;
+static VALUE tp_tagw_ids(VALUE self) {
+  tp_wasync_t *w;
+  VALUE ret = rb_ary_new();
+  long i;
+
+  TypedData_Get_Struct(self, tp_wasync_t, &tp_wasync_type, w);
+  pthread_mutex_lock(&w->lock);
+  for (i = 0; i < w->num_res; i++)
+    if (!w->res[i].skip)
+      rb_ary_push(ret, INT2FIX(w->res[i].id));
+  pthread_mutex_unlock(&w->lock);
+
+  return ret;
 }
 
 /*
- * Get the maximum length of a file name saved by this
- * TunePimp::TunePimp object.
+ * Did every file's tags get written?  Returns nil while still writing.
  *
  * Example:
- *   puts "max length: #{tp.max_file_name_len}"
+ *   w.wait
+ *   puts 'some files failed' unless w.success?
  *
  */
-static VALUE tp_tp_max_file_name_len(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return INT2FIX(tp_GetMaxFileNameLen(*tp));
+static VALUE tp_tagw_success(VALUE self) {
+  tp_wasync_t *w;
+  VALUE ret = Qtrue;
+  long i;
+
+  TypedData_Get_Struct(self, tp_wasync_t, &tp_wasync_type, w);
+  pthread_mutex_lock(&w->lock);
+  if (!w->done)
+    ret = Qnil;
+  for (i = 0; w->done && i < w->num_res; i++)
+    if (!w->res[i].skip && !w->res[i].ok)
+      ret = Qfalse;
+  pthread_mutex_unlock(&w->lock);
+
+  return ret;
 }
 
 /*
- * Delete files after they've been saved?
- *
- * If false, the status of the track is set to TunePimp::Status::Saved
- * instead.
+ * Stop writing: files not handed to libtunepimp yet are skipped (and
+ * fail with "tags weren't written").  The file being written is
+ * resolved from its status at that point, and this waits until it
+ * has been.
  *
  * Example:
- *   # let the user remove stuff
- *   tp.set_auto_remove_saved_files = false
+ *   w.cancel unless w.wait(30)
  *
  */
-static VALUE tp_tp_set_auto_remove_saved_files(VALUE self, VALUE auto_remove_saved_files) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  tp_SetAutoRemovedSavedFiles(*tp, !(auto_remove_saved_files == Qfalse || auto_remove_saved_files == Qnil));
+static VALUE tp_tagw_cancel(VALUE self) {
+  tp_wasync_t *w;
+
+  TypedData_Get_Struct(self, tp_wasync_t, &tp_wasync_type, w);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(tp_wasync_stop, w, NULL, NULL);
+#else
+  tp_wasync_stop(w);
+#endif
+
   return Qnil;
 }
 
 /*
- * Get the value of the TunePimp::TunePimp#auto_remove_saved_files
- * flag.
+ * Get the TunePimp::TunePimp writing these tags.
  *
  * Example:
- *   puts "Magic delete is " << (tp.auto_remove_saved_files ? 'on' : 'off')
+ *   w.tunepimp.wait_notifications(:timeout => 1)
  *
  */
-static VALUE tp_tp_auto_remove_saved_files(VALUE self) {
-  tunepimp_t *tp;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  return tp_GetAutoRemovedSavedFiles(*tp) ? Qtrue : Qfalse;
+static VALUE tp_tagw_tunepimp(VALUE self) {
+  return rb_iv_get(self, "@tunepimp");
 }
 
+/*********************************************************************/
+/* TunePimp::TRMJournal methods                                      */
+/*********************************************************************/
+
 /*
- * Get a list of files with status TunePimp::Status::Recognized, with a
- * similarity less than threshold. 
+ * Durable queue of TRM submissions in front of tp_AddTRMSubmission and
+ * tp_SubmitTRMs.  Each submission is appended to a journal file as
+ * "+ <track id> <trm id>" before it's queued; a thread submits them in
+ * batches, oldest first, and appends "= <n>" (or "! <n>" if it gave
+ * up) once the first n in the file are dealt with.  Since batches are
+ * always taken from the front, replaying the file on open gives back
+ * exactly what was still pending when the last run stopped.  The file
+ * is rewritten with just the pending entries (and a "# <submitted>
+ * <failed>" line carrying the counts) once it's mostly resolved ones.
+ *
+ * Batches go through a tunepimp_t of the journal's own (without
+ * analysis threads), so they don't get mixed up with submissions made
+ * with TunePimp#add_trm.  libtunepimp only empties its list when a
+ * submit succeeds, so a batch is added to it once and a retry just
+ * submits again; giving up on a batch means starting over with a new
+ * tunepimp_t.  The server, proxy and user info are copied from the
+ * TunePimp object whenever they're set there.
+ *
+ * The thread never touches the TunePimp object, so either can be
+ * garbage collected first without waiting on it: the thread finishes
+ * the submit in progress and frees the journal itself.
+ */
+#define TP_JRNL_COMPACT 1024
+
+typedef struct {
+  char track[64], trm[64];
+  double at;
+} tp_jent_t;
+
+struct tp_jrnl_t {
+  tp_pimp_t *pimp; /* NULL once detached */
+  tunepimp_t sub;  /* only touched by the thread once it's running */
+  char *app_name, *app_version, *path;
+  int fd, sync;
+  pthread_t thread;
+  int running;
+  tp_jent_t *sending; /* the batch being added to sub */
+
+  /* batching and retry settings */
+  long batch, max_attempts;
+  double max_age, backoff, max_backoff;
+
+  /* everything below is protected by lock */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stop, flush, orphaned;
+
+  /* connection settings for sub, and whether they've changed */
+  char user[256], pass[256], server[256], proxy[256];
+  short server_port, proxy_port;
+  int settings;
+
+  /* entries at the front added to sub and not yet resolved */
+  long in_sub;
+
+  /* pending entries are ents[head] to ents[len - 1] */
+  tp_jent_t *ents;
+  long head, len, cap;
+
+  /* entries in the file already resolved, and lines in the file */
+  long done, records;
+
+  unsigned long submitted, failed, retries, batches;
+  int attempts, streak, last_error;
+  double retry_at;
+};
+
+/* append a line to the journal; call with the lock held */
+static int tp_jrnl_append(tp_jrnl_t *j, const char *line) {
+  size_t len = strlen(line);
+  ssize_t n;
+
+  while ((n = write(j->fd, line, len)) < 0 && errno == EINTR);
+  if (n != (ssize_t) len || (j->sync && fdatasync(j->fd) < 0))
+    return 0;
+  j->records++;
+
+  return 1;
+}
+
+static int tp_jrnl_push(tp_jrnl_t *j, const char *track, const char *trm, double at) {
+  tp_jent_t *ents;
+  long cap;
+
+  /* slide the pending entries back to the front before growing */
+  if (j->head && (j->len == j->cap || j->head >= j->len / 2)) {
+    memmove(j->ents, j->ents + j->head, (j->len - j->head) * sizeof(tp_jent_t));
+    j->len -= j->head;
+    j->head = 0;
+  }
+  if (j->len == j->cap) {
+    cap = j->cap ? j->cap * 2 : 64;
+    if ((ents = realloc(j->ents, cap * sizeof(tp_jent_t))) == NULL)
+      return 0;
+    j->ents = ents;
+    j->cap = cap;
+  }
+
+  snprintf(j->ents[j->len].track, sizeof(j->ents[j->len].track), "%s", track);
+  snprintf(j->ents[j->len].trm, sizeof(j->ents[j->len].trm), "%s", trm);
+  j->ents[j->len++].at = at;
+
+  return 1;
+}
+
+/* 
+ * Rewrite the journal with only the pending entries, through a
+ * temporary file renamed over the old one.  Call with the lock held.
+ */
+static int tp_jrnl_compact(tp_jrnl_t *j) {
+  char line[160], *tmp;
+  long i;
+  int fd, ok;
+
+  if ((tmp = malloc(strlen(j->path) + 5)) == NULL)
+    return 0;
+  sprintf(tmp, "%s.tmp", j->path);
+  if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644)) < 0) {
+    free(tmp);
+    return 0;
+  }
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+  snprintf(line, sizeof(line), "# %lu %lu\n", j->submitted, j->failed);
+  ok = flock(fd, LOCK_EX | LOCK_NB) == 0 && write(fd, line, strlen(line)) == (ssize_t) strlen(line);
+  for (i = j->head; ok && i < j->len; i++) {
+    snprintf(line, sizeof(line), "+ %s %s\n", j->ents[i].track, j->ents[i].trm);
+    ok = write(fd, line, strlen(line)) == (ssize_t) strlen(line);
+  }
+  if (!ok || fsync(fd) < 0 || rename(tmp, j->path) < 0) {
+    close(fd);
+    unlink(tmp);
+    free(tmp);
+    return 0;
+  }
+  free(tmp);
+
+  close(j->fd);
+  j->fd = fd;
+  j->done = 0;
+  j->records = 1 + j->len - j->head;
+
+  return 1;
+}
+
+/* 
+ * Open (or create) the journal at j->path and replay it.  Returns NULL,
+ * or a message describing what went wrong.
+ */
+static const char *tp_jrnl_open(tp_jrnl_t *j) {
+  char track[64], trm[64], *buf, *line, *end;
+  unsigned long s, f;
+  struct stat st;
+  ssize_t len;
+  long n, adds = 0;
+
+  if ((j->fd = open(j->path, O_RDWR | O_CREAT | O_APPEND, 0644)) < 0)
+    return strerror(errno);
+  fcntl(j->fd, F_SETFD, FD_CLOEXEC);
+  if (flock(j->fd, LOCK_EX | LOCK_NB) < 0)
+    return errno == EWOULDBLOCK ? "journal is in use by another process" : strerror(errno);
+  if (fstat(j->fd, &st) < 0)
+    return strerror(errno);
+  if ((buf = malloc(st.st_size + 1)) == NULL)
+    return "out of memory";
+  if ((len = pread(j->fd, buf, st.st_size, 0)) < 0) {
+    free(buf);
+    return strerror(errno);
+  }
+  buf[len] = '\0';
+
+  /* a torn last line (we crashed mid-append) never happened */
+  for (end = buf + len; end > buf && end[-1] != '\n'; end--);
+  *end = '\0';
+  if (end - buf != len && ftruncate(j->fd, end - buf) < 0) {
+    free(buf);
+    return strerror(errno);
+  }
+
+  for (line = buf; *line; line = strchr(line, '\n') + 1) {
+    j->records++;
+    if (sscanf(line, "+ %63s %63s", track, trm) == 2) {
+      if (!tp_jrnl_push(j, track, trm, 0)) {
+        free(buf);
+        return "out of memory";
+      }
+      adds++;
+    } else if (sscanf(line, "= %ld", &n) == 1 && n >= j->done && n <= adds) {
+      j->submitted += n - j->done;
+      j->head += n - j->done;
+      j->done = n;
+    } else if (sscanf(line, "! %ld", &n) == 1 && n >= j->done && n <= adds) {
+      j->failed += n - j->done;
+      j->head += n - j->done;
+      j->done = n;
+    } else if (sscanf(line, "# %lu %lu", &s, &f) == 2) {
+      j->submitted = s;
+      j->failed = f;
+    }
+  }
+  free(buf);
+
+  /* start from a file with nothing but what's pending */
+  if (j->done && !tp_jrnl_compact(j))
+    return strerror(errno);
+
+  return NULL;
+}
+
+/* 
+ * Record the outcome of submitting the first num pending entries.
+ * Returns true if they were given up on.  Call with the lock held.
+ */
+static int tp_jrnl_resolve(tp_jrnl_t *j, long num, TPError err) {
+  char line[32];
+  double delay;
+  int give_up = 0, i;
+
+  if (err != tpOk) {
+    j->retries++;
+    j->streak++;
+    j->last_error = err;
+
+    /* 
+     * only server errors count towards giving up; anything else
+     * (no user info, say) waits for the caller to fix it
+     */
+    if (err == tpSubmitError && ++j->attempts >= j->max_attempts && j->max_attempts)
+      give_up = 1;
+    if (!give_up) {
+      for (delay = j->backoff, i = 1; i < j->streak && delay < j->max_backoff; i++)
+        delay *= 2;
+      j->retry_at = tp_now() + (delay < j->max_backoff ? delay : j->max_backoff);
+      return 0;
+    }
+    j->failed += num;
+  } else {
+    j->submitted += num;
+    j->batches++;
+    j->streak = 0;
+  }
+
+  j->attempts = 0;
+  j->retry_at = 0;
+  j->in_sub = 0;
+  j->head += num;
+  j->done += num;
+  snprintf(line, sizeof(line), "%c %ld\n", give_up ? '!' : '=', j->done);
+  tp_jrnl_append(j, line);
+
+  if (j->head == j->len) {
+    j->head = j->len = 0;
+    j->flush = 0;
+  }
+  if (j->done >= TP_JRNL_COMPACT && j->done >= j->len - j->head)
+    tp_jrnl_compact(j);
+
+  return give_up;
+}
+
+/* 
+ * Copy tp's server, proxy and user info for the thread to pass on to
+ * sub before its next submit.  Call with the GVL held.
+ */
+static void tp_jrnl_settings(tp_jrnl_t *j, tunepimp_t tp) {
+  char user[256], pass[256], server[256], proxy[256];
+  short server_port, proxy_port;
+
+  tp_GetUserInfo(tp, user, sizeof(user), pass, sizeof(pass));
+  tp_GetServer(tp, server, sizeof(server), &server_port);
+  tp_GetProxy(tp, proxy, sizeof(proxy), &proxy_port);
+
+  pthread_mutex_lock(&j->lock);
+  memcpy(j->user, user, sizeof(user));
+  memcpy(j->pass, pass, sizeof(pass));
+  memcpy(j->server, server, sizeof(server));
+  memcpy(j->proxy, proxy, sizeof(proxy));
+  j->server_port = server_port;
+  j->proxy_port = proxy_port;
+  j->settings = 1;
+  pthread_mutex_unlock(&j->lock);
+}
+
+static void tp_jrnl_destroy(tp_jrnl_t *j) {
+  if (j->fd >= 0)
+    close(j->fd);
+  if (j->sub)
+    tp_Delete(j->sub);
+  pthread_mutex_destroy(&j->lock);
+  pthread_cond_destroy(&j->cond);
+  free(j->sending);
+  free(j->ents);
+  free(j->app_name);
+  free(j->app_version);
+  free(j->path);
+  free(j);
+}
+
+static void *tp_jrnl_main(void *ptr) {
+  tp_jrnl_t *j = ptr;
+  char user[256], pass[256], server[256], proxy[256];
+  short server_port = 0, proxy_port = 0;
+  struct timespec ts;
+  double now, wake, t0;
+  long i, num, add;
+  int settings, stale = 0, orphaned;
+  tunepimp_t sub;
+  TPError err;
+
+  pthread_mutex_lock(&j->lock);
+  while (!j->stop) {
+    /* due when there's a full batch, it's been waiting long enough, or flushing */
+    now = tp_now();
+    num = j->len - j->head;
+    wake = -1;
+    if (num) {
+      wake = (j->flush || num >= j->batch) ? now : j->ents[j->head].at + j->max_age;
+      if (j->retry_at > wake)
+        wake = j->retry_at;
+    }
+    if (wake < 0) {
+      pthread_cond_wait(&j->cond, &j->lock);
+      continue;
+    } else if (wake > now) {
+      ts.tv_sec = (time_t) wake;
+      ts.tv_nsec = (long) ((wake - ts.tv_sec) * 1e9);
+      pthread_cond_timedwait(&j->cond, &j->lock, &ts);
+      continue;
+    }
+
+    /* a batch already in sub is submitted again as it is */
+    add = 0;
+    if ((num = j->in_sub) == 0) {
+      num = add = j->len - j->head < j->batch ? j->len - j->head : j->batch;
+      memcpy(j->sending, j->ents + j->head, num * sizeof(tp_jent_t));
+    }
+    if ((settings = j->settings || stale)) {
+      memcpy(user, j->user, sizeof(user));
+      memcpy(pass, j->pass, sizeof(pass));
+      memcpy(server, j->server, sizeof(server));
+      memcpy(proxy, j->proxy, sizeof(proxy));
+      server_port = j->server_port;
+      proxy_port = j->proxy_port;
+      j->settings = 0;
+    }
+    pthread_mutex_unlock(&j->lock);
+
+    /* sub still holds a batch we gave up on; start over without it */
+    if (stale) {
+      if ((sub = tp_NewWithArgs(j->app_name, j->app_version, 0)) == NULL) {
+        pthread_mutex_lock(&j->lock);
+        j->retry_at = tp_now() + j->max_backoff;
+        continue;
+      }
+      tp_Delete(j->sub);
+      j->sub = sub;
+      stale = 0;
+    }
+    if (settings) {
+      tp_SetServer(j->sub, server, server_port);
+      tp_SetProxy(j->sub, proxy, proxy_port);
+      tp_SetUserInfo(j->sub, user, pass);
+    }
+
+    TP_TRACE_START(t0);
+    for (i = 0; i < add; i++)
+      tp_AddTRMSubmission(j->sub, j->sending[i].track, j->sending[i].trm);
+    err = tp_SubmitTRMs(j->sub);
+    TP_TRACE_CALL(t0, "submit_trms", -1, num);
+
+    pthread_mutex_lock(&j->lock);
+    j->in_sub = num;
+    stale = tp_jrnl_resolve(j, num, err);
+    pthread_cond_broadcast(&j->cond);
+  }
+  orphaned = j->orphaned;
+  pthread_mutex_unlock(&j->lock);
+
+  /* nobody's left to free the journal (see tp_jrnl_free) */
+  if (orphaned)
+    tp_jrnl_destroy(j);
+
+  return NULL;
+}
+
+/* 
+ * Stop the submission thread; idempotent.  Entries still pending stay
+ * in the journal.
+ */
+static void *tp_jrnl_stop(void *ptr) {
+  tp_jrnl_t *j = ptr;
+
+  pthread_mutex_lock(&j->lock);
+  j->stop = 1;
+  pthread_cond_broadcast(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+
+  if (j->running)
+    pthread_join(j->thread, NULL);
+  j->running = 0;
+
+  return NULL;
+}
+
+/* detach from the TunePimp object; call with the GVL held */
+static void tp_jrnl_detach(tp_jrnl_t *j) {
+  if (j->pimp)
+    j->pimp->journal = NULL;
+  j->pimp = NULL;
+}
+
+/* 
+ * Don't wait for the thread here: it may be in the middle of a submit,
+ * and GC would wait with it.  It frees the journal when it's done.
+ */
+static void tp_jrnl_free(void *ptr) {
+  tp_jrnl_t *j = ptr;
+
+  if (j) {
+    tp_jrnl_detach(j);
+    if (j->running) {
+      pthread_mutex_lock(&j->lock);
+      j->stop = j->orphaned = 1;
+      pthread_cond_broadcast(&j->cond);
+      pthread_mutex_unlock(&j->lock);
+      pthread_detach(j->thread);
+      return;
+    }
+    tp_jrnl_destroy(j);
+  }
+}
+
+static size_t tp_jrnl_memsize(const void *ptr) {
+  const tp_jrnl_t *j = ptr;
+  return sizeof(tp_jrnl_t) + (j->cap + j->batch) * sizeof(tp_jent_t);
+}
+
+static const rb_data_type_t tp_jrnl_type = {
+  "TunePimp::TRMJournal",
+  { 0, tp_jrnl_free, tp_jrnl_memsize, TP_COMPACT(0) },
+  0, 0, 0
+};
+
+/*
+ * Open (or create) the TRM submission journal at path and start
+ * submitting from it through the TunePimp::TunePimp tp.  Submissions
+ * still pending from an earlier run are sent first.
+ *
+ * Submissions are sent in batches, once there's a full batch or the
+ * oldest has waited long enough.  A batch that fails is retried after
+ * an exponentially growing delay; one the server keeps rejecting
+ * (TunePimp::Error::SubmitError) is given up on after :max_attempts.
+ * Other errors (TunePimp::Error::NoUserInfo, say) are retried until
+ * they go away.  Only one journal can be attached to a TunePimp object
+ * at a time, and only one process can use a journal file at a time.
+ *
+ * The journal submits through a connection of its own, using tp's
+ * server, proxy and user info, so TRMs queued with
+ * TunePimp::TunePimp#add_trm are never sent along with its batches.
+ * Call TunePimp::TRMJournal#close when you're done: a journal that's
+ * garbage collected instead lets a submit in progress finish in the
+ * background, and holds on to the journal file until it has.
+ *
+ * Options:
+ *   :batch         submissions per batch (default 100).
+ *   :max_age       seconds a submission may wait for its batch to fill
+ *                  (default 60).
+ *   :backoff       seconds to wait before the first retry (default 1);
+ *                  doubled for each failure in a row.
+ *   :max_backoff   longest wait between retries (default 300).
+ *   :max_attempts  tries before a batch is given up on (default 10; 0
+ *                  or nil to never give up).
+ *   :sync          flush the journal to disk on every write (default
+ *                  true).
  *
  * Example:
- *   ary = tp.recognized_files(90)
+ *   tp.set_user_info(user, pass)
+ *   journal = TunePimp::TRMJournal.new(tp, 'trm-journal.log')
+ *   journal.add(track_id, trm_id)
  *
  */
-static VALUE tp_tp_recognized_files(VALUE self, VALUE thresh) {
-  tunepimp_t *tp;
-  int i, *ids, num;
-  VALUE ret;
-
-  ret = Qnil;
-  Data_Get_Struct(self, tunepimp_t, tp);
-  if (tp_GetRecognizedFileList(*tp, NUM2INT(thresh), &ids, &num)) {
-    ret = rb_ary_new();
-    for (i = 0; i < num; i++)
-      rb_ary_push(ret, INT2FIX(ids[i]));
-    tp_DeleteRecognizedFileList(*tp, ids);
+static VALUE tp_jrnl_new(int argc, VALUE *argv, VALUE klass) {
+  tp_jrnl_t *j;
+  tp_pimp_t *pimp;
+  VALUE self, tp, path, opts, val;
+  const char *err;
+
+  rb_scan_args(argc, argv, "21", &tp, &path, &opts);
+  TypedData_Get_Struct(tp, tp_pimp_t, &tp_pimp_type, pimp);
+  if (pimp->journal)
+    rb_raise(eException, "TunePimp object already has a TRM journal");
+
+  self = TypedData_Wrap_Struct(klass, &tp_jrnl_type, NULL);
+  if ((j = malloc(sizeof(tp_jrnl_t))) == NULL)
+    rb_raise(eException, "Couldn't allocate memory for tp_jrnl_t");
+  memset(j, 0, sizeof(tp_jrnl_t));
+  j->fd = -1;
+  pthread_mutex_init(&j->lock, NULL);
+  pthread_cond_init(&j->cond, NULL);
+  DATA_PTR(self) = j;
+
+  j->batch = 100;
+  j->max_age = 60;
+  j->backoff = 1;
+  j->max_backoff = 300;
+  j->max_attempts = 10;
+  j->sync = 1;
+  if (!NIL_P(opts)) {
+    Check_Type(opts, T_HASH);
+    if (RTEST(rb_funcall(opts, rb_intern("has_key?"), 1, ID2SYM(rb_intern("max_attempts")))))
+      j->max_attempts = NIL_P(val = tp_opt(opts, "max_attempts")) ? 0 : NUM2LONG(val);
+    if (RTEST(rb_funcall(opts, rb_intern("has_key?"), 1, ID2SYM(rb_intern("sync")))))
+      j->sync = RTEST(tp_opt(opts, "sync"));
+  }
+  if (!NIL_P(val = tp_opt(opts, "batch")))
+    j->batch = NUM2LONG(val);
+  if (!NIL_P(val = tp_opt(opts, "max_age")))
+    j->max_age = NUM2DBL(val);
+  if (!NIL_P(val = tp_opt(opts, "backoff")))
+    j->backoff = NUM2DBL(val);
+  if (!NIL_P(val = tp_opt(opts, "max_backoff")))
+    j->max_backoff = NUM2DBL(val);
+  if (j->batch < 1 || j->batch > 100000)
+    rb_raise(rb_eArgError, "batch must be between 1 and 100000");
+  if (j->max_age < 0 || j->backoff < 0 || j->max_backoff < j->backoff)
+    rb_raise(rb_eArgError, "need 0 <= backoff <= max_backoff and max_age >= 0");
+  if (j->max_attempts < 0)
+    rb_raise(rb_eArgError, "max_attempts must not be negative");
+
+  j->path = tp_strdup(path);
+  if ((err = tp_jrnl_open(j)) != NULL)
+    rb_raise(eException, "Couldn't open TRM journal %s: %s", j->path, err);
+
+  /* allocated here, so the thread never runs out */
+  j->sending = malloc(sizeof(tp_jent_t) * j->batch);
+  j->app_name = strdup(pimp->app_name);
+  j->app_version = strdup(pimp->app_version);
+  if (!j->sending || !j->app_name || !j->app_version)
+    rb_raise(rb_eNoMemError, "Couldn't allocate memory for TRM journal");
+  if ((j->sub = tp_NewWithArgs(j->app_name, j->app_version, 0)) == NULL)
+    rb_raise(rb_eNoMemError, "Couldn't create tunepimp_t for TRM journal");
+  tp_jrnl_settings(j, pimp->tp);
+
+  rb_iv_set(self, "@tunepimp", tp);
+  j->pimp = pimp;
+  pimp->journal = j;
+  if (!tp_thread_start(&j->thread, 0, tp_jrnl_main, j)) {
+    tp_jrnl_detach(j);
+    rb_raise(eException, "Couldn't start TRM journal thread");
   }
+  j->running = 1;
 
-  return ret;
+  rb_obj_call_init(self, argc, argv);
+
+  return self;
 }
 
+static VALUE tp_jrnl_init(int argc, VALUE *argv, VALUE self) {
+  UNUSED(argc);
+  UNUSED(argv);
+  return self;
+}
 
-/*********************************************************************/
-/* TunePimp::Track methods                                           */
-/*********************************************************************/
+static tp_jrnl_t *tp_jrnl_get_open(VALUE self) {
+  tp_jrnl_t *j;
+
+  TypedData_Get_Struct(self, tp_jrnl_t, &tp_jrnl_type, j);
+  if (!j->running)
+    rb_raise(eException, "TRM journal has been closed");
+
+  return j;
+}
+
+/* arguments and result of a journal append, made without the GVL */
+typedef struct {
+  tp_jrnl_t *j;
+  char track[64], trm[64];
+  int ok;
+} tp_jadd_t;
+
+static void *tp_jrnl_add_entry(void *ptr) {
+  tp_jadd_t *a = ptr;
+  tp_jrnl_t *j = a->j;
+  char line[160];
+
+  snprintf(line, sizeof(line), "+ %s %s\n", a->track, a->trm);
+  pthread_mutex_lock(&j->lock);
+  a->ok = tp_jrnl_push(j, a->track, a->trm, tp_now());
+  if (a->ok && !(a->ok = tp_jrnl_append(j, line)))
+    j->len--;
+  /* wakes the thread to check for a full batch or a new deadline */
+  if (a->ok)
+    pthread_cond_broadcast(&j->cond);
+  pthread_mutex_unlock(&j->lock);
+
+  return NULL;
+}
+
+/* copy a track or TRM id, which must be a single word */
+static void tp_jrnl_id(char *dst, size_t size, VALUE id) {
+  const char *src;
+  long i, len;
+
+  StringValue(id);
+  src = RSTRING_PTR(id);
+  len = RSTRING_LEN(id);
+  if (len < 1 || len >= (long) size)
+    rb_raise(rb_eArgError, "ids must be 1 to %d characters", (int) size - 1);
+  for (i = 0; i < len; i++)
+    if (src[i] <= ' ' || src[i] == 0x7f)
+      rb_raise(rb_eArgError, "invalid character in id");
+  memcpy(dst, src, len);
+  dst[len] = '\0';
+}
 
 /*
- * You cannot instantiate this class directly.  Use
- * TunePimp::TunePimp#get_track instead.
+ * Queue a track ID, TRM pair for submission.  It's in the journal on
+ * disk by the time this returns.  Returns self.
+ *
+ * Aliases:
+ *   TunePimp::TRMJournal#add_trm
+ *
+ * Example:
+ *   journal.add(track_id, trm_id)
  *
  */
-VALUE tp_tr_new(VALUE klass) {
-  rb_raise(eException, "You cannot instantiate this class directly.  Use TunePimp::TunePimp#get_track instead.");
-  return Qnil;
+static VALUE tp_jrnl_add(VALUE self, VALUE track_id, VALUE trm_id) {
+  tp_jadd_t a;
+
+  a.j = tp_jrnl_get_open(self);
+  tp_jrnl_id(a.track, sizeof(a.track), track_id);
+  tp_jrnl_id(a.trm, sizeof(a.trm), trm_id);
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(tp_jrnl_add_entry, &a, NULL, NULL);
+#else
+  tp_jrnl_add_entry(&a);
+#endif
+  if (!a.ok)
+    rb_raise(eException, "Couldn't write to TRM journal %s: %s", a.j->path, strerror(errno));
+
+  return self;
+}
+
+/* 
+ * Arguments of a wait for the journal to empty; timeout is in seconds,
+ * negative to wait forever.
+ */
+typedef struct {
+  tp_jrnl_t *j;
+  double timeout;
+  volatile int cancelled;
+} tp_jwait_t;
+
+static void *tp_jwait(void *ptr) {
+  tp_jwait_t *jw = ptr;
+  tp_jrnl_t *j = jw->j;
+  struct timespec ts;
+  double end = tp_now() + jw->timeout;
+
+  ts.tv_sec = (time_t) end;
+  ts.tv_nsec = (long) ((end - ts.tv_sec) * 1e9);
+
+  pthread_mutex_lock(&j->lock);
+  if (j->len > j->head) {
+    j->flush = 1;
+    pthread_cond_broadcast(&j->cond);
+  }
+  while (j->len > j->head && !j->stop && !jw->cancelled && jw->timeout != 0) {
+    if (jw->timeout < 0)
+      pthread_cond_wait(&j->cond, &j->lock);
+    else if (pthread_cond_timedwait(&j->cond, &j->lock, &ts) == ETIMEDOUT)
+      break;
+  }
+  pthread_mutex_unlock(&j->lock);
+
+  return NULL;
+}
+
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+static void tp_jwait_cancel(void *ptr) {
+  tp_jwait_t *jw = ptr;
+
+  pthread_mutex_lock(&jw->j->lock);
+  jw->cancelled = 1;
+  pthread_cond_broadcast(&jw->j->cond);
+  pthread_mutex_unlock(&jw->j->lock);
+}
+#endif /* HAVE_RB_THREAD_CALL_WITHOUT_GVL */
+
+static long tp_jrnl_queued(tp_jrnl_t *j) {
+  long ret;
+
+  pthread_mutex_lock(&j->lock);
+  ret = j->len - j->head;
+  pthread_mutex_unlock(&j->lock);
+
+  return ret;
 }
 
 /*
- * Constructor for TunePimp::Track object.
+ * Submit everything queued now, without waiting for batches to fill
+ * (failed batches still wait out their retry delay), and wait at most
+ * timeout seconds (forever if timeout is nil) for the queue to empty.
+ * Returns true if it did.
  *
- * This method is currently empty.  You should never call this method
- * directly unless you're instantiating a derived class (ie, you know
- * what you're doing).
+ * Example:
+ *   warn 'TRMs still queued' unless journal.flush(30)
  *
  */
-static VALUE tp_tr_init(VALUE self) {
-  return self;
+static VALUE tp_jrnl_flush(int argc, VALUE *argv, VALUE self) {
+  tp_jwait_t jw;
+  VALUE timeout;
+
+  rb_scan_args(argc, argv, "01", &timeout);
+  jw.j = tp_jrnl_get_open(self);
+  jw.timeout = NIL_P(timeout) ? -1 : NUM2DBL(timeout);
+  if (jw.timeout < 0 && !NIL_P(timeout))
+    rb_raise(rb_eArgError, "timeout must not be negative");
+
+  do {
+    jw.cancelled = 0;
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+    rb_thread_call_without_gvl(tp_jwait, &jw, tp_jwait_cancel, &jw);
+    rb_thread_check_ints();
+#else
+    tp_jwait(&jw);
+#endif
+  } while (jw.cancelled && tp_jrnl_queued(jw.j));
+
+  return tp_jrnl_queued(jw.j) ? Qfalse : Qtrue;
 }
 
 /*
- * Get the TunePimp::Status of a TunePimp::Track object.
+ * Get the number of submissions waiting to be sent.
+ *
+ * Aliases:
+ *   TunePimp::TRMJournal#size
+ *   TunePimp::TRMJournal#length
  *
  * Example:
- *   puts "Recognized" if tr.status == TunePimp::Status::Recognized
+ *   puts "#{journal.queued} TRMs waiting"
  *
  */
-static VALUE tp_tr_status(VALUE self) {
-  track_t *tr;
-  Data_Get_Struct(self, track_t, tr);
-  return INT2FIX(tr_GetStatus(*tr));
+static VALUE tp_jrnl_get_queued(VALUE self) {
+  tp_jrnl_t *j;
+  TypedData_Get_Struct(self, tp_jrnl_t, &tp_jrnl_type, j);
+  return LONG2NUM(tp_jrnl_queued(j));
 }
 
 /*
- * Set the status of a TunePimp::Track object.
+ * Get the submissions waiting to be sent, oldest first, as an array
+ * of [track_id, trm_id] pairs.
  *
  * Example:
- *   tr.status = TunePimp::Status::Verified
- *   
+ *   journal.pending.each { |track, trm| puts "#{track} #{trm}" }
+ *
  */
-static VALUE tp_tr_set_status(VALUE self, VALUE status) {
-  track_t *tr;
-  Data_Get_Struct(self, track_t, tr);
-  tr_SetStatus(*tr, NUM2INT(status));
-  return Qnil;
+static VALUE tp_jrnl_pending(VALUE self) {
+  tp_jrnl_t *j;
+  VALUE ret = rb_ary_new();
+  long i;
+
+  TypedData_Get_Struct(self, tp_jrnl_t, &tp_jrnl_type, j);
+  pthread_mutex_lock(&j->lock);
+  for (i = j->head; i < j->len; i++)
+    rb_ary_push(ret, rb_assoc_new(rb_str_new2(j->ents[i].track), rb_str_new2(j->ents[i].trm)));
+  pthread_mutex_unlock(&j->lock);
+
+  return ret;
 }
 
 /*
- * Get the file name of a TunePimp::Track object.
+ * Get the journal's counts: a hash with the number of submissions
+ * :queued, :submitted and :failed (given up on), the number of
+ * :batches sent and of failed attempts (:retries), the :last_error
+ * (a TunePimp::Error value, or nil), the seconds until the next retry
+ * (:retry_in, or nil) and the age of the oldest queued submission in
+ * seconds (:oldest, or nil).  :submitted and :failed carry over from
+ * earlier runs.
  *
  * Example:
- *   puts "Filename: " << tr.filename
+ *   s = journal.stats
+ *   puts "#{s[:queued]} queued, #{s[:submitted]} sent, #{s[:failed]} failed"
  *
  */
-static VALUE tp_tr_filename(VALUE self) {
-  track_t *tr;
-  char buf[1024];
-  Data_Get_Struct(self, track_t, tr);
-  tr_GetFileName(*tr, buf, 1024);
-  return rb_str_new2(buf);
+static VALUE tp_jrnl_stats(VALUE self) {
+  tp_jrnl_t *j;
+  unsigned long submitted, failed, retries, batches;
+  double now = tp_now(), retry_at, oldest;
+  long queued;
+  int last_error;
+  VALUE ret;
+
+  TypedData_Get_Struct(self, tp_jrnl_t, &tp_jrnl_type, j);
+  pthread_mutex_lock(&j->lock);
+  queued = j->len - j->head;
+  oldest = queued ? j->ents[j->head].at : -1;
+  submitted = j->submitted;
+  failed = j->failed;
+  retries = j->retries;
+  batches = j->batches;
+  last_error = j->retries ? j->last_error : -1;
+  retry_at = j->retry_at;
+  pthread_mutex_unlock(&j->lock);
+
+  ret = rb_hash_new();
+  rb_hash_aset(ret, ID2SYM(rb_intern("queued")), LONG2NUM(queued));
+  rb_hash_aset(ret, ID2SYM(rb_intern("submitted")), ULONG2NUM(submitted));
+  rb_hash_aset(ret, ID2SYM(rb_intern("failed")), ULONG2NUM(failed));
+  rb_hash_aset(ret, ID2SYM(rb_intern("batches")), ULONG2NUM(batches));
+  rb_hash_aset(ret, ID2SYM(rb_intern("retries")), ULONG2NUM(retries));
+  rb_hash_aset(ret, ID2SYM(rb_intern("last_error")), last_error < 0 ? Qnil : INT2FIX(last_error));
+  rb_hash_aset(ret, ID2SYM(rb_intern("retry_in")), retry_at > now ? rb_float_new(retry_at - now) : Qnil);
+  rb_hash_aset(ret, ID2SYM(rb_intern("oldest")), oldest < 0 ? Qnil : rb_float_new(oldest ? now - oldest : 0));
+
+  return ret;
 }
 
 /*
- * Get the TRM of a TunePimp::Track object.
+ * Get the path of the journal file.
  *
  * Example:
- *   puts "TRM: " << tr.trm
+ *   puts journal.path
  *
  */
-static VALUE tp_tr_trm(VALUE self) {
-  track_t *tr;
-  char buf[1024];
-  Data_Get_Struct(self, track_t, tr);
-  tr_GetTRM(*tr, buf, 1024);
-  return rb_str_new2(buf);
+static VALUE tp_jrnl_path(VALUE self) {
+  tp_jrnl_t *j;
+  TypedData_Get_Struct(self, tp_jrnl_t, &tp_jrnl_type, j);
+  return rb_str_new2(j->path);
 }
 
 /*
- * Get the local metadata of a TunePimp::Track object.
- *
- * TODO: better documentation here.
+ * Get the TunePimp::TunePimp submitting from this journal.
  *
  * Example:
- *   md = tr.local_metadata
+ *   journal.tunepimp.set_user_info(user, pass)
  *
  */
-static VALUE tp_tr_local_metadata(VALUE self) {
-  track_t *tr;
-  metadata_t **md;
-  
-  Data_Get_Struct(self, track_t, tr);
-  if ((md = malloc(sizeof(metadata_t *))) == NULL)
-    rb_raise(eException, "Couldn't alloc metadata_t*");
-  *md = md_New();
-  tr_GetLocalMetadata(*tr, *md);
-  
-  return Data_Wrap_Struct(cMD, 0, tp_md_free, md);
+static VALUE tp_jrnl_tunepimp(VALUE self) {
+  return rb_iv_get(self, "@tunepimp");
 }
 
 /*
- * Set the local metadata of a TunePimp::Track object.
- *
- * TODO: better documentation here.
+ * Stop submitting and close the journal.  A batch being sent is
+ * finished first; anything still queued stays in the journal for next
+ * time.
  *
  * Example:
- *   tr.local_metadata = md
+ *   journal.flush(10)
+ *   journal.close
  *
  */
-static VALUE tp_tr_set_local_metadata(VALUE self, VALUE metadata) {
-  track_t *tr;
-  metadata_t **md;
-  
-  Data_Get_Struct(self, track_t, tr);
-  Data_Get_Struct(metadata, metadata_t *, md);
-  tr_SetLocalMetadata(*tr, *md);
+static VALUE tp_jrnl_close(VALUE self) {
+  tp_jrnl_t *j;
+
+  TypedData_Get_Struct(self, tp_jrnl_t, &tp_jrnl_type, j);
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+  rb_thread_call_without_gvl(tp_jrnl_stop, j, NULL, NULL);
+#else
+  tp_jrnl_stop(j);
+#endif
+  tp_jrnl_detach(j);
+  if (j->fd >= 0)
+    close(j->fd);
+  j->fd = -1;
 
   return Qnil;
 }
 
 /*
- * Get the server metadata of a TunePimp::Track object.
- *
- * TODO: better documentation here.
+ * Has this TunePimp::TRMJournal been closed?
  *
  * Example:
- *   md = tr.server_metadata
+ *   journal.close unless journal.closed?
  *
  */
-static VALUE tp_tr_server_metadata(VALUE self) {
-  track_t *tr;
-  metadata_t **md;
-  
-  Data_Get_Struct(self, track_t, tr);
-  if ((md = malloc(sizeof(metadata_t *))) == NULL)
-    rb_raise(eException, "Couldn't alloc metadata_t*");
-  *md = md_New();
-  tr_GetServerMetadata(*tr, *md);
-  
-  return Data_Wrap_Struct(cMD, 0, tp_md_free, md);
+static VALUE tp_jrnl_closed(VALUE self) {
+  tp_jrnl_t *j;
+  TypedData_Get_Struct(self, tp_jrnl_t, &tp_jrnl_type, j);
+  return j->running ? Qfalse : Qtrue;
+}
+
+/*********************************************************************/
+/* TunePimp::Tracer methods                                          */
+/*********************************************************************/
+
+#define TP_TRACE_CAP 65536
+
+/*
+ * Status changes for the tracer.  The notify callback can't ask
+ * libtunepimp for a file's status (it may be holding its own locks),
+ * so while tracing it queues each notification here, with a reference
+ * to the instance, and a thread started by the first
+ * TunePimp::Tracer.start looks the status up and records it.
+ */
+typedef struct {
+  tp_pimp_t *pimp;
+  tunepimp_t tp;
+  int type, file_id;
+  double at;
+} tp_tstat_t;
+
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  tp_ring_t ring;
+  int running;
+} tp_tstat = {
+  PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+  { NULL, sizeof(tp_tstat_t), 0, 0, 0 }, 0
+};
+
+/* called from the notify callback while tracing */
+static void tp_tstat_note(tp_pimp_t *pimp, tunepimp_t tp, int type, int file_id) {
+  tp_tstat_t ts;
+
+  if (type == tpFileRemoved)
+    return;
+  ts.pimp = pimp;
+  ts.tp = tp;
+  ts.type = type;
+  ts.file_id = file_id;
+  ts.at = tp_now();
+
+  /* 
+   * referenced only once queued: dropping a reference here could
+   * delete tp from one of its own threads
+   */
+  pthread_mutex_lock(&tp_tstat.lock);
+  if (tp_tstat.running && tp_ring_push(&tp_tstat.ring, &ts)) {
+    if (tp_pimp_tryref(pimp))
+      pthread_cond_signal(&tp_tstat.cond);
+    else
+      tp_tstat.ring.len--;
+  }
+  pthread_mutex_unlock(&tp_tstat.lock);
+}
+
+static void *tp_tstat_main(void *ptr) {
+  tp_tstat_t ts;
+  track_t tr;
+  int status;
+
+  UNUSED(ptr);
+  pthread_mutex_lock(&tp_tstat.lock);
+  for (;;) {
+    if (!tp_ring_shift(&tp_tstat.ring, &ts)) {
+      pthread_cond_wait(&tp_tstat.cond, &tp_tstat.lock);
+      continue;
+    }
+    pthread_mutex_unlock(&tp_tstat.lock);
+
+    /* written, then removed (see auto_remove_saved_files) */
+    status = ts.type == tpWriteTagsComplete ? eSaved : -1;
+    if ((tr = tp_GetTrack(ts.tp, ts.file_id)) != NULL) {
+      status = tr_GetStatus(tr);
+      tp_ReleaseTrack(ts.tp, tr);
+    }
+    if (tp_tracing && status >= 0 && status < eLastStatus)
+      tp_trace_add(TP_TEV_STATUS, tp_status_names[status], ts.file_id, status, ts.at, 0);
+    tp_pimp_unref(ts.pimp);
+
+    pthread_mutex_lock(&tp_tstat.lock);
+  }
+
+  return NULL;
 }
 
 /*
- * Set the server metadata of a TunePimp::Track object.
+ * Start tracing: from now on binding calls (adding files, lookups,
+ * selecting results, writing tags, submitting TRMs, waiting for
+ * notifications), notifications and status changes are recorded, with
+ * timestamps and thread ids, in a ring buffer holding the last
+ * capacity events (default 65536).  Starting again clears the buffer.
  *
- * TODO: better documentation here.
+ * Status changes are looked up as the notifications come in, on a
+ * thread that runs from the first start on.
  *
  * Example:
- *   tr.server_metadata = md
+ *   TunePimp::Tracer.start
  *
  */
-static VALUE tp_tr_set_server_metadata(VALUE self, VALUE metadata) {
-  track_t *tr;
-  metadata_t **md;
-  
-  Data_Get_Struct(self, track_t, tr);
-  Data_Get_Struct(metadata, metadata_t *, md);
-  tr_SetServerMetadata(*tr, *md);
+static VALUE tp_tracer_start(int argc, VALUE *argv, VALUE self) {
+  VALUE cap;
+  unsigned long num = TP_TRACE_CAP;
+  tp_tev_t *events;
+  pthread_t tid;
+
+  UNUSED(self);
+  rb_scan_args(argc, argv, "01", &cap);
+  if (!NIL_P(cap))
+    num = NUM2ULONG(cap);
+  if (num < 1 || num > (1UL << 24))
+    rb_raise(rb_eArgError, "capacity must be between 1 and %lu", 1UL << 24);
+  if ((events = malloc(sizeof(tp_tev_t) * num)) == NULL)
+    rb_raise(eException, "Couldn't allocate %lu trace events", num);
+
+  pthread_mutex_lock(&tp_tstat.lock);
+  if (!tp_tstat.running)
+    tp_tstat.running = tp_thread_start(&tid, 1, tp_tstat_main, NULL);
+  pthread_mutex_unlock(&tp_tstat.lock);
+  if (!tp_tstat.running) {
+    free(events);
+    rb_raise(eException, "Couldn't start tracer thread");
+  }
+
+  pthread_mutex_lock(&tp_trace.lock);
+  free(tp_trace.events);
+  tp_trace.events = events;
+  tp_trace.cap = num;
+  tp_trace.total = 0;
+  tp_trace.epoch = tp_now();
+  pthread_mutex_unlock(&tp_trace.lock);
+  tp_tracing = 1;
 
   return Qnil;
 }
 
 /*
- * Get the error of a TunePimp::Track object.
+ * Stop tracing.  The events recorded so far are kept for
+ * TunePimp::Tracer.dump.
  *
  * Example:
- *   puts "Error: " << tr.error
+ *   TunePimp::Tracer.stop
+ *   TunePimp::Tracer.dump('trace.json')
  *
  */
-static VALUE tp_tr_error(VALUE self) {
-  track_t *tr;
-  char buf[1024];
-  Data_Get_Struct(self, track_t, tr);
-  tr_GetError(*tr, buf, 1024);
-  return rb_str_new2(buf);
+static VALUE tp_tracer_stop(VALUE self) {
+  UNUSED(self);
+  tp_tracing = 0;
+  return Qnil;
 }
 
 /*
- * Get the similarity of a TunePimp::Track object.
+ * Is tracing on?
  *
  * Example:
- *   puts "Similarity: #{tr.similarity}"
+ *   TunePimp::Tracer.start unless TunePimp::Tracer.tracing?
  *
  */
-static VALUE tp_tr_similarity(VALUE self) {
-  track_t *tr;
-  Data_Get_Struct(self, track_t, tr);
-  return INT2FIX(tr_GetSimilarity(*tr));
+static VALUE tp_tracer_tracing(VALUE self) {
+  UNUSED(self);
+  return tp_tracing ? Qtrue : Qfalse;
 }
 
 /*
- * Has this TunePimp::Track object changed?
+ * Throw away the events recorded so far.
  *
  * Example:
- *   puts 'This track has changed.' if tr.has_changed?
+ *   TunePimp::Tracer.clear
  *
  */
-static VALUE tp_tr_has_changed(VALUE self) {
-  track_t *tr;
-  Data_Get_Struct(self, track_t, tr);
-  return tr_HasChanged(*tr) ? Qtrue : Qfalse;
+static VALUE tp_tracer_clear(VALUE self) {
+  UNUSED(self);
+  pthread_mutex_lock(&tp_trace.lock);
+  tp_trace.total = 0;
+  pthread_mutex_unlock(&tp_trace.lock);
+  return Qnil;
 }
 
 /*
- * Get the number of results for this track.
+ * Get the number of events in the buffer, and the number that have
+ * been pushed out of it since tracing started, as [size, dropped].
  *
  * Example:
- *   puts "Found #{tr.num_results} results."
+ *   size, dropped = TunePimp::Tracer.size
  *
  */
-static VALUE tp_tr_num_results(VALUE self) {
-  track_t *tr;
-  Data_Get_Struct(self, track_t, tr);
-  return INT2FIX(tr_GetNumResults(*tr));
+static VALUE tp_tracer_size(VALUE self) {
+  unsigned long total, cap;
+
+  UNUSED(self);
+  pthread_mutex_lock(&tp_trace.lock);
+  total = tp_trace.total;
+  cap = tp_trace.cap;
+  pthread_mutex_unlock(&tp_trace.lock);
+
+  return rb_assoc_new(ULONG2NUM(total < cap ? total : cap), ULONG2NUM(total > cap ? total - cap : 0));
 }
 
-static VALUE wrap_artist(result_t *result) {
-  artistresult_t *a_r;
-  VALUE ret;
+/* a status change, by file and then in the order recorded */
+typedef struct {
+  int file_id;
+  unsigned long i;
+} tp_tev_ref_t;
 
-  a_r = (artistresult_t*) result;
-  ret = rb_hash_new();
-  rb_hash_aset(ret, rb_str_new2("relevance"), INT2FIX(a_r->relevance));
-  rb_hash_aset(ret, rb_str_new2("id"), rb_str_new2(a_r->id));
-  rb_hash_aset(ret, rb_str_new2("name"), rb_str_new2(a_r->name));
-  rb_hash_aset(ret, rb_str_new2("sort_name"), rb_str_new2(a_r->sortName));
+static int tp_tev_ref_cmp(const void *a, const void *b) {
+  const tp_tev_ref_t *x = a, *y = b;
 
-  return ret;
+  if (x->file_id != y->file_id)
+    return x->file_id < y->file_id ? -1 : 1;
+  return x->i < y->i ? -1 : x->i > y->i;
 }
 
-static VALUE wrap_album(result_t *result) {
-  albumresult_t *a_r;
-  VALUE ret;
+/*
+ * Dump the recorded events as Chrome trace JSON, for chrome://tracing
+ * or ui.perfetto.dev.  Binding calls and notifications show up on the
+ * threads they happened on, under "tunepimp"; status changes get one
+ * row per file, under "files", each status lasting until the file's
+ * next one (its current status, until the end of the trace).  Writes
+ * the JSON to path and returns the number of events if path is given,
+ * or returns the JSON.
+ *
+ * Example:
+ *   TunePimp::Tracer.dump('slow-batch.json')
+ *
+ */
+static VALUE tp_tracer_dump(int argc, VALUE *argv, VALUE self) {
+  tp_tev_t *events, *ev;
+  tp_tev_ref_t *files;
+  unsigned long i, num, first, prev;
+  long num_files = 0;
+  double epoch, end = 0;
+  VALUE path, ret, buf;
+  FILE *fp;
+
+  UNUSED(self);
+  rb_scan_args(argc, argv, "01", &path);
+
+  /* copy the buffer out, oldest first */
+  pthread_mutex_lock(&tp_trace.lock);
+  num = tp_trace.total < tp_trace.cap ? tp_trace.total : tp_trace.cap;
+  first = tp_trace.total - num;
+  buf = rb_str_buf_new((sizeof(tp_tev_t) + sizeof(tp_tev_ref_t)) * (num ? num : 1));
+  events = (tp_tev_t*) RSTRING_PTR(buf);
+  for (i = 0; i < num; i++)
+    events[i] = tp_trace.events[(first + i) % tp_trace.cap];
+  epoch = tp_trace.epoch;
+  pthread_mutex_unlock(&tp_trace.lock);
 
-  a_r = (albumresult_t*) result;
-  ret = rb_hash_new();
-  rb_hash_aset(ret, rb_str_new2("relevance"), INT2FIX(a_r->relevance));
-  rb_hash_aset(ret, rb_str_new2("name"), rb_str_new2(a_r->name));
-  rb_hash_aset(ret, rb_str_new2("id"), rb_str_new2(a_r->id));
-  rb_hash_aset(ret, rb_str_new2("num_tracks"), INT2FIX(a_r->numTracks));
-  rb_hash_aset(ret, rb_str_new2("num_cd_index_ids"), INT2FIX(a_r->numCDIndexIds));
-  rb_hash_aset(ret, rb_str_new2("is_va"), a_r->isVA ? Qtrue : Qfalse);
-  rb_hash_aset(ret, rb_str_new2("type"), INT2FIX(a_r->type));
-  rb_hash_aset(ret, rb_str_new2("release_year"), INT2FIX(a_r->releaseYear));
-  rb_hash_aset(ret, rb_str_new2("release_month"), INT2FIX(a_r->releaseMonth));
-  rb_hash_aset(ret, rb_str_new2("release_day"), INT2FIX(a_r->releaseDay));
-  rb_hash_aset(ret, rb_str_new2("release_country"), rb_str_new2(a_r->releaseCountry));
-  rb_hash_aset(ret, rb_str_new2("artist"), wrap_artist((result_t*) a_r->artist));
+  files = (tp_tev_ref_t*) (events + (num ? num : 1));
+  for (i = 0; i < num; i++) {
+    if (events[i].kind == TP_TEV_STATUS) {
+      files[num_files].file_id = events[i].file_id;
+      files[num_files++].i = i;
+    }
+    if (events[i].ts < epoch)
+      epoch = events[i].ts;
+    if (events[i].ts + events[i].dur > end)
+      end = events[i].ts + events[i].dur;
+  }
+  qsort(files, num_files, sizeof(tp_tev_ref_t), tp_tev_ref_cmp);
+
+  /* 
+   * each status lasts until the next different one; repeats (a file
+   * changed without changing status) are dropped
+   */
+  for (i = 0; i < (unsigned long) num_files; i++) {
+    ev = events + files[i].i;
+    if (i && files[i].file_id == files[i - 1].file_id) {
+      if (events[prev].arg == ev->arg) {
+        ev->kind = -1;
+        continue;
+      }
+      events[prev].dur = ev->ts - events[prev].ts;
+    }
+    if (i + 1 == (unsigned long) num_files || files[i + 1].file_id != ev->file_id)
+      ev->dur = end - ev->ts;
+    prev = files[i].i;
+  }
 
-  return ret;
-}
+  ret = rb_str_new2("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  tp_mx_cat(ret, "{\"ph\":\"M\",\"pid\":1,\"name\":\"process_name\",\"args\":{\"name\":\"tunepimp\"}},\n");
+  tp_mx_cat(ret, "{\"ph\":\"M\",\"pid\":2,\"name\":\"process_name\",\"args\":{\"name\":\"files\"}}");
+  for (i = 0; i < (unsigned long) num_files; i++)
+    if (!i || files[i].file_id != files[i - 1].file_id)
+      tp_mx_cat(ret, ",\n{\"ph\":\"M\",\"pid\":2,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"file %d\"}}",
+                files[i].file_id, files[i].file_id);
 
-static VALUE wrap_track(result_t *result) {
-  albumtrackresult_t *a_r;
-  VALUE ret;
+  for (i = 0; i < num; i++) {
+    ev = events + i;
+    switch (ev->kind) {
+      case TP_TEV_CALL:
+        tp_mx_cat(ret, ",\n{\"ph\":\"X\",\"cat\":\"call\",\"name\":\"%s\",\"pid\":1,\"tid\":%ld,\"ts\":%.3f,\"dur\":%.3f,\"args\":{",
+                  ev->name, ev->tid, (ev->ts - epoch) * 1e6, ev->dur * 1e6);
+        if (ev->file_id >= 0)
+          tp_mx_cat(ret, "\"file_id\":%d,", ev->file_id);
+        tp_mx_cat(ret, "\"result\":%ld}}", ev->arg);
+        break;
+      case TP_TEV_NOTE:
+        tp_mx_cat(ret, ",\n{\"ph\":\"i\",\"s\":\"t\",\"cat\":\"notify\",\"name\":\"%s\",\"pid\":1,\"tid\":%ld,\"ts\":%.3f,\"args\":{\"file_id\":%d}}",
+                  ev->name, ev->tid, (ev->ts - epoch) * 1e6, ev->file_id);
+        break;
+      case TP_TEV_STATUS:
+        tp_mx_cat(ret, ",\n{\"ph\":\"X\",\"cat\":\"status\",\"name\":\"%s\",\"pid\":2,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"file_id\":%d,\"status\":%ld}}",
+                  ev->name, ev->file_id, (ev->ts - epoch) * 1e6, ev->dur * 1e6, ev->file_id, ev->arg);
+        break;
+    }
+  }
+  rb_str_cat(ret, "\n]}\n", 4);
+  RB_GC_GUARD(buf);
 
-  a_r = (albumtrackresult_t*) result;
-  ret = rb_hash_new();
-  rb_hash_aset(ret, rb_str_new2("relevance"), INT2FIX(a_r->relevance));
-  rb_hash_aset(ret, rb_str_new2("name"), rb_str_new2(a_r->name));
-  rb_hash_aset(ret, rb_str_new2("id"), rb_str_new2(a_r->id));
-  rb_hash_aset(ret, rb_str_new2("num_trm_ids"), INT2FIX(a_r->numTRMIds));
-  rb_hash_aset(ret, rb_str_new2("track_num"), INT2FIX(a_r->trackNum));
-  rb_hash_aset(ret, rb_str_new2("duration"), INT2FIX(a_r->duration));
-  rb_hash_aset(ret, rb_str_new2("artist"), wrap_artist((result_t*) a_r->artist));
-  rb_hash_aset(ret, rb_str_new2("album"), wrap_album((result_t*) a_r->album));
+  if (NIL_P(path))
+    return ret;
 
-  return ret;
+  if ((fp = fopen(StringValueCStr(path), "w")) == NULL)
+    rb_raise(eException, "Couldn't open %s: %s", RSTRING_PTR(path), strerror(errno));
+  i = fwrite(RSTRING_PTR(ret), 1, RSTRING_LEN(ret), fp) == (size_t) RSTRING_LEN(ret);
+  if (fclose(fp) || !i)
+    rb_raise(eException, "Couldn't write %s: %s", RSTRING_PTR(path), strerror(errno));
+
+  return ULONG2NUM(num);
 }
 
+/*********************************************************************/
+/* TunePimp::TunePimp bulk export                                    */
+/*********************************************************************/
+
 /*
- * Get the results for this TunePimp::Track object.
- *
- * TODO: documentation
- *
- * Example: 
- *   type, results = tr.results
- *
+ * Buffered writer on a plain file descriptor, or (if fd is -1) on a
+ * Ruby object with a write method.  Used without the GVL, so the
+ * object is only called back with the GVL reacquired; the first write
+ * error is kept in err (and an exception raised by write in state),
+ * and everything after it is dropped.
  */
-static VALUE tp_tr_results(VALUE self) {
-  track_t *tr;
-  TPResultType type;
-  result_t results;
-  int i, num;
-  VALUE ary, ret;
-  Data_Get_Struct(self, track_t, tr);
+typedef struct {
+  int fd, err, latin1, state;
+  VALUE io;
+  size_t len;
+  char buf[65536];
+} tp_writer_t;
+
+static VALUE tp_w_io_write_i(VALUE ptr) {
+  tp_writer_t *w = (tp_writer_t*) ptr;
+  return rb_funcall(w->io, rb_intern("write"), 1, rb_str_new(w->buf, w->len));
+}
 
-  ary = rb_ary_new();
-  tr_GetResults(*tr, &type, &results, &num);
-  switch (type) {
-    case eArtistList:
-      for (i = 0; i < num; i++)
-        rb_ary_push(ary, wrap_artist(results + i));
-      break;
-    case eAlbumList:
-      for (i = 0; i < num; i++)
-        rb_ary_push(ary, wrap_album(results + i));
-      break;
-    case eTrackList:
-      for (i = 0; i < num; i++)
-        rb_ary_push(ary, wrap_track(results + i));
-      break;
-    case eNone:
-    case eMatchedTrack:
-/* 
-*         ary = wrap_tracks(results, num);
-*         break;
-*/ 
-    default:
-      rb_raise(eException, "Result type %d not implemented", type);
+static void *tp_w_io_write(void *ptr) {
+  tp_writer_t *w = ptr;
+  rb_protect(tp_w_io_write_i, (VALUE) w, &w->state);
+  return NULL;
+}
+
+static void tp_w_flush(tp_writer_t *w) {
+  size_t ofs = 0;
+  ssize_t n;
+
+  if (w->fd < 0) {
+    if (w->len > 0 && !w->err) {
+#ifdef HAVE_RB_THREAD_CALL_WITHOUT_GVL
+      rb_thread_call_with_gvl(tp_w_io_write, w);
+#else
+      tp_w_io_write(w);
+#endif
+      if (w->state)
+        w->err = EIO;
+    }
+    w->len = 0;
+    return;
   }
-  rs_Delete(type, &results, num);
 
-  ret = rb_ary_new();
-  rb_ary_push(ret, INT2FIX(type));
-  rb_ary_push(ret, ary);
+  while (ofs < w->len && !w->err) {
+    if ((n = write(w->fd, w->buf + ofs, w->len - ofs)) < 0) {
+      if (errno != EINTR)
+        w->err = errno;
+    } else {
+      ofs += n;
+    }
+  }
+  w->len = 0;
+}
 
-  return ret;
+static void tp_w_put(tp_writer_t *w, const void *ptr, size_t len) {
+  size_t n;
+
+  while (len > 0) {
+    if (w->len == sizeof(w->buf))
+      tp_w_flush(w);
+    n = sizeof(w->buf) - w->len;
+    if (n > len)
+      n = len;
+    memcpy(w->buf + w->len, ptr, n);
+    w->len += n;
+    ptr = (const char*) ptr + n;
+    len -= n;
+  }
 }
 
-/*
- * Lock this TunePimp::Track object.
- *
- * TODO: better documentation
- *
- * Example:
- *   tr.lock
- *
- */
-static VALUE tp_tr_lock(VALUE self) {
-  track_t *tr;
-  Data_Get_Struct(self, track_t, tr);
-  tr_Lock(*tr);
-  return Qnil;
+static void tp_w_putc(tp_writer_t *w, char c) {
+  if (w->len == sizeof(w->buf))
+    tp_w_flush(w);
+  w->buf[w->len++] = c;
+}
+
+static void tp_w_puts(tp_writer_t *w, const char *str) {
+  tp_w_put(w, str, strlen(str));
+}
+
+static void tp_w_long(tp_writer_t *w, long val) {
+  char buf[32];
+  tp_w_put(w, buf, snprintf(buf, sizeof(buf), "%ld", val));
 }
 
 /*
- * Unlock this TunePimp::Track object.
- *
- * TODO: better documentation
- *
- * Example:
- *   tr.unlock
- *
+ * Output formats.  Each one is a set of callbacks driven by
+ * tp_export_rec below; nested is non-zero for metadata fields, which
+ * JSON and MessagePack write as a nested map and CSV as prefixed
+ * columns.
  */
-static VALUE tp_tr_unlock(VALUE self) {
-  track_t *tr;
-  Data_Get_Struct(self, track_t, tr);
-  tr_Unlock(*tr);
-  return Qnil;
+typedef struct {
+  void (*rec_begin)(tp_writer_t *, int num_fields);
+  void (*rec_end)(tp_writer_t *);
+  void (*map_begin)(tp_writer_t *, const char *key, int num_fields);
+  void (*map_end)(tp_writer_t *);
+  void (*key)(tp_writer_t *, const char *key, int first);
+  void (*str)(tp_writer_t *, const char *val);
+  void (*num)(tp_writer_t *, long val);
+  void (*bool_)(tp_writer_t *, int val);
+} tp_format_t;
+
+/* JSON Lines */
+static void tp_json_str(tp_writer_t *w, const char *val) {
+  const unsigned char *p;
+  char buf[8];
+
+  tp_w_putc(w, '"');
+  for (p = (const unsigned char*) val; *p; p++) {
+    if (*p == '"' || *p == '\\') {
+      tp_w_putc(w, '\\');
+      tp_w_putc(w, *p);
+    } else if (*p < 0x20 || (*p >= 0x80 && w->latin1)) {
+      /* control characters, and latin1 bytes that aren't valid UTF-8 */
+      snprintf(buf, sizeof(buf), "\\u%04x", *p);
+      tp_w_puts(w, buf);
+    } else {
+      tp_w_putc(w, *p);
+    }
+  }
+  tp_w_putc(w, '"');
 }
 
+static void tp_json_rec_begin(tp_writer_t *w, int n) { UNUSED(n); tp_w_putc(w, '{'); }
+static void tp_json_rec_end(tp_writer_t *w) { tp_w_puts(w, "}\n"); }
+static void tp_json_map_end(tp_writer_t *w) { tp_w_putc(w, '}'); }
+static void tp_json_num(tp_writer_t *w, long val) { tp_w_long(w, val); }
+static void tp_json_bool(tp_writer_t *w, int val) { tp_w_puts(w, val ? "true" : "false"); }
+
+static void tp_json_key(tp_writer_t *w, const char *key, int first) {
+  if (!first)
+    tp_w_putc(w, ',');
+  tp_json_str(w, key);
+  tp_w_putc(w, ':');
+}
+
+static void tp_json_map_begin(tp_writer_t *w, const char *key, int n) {
+  UNUSED(key);
+  UNUSED(n);
+  tp_w_putc(w, '{');
+}
+
+static const tp_format_t tp_format_json = {
+  tp_json_rec_begin, tp_json_rec_end, tp_json_map_begin, tp_json_map_end,
+  tp_json_key, tp_json_str, tp_json_num, tp_json_bool
+};
+
+/* CSV (RFC 4180) */
+static void tp_csv_str(tp_writer_t *w, const char *val) {
+  const char *p;
+
+  if (!val[strcspn(val, ",\"\r\n")]) {
+    tp_w_puts(w, val);
+    return;
+  }
+
+  tp_w_putc(w, '"');
+  for (p = val; *p; p++) {
+    if (*p == '"')
+      tp_w_putc(w, '"');
+    tp_w_putc(w, *p);
+  }
+  tp_w_putc(w, '"');
+}
+
+static void tp_csv_rec_begin(tp_writer_t *w, int n) { UNUSED(w); UNUSED(n); }
+static void tp_csv_rec_end(tp_writer_t *w) { tp_w_puts(w, "\r\n"); }
+static void tp_csv_map_end(tp_writer_t *w) { UNUSED(w); }
+static void tp_csv_num(tp_writer_t *w, long val) { tp_w_long(w, val); }
+static void tp_csv_bool(tp_writer_t *w, int val) { tp_w_puts(w, val ? "true" : "false"); }
+
+static void tp_csv_key(tp_writer_t *w, const char *key, int first) {
+  UNUSED(key);
+  if (!first)
+    tp_w_putc(w, ',');
+}
+
+static void tp_csv_map_begin(tp_writer_t *w, const char *key, int n) {
+  UNUSED(w);
+  UNUSED(key);
+  UNUSED(n);
+}
+
+static const tp_format_t tp_format_csv = {
+  tp_csv_rec_begin, tp_csv_rec_end, tp_csv_map_begin, tp_csv_map_end,
+  tp_csv_key, tp_csv_str, tp_csv_num, tp_csv_bool
+};
+
+/* MessagePack: one map per track, back to back */
+static void tp_mp_be(tp_writer_t *w, unsigned char tag, unsigned long val, int bytes) {
+  unsigned char buf[9];
+  int i;
+
+  buf[0] = tag;
+  for (i = 0; i < bytes; i++)
+    buf[bytes - i] = (val >> (i * 8)) & 0xff;
+  tp_w_put(w, buf, bytes + 1);
+}
+
+static void tp_mp_str(tp_writer_t *w, const char *val) {
+  size_t len = strlen(val);
+
+  if (len < 32)
+    tp_w_putc(w, (char) (0xa0 | len));
+  else if (len < 0x100)
+    tp_mp_be(w, 0xd9, len, 1);
+  else if (len < 0x10000)
+    tp_mp_be(w, 0xda, len, 2);
+  else
+    tp_mp_be(w, 0xdb, len, 4);
+  tp_w_put(w, val, len);
+}
+
+static void tp_mp_num(tp_writer_t *w, long val) {
+  if (val >= 0 && val < 128)
+    tp_w_putc(w, (char) val);
+  else if (val >= -32 && val < 0)
+    tp_w_putc(w, (char) (0xe0 | (val + 32)));
+  else
+    tp_mp_be(w, 0xd3, (unsigned long) val, 8);
+}
+
+static void tp_mp_map(tp_writer_t *w, int n) {
+  if (n < 16)
+    tp_w_putc(w, (char) (0x80 | n));
+  else
+    tp_mp_be(w, 0xde, n, 2);
+}
+
+static void tp_mp_rec_end(tp_writer_t *w) { UNUSED(w); }
+static void tp_mp_map_end(tp_writer_t *w) { UNUSED(w); }
+static void tp_mp_bool(tp_writer_t *w, int val) { tp_w_putc(w, (char) (val ? 0xc3 : 0xc2)); }
+static void tp_mp_key(tp_writer_t *w, const char *key, int first) { UNUSED(first); tp_mp_str(w, key); }
+
+static void tp_mp_map_begin(tp_writer_t *w, const char *key, int n) {
+  UNUSED(key);
+  tp_mp_map(w, n);
+}
+
+static const tp_format_t tp_format_msgpack = {
+  tp_mp_map, tp_mp_rec_end, tp_mp_map_begin, tp_mp_map_end,
+  tp_mp_key, tp_mp_str, tp_mp_num, tp_mp_bool
+};
 
-/*********************************************************************/
-/* TunePimp::Metadata methods                                        */
-/*********************************************************************/
 /*
- * Create a new TunePimp::Metadata object.
- *
- * Example:
- *   md = TunePimp::Metadata.new
- *
+ * Fields that TunePimp::TunePimp#export can write.
  */
-VALUE tp_md_new(VALUE klass) {
-  metadata_t **md;
-  VALUE self;
+static const char *tp_export_field_names[] = {
+  "id", "status", "filename", "trm", "similarity", "error", "local",
+  "server", NULL
+};
+
+enum {
+  TP_EXPORT_ID,
+  TP_EXPORT_STATUS,
+  TP_EXPORT_FILENAME,
+  TP_EXPORT_TRM,
+  TP_EXPORT_SIMILARITY,
+  TP_EXPORT_ERROR,
+  TP_EXPORT_LOCAL,
+  TP_EXPORT_SERVER,
+  TP_EXPORT_LAST
+};
+
+typedef struct {
+  tp_call_t call; /* must be first (see tp_call_blocking) */
+  const tp_format_t *fmt;
+  int fields, csv, count, nomem, close_fd;
+  tp_writer_t *w;
+} tp_export_t;
 
-  if ((md = malloc(sizeof(metadata_t*))) == NULL)
-    rb_raise(eException, "Couldn't allocate memory for metadata_t*");
-  *md = md_New();
+/*
+ * Copy of one track's state, taken with the track locked.
+ */
+typedef struct {
+  int id, status, similarity;
+  char filename[1024], trm[1024], error[1024];
+  metadata_t *md[2];
+} tp_export_rec_t;
+
+static void tp_export_md(tp_export_t *ex, const char *key, const metadata_t *md) {
+  const tp_md_field_t *f;
+  const char *ptr;
+  int n;
+
+  for (n = 0; tp_md_fields[n].name; n++);
+  ex->fmt->map_begin(ex->w, key, n);
+
+  for (f = tp_md_fields; f->name; f++) {
+    ex->fmt->key(ex->w, f->name, f == tp_md_fields);
+    ptr = (const char*) md + f->offset;
+    switch (f->type) {
+      case TP_MD_STR:
+        ex->fmt->str(ex->w, ptr);
+        break;
+      case TP_MD_INT:
+        ex->fmt->num(ex->w, *(const int*) ptr);
+        break;
+      case TP_MD_ULONG:
+        ex->fmt->num(ex->w, (long) *(const unsigned long*) ptr);
+        break;
+      case TP_MD_BOOL:
+        ex->fmt->bool_(ex->w, *(const int*) ptr);
+        break;
+    }
+  }
 
-  self = Data_Wrap_Struct(klass, 0, tp_md_free, md);
-  rb_obj_call_init(self, 0, NULL);
+  ex->fmt->map_end(ex->w);
+}
 
-  return self;
+static void tp_export_rec(tp_export_t *ex, const tp_export_rec_t *rec) {
+  const tp_format_t *fmt = ex->fmt;
+  tp_writer_t *w = ex->w;
+  int f, n, first = 1;
+
+  for (n = f = 0; f < TP_EXPORT_LAST; f++)
+    if (ex->fields & (1 << f))
+      n++;
+
+  fmt->rec_begin(w, n);
+  for (f = 0; f < TP_EXPORT_LAST; f++) {
+    if (!(ex->fields & (1 << f)))
+      continue;
+
+    fmt->key(w, tp_export_field_names[f], first);
+    first = 0;
+
+    switch (f) {
+      case TP_EXPORT_ID:
+        fmt->num(w, rec->id);
+        break;
+      case TP_EXPORT_STATUS:
+        fmt->num(w, rec->status);
+        break;
+      case TP_EXPORT_FILENAME:
+        fmt->str(w, rec->filename);
+        break;
+      case TP_EXPORT_TRM:
+        fmt->str(w, rec->trm);
+        break;
+      case TP_EXPORT_SIMILARITY:
+        fmt->num(w, rec->similarity);
+        break;
+      case TP_EXPORT_ERROR:
+        fmt->str(w, rec->error);
+        break;
+      case TP_EXPORT_LOCAL:
+        tp_export_md(ex, "local", rec->md[0]);
+        break;
+      case TP_EXPORT_SERVER:
+        tp_export_md(ex, "server", rec->md[1]);
+        break;
+    }
+  }
+  fmt->rec_end(w);
+}
+
+static void tp_export_csv_header(tp_export_t *ex) {
+  const tp_md_field_t *md_f;
+  int f, first = 1;
+
+  for (f = 0; f < TP_EXPORT_LAST; f++) {
+    if (!(ex->fields & (1 << f)))
+      continue;
+
+    if (f == TP_EXPORT_LOCAL || f == TP_EXPORT_SERVER) {
+      for (md_f = tp_md_fields; md_f->name; md_f++) {
+        if (!first)
+          tp_w_putc(ex->w, ',');
+        tp_w_puts(ex->w, tp_export_field_names[f]);
+        tp_w_putc(ex->w, '_');
+        tp_w_puts(ex->w, md_f->name);
+        first = 0;
+      }
+    } else {
+      if (!first)
+        tp_w_putc(ex->w, ',');
+      tp_w_puts(ex->w, tp_export_field_names[f]);
+      first = 0;
+    }
+  }
+  tp_w_puts(ex->w, "\r\n");
+}
+
+static void *tp_call_export(void *ptr) {
+  tp_export_t *ex = ptr;
+  tp_export_rec_t rec;
+  track_t tr;
+  int i, num, *ids;
+
+  ex->w->latin1 = !tp_GetUseUTF8(ex->call.tp);
+
+  num = tp_GetNumFileIds(ex->call.tp);
+  rec.md[0] = md_New();
+  rec.md[1] = md_New();
+  if ((ids = malloc(sizeof(int) * (num > 0 ? num : 1))) == NULL || !rec.md[0] || !rec.md[1]) {
+    ex->nomem = 1;
+    goto done;
+  }
+  tp_GetFileIds(ex->call.tp, ids, num);
+
+  if (ex->csv)
+    tp_export_csv_header(ex);
+
+  for (i = 0; i < num && !ex->call.cancelled && !ex->w->err; i++) {
+    if ((tr = tp_GetTrack(ex->call.tp, ids[i])) == NULL)
+      continue;
+
+    /* hold the lock only while copying */
+    tr_Lock(tr);
+    rec.id = ids[i];
+    rec.status = tr_GetStatus(tr);
+    rec.similarity = tr_GetSimilarity(tr);
+    tr_GetFileName(tr, rec.filename, sizeof(rec.filename));
+    tr_GetTRM(tr, rec.trm, sizeof(rec.trm));
+    tr_GetError(tr, rec.error, sizeof(rec.error));
+    if (ex->fields & (1 << TP_EXPORT_LOCAL))
+      tr_GetLocalMetadata(tr, rec.md[0]);
+    if (ex->fields & (1 << TP_EXPORT_SERVER))
+      tr_GetServerMetadata(tr, rec.md[1]);
+    tr_Unlock(tr);
+    tp_ReleaseTrack(ex->call.tp, tr);
+
+    tp_export_rec(ex, &rec);
+    ex->count++;
+  }
+  tp_w_flush(ex->w);
+
+done:
+  free(ids);
+  if (rec.md[0])
+    md_Delete(rec.md[0]);
+  if (rec.md[1])
+    md_Delete(rec.md[1]);
+  return NULL;
+}
+
+static VALUE tp_export_run(VALUE ptr) {
+  tp_export_t *ex = (tp_export_t*) ptr;
+
+  tp_call_blocking(tp_call_export, &ex->call);
+  if (ex->w->state)
+    rb_jump_tag(ex->w->state);
+  if (ex->nomem)
+    rb_raise(eException, "Couldn't allocate export buffers");
+  if (ex->call.cancelled)
+    rb_raise(rb_eInterrupt, "Export interrupted after %d tracks", ex->count);
+  if (ex->w->err)
+    rb_raise(eException, "Couldn't write export: %s", strerror(ex->w->err));
+
+  return INT2FIX(ex->count);
+}
+
+static VALUE tp_export_close(VALUE ptr) {
+  tp_export_t *ex = (tp_export_t*) ptr;
+
+  if (ex->close_fd)
+    close(ex->w->fd);
+  free(ex->w);
+
+  return Qnil;
 }
 
 /*
- * Constructor for TunePimp::Metadata object.
+ * Write the state of every track in this TunePimp::TunePimp object to
+ * a file or IO, in one pass.
+ *
+ * Tracks are read and formatted in native code with other Ruby threads
+ * still running, and each track is only locked while it's copied.  No
+ * Ruby objects are created per track.
+ *
+ * dest is either a path or an IO.  An IO with a file descriptor is
+ * flushed first and written to directly; anything else with a write
+ * method (a StringIO, say) is passed the output in 64k chunks.
+ * Returns the number of tracks written.  Raises Interrupt if the
+ * thread is interrupted partway through.
+ *
+ * Options:
+ *   :format - :jsonl (one JSON object per line, the default), :csv
+ *             (with a header row), or :msgpack (one MessagePack map
+ *             per track, back to back).
+ *   :fields - any of :id, :status, :filename, :trm, :similarity,
+ *             :error, :local and :server (the local and server
+ *             metadata).  Defaults to all of them.
  *
- * This method is currently empty.  You should never call this method
- * directly unless you're instantiating a derived class (ie, you know
- * what you're doing).
+ * Example:
+ *   tp.export('library.csv', :format => :csv, :fields => [:id, :filename, :local])
  *
  */
-static VALUE tp_md_init(VALUE self) {
-  return self;
-}
+static VALUE tp_tp_export(int argc, VALUE *argv, VALUE self) {
+  tunepimp_t *tp;
+  tp_export_t ex;
+  const char *name;
+  long i;
+  int f, fd;
+  VALUE dest, opts, v, path;
+
+  rb_scan_args(argc, argv, "11", &dest, &opts);
+  TypedData_Get_Struct(self, tunepimp_t, &tp_pimp_type, tp);
+
+  memset(&ex, 0, sizeof(ex));
+  ex.call.tp = *tp;
+
+  ex.fmt = &tp_format_json;
+  if (!NIL_P(v = tp_opt(opts, "format"))) {
+    name = rb_id2name(rb_to_id(v));
+    if (!strcmp(name, "csv")) {
+      ex.fmt = &tp_format_csv;
+      ex.csv = 1;
+    } else if (!strcmp(name, "msgpack")) {
+      ex.fmt = &tp_format_msgpack;
+    } else if (strcmp(name, "jsonl") && strcmp(name, "json")) {
+      rb_raise(rb_eArgError, "unknown export format: %s", name);
+    }
+  }
+
+  if (NIL_P(v = tp_opt(opts, "fields"))) {
+    ex.fields = (1 << TP_EXPORT_LAST) - 1;
+  } else {
+    v = rb_Array(v);
+    for (i = 0; i < RARRAY_LEN(v); i++) {
+      name = rb_id2name(rb_to_id(RARRAY_PTR(v)[i]));
+      for (f = 0; tp_export_field_names[f] && strcmp(name, tp_export_field_names[f]); f++);
+      if (!tp_export_field_names[f])
+        rb_raise(rb_eArgError, "unknown export field: %s", name);
+      ex.fields |= 1 << f;
+    }
+  }
+
+  if (rb_respond_to(dest, rb_intern("fileno")) &&
+      !NIL_P(v = rb_funcall(dest, rb_intern("fileno"), 0))) {
+    rb_funcall(dest, rb_intern("flush"), 0);
+    fd = NUM2INT(v);
+  } else if (rb_respond_to(dest, rb_intern("write"))) {
+    /* StringIO and friends: no descriptor, so go through write */
+    fd = -1;
+  } else {
+    path = rb_String(dest);
+    if ((fd = open(StringValueCStr(path), O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+      rb_sys_fail(RSTRING_PTR(path));
+    ex.close_fd = 1;
+  }
+
+  if ((ex.w = malloc(sizeof(tp_writer_t))) == NULL) {
+    if (ex.close_fd)
+      close(fd);
+    rb_raise(eException, "Couldn't allocate export buffer");
+  }
+  ex.w->fd = fd;
+  ex.w->io = dest;
+  ex.w->len = 0;
+  ex.w->err = 0;
+  ex.w->state = 0;
+
+  v = rb_ensure(tp_export_run, (VALUE) &ex, tp_export_close, (VALUE) &ex);
+  RB_GC_GUARD(dest);
 
+  return v;
+}
 
 /*********************************************************************/
 /* End Shenanigans, begin init code.                                 */
 /*********************************************************************/
 void Init_tunepimp(void) {
+  char buf[64];
+  int i;
+
   /**************************/
   /* define TunePimp module */
   /**************************/
+  /* Track identity map needs a WeakMap that takes Integer keys */
+#if defined(RUBY_API_VERSION_CODE) && RUBY_API_VERSION_CODE >= 20700
+  cWeakMap = rb_const_get(rb_const_get(rb_cObject, rb_intern("ObjectSpace")), rb_intern("WeakMap"));
+  rb_gc_register_address(&cWeakMap);
+#endif
+  id_aref = rb_intern("[]");
+  id_aset = rb_intern("[]=");
+  id_delete = rb_intern("delete");
+  if (cWeakMap)
+    tp_weakmap_delete = rb_method_boundp(cWeakMap, id_delete, 0);
+
   mTP = rb_define_module("TunePimp");
   rb_define_const(mTP, "VERSION", rb_str_new2(VERSION));
   
@@ -1886,6 +12003,7 @@ void Init_tunepimp(void) {
   /* define TunePimp::TunePimp class */
   /***********************************/
   cTP = rb_define_class_under(mTP, "TunePimp", rb_cObject);
+  rb_undef_alloc_func(cTP);
   rb_define_singleton_method(cTP, "new", tp_tp_new, -1);
   rb_define_singleton_method(cTP, "initialize", tp_tp_init, 0);
 
@@ -1902,7 +12020,7 @@ void Init_tunepimp(void) {
   rb_define_method(cTP, "server", tp_tp_get_server, 0);
   rb_define_alias(cTP, "get_server", "server");
 
-  rb_define_method(cTP, "set_proxy", tp_tp_set_proxy, 2);
+  rb_define_method(cTP, "set_proxy", tp_tp_set_proxy, -1);
   rb_define_method(cTP, "proxy", tp_tp_get_proxy, 0);
   rb_define_alias(cTP, "get_proxy", "proxy");
 
@@ -1919,6 +12037,10 @@ void Init_tunepimp(void) {
   
   rb_define_method(cTP, "status", tp_tp_status, 0); 
   rb_define_alias(cTP, "get_status", "status");
+
+  rb_define_method(cTP, "wait_notifications", tp_tp_wait_nots, -1);
+  rb_define_method(cTP, "wait_status", tp_tp_wait_status, -1);
+  rb_define_method(cTP, "notification_io", tp_tp_not_io, 0);
   
   rb_define_method(cTP, "error", tp_tp_error, 0); 
   rb_define_alias(cTP, "get_error", "error");
@@ -1928,6 +12050,10 @@ void Init_tunepimp(void) {
 
   rb_define_method(cTP, "add_file", tp_tp_add_file, 1);
   rb_define_method(cTP, "add_dir", tp_tp_add_dir, 1);
+  rb_define_method(cTP, "add_files", tp_tp_add_files, -1);
+  rb_define_method(cTP, "add_tree", tp_tp_add_tree, -1);
+  rb_define_method(cTP, "trm_cache=", tp_tp_set_trm_cache, 1);
+  rb_define_method(cTP, "trm_cache", tp_tp_trm_cache, 0);
   rb_define_method(cTP, "remove", tp_tp_remove, 1);
 
   rb_define_method(cTP, "num_files", tp_tp_num_files, 0);
@@ -1940,6 +12066,11 @@ void Init_tunepimp(void) {
   rb_define_alias(cTP, "get_num_unsaved_items", "num_unsaved_items");
 
   rb_define_method(cTP, "track_counts", tp_tp_track_counts, 0);
+  rb_define_method(cTP, "metrics_enabled=", tp_tp_set_metrics_enabled, 1);
+  rb_define_method(cTP, "metrics_enabled", tp_tp_metrics_enabled, 0);
+  rb_define_method(cTP, "metrics", tp_tp_metrics, 0);
+  rb_define_method(cTP, "metrics_text", tp_tp_metrics_text, -1);
+  rb_define_method(cTP, "transitions", tp_tp_transitions, 1);
 
   rb_define_method(cTP, "num_file_ids", tp_tp_num_file_ids, 0);
   rb_define_alias(cTP, "get_num_file_ids", "num_file_ids");
@@ -1948,12 +12079,15 @@ void Init_tunepimp(void) {
   rb_define_method(cTP, "track", tp_tp_track, 1);
   rb_define_alias(cTP, "get_track", "track");
   rb_define_method(cTP, "release_track", tp_tp_release_track, 1);
+  rb_define_method(cTP, "snapshot", tp_tp_snapshot, -1);
+  rb_define_method(cTP, "export", tp_tp_export, -1);
   rb_define_method(cTP, "wake", tp_tp_wake, 1);
   rb_define_method(cTP, "select_result", tp_tp_select_result, 2);
 
   rb_define_method(cTP, "misidentified", tp_tp_misidentified, 1);
   rb_define_method(cTP, "identify_again", tp_tp_identify_again, 1);
   rb_define_method(cTP, "write_tags", tp_tp_write_tags, -1);
+  rb_define_method(cTP, "write_tags_async", tp_tp_write_tags_async, -1);
   rb_define_method(cTP, "add_trm", tp_tp_add_trm, 2);
   rb_define_alias(cTP, "add_trm_submission", "add_trm");
   rb_define_method(cTP, "submit_trms", tp_tp_submit_trms, 0);
@@ -2006,6 +12140,7 @@ void Init_tunepimp(void) {
   /* define TunePimp::Track class */
   /********************************/
   cTr = rb_define_class_under(mTP, "Track", rb_cObject);
+  rb_undef_alloc_func(cTr);
   rb_define_singleton_method(cTr, "new", tp_tr_new, 0);
   rb_define_singleton_method(cTr, "initialize", tp_tr_init, 0);
 
@@ -2015,11 +12150,11 @@ void Init_tunepimp(void) {
   rb_define_method(cTr, "filename", tp_tr_filename, 0);
   rb_define_method(cTr, "trm", tp_tr_trm, 0);
 
-  rb_define_method(cTr, "local_metadata", tp_tr_local_metadata, 0);
-  rb_define_method(cTr, "local_metadata=", tp_tr_set_local_metadata, 0);
+  rb_define_method(cTr, "local_metadata", tp_tr_local_metadata, -1);
+  rb_define_method(cTr, "local_metadata=", tp_tr_set_local_metadata, 1);
 
-  rb_define_method(cTr, "server_metadata", tp_tr_server_metadata, 0);
-  rb_define_method(cTr, "server_metadata=", tp_tr_set_server_metadata, 0);
+  rb_define_method(cTr, "server_metadata", tp_tr_server_metadata, -1);
+  rb_define_method(cTr, "server_metadata=", tp_tr_set_server_metadata, 1);
   
   rb_define_method(cTr, "error", tp_tr_error, 0);
   rb_define_method(cTr, "similarity", tp_tr_similarity, 0);
@@ -2033,9 +12168,21 @@ void Init_tunepimp(void) {
   /* define TunePimp::Metadata class */
   /***********************************/
   cMD = rb_define_class_under(mTP, "Metadata", rb_cObject);
+  rb_undef_alloc_func(cMD);
   rb_define_singleton_method(cMD, "new", tp_md_new, 0);
   rb_define_singleton_method(cMD, "initialize", tp_md_init, 0);
 
+  for (i = 0; tp_md_fields[i].name; i++) {
+    snprintf(buf, sizeof(buf), "%s=", tp_md_fields[i].name);
+    rb_define_method(cMD, tp_md_fields[i].name, tp_md_accessors[i].get, 0);
+    rb_define_method(cMD, buf, tp_md_accessors[i].set, 1);
+  }
+  rb_define_method(cMD, "to_h", tp_md_to_h, 0);
+  rb_define_method(cMD, "diff", tp_md_diff, 1);
+  rb_define_method(cMD, "==", tp_md_eq, 1);
+  rb_define_method(cMD, "eql?", tp_md_eq, 1);
+  rb_define_method(cMD, "hash", tp_md_hash, 0);
+
 /* 
  *   rb_define_singleton_method(cMD, "convert_to_album_status", tp_md_convert_to_album_status, 1);
  *   rb_define_singleton_method(cMD, "convert_to_album_type", tp_md_convert_to_album_type, 1);
@@ -2044,6 +12191,160 @@ void Init_tunepimp(void) {
  *   rb_define_singleton_method(cMD, "convert_from_album_type", tp_md_convert_from_album_type, 1);
  */ 
   
+  /**********************************/
+  /* define TunePimp::Results class */
+  /**********************************/
+  cRS = rb_define_class_under(mTP, "Results", rb_cObject);
+  rb_include_module(cRS, rb_mEnumerable);
+  rb_undef_alloc_func(cRS);
+  rb_define_singleton_method(cRS, "new", tp_rs_new, 0);
+
+  rb_define_method(cRS, "type", tp_rs_type, 0);
+  rb_define_method(cRS, "size", tp_rs_size, 0);
+  rb_define_alias(cRS, "length", "size");
+  rb_define_method(cRS, "[]", tp_rs_aref, 1);
+  rb_define_method(cRS, "each", tp_rs_each, 0);
+
+  /********************************/
+  /* define TunePimp::Index class */
+  /********************************/
+  cIdx = rb_define_class_under(mTP, "Index", rb_cObject);
+  rb_undef_alloc_func(cIdx);
+  rb_define_singleton_method(cIdx, "new", tp_idx_new, 1);
+  rb_define_method(cIdx, "initialize", tp_idx_init, 1);
+
+  rb_define_method(cIdx, "path", tp_idx_path, 0);
+  rb_define_method(cIdx, "size", tp_idx_size, 0);
+  rb_define_alias(cIdx, "length", "size");
+  rb_define_method(cIdx, "[]", tp_idx_aref, 1);
+  rb_define_method(cIdx, "record", tp_idx_record, -1);
+  rb_define_method(cIdx, "delete", tp_idx_delete_path, 1);
+  rb_define_method(cIdx, "sync", tp_idx_sync, 0);
+  rb_define_method(cIdx, "close", tp_idx_close_index, 0);
+  rb_define_method(cIdx, "closed?", tp_idx_closed, 0);
+
+  /***********************************/
+  /* define TunePimp::TRMCache class */
+  /***********************************/
+  cTRMC = rb_define_class_under(mTP, "TRMCache", rb_cObject);
+  rb_undef_alloc_func(cTRMC);
+  rb_define_singleton_method(cTRMC, "new", tp_trmc_new, -1);
+  rb_define_method(cTRMC, "initialize", tp_trmc_init, -1);
+  rb_define_singleton_method(cTRMC, "key", tp_trmc_key, 1);
+
+  rb_define_method(cTRMC, "[]", tp_trmc_aref, 1);
+  rb_define_method(cTRMC, "[]=", tp_trmc_aset, 2);
+  rb_define_method(cTRMC, "path", tp_trmc_path, 0);
+  rb_define_method(cTRMC, "capacity", tp_trmc_capacity, 0);
+  rb_define_method(cTRMC, "stats", tp_trmc_stats, 0);
+  rb_define_method(cTRMC, "sync", tp_trmc_sync, 0);
+  rb_define_method(cTRMC, "close", tp_trmc_close_cache, 0);
+  rb_define_method(cTRMC, "closed?", tp_trmc_closed, 0);
+
+  cProxy = rb_define_class_under(mTP, "Proxy", rb_cObject);
+  rb_undef_alloc_func(cProxy);
+  rb_define_singleton_method(cProxy, "new", tp_proxy_new, -1);
+  rb_define_method(cProxy, "initialize", tp_proxy_init, -1);
+  rb_define_method(cProxy, "attach", tp_proxy_attach, 1);
+  rb_define_method(cProxy, "port", tp_proxy_port, 0);
+  rb_define_method(cProxy, "cache_dir", tp_proxy_cache_dir, 0);
+  rb_define_method(cProxy, "ttl", tp_proxy_ttl, 0);
+  rb_define_method(cProxy, "stats", tp_proxy_stats, 0);
+  rb_define_method(cProxy, "close", tp_proxy_close, 0);
+  rb_define_method(cProxy, "closed?", tp_proxy_closed, 0);
+
+  cPool = rb_define_class_under(mTP, "Pool", rb_cObject);
+  rb_undef_alloc_func(cPool);
+  rb_include_module(cPool, rb_mEnumerable);
+  rb_define_singleton_method(cPool, "new", tp_pool_new, -1);
+  rb_define_method(cPool, "initialize", tp_pool_init, -1);
+  rb_define_method(cPool, "instances", tp_pool_instances, 0);
+  rb_define_method(cPool, "size", tp_pool_size, 0);
+  rb_define_alias(cPool, "length", "size");
+  rb_define_method(cPool, "each", tp_pool_each, 0);
+  rb_define_method(cPool, "shard", tp_pool_shard, 1);
+  rb_define_method(cPool, "locate", tp_pool_locate, 1);
+  rb_define_method(cPool, "add_file", tp_pool_add_file, 1);
+  rb_define_method(cPool, "add_files", tp_pool_add_files, -1);
+  rb_define_method(cPool, "add_tree", tp_pool_add_tree, -1);
+  rb_define_method(cPool, "remove", tp_pool_remove, 1);
+  rb_define_method(cPool, "track", tp_pool_track, 1);
+  rb_define_method(cPool, "write_tags", tp_pool_write_tags, -1);
+  rb_define_method(cPool, "submit_trms", tp_pool_submit_trms, 0);
+  rb_define_method(cPool, "file_ids", tp_pool_file_ids, 0);
+  rb_define_method(cPool, "num_files", tp_pool_num_files, 0);
+  rb_define_method(cPool, "track_counts", tp_pool_track_counts, 0);
+  rb_define_method(cPool, "wait_notifications", tp_pool_wait_nots, -1);
+  rb_define_method(cPool, "wait_status", tp_pool_wait_status, -1);
+
+  cGov = rb_define_class_under(mTP, "Governor", rb_cObject);
+  rb_undef_alloc_func(cGov);
+  rb_define_singleton_method(cGov, "new", tp_gov_new, -1);
+  rb_define_method(cGov, "initialize", tp_gov_init, -1);
+  rb_define_method(cGov, "feed", tp_gov_feed, 1);
+  rb_define_method(cGov, "latency=", tp_gov_set_latency, 1);
+  rb_define_method(cGov, "queued", tp_gov_queued, 0);
+  rb_define_method(cGov, "stats", tp_gov_stats, 0);
+  rb_define_method(cGov, "level", tp_gov_level, 0);
+  rb_define_method(cGov, "target", tp_gov_target, 0);
+  rb_define_method(cGov, "stop", tp_gov_stop_governing, 0);
+  rb_define_method(cGov, "stopped?", tp_gov_stopped, 0);
+
+  cTagWrite = rb_define_class_under(mTP, "TagWrite", rb_cObject);
+  rb_undef_alloc_func(cTagWrite);
+  rb_define_method(cTagWrite, "wait", tp_tagw_wait, -1);
+  rb_define_method(cTagWrite, "done?", tp_tagw_done, 0);
+  rb_define_method(cTagWrite, "results", tp_tagw_results, 0);
+  rb_define_method(cTagWrite, "errors", tp_tagw_errors, 0);
+  rb_define_method(cTagWrite, "ids", tp_tagw_ids, 0);
+  rb_define_method(cTagWrite, "success?", tp_tagw_success, 0);
+  rb_define_method(cTagWrite, "cancel", tp_tagw_cancel, 0);
+  rb_define_method(cTagWrite, "tunepimp", tp_tagw_tunepimp, 0);
+
+  cJournal = rb_define_class_under(mTP, "TRMJournal", rb_cObject);
+  rb_undef_alloc_func(cJournal);
+  rb_define_singleton_method(cJournal, "new", tp_jrnl_new, -1);
+  rb_define_method(cJournal, "initialize", tp_jrnl_init, -1);
+  rb_define_method(cJournal, "add", tp_jrnl_add, 2);
+  rb_define_alias(cJournal, "add_trm", "add");
+  rb_define_method(cJournal, "flush", tp_jrnl_flush, -1);
+  rb_define_method(cJournal, "queued", tp_jrnl_get_queued, 0);
+  rb_define_alias(cJournal, "size", "queued");
+  rb_define_alias(cJournal, "length", "queued");
+  rb_define_method(cJournal, "pending", tp_jrnl_pending, 0);
+  rb_define_method(cJournal, "stats", tp_jrnl_stats, 0);
+  rb_define_method(cJournal, "path", tp_jrnl_path, 0);
+  rb_define_method(cJournal, "tunepimp", tp_jrnl_tunepimp, 0);
+  rb_define_method(cJournal, "close", tp_jrnl_close, 0);
+  rb_define_method(cJournal, "closed?", tp_jrnl_closed, 0);
+
+  mTracer = rb_define_module_under(mTP, "Tracer");
+  rb_define_module_function(mTracer, "start", tp_tracer_start, -1);
+  rb_define_module_function(mTracer, "stop", tp_tracer_stop, 0);
+  rb_define_module_function(mTracer, "tracing?", tp_tracer_tracing, 0);
+  rb_define_module_function(mTracer, "clear", tp_tracer_clear, 0);
+  rb_define_module_function(mTracer, "size", tp_tracer_size, 0);
+  rb_define_module_function(mTracer, "dump", tp_tracer_dump, -1);
+
+  /*****************************************/
+  /* define TunePimp::*Result struct types */
+  /*****************************************/
+  cArtistResult = rb_struct_define(NULL, "relevance", "id", "name",
+                                   "sort_name", NULL);
+  rb_define_const(mTP, "ArtistResult", cArtistResult);
+
+  cAlbumResult = rb_struct_define(NULL, "relevance", "id", "name",
+                                  "num_tracks", "num_cd_index_ids",
+                                  "is_va", "type", "release_year",
+                                  "release_month", "release_day",
+                                  "release_country", "artist", NULL);
+  rb_define_const(mTP, "AlbumResult", cAlbumResult);
+
+  cTrackResult = rb_struct_define(NULL, "relevance", "id", "name",
+                                  "num_trm_ids", "track_num", "duration",
+                                  "artist", "album", NULL);
+  rb_define_const(mTP, "TrackResult", cTrackResult);
+
   /******************************************/
   /* define TunePimp::ThreadPriority module */
   /******************************************/
@@ -2078,6 +12379,7 @@ void Init_tunepimp(void) {
   rb_define_const(mStat, "FileLookup", INT2FIX(eFileLookup));
   rb_define_const(mStat, "UserSelection", INT2FIX(eUserSelection));
   rb_define_const(mStat, "Verified", INT2FIX(eVerified));
+  rb_define_const(mStat, "Saved", INT2FIX(eSaved));
   rb_define_const(mStat, "Deleted", INT2FIX(eDeleted));
   rb_define_const(mStat, "Error", INT2FIX(eError));
 